@@ -392,13 +392,16 @@ bail:
     DiskImgLib::Global::AppCleanup();
 }
 
-/*static*/ void DiskArchive::DebugMsgHandler(const char* file, int line,
-    const char* msg)
+/*static*/ void DiskArchive::DebugMsgHandler(
+    DiskImgLib::Global::LogSeverity severity, const char* file,
+    int line, const char* msg)
 {
     ASSERT(file != NULL);
     ASSERT(msg != NULL);
 
-    LOG_BASE(DebugLog::LOG_INFO, file, line, "<diskimg> %hs", msg);
+    /* DiskImgLib severities have the same values as ours */
+    LOG_BASE((DebugLog::LogSeverity) severity, file, line, "<diskimg> %hs",
+        msg);
 }
 
 /*static*/ bool DiskArchive::ProgressCallback(DiskImgLib::A2FileDescr* pFile,
@@ -323,7 +323,8 @@ private:
     /*
      * Handle a debug message from the DiskImg library.
      */
-    static void DebugMsgHandler(const char* file, int line, const char* msg);
+    static void DebugMsgHandler(DiskImgLib::Global::LogSeverity severity,
+        const char* file, int line, const char* msg);
 
     /*
      * A file we're adding clashes with an existing file.  Decide what to do
@@ -0,0 +1,824 @@
+/*
+ * CiderPress
+ * Copyright (C) 2009 by CiderPress authors.  All Rights Reserved.
+ * See the file LICENSE for distribution terms.
+ */
+/*
+ * Sector cache, implemented as a GenericFD that sits on top of another GFD.
+ *
+ * The cache is a fixed-size pool of 256-byte entries.  Entries are found
+ * through a chained hash table keyed on the sector ("unit") number, and
+ * kept on a doubly-linked LRU list.  Everything is stored as parallel
+ * arrays of indices, so there's no per-entry allocation.
+ *
+ * In write-back mode, dirty units are written out together: the dirty set
+ * is sorted by offset and adjacent units are merged into single writes.
+ * This happens when the image is flushed, and whenever the LRU entry that
+ * needs to be evicted is dirty.  Bulk updates to a ProDOS volume rewrite
+ * the same directory, bitmap, and index blocks many times over, so most
+ * of those writes never reach the file.
+ *
+ * Reads from the underlying GFD are done without holding the lock (as
+ * long as its ReadAt is thread-safe), so threads reading different parts
+ * of the image don't wait on each other's I/O.  Anything that changes the
+ * cached data bumps fWriteGen; a reader that sees it change while it was
+ * reading throws its data away and looks again, so stale data never gets
+ * into the cache.
+ */
+#include "StdAfx.h"
+#include "DiskImgPriv.h"
+
+
+/*
+ * Prepare the cache.  On success, we own "pGFD".
+ */
+DIError GFDBlockCache::Open(GenericFD* pGFD, di_off_t length, long maxBytes,
+    bool writeBack)
+{
+    int i, hashSize;
+
+    if (fpGFD != NULL)
+        return kDIErrAlreadyOpen;
+    if (pGFD == NULL || length < 0)
+        return kDIErrInvalidArg;
+
+    fNumEntries = (int) (maxBytes / kUnitSize);
+    if (fNumEntries < kMaxRunUnits)
+        return kDIErrInvalidArg;
+
+    /* size the hash table to ~2x the number of entries */
+    hashSize = 1;
+    while (hashSize < fNumEntries * 2)
+        hashSize <<= 1;
+    fHashMask = hashSize - 1;
+
+    fKeys = new long[fNumEntries];
+    fHashNext = new int[fNumEntries];
+    fLruPrev = new int[fNumEntries];
+    fLruNext = new int[fNumEntries];
+    fDirtyFlags = new bool[fNumEntries];
+    fHashHeads = new int[hashSize];
+    fData = new uint8_t[(long) fNumEntries * kUnitSize];
+    fRunBuf = new uint8_t[kMaxRunUnits * kUnitSize];
+    if (writeBack) {
+        fSortKeys = new long[fNumEntries];
+        fFlushBuf = new uint8_t[kMaxRunUnits * kUnitSize];
+    }
+    if (fKeys == NULL || fHashNext == NULL || fLruPrev == NULL ||
+        fLruNext == NULL || fDirtyFlags == NULL || fHashHeads == NULL ||
+        fData == NULL || fRunBuf == NULL ||
+        (writeBack && (fSortKeys == NULL || fFlushBuf == NULL)))
+    {
+        Close();
+        return kDIErrMalloc;
+    }
+    for (i = 0; i < hashSize; i++)
+        fHashHeads[i] = -1;
+
+    fNumUsed = fNumDirty = 0;
+    fLruHead = fLruTail = -1;
+    fWriteGen = 0;
+    memset(&fStats, 0, sizeof(fStats));
+
+    fpGFD = pGFD;
+    fLength = length;
+    fCurrentOffset = 0;
+    fWriteBack = writeBack;
+    fReadOnly = pGFD->GetReadOnly();
+
+    return kDIErrNone;
+}
+
+/*
+ * Write any dirty data, then close and discard the underlying GFD.
+ */
+DIError GFDBlockCache::Close(void)
+{
+    DIError dierr = kDIErrNone;
+
+    DIAutoLock lock(&fLock);
+    if (fpGFD != NULL) {
+        dierr = FlushDirty();
+        if (dierr != kDIErrNone) {
+            LOGW("  GFDBlockCache lost dirty data on close (err=%d)", dierr);
+        }
+        LOGD("  GFDBlockCache closing (hits=%ld misses=%ld evict=%ld wb=%ld/%ld)",
+            fStats.hits, fStats.misses, fStats.evictions, fStats.writeBacks,
+            fStats.flushes);
+        fpGFD->Close();
+        delete fpGFD;
+        fpGFD = NULL;
+    }
+
+    delete[] fKeys;
+    delete[] fHashNext;
+    delete[] fLruPrev;
+    delete[] fLruNext;
+    delete[] fDirtyFlags;
+    delete[] fHashHeads;
+    delete[] fData;
+    delete[] fRunBuf;
+    delete[] fSortKeys;
+    delete[] fFlushBuf;
+    fKeys = fSortKeys = NULL;
+    fHashNext = fLruPrev = fLruNext = fHashHeads = NULL;
+    fDirtyFlags = NULL;
+    fData = fRunBuf = fFlushBuf = NULL;
+    fNumEntries = fNumUsed = fNumDirty = 0;
+
+    return dierr;
+}
+
+DIError GFDBlockCache::Seek(di_off_t offset, DIWhence whence)
+{
+    di_off_t newPosn;
+
+    if (fpGFD == NULL)
+        return kDIErrNotReady;
+
+    switch (whence) {
+    case kSeekSet:
+        newPosn = offset;
+        break;
+    case kSeekCur:
+        newPosn = fCurrentOffset + offset;
+        break;
+    case kSeekEnd:
+        newPosn = fLength + offset;
+        break;
+    default:
+        assert(false);
+        return kDIErrInvalidArg;
+    }
+    if (newPosn < 0)
+        return kDIErrInvalidArg;
+
+    fCurrentOffset = newPosn;
+    return kDIErrNone;
+}
+
+/*
+ * Read data at the current position.
+ */
+DIError GFDBlockCache::Read(void* buf, size_t length, size_t* pActual)
+{
+    DIError dierr;
+    size_t actual;
+
+    dierr = DoRead(buf, length, fCurrentOffset, &actual);
+    if (dierr != kDIErrNone)
+        return dierr;
+    if (actual != length && pActual == NULL)
+        return kDIErrDataUnderrun;
+    if (pActual != NULL)
+        *pActual = actual;
+    fCurrentOffset += actual;
+    return kDIErrNone;
+}
+
+/*
+ * Write data at the current position.
+ */
+DIError GFDBlockCache::Write(const void* buf, size_t length, size_t* pActual)
+{
+    DIError dierr;
+
+    assert(pActual == NULL);     // not handling partial writes
+    dierr = DoWrite(buf, length, fCurrentOffset);
+    if (dierr == kDIErrNone)
+        fCurrentOffset += length;
+    return dierr;
+}
+
+/*
+ * Read data from "offset", from the cache when possible.  If "pActual" is
+ * NULL, reading off the end of the data is an error.
+ *
+ * The lock is dropped while we read from the underlying GFD.
+ */
+DIError GFDBlockCache::DoRead(void* buf, size_t length, di_off_t offset,
+    size_t* pActual)
+{
+    DIError dierr = kDIErrNone;
+    uint8_t* outp = (uint8_t*) buf;
+    size_t remaining = length;
+    uint8_t runBuf[kMaxRunUnits * kUnitSize];
+    DIAutoLock lock(&fLock);
+
+    if (fpGFD == NULL)
+        return kDIErrNotReady;
+    if (length == 0) {
+        if (pActual != NULL)
+            *pActual = 0;
+        return kDIErrNone;
+    }
+
+    const bool unlockForIO = fpGFD->GetIsReadAtThreadSafe();
+
+    if (IsBypass(offset, length)) {
+        size_t actual;
+
+        if (unlockForIO && offset + (di_off_t) length <= fLength) {
+            /* overlaying afterward is right even if a write got in first */
+            fLock.Unlock();
+            dierr = fpGFD->ReadAt(buf, length, offset);
+            fLock.Lock();
+            if (dierr != kDIErrNone)
+                return dierr;
+            OverlayCached((uint8_t*) buf, offset, length);
+            actual = length;
+        } else {
+            dierr = ReadDirect(buf, offset, length, &actual);
+            if (dierr != kDIErrNone)
+                return dierr;
+        }
+        if (actual != length && pActual == NULL)
+            return kDIErrDataUnderrun;
+        if (pActual != NULL)
+            *pActual = actual;
+        return kDIErrNone;
+    }
+
+    while (remaining != 0) {
+        long unit = (long) (offset >> kUnitShift);
+        int unitOff = (int) (offset & (kUnitSize-1));
+        size_t chunk = kUnitSize - unitOff;
+        const uint8_t* src;
+        int idx;
+
+        if (chunk > remaining)
+            chunk = remaining;
+
+        idx = Lookup(unit);
+        if (idx >= 0) {
+            fStats.hits++;
+            src = UnitData(idx);
+        } else {
+            /*
+             * Miss.  Find out how many consecutive units we're missing,
+             * and pull them all in with a single read.
+             */
+            long lastUnit = (long) ((offset + remaining - 1) >> kUnitShift);
+            long runLen = 1;
+
+            while (runLen < kMaxRunUnits && unit + runLen <= lastUnit &&
+                Lookup(unit + runLen) < 0)
+            {
+                runLen++;
+            }
+            fStats.misses += runLen;
+
+            if (unlockForIO) {
+                unsigned long writeGen = fWriteGen;
+                di_off_t dataLen = fLength;
+
+                fLock.Unlock();
+                dierr = ReadRun(unit, runLen, dataLen, runBuf);
+                fLock.Lock();
+                if (dierr != kDIErrNone)
+                    return dierr;
+                if (writeGen != fWriteGen)
+                    continue;       // may be stale, try again
+            } else {
+                dierr = ReadRun(unit, runLen, fLength, runBuf);
+                if (dierr != kDIErrNone)
+                    return dierr;
+            }
+
+            /*
+             * Another thread may have loaded some of these while we were
+             * reading; AddRun skips those.  Either way, what we read is
+             * current, so copy from it directly.
+             */
+            dierr = AddRun(unit, runLen, runBuf);
+            if (dierr != kDIErrNone)
+                return dierr;
+            src = runBuf;
+        }
+
+        memcpy(outp, src + unitOff, chunk);
+        outp += chunk;
+        offset += chunk;
+        remaining -= chunk;
+    }
+
+    if (pActual != NULL)
+        *pActual = length;
+    return kDIErrNone;
+}
+
+/*
+ * Write data at "offset".  In write-through mode the data goes straight to
+ * the underlying GFD; in write-back mode it sits in the cache until flushed.
+ */
+DIError GFDBlockCache::DoWrite(const void* buf, size_t length, di_off_t offset)
+{
+    DIError dierr = kDIErrNone;
+    const uint8_t* inp = (const uint8_t*) buf;
+    size_t remaining = length;
+    DIAutoLock lock(&fLock);
+
+    if (fpGFD == NULL)
+        return kDIErrNotReady;
+    if (fReadOnly)
+        return kDIErrAccessDenied;
+    fWriteGen++;
+
+    if (!fWriteBack || IsBypass(offset, length)) {
+        if (offset + (di_off_t) length > fLength) {
+            /* extending the file; positional writes may not allow that */
+            dierr = fpGFD->Seek(offset, kSeekSet);
+            if (dierr == kDIErrNone)
+                dierr = fpGFD->Write(buf, length);
+        } else {
+            dierr = fpGFD->WriteAt(buf, length, offset);
+        }
+        if (dierr != kDIErrNone)
+            return dierr;
+
+        /* anything we're holding in that range is now stale */
+        UpdateCached(inp, offset, length);
+
+        if (offset + (di_off_t) length > fLength)
+            fLength = offset + length;
+        return kDIErrNone;
+    }
+
+    while (remaining != 0) {
+        long unit = (long) (offset >> kUnitShift);
+        int unitOff = (int) (offset & (kUnitSize-1));
+        size_t chunk = kUnitSize - unitOff;
+        int idx;
+
+        if (chunk > remaining)
+            chunk = remaining;
+
+        idx = Lookup(unit);
+        if (idx < 0) {
+            if (chunk == kUnitSize) {
+                /* overwriting the whole thing, no need to read it */
+                dierr = AllocEntry(unit, &idx);
+            } else {
+                fStats.misses++;
+                dierr = LoadRun(unit, 1);
+                idx = Lookup(unit);
+            }
+            if (dierr != kDIErrNone)
+                return dierr;
+            assert(idx >= 0);
+        }
+
+        memcpy(UnitData(idx) + unitOff, inp, chunk);
+        if (!fDirtyFlags[idx]) {
+            fDirtyFlags[idx] = true;
+            fNumDirty++;
+        }
+
+        inp += chunk;
+        offset += chunk;
+        remaining -= chunk;
+    }
+
+    return kDIErrNone;
+}
+
+/*
+ * Truncate the underlying file at the current position.  We just flush
+ * and throw everything away, since this is rarely used.
+ */
+DIError GFDBlockCache::Truncate(void)
+{
+    DIError dierr;
+    DIAutoLock lock(&fLock);
+
+    if (fpGFD == NULL)
+        return kDIErrNotReady;
+    fWriteGen++;
+
+    dierr = Invalidate();
+    if (dierr != kDIErrNone)
+        return dierr;
+    dierr = fpGFD->Seek(fCurrentOffset, kSeekSet);
+    if (dierr != kDIErrNone)
+        return dierr;
+    dierr = fpGFD->Truncate();
+    if (dierr == kDIErrNone)
+        fLength = fCurrentOffset;
+    return dierr;
+}
+
+/*
+ * Write dirty units and flush the underlying GFD (which matters for
+ * physical volumes).
+ */
+DIError GFDBlockCache::Flush(void)
+{
+    DIError dierr;
+    DIAutoLock lock(&fLock);
+
+    if (fpGFD == NULL)
+        return kDIErrNotReady;
+    dierr = FlushDirty();
+    if (dierr != kDIErrNone)
+        return dierr;
+    return fpGFD->Flush();
+}
+
+/*
+ * Write all dirty units to the underlying GFD, in offset order, merging
+ * runs of adjacent units into a single write.
+ */
+DIError GFDBlockCache::FlushDirty(void)
+{
+    DIError dierr;
+    long numKeys, start, end;
+    int idx;
+    DIAutoLock lock(&fLock);
+
+    if (!fWriteBack || fNumDirty == 0)
+        return kDIErrNone;
+
+    numKeys = 0;
+    for (idx = 0; idx < fNumUsed; idx++) {
+        if (fDirtyFlags[idx])
+            fSortKeys[numKeys++] = fKeys[idx];
+    }
+    assert(numKeys == fNumDirty);
+    qsort(fSortKeys, numKeys, sizeof(long), CompareUnits);
+
+    for (start = 0; start < numKeys; start = end) {
+        end = start + 1;
+        while (end < numKeys && end - start < kMaxRunUnits &&
+            fSortKeys[end] == fSortKeys[end-1] + 1)
+        {
+            end++;
+        }
+
+        dierr = WriteRun(&fSortKeys[start], end - start);
+        if (dierr != kDIErrNone)
+            return dierr;
+    }
+
+    assert(fNumDirty == 0);
+    fStats.flushes++;
+    return kDIErrNone;
+}
+
+/*
+ * Discard the contents of the cache, writing dirty units first.
+ */
+DIError GFDBlockCache::Invalidate(void)
+{
+    DIError dierr;
+    int i;
+    DIAutoLock lock(&fLock);
+
+    dierr = FlushDirty();
+    if (dierr != kDIErrNone)
+        return dierr;
+
+    fWriteGen++;
+    for (i = 0; i <= fHashMask; i++)
+        fHashHeads[i] = -1;
+    fNumUsed = fNumDirty = 0;
+    fLruHead = fLruTail = -1;
+    return kDIErrNone;
+}
+
+
+/*
+ * ---------------------------------------------------------------------------
+ *      Internals
+ * ---------------------------------------------------------------------------
+ */
+
+/*
+ * Find the entry holding "unit", without affecting the LRU ordering.
+ * Returns -1 if not found.
+ */
+int GFDBlockCache::Find(long unit) const
+{
+    int idx = fHashHeads[unit & fHashMask];
+
+    while (idx >= 0 && fKeys[idx] != unit)
+        idx = fHashNext[idx];
+    return idx;
+}
+
+/*
+ * Find the entry holding "unit".  On success, the entry becomes the most
+ * recently used.  Returns -1 if not found.
+ */
+int GFDBlockCache::Lookup(long unit)
+{
+    int idx = Find(unit);
+
+    if (idx >= 0 && idx != fLruHead) {
+        LruUnlink(idx);
+        LruPushHead(idx);
+    }
+    return idx;
+}
+
+/*
+ * Get an entry for "unit", which must not already be in the cache.  If
+ * the cache is full, the least-recently-used entry is evicted.  If that
+ * entry is dirty, we flush everything that's dirty, so that the writes
+ * go out in order and in as few pieces as possible.
+ *
+ * The new entry is clean, most recently used, and has undefined contents.
+ */
+DIError GFDBlockCache::AllocEntry(long unit, int* pIdx)
+{
+    int idx;
+
+    assert(Lookup(unit) < 0);
+
+    if (fNumUsed < fNumEntries) {
+        idx = fNumUsed++;
+    } else {
+        idx = fLruTail;
+        assert(idx >= 0);
+        if (fDirtyFlags[idx]) {
+            DIError dierr = FlushDirty();
+            if (dierr != kDIErrNone)
+                return dierr;
+        }
+        RemoveEntry(idx);
+        fStats.evictions++;
+    }
+
+    fKeys[idx] = unit;
+    fDirtyFlags[idx] = false;
+    fHashNext[idx] = fHashHeads[unit & fHashMask];
+    fHashHeads[unit & fHashMask] = idx;
+    LruPushHead(idx);
+
+    *pIdx = idx;
+    return kDIErrNone;
+}
+
+/*
+ * Unlink an entry from the hash chain and LRU list.  Does not return it
+ * to the pool; the caller is expected to re-use it immediately.
+ */
+void GFDBlockCache::RemoveEntry(int idx)
+{
+    HashUnlink(idx);
+    LruUnlink(idx);
+}
+
+void GFDBlockCache::HashUnlink(int idx)
+{
+    int* pLink = &fHashHeads[fKeys[idx] & fHashMask];
+
+    while (*pLink != idx) {
+        assert(*pLink >= 0);
+        pLink = &fHashNext[*pLink];
+    }
+    *pLink = fHashNext[idx];
+    fHashNext[idx] = -1;
+}
+
+void GFDBlockCache::LruUnlink(int idx)
+{
+    if (fLruPrev[idx] >= 0)
+        fLruNext[fLruPrev[idx]] = fLruNext[idx];
+    else
+        fLruHead = fLruNext[idx];
+    if (fLruNext[idx] >= 0)
+        fLruPrev[fLruNext[idx]] = fLruPrev[idx];
+    else
+        fLruTail = fLruPrev[idx];
+}
+
+void GFDBlockCache::LruPushHead(int idx)
+{
+    fLruPrev[idx] = -1;
+    fLruNext[idx] = fLruHead;
+    if (fLruHead >= 0)
+        fLruPrev[fLruHead] = idx;
+    fLruHead = idx;
+    if (fLruTail < 0)
+        fLruTail = idx;
+}
+
+/*
+ * Write "numUnits" consecutive dirty units, whose unit numbers are in
+ * "units", to the underlying GFD with a single write.  The last unit may
+ * be short if the data length isn't a multiple of the unit size.
+ */
+DIError GFDBlockCache::WriteRun(const long* units, long numUnits)
+{
+    DIError dierr;
+    di_off_t offset = (di_off_t) units[0] << kUnitShift;
+    size_t len = numUnits * kUnitSize;
+    const uint8_t* data;
+    long i;
+
+    assert(numUnits > 0 && numUnits <= kMaxRunUnits);
+    if (offset + (di_off_t) len > fLength)
+        len = (size_t) (fLength - offset);
+
+    if (numUnits == 1) {
+        data = UnitData(Find(units[0]));
+    } else {
+        for (i = 0; i < numUnits; i++) {
+            assert(Find(units[i]) >= 0);
+            memcpy(fFlushBuf + i * kUnitSize, UnitData(Find(units[i])),
+                kUnitSize);
+        }
+        data = fFlushBuf;
+    }
+
+    dierr = fpGFD->WriteAt(data, len, offset);
+    if (dierr != kDIErrNone) {
+        LOGW("  GFDBlockCache write-back of units %ld-%ld failed (err=%d)",
+            units[0], units[numUnits-1], dierr);
+        return dierr;
+    }
+
+    for (i = 0; i < numUnits; i++) {
+        int idx = Find(units[i]);
+        assert(fDirtyFlags[idx]);
+        fDirtyFlags[idx] = false;
+    }
+    fNumDirty -= numUnits;
+    fStats.writeBacks += numUnits;
+    return kDIErrNone;
+}
+
+/*
+ * qsort() comparison function for unit numbers.
+ */
+/*static*/ int GFDBlockCache::CompareUnits(const void* v1, const void* v2)
+{
+    long unit1 = *(const long*) v1;
+    long unit2 = *(const long*) v2;
+
+    if (unit1 < unit2)
+        return -1;
+    else if (unit1 > unit2)
+        return 1;
+    return 0;
+}
+
+/*
+ * Read "numUnits" consecutive units, none of which are currently cached,
+ * and add them to the cache.
+ */
+DIError GFDBlockCache::LoadRun(long firstUnit, long numUnits)
+{
+    DIError dierr;
+
+    dierr = ReadRun(firstUnit, numUnits, fLength, fRunBuf);
+    if (dierr != kDIErrNone)
+        return dierr;
+    return AddRun(firstUnit, numUnits, fRunBuf);
+}
+
+/*
+ * Read "numUnits" consecutive units from the underlying GFD into "buf",
+ * which must hold kMaxRunUnits units.  "dataLen" is the length of the
+ * data (fLength, sampled while the lock was held).  Doesn't touch the
+ * cache, so this may be called without holding the lock.
+ */
+DIError GFDBlockCache::ReadRun(long firstUnit, long numUnits,
+    di_off_t dataLen, uint8_t* buf)
+{
+    di_off_t offset = (di_off_t) firstUnit << kUnitShift;
+    size_t len = numUnits * kUnitSize;
+
+    assert(numUnits > 0 && numUnits <= kMaxRunUnits);
+    assert(offset < dataLen);
+
+    /* the last unit in the image may be short; zero-fill the rest */
+    if (offset + (di_off_t) len > dataLen) {
+        len = (size_t) (dataLen - offset);
+        memset(buf + len, 0, numUnits * kUnitSize - len);
+    }
+
+    return fpGFD->ReadAt(buf, len, offset);
+}
+
+/*
+ * Add the units in "buf" to the cache.  Units that are already cached
+ * are left alone.
+ */
+DIError GFDBlockCache::AddRun(long firstUnit, long numUnits,
+    const uint8_t* buf)
+{
+    long i;
+
+    for (i = 0; i < numUnits; i++) {
+        DIError dierr;
+        int idx;
+
+        if (Find(firstUnit + i) >= 0)
+            continue;
+        dierr = AllocEntry(firstUnit + i, &idx);
+        if (dierr != kDIErrNone)
+            return dierr;
+        memcpy(UnitData(idx), buf + i * kUnitSize, kUnitSize);
+    }
+    return kDIErrNone;
+}
+
+/*
+ * Read directly from the underlying GFD, then lay whatever we have cached
+ * on top of it.
+ */
+DIError GFDBlockCache::ReadDirect(void* buf, di_off_t offset, size_t length,
+    size_t* pActual)
+{
+    DIError dierr;
+
+    if (offset + (di_off_t) length <= fLength) {
+        dierr = fpGFD->ReadAt(buf, length, offset);
+        *pActual = length;
+    } else {
+        /* reading off the end; only the stream interface reports partials */
+        dierr = fpGFD->Seek(offset, kSeekSet);
+        if (dierr == kDIErrNone)
+            dierr = fpGFD->Read(buf, length, pActual);
+    }
+    if (dierr != kDIErrNone)
+        return dierr;
+
+    OverlayCached((uint8_t*) buf, offset, *pActual);
+    return kDIErrNone;
+}
+
+/*
+ * Copy cached data over the corresponding parts of "buf", which holds
+ * "length" bytes read from "offset".  Doesn't affect LRU ordering.
+ */
+void GFDBlockCache::OverlayCached(uint8_t* buf, di_off_t offset,
+    size_t length)
+{
+    di_off_t end = offset + length;
+    long unit;
+
+    if (fNumUsed == 0 || length == 0)
+        return;
+
+    for (unit = (long) (offset >> kUnitShift);
+        ((di_off_t) unit << kUnitShift) < end; unit++)
+    {
+        int idx = Find(unit);
+        if (idx < 0)
+            continue;
+
+        di_off_t unitStart = (di_off_t) unit << kUnitShift;
+        di_off_t copyStart = unitStart > offset ? unitStart : offset;
+        di_off_t copyEnd = unitStart + kUnitSize < end ?
+                                unitStart + kUnitSize : end;
+        memcpy(buf + (copyStart - offset),
+            UnitData(idx) + (copyStart - unitStart),
+            (size_t) (copyEnd - copyStart));
+    }
+}
+
+/*
+ * Data in "buf" has just been written straight to the underlying GFD.
+ * Update any entries that overlap the range.  Whole units that aren't
+ * in the cache are added, on the assumption that recently-written data
+ * will be read again soon (directory blocks, bitmaps).
+ */
+void GFDBlockCache::UpdateCached(const uint8_t* buf, di_off_t offset,
+    size_t length)
+{
+    di_off_t end = offset + length;
+    bool bigWrite = IsBypass(offset, length);
+    long unit;
+
+    for (unit = (long) (offset >> kUnitShift);
+        ((di_off_t) unit << kUnitShift) < end; unit++)
+    {
+        di_off_t unitStart = (di_off_t) unit << kUnitShift;
+        di_off_t copyStart = unitStart > offset ? unitStart : offset;
+        di_off_t copyEnd = unitStart + kUnitSize < end ?
+                                unitStart + kUnitSize : end;
+        int idx;
+
+        idx = Find(unit);
+        if (idx < 0) {
+            if (bigWrite || copyEnd - copyStart != kUnitSize ||
+                unitStart + kUnitSize > fLength)
+            {
+                continue;
+            }
+            if (AllocEntry(unit, &idx) != kDIErrNone)
+                continue;
+        }
+
+        memcpy(UnitData(idx) + (copyStart - unitStart),
+            buf + (copyStart - offset), (size_t) (copyEnd - copyStart));
+
+        /* a partially-overwritten dirty unit still needs to be written */
+        if (copyEnd - copyStart == kUnitSize && fDirtyFlags[idx]) {
+            fDirtyFlags[idx] = false;
+            fNumDirty--;
+        }
+    }
+}
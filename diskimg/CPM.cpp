@@ -218,7 +218,7 @@ DIError DiskFSCPM::ReadCatalog(void)
                 fDirEntry[i].userNumber);
         }
 
-        pFile = new A2FileCPM(this, fDirEntry);
+        pFile = new (this) A2FileCPM(this, fDirEntry);
         FormatName(pFile->fFileName, (char*)fDirEntry[i].fileName);
         pFile->fReadOnly = fDirEntry[i].readOnly;
         pFile->fDirIdx = i;
@@ -587,13 +587,16 @@ DIError A2FDCPM::Read(void* buf, size_t len, size_t* pActual)
     long incrLen = len;
 
     DIError dierr = kDIErrNone;
+    DiskImg* pDiskImg = fpFile->GetDiskFS()->GetDiskImg();
     const int kCPMBlockSize = kBlkSize*2;
     assert(kCPMBlockSize == 1024);
     uint8_t blkBuf[kCPMBlockSize];
+    long blockList[kMaxBlocksPerRead * 2];
     int blkIndex = (int) (fOffset / kCPMBlockSize);
     int bufOffset = (int) (fOffset % kCPMBlockSize);        // (& 0x3ff)
     size_t thisCount;
     long prodosBlock;
+    int numBlocks, i;
 
     if (len == 0)
         return kDIErrNone;
@@ -605,47 +608,78 @@ DIError A2FDCPM::Read(void* buf, size_t len, size_t* pActual)
             return kDIErrDataUnderrun;
         }
 
-        if (fBlockList[blkIndex] == 0) {
+        if (bufOffset != 0 || len < (size_t) kCPMBlockSize) {
             /*
-             * Sparse block.
+             * Partial block.  Read one CP/M block (two ProDOS blocks)
+             * and pull out the set of data that the user wants.
              */
-            memset(blkBuf, kNoDataByte, sizeof(blkBuf));
+            if (fBlockList[blkIndex] == 0) {
+                /*
+                 * Sparse block.
+                 */
+                memset(blkBuf, kNoDataByte, sizeof(blkBuf));
+            } else {
+                prodosBlock = GetProDOSBlock(blkIndex);
+                dierr = pDiskImg->ReadBlock(prodosBlock, blkBuf);
+                if (dierr != kDIErrNone) {
+                    LOGI(" CP/M error1 reading file '%s'", pFile->fFileName);
+                    return dierr;
+                }
+                dierr = pDiskImg->ReadBlock(prodosBlock+1, blkBuf + kBlkSize);
+                if (dierr != kDIErrNone) {
+                    LOGI(" CP/M error2 reading file '%s'", pFile->fFileName);
+                    return dierr;
+                }
+            }
+
+            thisCount = kCPMBlockSize - bufOffset;
+            if (thisCount > len)
+                thisCount = len;
+
+            memcpy(buf, blkBuf + bufOffset, thisCount);
+            numBlocks = 1;
         } else {
             /*
-             * Read one CP/M block (two ProDOS blocks) and pull out the
-             * set of data that the user wants.
-             *
-             * On some Microsoft Softcard disks, the first three tracks hold
-             * file data rather than the system image.
+             * Whole blocks.  Convert them to a list of ProDOS blocks and
+             * read them straight into the caller's buffer, which merges
+             * contiguous runs.  ProDOS block 0 can hold file data on a
+             * Softcard disk, so sparse entries are passed as -1 and then
+             * filled in with the "no data" byte.
              */
-            prodosBlock = DiskFSCPM::CPMToProDOSBlock(fBlockList[blkIndex]);
-            if (prodosBlock >= 280)
-                prodosBlock -= 280;
-
-            dierr = fpFile->GetDiskFS()->GetDiskImg()->ReadBlock(prodosBlock,
-                        blkBuf);
-            if (dierr != kDIErrNone) {
-                LOGI(" CP/M error1 reading file '%s'", pFile->fFileName);
-                return dierr;
+            numBlocks = (int) (len / kCPMBlockSize);
+            if (numBlocks > kMaxBlocksPerRead)
+                numBlocks = kMaxBlocksPerRead;
+            if (numBlocks > fBlockCount - blkIndex)
+                numBlocks = fBlockCount - blkIndex;
+
+            for (i = 0; i < numBlocks; i++) {
+                if (fBlockList[blkIndex + i] == 0) {
+                    blockList[i*2] = blockList[i*2 +1] = -1;
+                } else {
+                    prodosBlock = GetProDOSBlock(blkIndex + i);
+                    blockList[i*2] = prodosBlock;
+                    blockList[i*2 +1] = prodosBlock +1;
+                }
             }
-            dierr = fpFile->GetDiskFS()->GetDiskImg()->ReadBlock(prodosBlock+1,
-                        blkBuf + kBlkSize);
+            dierr = pDiskImg->ReadBlockList(blockList, numBlocks * 2, buf);
             if (dierr != kDIErrNone) {
-                LOGI(" CP/M error2 reading file '%s'", pFile->fFileName);
+                LOGI(" CP/M error3 reading file '%s'", pFile->fFileName);
                 return dierr;
             }
+            for (i = 0; i < numBlocks; i++) {
+                if (fBlockList[blkIndex + i] == 0) {
+                    memset((char*)buf + i * kCPMBlockSize, kNoDataByte,
+                        kCPMBlockSize);
+                }
+            }
+            thisCount = numBlocks * kCPMBlockSize;
         }
 
-        thisCount = kCPMBlockSize - bufOffset;
-        if (thisCount > len)
-            thisCount = len;
-
-        memcpy(buf, blkBuf + bufOffset, thisCount);
         len -= thisCount;
         buf = (char*)buf + thisCount;
 
         bufOffset = 0;
-        blkIndex++;
+        blkIndex += numBlocks;
     }
 
     fOffset += incrLen;
@@ -653,6 +687,22 @@ DIError A2FDCPM::Read(void* buf, size_t len, size_t* pActual)
     return dierr;
 }
 
+/*
+ * Get the first of the two ProDOS blocks that hold a CP/M block.
+ *
+ * On some Microsoft Softcard disks, the first three tracks hold file data
+ * rather than the system image.
+ */
+long A2FDCPM::GetProDOSBlock(int blkIndex) const
+{
+    long prodosBlock;
+
+    prodosBlock = DiskFSCPM::CPMToProDOSBlock(fBlockList[blkIndex]);
+    if (prodosBlock >= 280)
+        prodosBlock -= 280;
+    return prodosBlock;
+}
+
 /*
  * Write data at the current offset.
  */
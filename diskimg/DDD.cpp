@@ -90,60 +90,43 @@ const unsigned long kDDDProSignature = 0xd0bfc903;
 
 /*
  * ===========================================================================
- *      BitBuffer
+ *      Bit helpers
  * ===========================================================================
  */
 
 /*
- * Class for getting and putting bits to and from a file.
+ * The compressed stream is read and written with BitInputBuffer and
+ * BitOutputBuffer, entirely in memory.  Those work MSB-first; DDD stores
+ * many of its values LSB-first, so they get reversed on the way through.
  */
-class WrapperDDD::BitBuffer {
-public:
-    BitBuffer(void) : fpGFD(NULL), fBits(0), fBitCount(0), fIOFailure(false) {}
-    ~BitBuffer(void) {}
 
-    void SetFile(GenericFD* pGFD) { fpGFD = pGFD; }
-    void PutBits(uint8_t bits, int numBits);
-    uint8_t GetBits(int numBits);
-
-    bool IOFailure(void) const { return fIOFailure; }
+/*
+ * Utility function to reverse the order of bits in a byte.
+ */
+static uint8_t Reverse(uint8_t val)
+{
+    int i;
+    uint8_t result = 0;       // init is to make valgrind happy
 
-    static uint8_t Reverse(uint8_t val);
+    for (i = 0; i < 8; i++) {
+        result = (result << 1) + (val & 0x01);
+        val >>= 1;
+    }
 
-private:
-    GenericFD*  fpGFD;
-    uint8_t     fBits;
-    int         fBitCount;
-    bool        fIOFailure;
-};
+    return result;
+}
 
 /*
  * Add bits to the buffer.
  *
  * We roll the low bits out of "bits" and shift them to the left (in the
- * reverse order in which they were passed in).  As soon as we get 8 bits
- * we flush.
+ * reverse order in which they were passed in).
  */
-void WrapperDDD::BitBuffer::PutBits(uint8_t bits, int numBits)
+static inline void PutBits(BitOutputBuffer* pBitBuf, uint8_t bits,
+    int numBits)
 {
-    assert(fBitCount >= 0 && fBitCount < 8);
     assert(numBits > 0 && numBits <= 8);
-    assert(fpGFD != NULL);
-
-    DIError dierr;
-
-    while (numBits--) {
-        fBits = (fBits << 1) | (bits & 0x01);
-        fBitCount++;
-
-        if (fBitCount == 8) {
-            dierr = fpGFD->Write(&fBits, 1);
-            fIOFailure = (dierr != kDIErrNone);
-            fBitCount = 0;
-        }
-
-        bits >>= 1;
-    }
+    pBitBuf->WriteBits(Reverse(bits) >> (8 - numBits), numBits);
 }
 
 /*
@@ -152,62 +135,10 @@ void WrapperDDD::BitBuffer::PutBits(uint8_t bits, int numBits)
  * These come out in the order in which they appear in the file, which
  * means that in some cases they will have to be reversed.
  */
-uint8_t WrapperDDD::BitBuffer::GetBits(int numBits)
+static inline uint8_t GetBits(BitInputBuffer* pBitBuf, int numBits)
 {
-    assert(fBitCount >= 0 && fBitCount < 8);
     assert(numBits > 0 && numBits <= 8);
-    assert(fpGFD != NULL);
-
-    DIError dierr;
-    uint8_t retVal;
-
-    if (fBitCount == 0) {
-        /* have no bits */
-        dierr = fpGFD->Read(&fBits, 1);
-        fIOFailure = (dierr != kDIErrNone);
-        fBitCount = 8;
-    }
-
-    if (numBits <= fBitCount) {
-        /* just serve up what we've already got */
-        retVal = fBits >> (8 - numBits);
-        fBits <<= numBits;
-        fBitCount -= numBits;
-    } else {
-        /* some old, some new; load what we have right-aligned */
-        retVal = fBits >> (8 - fBitCount);
-        numBits -= fBitCount;
-
-        dierr = fpGFD->Read(&fBits, 1);
-        fIOFailure = (dierr != kDIErrNone);
-        fBitCount = 8;
-
-        /* make room for the rest (also zeroes out the low bits) */
-        retVal <<= numBits;
-
-        /* add the high bits from the new byte */
-        retVal |= fBits >> (8 - numBits);
-        fBits <<= numBits;
-        fBitCount -= numBits;
-    }
-
-    return retVal;
-}
-
-/*
- * Utility function to reverse the order of bits in a byte.
- */
-/*static*/ uint8_t WrapperDDD::BitBuffer::Reverse(uint8_t val)
-{
-    int i;
-    uint8_t result = 0;       // init is to make valgrind happy
-
-    for (i = 0; i < 8; i++) {
-        result = (result << 1) + (val & 0x01);
-        val >>= 1;
-    }
-
-    return result;
+    return (uint8_t) pBitBuf->GetBits(numBits, NULL);
 }
 
 
@@ -236,41 +167,68 @@ static const int kFavoriteBitEncLen[kNumFavorites] = {
  *
  * Assumes pSrcGFD points to DOS-ordered sectors.  (This is enforced when the
  * disk image is first being created.)
+ *
+ * The output is assembled in memory and written in one piece.
  */
 /*static*/ DIError WrapperDDD::PackDisk(GenericFD* pSrcGFD, GenericFD* pWrapperGFD,
     short diskVolNum)
 {
+    /* worst case is every byte stored plain, at 9 bits each */
+    const int kMaxPackedLen =
+        (3 + 8 + kNumTracks * (kNumFavorites * 8 + kTrackLen * 9) + 8) / 8 + 1;
     DIError dierr = kDIErrNone;
-    BitBuffer bitBuffer;
+    uint8_t* outBuf = NULL;
+    int outBits;
 
     assert(diskVolNum >= 0 && diskVolNum < 256);
 
+    outBuf = new uint8_t[kMaxPackedLen];
+    if (outBuf == NULL) {
+        dierr = kDIErrMalloc;
+        goto bail;
+    }
+
     /* write four zeroes to replace the DOS addr/len bytes */
     /* (actually, let's write the apparent DDD Pro v1.1 signature instead) */
     WriteLongLE(pWrapperGFD, kDDDProSignature);
 
-    bitBuffer.SetFile(pWrapperGFD);
+    {
+        BitOutputBuffer bitBuffer(outBuf, kMaxPackedLen);
 
-    bitBuffer.PutBits(0x00, 3);
-    bitBuffer.PutBits((uint8_t)diskVolNum, 8);
+        PutBits(&bitBuffer, 0x00, 3);
+        PutBits(&bitBuffer, (uint8_t)diskVolNum, 8);
 
-    /*
-     * Process all tracks.
-     */
-    for (int track = 0; track < kNumTracks; track++) {
-        uint8_t trackBuf[kTrackLen];
+        /*
+         * Process all tracks.
+         */
+        for (int track = 0; track < kNumTracks; track++) {
+            uint8_t trackBuf[kTrackLen];
 
-        dierr = pSrcGFD->Read(trackBuf, kTrackLen);
-        if (dierr != kDIErrNone) {
-            LOGI(" DDD error during read (err=%d)", dierr);
-            goto bail;
+            dierr = pSrcGFD->Read(trackBuf, kTrackLen);
+            if (dierr != kDIErrNone) {
+                LOGI(" DDD error during read (err=%d)", dierr);
+                goto bail;
+            }
+
+            PackTrack(trackBuf, &bitBuffer);
         }
 
-        PackTrack(trackBuf, &bitBuffer);
+        /*
+         * Write 8 bits of zeroes to flush remaining data out of buffer.
+         * Only whole bytes go to the file; the leftover bits are dropped.
+         */
+        PutBits(&bitBuffer, 0x00, 8);
+        outBits = bitBuffer.Finish();
+        if (outBits < 0) {
+            LOGW(" DDD overran the output buffer");
+            dierr = kDIErrInternal;
+            goto bail;
+        }
     }
 
-    /* write 8 bits of zeroes to flush remaining data out of buffer */
-    bitBuffer.PutBits(0x00, 8);
+    dierr = pWrapperGFD->Write(outBuf, outBits / 8);
+    if (dierr != kDIErrNone)
+        goto bail;
 
     /* write another zero byte because that's what DDD Pro v1.1 does */
     long zero;
@@ -281,13 +239,15 @@ static const int kFavoriteBitEncLen[kNumFavorites] = {
 
     assert(dierr == kDIErrNone);
 bail:
+    delete[] outBuf;
     return dierr;
 }
 
 /*
  * Compress a track full of data.
  */
-/*static*/ void WrapperDDD::PackTrack(const uint8_t* trackBuf, BitBuffer* pBitBuf)
+/*static*/ void WrapperDDD::PackTrack(const uint8_t* trackBuf,
+    BitOutputBuffer* pBitBuf)
 {
     uint16_t freqCounts[kNumSymbols];
     uint8_t favorites[kNumFavorites];
@@ -298,7 +258,7 @@ bail:
 
     /* write favorites */
     for (fav = 0; fav < kNumFavorites; fav++)
-        pBitBuf->PutBits(favorites[fav], 8);
+        PutBits(pBitBuf, favorites[fav], 8);
 
     /*
      * Compress track data.  Store runs as { 0x97 char count }, where
@@ -326,9 +286,9 @@ bail:
                 }
             }
 
-            pBitBuf->PutBits(kRLEDelim, 8);     // note kRLEDelim has hi bit set
-            pBitBuf->PutBits(*ucp, 8);
-            pBitBuf->PutBits(runLen, 8);
+            PutBits(pBitBuf, kRLEDelim, 8);     // note kRLEDelim has hi bit set
+            PutBits(pBitBuf, *ucp, 8);
+            PutBits(pBitBuf, runLen, 8);
 
         } else {
             /*
@@ -340,11 +300,11 @@ bail:
             }
             if (fav == kNumFavorites) {
                 /* just a plain byte */
-                pBitBuf->PutBits(0x00, 1);
-                pBitBuf->PutBits(*ucp, 8);
+                PutBits(pBitBuf, 0x00, 1);
+                PutBits(pBitBuf, *ucp, 8);
             } else {
                 /* found a favorite; leading hi bit is implied */
-                pBitBuf->PutBits(kFavoriteBitEnc[fav], kFavoriteBitEncLen[fav]);
+                PutBits(pBitBuf, kFavoriteBitEnc[fav], kFavoriteBitEncLen[fav]);
             }
         }
     }
@@ -446,47 +406,85 @@ static const uint8_t kFavoriteBitDec[kNumFavorites] = {
 /*
  * Entry point for unpacking a disk image compressed with DDD.
  *
+ * The compressed data is read into memory in one piece, up to a little
+ * more than the largest file DDD could produce.
+ *
  * The result is an unadorned DOS-ordered image.
  */
 /*static*/ DIError WrapperDDD::UnpackDisk(GenericFD* pGFD, GenericFD* pNewGFD,
     short* pDiskVolNum)
 {
+    /* worst case is every byte stored plain, plus slop for DOS DDD */
+    const long kMaxPackedLen =
+        (3 + 8 + kNumTracks * (kNumFavorites * 8 + kTrackLen * 9) + 8) / 8 +
+        256 + 16;
     DIError dierr = kDIErrNone;
-    BitBuffer bitBuffer;
+    BitInputBuffer* pBitBuffer = NULL;
+    uint8_t* inBuf = NULL;
+    di_off_t fileLen;
+    long inLen, excess;
     uint8_t val;
     long lbuf;
 
     assert(pGFD != NULL);
     assert(pNewGFD != NULL);
 
+    dierr = pGFD->Seek(0, kSeekEnd);
+    if (dierr != kDIErrNone)
+        goto bail;
+    fileLen = pGFD->Tell();
+    pGFD->Rewind();
+
     /* read four zeroes to skip the DOS addr/len bytes */
     assert(sizeof(lbuf) >= 4);
     dierr = pGFD->Read(&lbuf, 4);
     if (dierr != kDIErrNone)
         goto bail;
 
-    bitBuffer.SetFile(pGFD);
+    if (fileLen - 4 > kMaxPackedLen)
+        inLen = kMaxPackedLen;      // way too big; will fail excess test
+    else
+        inLen = (long) (fileLen - 4);
+    if (inLen <= 0) {
+        LOGI(" DDD failure or EOF on input file");
+        dierr = kDIErrBadCompressedData;
+        goto bail;
+    }
+    inBuf = new uint8_t[inLen];
+    if (inBuf == NULL) {
+        dierr = kDIErrMalloc;
+        goto bail;
+    }
+    dierr = pGFD->Read(inBuf, inLen);
+    if (dierr != kDIErrNone)
+        goto bail;
+
+    pBitBuffer = new BitInputBuffer(inBuf, inLen * 8, false);
+    if (pBitBuffer == NULL) {
+        dierr = kDIErrMalloc;
+        goto bail;
+    }
 
-    val = bitBuffer.GetBits(3);
+    val = GetBits(pBitBuffer, 3);
     if (val != 0) {
         LOGI(" DDD bits not zero, this isn't a DDD II file (0x%02x)", val);
         dierr = kDIErrGeneric;
         goto bail;
     }
-    val = bitBuffer.GetBits(8);
-    *pDiskVolNum = bitBuffer.Reverse(val);
+    val = GetBits(pBitBuffer, 8);
+    *pDiskVolNum = Reverse(val);
     LOGI(" DDD found disk volume num = %d", *pDiskVolNum);
 
     int track;
     for (track = 0; track < kNumTracks; track++) {
         uint8_t trackBuf[kTrackLen];
 
-        if (!UnpackTrack(&bitBuffer, trackBuf)) {
+        if (!UnpackTrack(pBitBuffer, trackBuf)) {
             LOGI(" DDD failed unpacking track %d", track);
             dierr = kDIErrBadCompressedData;
             goto bail;
         }
-        if (bitBuffer.IOFailure()) {
+        if (pBitBuffer->GetOverrun()) {
             LOGI(" DDD failure or EOF on input file");
             dierr = kDIErrBadCompressedData;
             goto bail;
@@ -497,8 +495,8 @@ static const uint8_t kFavoriteBitDec[kNumFavorites] = {
     }
 
     /*
-     * We should be within a byte or two of the end of the file.  Try
-     * to read more and expect it to fail.
+     * We should be within a byte or two of the end of the file.  See
+     * how much input we didn't use.
      *
      * Unfortunately, if this was a DOS DDD file, we could be up to 256
      * bytes off (the 1 additional byte it adds plus the remaining 255
@@ -509,25 +507,23 @@ static const uint8_t kFavoriteBitDec[kNumFavorites] = {
      * for long runs of bytes provides some opportunity for correct
      * detection.
      */
-    size_t actual;
-    char sctBuf[256 + 16];
-    dierr = pGFD->Read(&sctBuf, sizeof(sctBuf), &actual);
-    if (dierr == kDIErrNone) {
-        if (actual > /*kMaxExcessByteCount*/ 256) {
-            LOGW(" DDD looks like too much data in input file (%lu extra)",
-                (unsigned long) actual);
-            dierr = kDIErrBadCompressedData;
-            goto bail;
-        } else {
-            LOGI(" DDD excess bytes (%lu) within normal parameters",
-                (unsigned long) actual);
-        }
+    excess = (long) (fileLen - 4) -
+                (pBitBuffer->GetBitsConsumed() + 7) / 8;
+    if (excess > /*kMaxExcessByteCount*/ 256) {
+        LOGW(" DDD looks like too much data in input file (%ld extra)",
+            excess);
+        dierr = kDIErrBadCompressedData;
+        goto bail;
+    } else if (excess > 0) {
+        LOGI(" DDD excess bytes (%ld) within normal parameters", excess);
     }
 
     LOGI(" DDD looks like a DDD archive!");
     dierr = kDIErrNone;
 
 bail:
+    delete pBitBuffer;
+    delete[] inBuf;
     return dierr;
 }
 
@@ -536,7 +532,8 @@ bail:
  *
  * Returns "true" if all went well, "false" if something failed.
  */
-/*static*/ bool WrapperDDD::UnpackTrack(BitBuffer* pBitBuffer, uint8_t* trackBuf)
+/*static*/ bool WrapperDDD::UnpackTrack(BitInputBuffer* pBitBuffer,
+    uint8_t* trackBuf)
 {
     uint8_t favorites[kNumFavorites];
     uint8_t val;
@@ -547,8 +544,8 @@ bail:
      * Start by pulling our favorites out, in reverse order.
      */
     for (fav = 0; fav < kNumFavorites; fav++) {
-        val = pBitBuffer->GetBits(8);
-        val = pBitBuffer->Reverse(val);
+        val = GetBits(pBitBuffer, 8);
+        val = Reverse(val);
         favorites[fav] = val;
     }
 
@@ -558,20 +555,20 @@ bail:
      * Keep pulling data out until the track is full.
      */
     while (trackPtr < trackBuf + kTrackLen) {
-        val = pBitBuffer->GetBits(1);
+        val = GetBits(pBitBuffer, 1);
         if (!val) {
             /* simple byte */
-            val = pBitBuffer->GetBits(8);
-            val = pBitBuffer->Reverse(val);
+            val = GetBits(pBitBuffer, 8);
+            val = Reverse(val);
             *trackPtr++ = val;
         } else {
             /* try for a prefix match */
             int extraBits;
 
-            val = pBitBuffer->GetBits(2);
+            val = GetBits(pBitBuffer, 2);
 
             for (extraBits = 0; extraBits < 4; extraBits++) {
-                val = (val << 1) | pBitBuffer->GetBits(1);
+                val = (val << 1) | GetBits(pBitBuffer, 1);
                 int start, end;
 
                 if (extraBits == 0) {
@@ -604,11 +601,11 @@ bail:
                 uint8_t rleChar;
                 int rleCount;
 
-                (void) pBitBuffer->GetBits(1);  // get last bit of 0x97
-                val = pBitBuffer->GetBits(8);
-                rleChar = pBitBuffer->Reverse(val);
-                val = pBitBuffer->GetBits(8);
-                rleCount = pBitBuffer->Reverse(val);
+                (void) GetBits(pBitBuffer, 1);  // get last bit of 0x97
+                val = GetBits(pBitBuffer, 8);
+                rleChar = Reverse(val);
+                val = GetBits(pBitBuffer, 8);
+                rleCount = Reverse(val);
                 //LOGI(" DDD found run of %d of 0x%02x", rleCount, rleChar);
 
                 if (rleCount == 0)
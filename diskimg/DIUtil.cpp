@@ -348,3 +348,165 @@ bool DiskImgLib::IsWin9x(void)
     return false;
 }
 #endif
+
+
+/*
+ * ===========================================================================
+ *      DIMutex
+ * ===========================================================================
+ */
+
+#ifdef _WIN32
+DIMutex::DIMutex(void)
+{
+    InitializeCriticalSection(&fCritSec);
+}
+DIMutex::~DIMutex(void)
+{
+    DeleteCriticalSection(&fCritSec);
+}
+void DIMutex::Lock(void)
+{
+    EnterCriticalSection(&fCritSec);
+}
+void DIMutex::Unlock(void)
+{
+    LeaveCriticalSection(&fCritSec);
+}
+#else
+DIMutex::DIMutex(void)
+{
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&fMutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+DIMutex::~DIMutex(void)
+{
+    pthread_mutex_destroy(&fMutex);
+}
+void DIMutex::Lock(void)
+{
+    pthread_mutex_lock(&fMutex);
+}
+void DIMutex::Unlock(void)
+{
+    pthread_mutex_unlock(&fMutex);
+}
+#endif
+
+
+/*
+ * ===========================================================================
+ *      Thread runner
+ * ===========================================================================
+ */
+
+typedef struct ThreadStart {
+    DIThreadFunc    func;
+    void*           arg;
+    int             threadIdx;
+} ThreadStart;
+
+#ifdef _WIN32
+static DWORD WINAPI ThreadEntry(LPVOID param)
+{
+    ThreadStart* pStart = (ThreadStart*) param;
+    (*pStart->func)(pStart->arg, pStart->threadIdx);
+    return 0;
+}
+#else
+static void* ThreadEntry(void* param)
+{
+    ThreadStart* pStart = (ThreadStart*) param;
+    (*pStart->func)(pStart->arg, pStart->threadIdx);
+    return NULL;
+}
+#endif
+
+void DiskImgLib::RunThreads(int numThreads, DIThreadFunc func, void* arg)
+{
+    ThreadStart* starts = NULL;
+#ifdef _WIN32
+    HANDLE* threads = NULL;
+#else
+    pthread_t* threads = NULL;
+#endif
+    int numStarted = 0;
+    int i;
+
+    if (numThreads <= 1) {
+        if (numThreads == 1)
+            (*func)(arg, 0);
+        return;
+    }
+
+    starts = new ThreadStart[numThreads];
+#ifdef _WIN32
+    threads = new HANDLE[numThreads];
+#else
+    threads = new pthread_t[numThreads];
+#endif
+
+    /* index 0 runs on the calling thread */
+    for (i = 0; i < numThreads; i++) {
+        starts[i].func = func;
+        starts[i].arg = arg;
+        starts[i].threadIdx = i;
+    }
+    for (i = 1; i < numThreads; i++) {
+#ifdef _WIN32
+        threads[i] = CreateThread(NULL, 0, ThreadEntry, &starts[i], 0, NULL);
+        if (threads[i] == NULL)
+            break;
+#else
+        if (pthread_create(&threads[i], NULL, ThreadEntry, &starts[i]) != 0)
+            break;
+#endif
+        numStarted++;
+    }
+    if (numStarted != numThreads - 1) {
+        LOGW("RunThreads: only started %d of %d threads",
+            numStarted + 1, numThreads);
+    }
+
+    (*func)(arg, 0);
+    for (i = numStarted + 1; i < numThreads; i++)
+        (*func)(arg, i);
+
+    for (i = 1; i <= numStarted; i++) {
+#ifdef _WIN32
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+#else
+        pthread_join(threads[i], NULL);
+#endif
+    }
+
+    delete[] threads;
+    delete[] starts;
+}
+
+
+/*
+ * Get the current time in microseconds.  The starting point is arbitrary,
+ * so this is only useful for measuring intervals.
+ */
+int64_t DiskImgLib::GetTimeUsec(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER freq, count;
+
+    if (!QueryPerformanceFrequency(&freq) || !QueryPerformanceCounter(&count))
+        return (int64_t) GetTickCount() * 1000;
+    return (int64_t) (count.QuadPart / freq.QuadPart) * 1000000 +
+        ((count.QuadPart % freq.QuadPart) * 1000000) / freq.QuadPart;
+#else
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (int64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
@@ -811,7 +811,7 @@ DIError DiskFSDOS33::ProcessCatalogSector(int catTrack, int catSect,
 
     for (i = 0; i < kCatalogEntriesPerSect; i++) {
         if (pEntry[0x00] != kEntryUnused && pEntry[0x00] != kEntryDeleted) {
-            pFile = new A2FileDOS(this);
+            pFile = new (this) A2FileDOS(this);
 
             pFile->SetQuality(A2File::kQualityGood);
 
@@ -1747,7 +1747,7 @@ DIError DiskFSDOS33::CreateFile(const CreateParms* pParms,  A2File** ppNewFile)
     /*
      * Create a new entry for our file list.
      */
-    pNewFile = new A2FileDOS(this);
+    pNewFile = new (this) A2FileDOS(this);
     if (pNewFile == NULL) {
         dierr = kDIErrMalloc;
         goto bail;
@@ -2150,6 +2150,7 @@ DIError DiskFSDOS33::RenameFile(A2File* pGenericFile, const char* newName)
     A2FileDOS::TrimTrailingSpaces(storedName);
 
     strcpy(pFile->fFileName, storedName);
+    ReindexFile(pFile);
 
 bail:
     return dierr;
@@ -147,6 +147,8 @@ void DiskFS::SetAllReadOnly(bool val)
  * the most appropriate way to hold the data.  The tree is easier to update,
  * but the linear list corresponds to the primary view in CiderPress, and
  * lists are simpler and easier to manage.  For now I'm sticking with a list.
+ * GetFileTable provides an array view of it for callers that want one, and
+ * the A2File objects themselves live in a per-DiskFS arena.
  *
  * The files MUST be in the order in which they came from the disk.  This
  * doesn't matter most of the time, but for Pascal volumes it's essential
@@ -160,7 +162,19 @@ void DiskFS::AddFileToList(A2File* pFile)
 {
     assert(pFile->GetNext() == NULL);
 
-    if (fpA2Head == NULL) {
+    if (fpInsertAfter != NULL) {
+        /* loading a subdirectory on demand; see LoadPendingDir */
+        A2File* pNext = fpInsertAfter->GetNext();
+
+        pFile->SetPrev(fpInsertAfter);
+        pFile->SetNext(pNext);
+        fpInsertAfter->SetNext(pFile);
+        if (pNext != NULL)
+            pNext->SetPrev(pFile);
+        else
+            fpA2Tail = pFile;
+        fpInsertAfter = pFile;
+    } else if (fpA2Head == NULL) {
         assert(fpA2Tail == NULL);
         fpA2Head = fpA2Tail = pFile;
     } else {
@@ -168,6 +182,8 @@ void DiskFS::AddFileToList(A2File* pFile)
         fpA2Tail->SetNext(pFile);
         fpA2Tail = pFile;
     }
+
+    IndexFile(pFile);
 }
 
 /*
@@ -180,12 +196,8 @@ void DiskFS::AddFileToList(A2File* pFile)
  *
  * The part where things go pear-shaped happens if "pPrev" is a subdirectory.
  * If so, we need to come after all of the subdir's entries, including any
- * entries for sub-subdirs.  There's no graceful way to go about this in a
- * linear list.
- *
- * (We'd love to be able to find the *next* entry and then back up one,
- * but odds are that there isn't a "next" entry if we're busily creating
- * files.)
+ * entries for sub-subdirs.  The parent/child index tells us where the
+ * subdir's contents end.
  */
 void DiskFS::InsertFileInList(A2File* pFile, A2File* pPrev)
 {
@@ -194,123 +206,665 @@ void DiskFS::InsertFileInList(A2File* pFile, A2File* pPrev)
     if (fpA2Head == NULL) {
         assert(pPrev == NULL);
         fpA2Head = fpA2Tail = pFile;
-        return;
     } else if (pPrev == NULL) {
         // create two entries on DOS disk, delete first, add new file
         pFile->SetNext(fpA2Head);
+        fpA2Head->SetPrev(pFile);
         fpA2Head = pFile;
-        return;
-    }
+    } else {
+        /*
+         * If we're inserting after the parent (i.e. we're the very first
+         * thing in a subdir) or after a plain file, just drop it in.
+         *
+         * If we're inserting after a subdir, go fish.
+         */
+        if (pPrev->IsDirectory() && pFile->GetParent() != pPrev) {
+            pPrev = SkipSubdir(pPrev);
+        }
 
-    /*
-     * If we're inserting after the parent (i.e. we're the very first thing
-     * in a subdir) or after a plain file, just drop it in.
-     *
-     * If we're inserting after a subdir, go fish.
-     */
-    if (pPrev->IsDirectory() && pFile->GetParent() != pPrev) {
-        pPrev = SkipSubdir(pPrev);
+        A2File* pNext = pPrev->GetNext();
+        pFile->SetPrev(pPrev);
+        pFile->SetNext(pNext);
+        pPrev->SetNext(pFile);
+        if (pNext != NULL)
+            pNext->SetPrev(pFile);
+        else
+            fpA2Tail = pFile;
     }
 
-    pFile->SetNext(pPrev->GetNext());
-    pPrev->SetNext(pFile);
+    IndexFile(pFile);
 }
 
 /*
  * Skip over all entries in the subdir we're pointing to.
  *
- * The return value is the very last entry in the subdir.
+ * The return value is the very last entry in the subdir, found by following
+ * the last child down until we reach something with no children.
  */
 A2File* DiskFS::SkipSubdir(A2File* pSubdir)
 {
-    if (pSubdir->GetNext() == NULL)
-        return pSubdir;     // end of list reached -- subdir is empty
-
     A2File* pCur = pSubdir;
-    A2File* pNext = NULL;
 
-    assert(pCur != NULL);    // at least one time through the loop
+    while (pCur->fpLastChild != NULL)
+        pCur = pCur->fpLastChild;
 
-    while (pCur != NULL) {
-        pNext = pCur->GetNext();
-        if (pNext == NULL)               // end of list reached
-            return pCur;
+    return pCur;
+}
 
-        if (pNext->GetParent() != pSubdir)  // end of dir reached
-            return pCur;
-        if (pNext->IsDirectory())
-            pCur = SkipSubdir(pNext);   // get last entry in dir
-        else
-            pCur = pNext;               // advance forward one
+/*
+ * Delete a member from the list.
+ */
+void DiskFS::DeleteFileFromList(A2File* pFile)
+{
+    A2File* pPrev = pFile->GetPrev();
+    A2File* pNext = pFile->GetNext();
+
+    if (pPrev == NULL && fpA2Head != pFile) {
+        LOGI("GLITCH: couldn't find element to delete!");
+        assert(false);
+        return;
     }
 
-    /* should never get here */
-    assert(false);
-    return pNext;
+    UnindexFile(pFile);
+
+    if (pPrev != NULL)
+        pPrev->SetNext(pNext);
+    else
+        fpA2Head = pNext;
+    if (pNext != NULL)
+        pNext->SetPrev(pPrev);
+    else
+        fpA2Tail = pPrev;
+
+    delete pFile;
 }
 
+
 /*
- * Delete a member from the list.
- *
- * We're currently singly-linked, making this rather expensive.
+ * ===========================================================================
+ *      File storage
+ * ===========================================================================
  */
-void DiskFS::DeleteFileFromList(A2File* pFile)
+
+FileArena::FileArena(void)
+    : fpChunkList(NULL), fpCur(NULL), fAvail(0), fNumFreeLists(0)
 {
-    if (fpA2Head == pFile) {
-        /* delete the head of the list */
-        fpA2Head = fpA2Head->GetNext();
-        delete pFile;
+    memset(fFreeLists, 0, sizeof(fFreeLists));
+}
+
+FileArena::~FileArena(void)
+{
+    while (fpChunkList != NULL) {
+        uint8_t* pNext = *(uint8_t**) fpChunkList;
+        delete[] fpChunkList;
+        fpChunkList = pNext;
+    }
+}
+
+/*
+ * Allocate a new chunk with room for "size" bytes, and link it into the
+ * chunk list.  Returns a pointer to the usable part.
+ */
+uint8_t* FileArena::NewChunk(size_t size)
+{
+    uint8_t* pChunk = new uint8_t[kAlign + size];
+
+    *(uint8_t**) pChunk = fpChunkList;
+    fpChunkList = pChunk;
+    return pChunk + kAlign;
+}
+
+/*
+ * Allocate "size" bytes, aligned for any object.
+ */
+void* FileArena::Alloc(size_t size)
+{
+    size = RoundUp(size);
+
+    for (int i = 0; i < fNumFreeLists; i++) {
+        if (fFreeLists[i].size == size && fFreeLists[i].pHead != NULL) {
+            void* ptr = fFreeLists[i].pHead;
+            fFreeLists[i].pHead = *(void**) ptr;
+            return ptr;
+        }
+    }
+
+    if (size > kChunkSize / 4)
+        return NewChunk(size);      // odd one out; give it its own chunk
+
+    if (size > fAvail) {
+        fpCur = NewChunk(kChunkSize);
+        fAvail = kChunkSize;
+    }
+    void* ptr = fpCur;
+    fpCur += size;
+    fAvail -= size;
+    return ptr;
+}
+
+/*
+ * Return memory to the arena.  "size" must match what was passed to Alloc.
+ * If we run out of free lists the memory just sits until the arena goes
+ * away.
+ */
+void FileArena::Free(void* ptr, size_t size)
+{
+    int i;
+
+    size = RoundUp(size);
+    for (i = 0; i < fNumFreeLists; i++) {
+        if (fFreeLists[i].size == size)
+            break;
+    }
+    if (i == fNumFreeLists) {
+        if (fNumFreeLists == kMaxFreeLists)
+            return;
+        fFreeLists[i].size = size;
+        fFreeLists[i].pHead = NULL;
+        fNumFreeLists++;
+    }
+
+    *(void**) ptr = fFreeLists[i].pHead;
+    fFreeLists[i].pHead = ptr;
+}
+
+/*
+ * Each A2File is preceded by a small header that records where it came
+ * from, so that "delete" can give it back.
+ */
+typedef struct FileObjHeader {
+    FileArena*  pArena;
+    size_t      size;
+} FileObjHeader;
+static const size_t kFileObjHeaderLen = 16;     // keep objects aligned
+
+/*
+ * Allocate storage for an A2File from the DiskFS's arena, creating the
+ * arena if this is the first file.
+ */
+/*static*/ void* A2File::operator new(size_t size, DiskFS* pDiskFS)
+{
+    FileArena* pArena = NULL;
+    uint8_t* mem;
+
+    assert(sizeof(FileObjHeader) <= kFileObjHeaderLen);
+    size += kFileObjHeaderLen;
+    if (pDiskFS != NULL) {
+        if (pDiskFS->fpFileArena == NULL)
+            pDiskFS->fpFileArena = new FileArena;
+        pArena = pDiskFS->fpFileArena;
+        mem = (uint8_t*) pArena->Alloc(size);
     } else {
-        A2File* pCur = fpA2Head;
-        while (pCur != NULL) {
-            if (pCur->GetNext() == pFile) {
-                /* found it */
-                A2File* pNextNext = pCur->GetNext()->GetNext();
-                delete pCur->GetNext();
-                pCur->SetNext(pNextNext);
-                break;
+        mem = (uint8_t*) ::operator new(size);
+    }
+
+    FileObjHeader* pHdr = (FileObjHeader*) mem;
+    pHdr->pArena = pArena;
+    pHdr->size = size;
+    return mem + kFileObjHeaderLen;
+}
+
+/*
+ * Release an A2File's storage.
+ */
+/*static*/ void A2File::operator delete(void* ptr)
+{
+    if (ptr == NULL)
+        return;
+
+    uint8_t* mem = (uint8_t*) ptr - kFileObjHeaderLen;
+    FileObjHeader* pHdr = (FileObjHeader*) mem;
+    if (pHdr->pArena != NULL)
+        pHdr->pArena->Free(mem, pHdr->size);
+    else
+        ::operator delete(mem);
+}
+
+/*
+ * Matching delete for the placement form, used if a constructor throws.
+ */
+/*static*/ void A2File::operator delete(void* ptr, DiskFS* /*pDiskFS*/)
+{
+    A2File::operator delete(ptr);
+}
+
+
+/*
+ * ===========================================================================
+ *      File table
+ * ===========================================================================
+ */
+
+/*
+ * Give a file a handle as it enters the list.  Handles are slots in
+ * fpHandleTable, handed out in order and never reused.
+ */
+void DiskFS::AssignHandle(A2File* pFile)
+{
+    if (fNumHandles == fHandleTableSize) {
+        long newSize = (fHandleTableSize == 0) ? 256 : fHandleTableSize * 2;
+        A2File** newTable = new A2File*[newSize];
+        if (fNumHandles != 0)
+            memcpy(newTable, fpHandleTable, fNumHandles * sizeof(A2File*));
+        delete[] fpHandleTable;
+        fpHandleTable = newTable;
+        fHandleTableSize = newSize;
+    }
+
+    pFile->fHandle = fNumHandles;
+    fpHandleTable[fNumHandles++] = pFile;
+}
+
+DiskFS::FileHandle DiskFS::GetFileHandle(const A2File* pFile) const
+{
+    return pFile->fHandle;
+}
+
+A2File* DiskFS::GetFileByHandle(FileHandle handle) const
+{
+    if (handle < 0 || handle >= fNumHandles)
+        return NULL;
+    return fpHandleTable[handle];
+}
+
+/*
+ * Fill in fpFileTable from the linked list.  Any directories that haven't
+ * been read yet are loaded first.
+ */
+void DiskFS::BuildFileTable(void)
+{
+    A2File* pFile;
+    long idx;
+
+    pFile = fpA2Head;
+    while (pFile != NULL) {
+        if (pFile->fDirPending)
+            LoadPendingDir(pFile);
+        pFile = pFile->GetNext();
+    }
+
+    /* every file in the list is in the hash table, so we know the count */
+    if (fNumHashed > fFileTableSize) {
+        delete[] fpFileTable;
+        fFileTableSize = fNumHashed + fNumHashed / 4;
+        fpFileTable = new A2File*[fFileTableSize];
+    }
+
+    idx = 0;
+    pFile = fpA2Head;
+    while (pFile != NULL) {
+        assert(idx < fNumHashed);
+        fpFileTable[idx++] = pFile;
+        pFile = pFile->GetNext();
+    }
+    assert(idx == fNumHashed);
+
+    fFileTableCount = idx;
+    fFileTableValid = true;
+}
+
+/*
+ * Get the file list as an array.
+ */
+A2File* const* DiskFS::GetFileTable(long* pCount) const
+{
+    if (!fFileTableValid)
+        const_cast<DiskFS*>(this)->BuildFileTable();
+
+    *pCount = fFileTableCount;
+    return fpFileTable;
+}
+
+
+/*
+ * ===========================================================================
+ *      File index
+ * ===========================================================================
+ */
+
+/*
+ * The index has two parts.  A hash table on the full pathname makes
+ * GetFileByName a constant-time operation, and per-directory child lists
+ * let hierarchical filesystems find a directory's contents without walking
+ * the linear list.  Both are intrusive, using fields in A2File, and are
+ * updated whenever a file enters or leaves the list.
+ *
+ * Filesystems that change a pathname after the file is in the list must
+ * call ReindexFile.
+ */
+
+static const uint32_t kPathHashSeed = 2166136261U;
+static const uint32_t kInitialHashTableSize = 256;   // power of 2
+
+/*
+ * Add "str" to a running pathname hash (FNV-1a).
+ *
+ * The hash has to agree with any StringCompareFunc we're handed, so it's
+ * deliberately coarse: ASCII case is folded, and ' ', '.', and all
+ * high-ASCII characters hash the same.  That covers strcasecmp, the HFS
+ * Mac OS Roman ordering (which equates ' ' with 0xca), and ProDOS names
+ * shown with GS/OS lower-case flags (where ' ' is a lower-case '.').
+ */
+/*static*/ uint32_t DiskFS::HashPathName(uint32_t hash, const char* str)
+{
+    const uint8_t* ucp = (const uint8_t*) str;
+
+    while (*ucp != '\0') {
+        uint8_t ch = *ucp++;
+        if (ch >= 'a' && ch <= 'z')
+            ch -= 'a' - 'A';
+        else if (ch == ' ' || ch == '.' || ch >= 0x80)
+            ch = 0x80;
+        hash = (hash ^ ch) * 16777619U;
+    }
+
+    return hash;
+}
+
+/*
+ * Add a file to the pathname hash table, growing the table if it's full.
+ *
+ * Entries are appended to the end of their chain, so files with identical
+ * names (possible on a damaged disk) are found in list order.
+ */
+void DiskFS::HashAdd(A2File* pFile)
+{
+    A2File** ppLink;
+
+    if ((uint32_t) fNumHashed >= fHashTableSize) {
+        uint32_t newSize = (fHashTableSize == 0) ?
+                                kInitialHashTableSize : fHashTableSize * 2;
+        A2File** newTable = new A2File*[newSize];
+        memset(newTable, 0, newSize * sizeof(A2File*));
+
+        for (uint32_t i = 0; i < fHashTableSize; i++) {
+            A2File* pCur = fpHashTable[i];
+            while (pCur != NULL) {
+                A2File* pNext = pCur->fpHashNext;
+
+                ppLink = &newTable[pCur->fPathHash & (newSize-1)];
+                while (*ppLink != NULL)
+                    ppLink = &(*ppLink)->fpHashNext;
+                *ppLink = pCur;
+                pCur->fpHashNext = NULL;
+
+                pCur = pNext;
             }
-            pCur = pCur->GetNext();
         }
 
+        delete[] fpHashTable;
+        fpHashTable = newTable;
+        fHashTableSize = newSize;
+    }
+
+    pFile->fPathHash = HashPathName(kPathHashSeed, pFile->GetPathName());
+    pFile->fpHashNext = NULL;
+
+    ppLink = &fpHashTable[pFile->fPathHash & (fHashTableSize-1)];
+    while (*ppLink != NULL)
+        ppLink = &(*ppLink)->fpHashNext;
+    *ppLink = pFile;
+    fNumHashed++;
+}
+
+/*
+ * Remove a file from the pathname hash table.  Uses the hash computed when
+ * the file was added, so this works after the pathname has changed.
+ */
+void DiskFS::HashRemove(A2File* pFile)
+{
+    A2File** ppLink;
+
+    if (fpHashTable == NULL)
+        return;
+
+    ppLink = &fpHashTable[pFile->fPathHash & (fHashTableSize-1)];
+    while (*ppLink != NULL) {
+        if (*ppLink == pFile) {
+            *ppLink = pFile->fpHashNext;
+            pFile->fpHashNext = NULL;
+            fNumHashed--;
+            return;
+        }
+        ppLink = &(*ppLink)->fpHashNext;
+    }
+
+    LOGI("GLITCH: '%s' not found in hash table", pFile->GetPathName());
+    assert(false);
+}
+
+/*
+ * Add a newly-linked file to the index.
+ *
+ * To find our place among our siblings we look at the entry ahead of us
+ * in the list.  That's either our parent, the sibling we follow, or
+ * something inside that sibling, so we climb parent pointers until we hit
+ * one of the first two.
+ */
+void DiskFS::IndexFile(A2File* pFile)
+{
+    HashAdd(pFile);
+    AssignHandle(pFile);
+    fFileTableValid = false;
+
+    A2File* pParent = pFile->GetParent();
+    pFile->fpIdxParent = pParent;
+    if (pParent == NULL)
+        return;
+
+    A2File* pPrevSib = NULL;
+    A2File* pCur = pFile->GetPrev();
+    while (pCur != pParent) {
         if (pCur == NULL) {
-            LOGI("GLITCH: couldn't find element to delete!");
-            assert(false);
+            /* list isn't in tree order; just put it at the end */
+            pPrevSib = pParent->fpLastChild;
+            break;
+        }
+        if (pCur->fpIdxParent == pParent) {
+            pPrevSib = pCur;
+            break;
+        }
+        pCur = pCur->fpIdxParent;
+    }
+
+    pFile->fpPrevSibling = pPrevSib;
+    if (pPrevSib == NULL) {
+        pFile->fpNextSibling = pParent->fpFirstChild;
+        pParent->fpFirstChild = pFile;
+    } else {
+        pFile->fpNextSibling = pPrevSib->fpNextSibling;
+        pPrevSib->fpNextSibling = pFile;
+    }
+    if (pFile->fpNextSibling != NULL)
+        pFile->fpNextSibling->fpPrevSibling = pFile;
+    else
+        pParent->fpLastChild = pFile;
+}
+
+/*
+ * Remove a file that's about to leave the list from the index.
+ */
+void DiskFS::UnindexFile(A2File* pFile)
+{
+    HashRemove(pFile);
+    fpHandleTable[pFile->fHandle] = NULL;
+    fFileTableValid = false;
+
+    /* only empty directories get deleted, but don't leave dangling links */
+    A2File* pChild = pFile->fpFirstChild;
+    while (pChild != NULL) {
+        A2File* pNext = pChild->fpNextSibling;
+        pChild->fpIdxParent = pChild->fpPrevSibling = pChild->fpNextSibling =
+            NULL;
+        pChild = pNext;
+    }
+    pFile->fpFirstChild = pFile->fpLastChild = NULL;
+
+    A2File* pParent = pFile->fpIdxParent;
+    if (pParent == NULL)
+        return;
+
+    if (pFile->fpPrevSibling != NULL)
+        pFile->fpPrevSibling->fpNextSibling = pFile->fpNextSibling;
+    else
+        pParent->fpFirstChild = pFile->fpNextSibling;
+    if (pFile->fpNextSibling != NULL)
+        pFile->fpNextSibling->fpPrevSibling = pFile->fpPrevSibling;
+    else
+        pParent->fpLastChild = pFile->fpPrevSibling;
+
+    pFile->fpIdxParent = pFile->fpPrevSibling = pFile->fpNextSibling = NULL;
+}
+
+/*
+ * Update the hash table after a file's pathname has changed.
+ */
+void DiskFS::ReindexFile(A2File* pFile)
+{
+    HashRemove(pFile);
+    HashAdd(pFile);
+}
+
+/*
+ * Parent/child index accessors.
+ */
+A2File* DiskFS::GetLastChild(const A2File* pDir) const
+{
+    return pDir->fpLastChild;
+}
+A2File* DiskFS::GetPrevSibling(const A2File* pFile) const
+{
+    return pFile->fpPrevSibling;
+}
+
+/*
+ * Find the file called "fileName" in directory "pDir".  Pass NULL for
+ * filesystems without directories.
+ *
+ * We compute the hash the full pathname would have, then check the
+ * candidates' parent and filename.
+ */
+A2File* DiskFS::FindChild(A2File* pDir, const char* fileName,
+    StringCompareFunc func)
+{
+    static const char kSepStr[2] = { kDIFssep, '\0' };
+    uint32_t hash = kPathHashSeed;
+
+    if (func == NULL)
+        func = ::strcasecmp;
+
+    if (pDir != NULL) {
+        if (pDir->fDirPending)
+            LoadPendingDir(pDir);
+        if (!pDir->IsVolumeDirectory()) {
+            hash = HashPathName(hash, pDir->GetPathName());
+            hash = HashPathName(hash, kSepStr);
+        }
+    }
+    hash = HashPathName(hash, fileName);
+
+    if (fpHashTable == NULL)
+        return NULL;
+
+    A2File* pFile = fpHashTable[hash & (fHashTableSize-1)];
+    while (pFile != NULL) {
+        if (pFile->fPathHash == hash && pFile->fpIdxParent == pDir &&
+            (*func)(pFile->GetFileName(), fileName) == 0)
+        {
+            return pFile;
         }
+        pFile = pFile->fpHashNext;
     }
+
+    return NULL;
 }
 
+/*
+ * Find a file in the hash table by full pathname.  Doesn't load anything.
+ */
+A2File* DiskFS::LookupPathName(const char* pathName, StringCompareFunc func)
+{
+    if (fpHashTable == NULL)
+        return NULL;
+
+    uint32_t hash = HashPathName(kPathHashSeed, pathName);
+    A2File* pFile = fpHashTable[hash & (fHashTableSize-1)];
+    while (pFile != NULL) {
+        if (pFile->fPathHash == hash &&
+            (*func)(pFile->GetPathName(), pathName) == 0)
+        {
+            return pFile;
+        }
+        pFile = pFile->fpHashNext;
+    }
+
+    return NULL;
+}
+
+
+/*
+ * Mark a directory whose contents haven't been read yet.
+ */
+void DiskFS::SetDirPending(A2File* pDir)
+{
+    assert(fLazyDirs);
+    assert(pDir->IsDirectory());
+    pDir->fDirPending = true;
+}
+
+/*
+ * Read the contents of a directory that Initialize skipped over, inserting
+ * the entries into the list right after it.  Sub-directories are left
+ * pending, so this only reads one level.
+ *
+ * If the directory can't be read we mark it as damaged, as the full scan
+ * would have.
+ */
+void DiskFS::LoadPendingDir(A2File* pDir)
+{
+    DIError dierr;
+
+    assert(pDir->fDirPending);
+    assert(fpInsertAfter == NULL);
+
+    pDir->fDirPending = false;
+    fpInsertAfter = pDir;
+    dierr = LoadSubdir(pDir);
+    fpInsertAfter = NULL;
+
+    if (dierr != kDIErrNone) {
+        LOGI(" DiskFS unable to load dir '%s': %s", pDir->GetPathName(),
+            DIStrError(dierr));
+        pDir->SetQuality(A2File::kQualityDamaged);
+    }
+}
 
 /*
  * Access the "next" pointer.
  *
  * Because we apparently can't declare an anonymous class as a friend
  * in MSVC++6.0, this can't be an inline function.
+ *
+ * If we're stepping into a directory that hasn't been loaded yet, load it
+ * now.  This changes the list, but not in a way the caller can see.
  */
 A2File* DiskFS::GetNextFile(A2File* pFile) const
 {
     if (pFile == NULL)
         return fpA2Head;
-    else
-        return pFile->GetNext();
+    if (pFile->fDirPending)
+        const_cast<DiskFS*>(this)->LoadPendingDir(pFile);
+    return pFile->GetNext();
 }
 
 /*
  * Return the #of elements in the linear file list.
- *
- * Right now the only code that calls this is the disk info panel in
- * CiderPress, so we don't need it to be efficient.
  */
 long DiskFS::GetFileCount(void) const
 {
-    long count = 0;
-
-    A2File* pFile = fpA2Head;
-    while (pFile != NULL) {
-        count++;
-        pFile = pFile->GetNext();
-    }
+    long count;
 
+    (void) GetFileTable(&count);
     return count;
 }
 
@@ -328,6 +882,24 @@ void DiskFS::DeleteFileList(void)
         delete pFile;
         pFile = pNext;
     }
+    fpA2Head = fpA2Tail = NULL;
+
+    delete[] fpHashTable;
+    fpHashTable = NULL;
+    fHashTableSize = 0;
+    fNumHashed = 0;
+
+    delete[] fpHandleTable;
+    fpHandleTable = NULL;
+    fHandleTableSize = fNumHandles = 0;
+    delete[] fpFileTable;
+    fpFileTable = NULL;
+    fFileTableSize = fFileTableCount = 0;
+    fFileTableValid = false;
+
+    /* all files are gone, so nothing points into the arena */
+    delete fpFileArena;
+    fpFileArena = NULL;
 }
 
 /*
@@ -347,7 +919,7 @@ void DiskFS::DumpFileList(void)
 }
 
 /*
- * Run through the list of files and find one that matches (case-insensitive).
+ * Find the file that matches (case-insensitive).
  *
  * This does not attempt to open files in sub-volumes.  We could, but it's
  * likely that the application has "decorated" the name in some fashion,
@@ -361,15 +933,30 @@ A2File* DiskFS::GetFileByName(const char* fileName, StringCompareFunc func)
     if (func == NULL)
         func = ::strcasecmp;
 
-    pFile = GetNextFile(NULL);
-    while (pFile != NULL) {
-        if ((*func)(pFile->GetPathName(), fileName) == 0)
-            return pFile;
+    pFile = LookupPathName(fileName, func);
+    if (pFile == NULL && fLazyDirs) {
+        /*
+         * Not found.  Read any unloaded directories along the path, then
+         * try again.
+         */
+        char* pathBuf = new char[strlen(fileName)+1];
+        strcpy(pathBuf, fileName);
+
+        char* cp = strchr(pathBuf, kDIFssep);
+        while (cp != NULL) {
+            *cp = '\0';
+            A2File* pDir = LookupPathName(pathBuf, func);
+            *cp = kDIFssep;
+            if (pDir != NULL && pDir->fDirPending)
+                LoadPendingDir(pDir);
+            cp = strchr(cp+1, kDIFssep);
+        }
+        delete[] pathBuf;
 
-        pFile = GetNextFile(pFile);
+        pFile = LookupPathName(fileName, func);
     }
 
-    return NULL;
+    return pFile;
 }
 
 
@@ -517,6 +1104,18 @@ void DiskFS::SetParameter(DiskFSParameter parm, long val)
 }
 
 
+/*
+ * Get the I/O statistics for the image.  The DiskImg keeps them on the
+ * outermost image, so this covers sub-volumes too.
+ */
+void DiskFS::GetIOStats(DiskImg::IOStats* pStats) const
+{
+    if (fpImg != NULL)
+        fpImg->GetIOStats(pStats);
+    else
+        memset(pStats, 0, sizeof(*pStats));
+}
+
 /*
  * Scan for damaged or suspicious files.
  */
@@ -535,3 +1134,249 @@ void DiskFS::ScanForDamagedFiles(bool* pDamaged, bool* pSuspicious)
         pFile = GetNextFile(pFile);
     }
 }
+
+
+/*
+ * ===========================================================================
+ *      ExtractAll
+ * ===========================================================================
+ */
+
+#ifdef _WIN32
+# define kLocalFssep '\\'
+#else
+# define kLocalFssep '/'
+#endif
+
+/*
+ * State shared by the extraction threads.
+ */
+typedef struct ExtractState {
+    const char* outDir;
+    A2File**    fileList;
+    long        numFiles;
+
+    DIMutex     lock;           // guards the fields below
+    long        nextFile;       // index of next file to hand out
+    DIError     firstErr;       // first failure, if any
+} ExtractState;
+
+/*
+ * Create a directory, ignoring "already exists" and any other failure
+ * (which will be reported when we try to create the file).
+ */
+static void MakeOneDir(const char* path)
+{
+#ifdef _WIN32
+    (void) CreateDirectoryA(path, NULL);
+#else
+    (void) mkdir(path, 0755);
+#endif
+}
+
+/*
+ * Build the host pathname for "pFile" under "outDir".  Filesystem
+ * separators become host separators; characters the host won't like in
+ * a filename, and "." or ".." components, are replaced with '_'.
+ *
+ * Returns a new[]ed string.
+ */
+static char* BuildOutputPath(const char* outDir, const A2File* pFile)
+{
+    const char* pathName = pFile->GetPathName();
+    char fssep = pFile->GetFssep();
+    size_t dirLen = strlen(outDir);
+    char* outPath = new char[dirLen + 1 + strlen(pathName) + 1];
+    char* cp;
+    char* compStart;
+
+    strcpy(outPath, outDir);
+    cp = outPath + dirLen;
+    *cp++ = kLocalFssep;
+
+    compStart = cp;
+    for ( ; *pathName != '\0'; pathName++) {
+        char ch = *pathName;
+
+        if (fssep != '\0' && ch == fssep) {
+            *cp++ = kLocalFssep;
+            compStart = cp;
+            continue;
+        }
+        if ((uint8_t) ch < 0x20 || ch == '/' || ch == '\\' ||
+            ch == 0x7f
+#ifdef _WIN32
+            || strchr(":*?\"<>|", ch) != NULL
+#endif
+            )
+        {
+            ch = '_';
+        }
+        *cp++ = ch;
+
+        /* don't let "." or ".." climb out of the output directory */
+        if (ch == '.' && (pathName[1] == '\0' || pathName[1] == fssep)) {
+            char* dp;
+            for (dp = compStart; dp < cp && *dp == '.'; dp++)
+                ;
+            if (dp == cp) {
+                for (dp = compStart; dp < cp; dp++)
+                    *dp = '_';
+            }
+        }
+    }
+    *cp = '\0';
+
+    return outPath;
+}
+
+/*
+ * Create the directories leading up to "outPath", which must begin with
+ * "outDir" (already created).
+ */
+static void MakeParentDirs(char* outPath, size_t dirLen)
+{
+    char* cp;
+
+    for (cp = outPath + dirLen + 1; *cp != '\0'; cp++) {
+        if (*cp == kLocalFssep) {
+            *cp = '\0';
+            MakeOneDir(outPath);
+            *cp = kLocalFssep;
+        }
+    }
+}
+
+/*
+ * Copy the data fork of one file out to the host filesystem.
+ */
+static DIError ExtractOneFile(A2File* pFile, const char* outDir,
+    uint8_t* buf, size_t bufSize)
+{
+    DIError dierr = kDIErrNone;
+    A2FileDescr* pDescr = NULL;
+    char* outPath = NULL;
+    FILE* fp = NULL;
+    size_t actual;
+
+    outPath = BuildOutputPath(outDir, pFile);
+    MakeParentDirs(outPath, strlen(outDir));
+
+    dierr = pFile->Open(&pDescr, true, false);
+    if (dierr != kDIErrNone) {
+        LOGW("ExtractAll: unable to open '%s': %s", pFile->GetPathName(),
+            DIStrError(dierr));
+        goto bail;
+    }
+
+    fp = fopen(outPath, "wb");
+    if (fp == NULL) {
+        dierr = ErrnoOrGeneric();
+        LOGW("ExtractAll: unable to create '%s' (err=%d)", outPath, dierr);
+        goto bail;
+    }
+
+    while (true) {
+        dierr = pDescr->Read(buf, bufSize, &actual);
+        if (dierr != kDIErrNone) {
+            LOGW("ExtractAll: read failed on '%s': %s",
+                pFile->GetPathName(), DIStrError(dierr));
+            goto bail;
+        }
+        if (actual == 0)
+            break;
+        if (fwrite(buf, 1, actual, fp) != actual) {
+            dierr = kDIErrWriteFailed;
+            LOGW("ExtractAll: write failed on '%s'", outPath);
+            goto bail;
+        }
+    }
+
+bail:
+    if (fp != NULL) {
+        if (fclose(fp) != 0 && dierr == kDIErrNone)
+            dierr = kDIErrWriteFailed;
+    }
+    if (pDescr != NULL)
+        pDescr->Close();
+    delete[] outPath;
+    return dierr;
+}
+
+/*
+ * Thread body: pull files off the shared list until it's empty.
+ */
+static void ExtractThread(void* arg, int threadIdx)
+{
+    ExtractState* pState = (ExtractState*) arg;
+    const size_t kBufSize = 64 * 1024;
+    uint8_t* buf = new uint8_t[kBufSize];
+
+    (void) threadIdx;
+
+    while (true) {
+        long idx;
+        {
+            DIAutoLock lock(&pState->lock);
+            idx = pState->nextFile++;
+        }
+        if (idx >= pState->numFiles)
+            break;
+
+        DIError dierr = ExtractOneFile(pState->fileList[idx],
+                            pState->outDir, buf, kBufSize);
+        if (dierr != kDIErrNone) {
+            DIAutoLock lock(&pState->lock);
+            if (pState->firstErr == kDIErrNone)
+                pState->firstErr = dierr;
+        }
+    }
+
+    delete[] buf;
+}
+
+/*
+ * Extract the data fork of every file in "pDiskFS" into "outDir",
+ * recreating the directory hierarchy, using up to "numThreads" threads.
+ *
+ * Files are opened read-only, so this may be called on an image opened
+ * read-only.  Sub-volumes are not descended into.  A failure on one file
+ * doesn't stop the others; the first error seen is returned.
+ */
+DIError DiskImgLib::ExtractAll(DiskFS* pDiskFS, const char* outDir,
+    int numThreads)
+{
+    ExtractState state;
+    A2File* const* pFileTable;
+    long tableCount, count;
+
+    if (pDiskFS == NULL || outDir == NULL || outDir[0] == '\0')
+        return kDIErrInvalidArg;
+    if (numThreads < 1)
+        numThreads = 1;
+
+    state.outDir = outDir;
+    pFileTable = pDiskFS->GetFileTable(&tableCount);
+    state.fileList = new A2File*[tableCount + 1];
+    state.numFiles = 0;
+    state.nextFile = 0;
+    state.firstErr = kDIErrNone;
+
+    count = 0;
+    for (long i = 0; i < tableCount; i++) {
+        A2File* pFile = pFileTable[i];
+        if (!pFile->IsDirectory() && !pFile->IsVolumeDirectory())
+            state.fileList[count++] = pFile;
+    }
+    state.numFiles = count;
+    if (numThreads > count)
+        numThreads = count > 0 ? (int) count : 1;
+
+    LOGI("ExtractAll: %ld files to '%s' with %d threads", count, outDir,
+        numThreads);
+    MakeOneDir(outDir);
+    pDiskFS->GetDiskImg()->RunIOThreads(numThreads, ExtractThread, &state);
+
+    delete[] state.fileList;
+    return state.firstErr;
+}
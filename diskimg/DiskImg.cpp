@@ -229,9 +229,31 @@ DiskImg::DiskImg(void)
 
     fNibbleTrackBuf = NULL;
     fNibbleTrackLoaded = -1;
+    fpNibbleSlots = NULL;
+    fNumNibbleSlots = 0;
+    fpNibbleCurSlot = NULL;
+    fNibbleUseCount = 0;
+    memset(&fNibbleCacheStats, 0, sizeof(fNibbleCacheStats));
+    fpLock = new DIMutex;
 
     fNuFXCompressType = kNuThreadFormatLZW2;
 
+    fCacheMode = kCacheModeWriteThrough;
+    fCacheMaxBytes = kDefaultCacheSize;
+    fpBlockCache = NULL;
+    memset(&fIOStats, 0, sizeof(fIOStats));
+    fLastIOEnd = 0;
+    fNumProbeWindows = 0;
+    fProbeThreads = kDefaultProbeThreads;
+    fParallelProbe = false;
+    fGzipMemoryLimit = kGzipMax;
+    fGzipIndexMode = kGzipIndexNone;
+    fUseMmap = false;
+    fpFormatCache = NULL;
+    memset(&fFormatEntry, 0, sizeof(fFormatEntry));
+    fHaveFormatKey = false;
+    fFormatCacheHit = false;
+
     fNotes = NULL;
     fpBadBlockMap = NULL;
     fDiskFSRefCnt = 0;
@@ -247,7 +269,9 @@ DiskImg::~DiskImg(void)
     }
     (void) CloseImage();
     delete[] fpNibbleDescrTable;
-    delete[] fNibbleTrackBuf;
+    FreeNibbleTracks();
+    FreeProbeWindows();
+    delete fpLock;
     delete[] fNotes;
     delete fpBadBlockMap;
 
@@ -287,7 +311,10 @@ void DiskImg::SetCustomNibbleDescr(const NibbleDescr* pDescr)
         assert(fpNibbleDescrTable != NULL);
         //LOGI("Overwriting entry %d with new value (special=%d)",
         //  kNibbleDescrCustom, pDescr->special);
+        DIAutoLock lock(fpLock);    // the sector maps may refer to it
         fpNibbleDescrTable[kNibbleDescrCustom] = *pDescr;
+        for (int i = 0; i < fNumNibbleSlots; i++)
+            fpNibbleSlots[i].map.pNibbleDescr = NULL;
         fpNibbleDescr = &fpNibbleDescrTable[kNibbleDescrCustom];
     }
 }
@@ -309,6 +336,7 @@ DIError DiskImg::OpenImage(const char* pathName, char fssep, bool readOnly)
 {
     DIError dierr = kDIErrNone;
     bool isWinDevice = false;
+    OpTimer timer(this, kTimedOpen);
 
     if (fpDataGFD != NULL) {
         LOGI(" DI already open!");
@@ -372,6 +400,9 @@ DIError DiskImg::OpenImage(const char* pathName, char fssep, bool readOnly)
         fpWrapperGFD = pGFDFile;
         pGFDFile = NULL;
 
+        if (fpFormatCache != NULL)
+            LookupFormatCache(pathName, fssep);
+
         dierr = AnalyzeImageFile(pathName, fssep);
         if (dierr != kDIErrNone)
             goto bail;
@@ -379,6 +410,7 @@ DIError DiskImg::OpenImage(const char* pathName, char fssep, bool readOnly)
 
 
     assert(fpDataGFD != NULL);
+    InstallBlockCache();
 
 bail:
     return dierr;
@@ -459,6 +491,8 @@ DIError DiskImg::OpenImage(DiskImg* pParent, long firstBlock, long numBlocks)
     }
 
     fReadOnly = pParent->GetReadOnly();     // very important
+    fProbeThreads = pParent->fProbeThreads;
+    pParent->GetIOStatsSink()->subVolumeProbes++;
 
     DIError dierr;
     GFDGFD* pGFDGFD;
@@ -512,6 +546,8 @@ DIError DiskImg::OpenImage(DiskImg* pParent, long firstTrack, long firstSector,
     }
 
     fReadOnly = pParent->GetReadOnly();     // very important
+    fProbeThreads = pParent->fProbeThreads;
+    pParent->GetIOStatsSink()->subVolumeProbes++;
 
     DIError dierr;
     GFDGFD* pGFDGFD;
@@ -589,6 +625,7 @@ DIError DiskImg::CloseImage(void)
     dierr = FlushImage(kFlushAll);
     if (dierr != kDIErrNone)
         return dierr;
+    FreeNibbleTracks();
 
     /*
      * Clean up.  Close GFD, OrigGFD, and OuterGFD.  Delete ImageWrapper
@@ -601,6 +638,7 @@ DIError DiskImg::CloseImage(void)
         fpDataGFD->Close();
         delete fpDataGFD;
         fpDataGFD = NULL;
+        fpBlockCache = NULL;
     }
     if (fpWrapperGFD != NULL) {
         fpWrapperGFD->Close();
@@ -659,6 +697,23 @@ DIError DiskImg::FlushImage(FlushMode mode)
         return kDIErrNone;
     }
 
+    /*
+     * Step 1: make sure any local caches have been flushed.  This is
+     * cheap, so we do it even for "fast" flushes of slow wrappers.
+     */
+    dierr = FlushNibbleTracks();
+    if (dierr != kDIErrNone) {
+        LOGI(" ERROR: nibble track flush failed (err=%d)", dierr);
+        return dierr;
+    }
+    if (fpBlockCache != NULL) {
+        dierr = fpBlockCache->FlushDirty();
+        if (dierr != kDIErrNone) {
+            LOGI(" ERROR: sector cache flush failed (err=%d)", dierr);
+            return dierr;
+        }
+    }
+
     if (mode == kFlushFastOnly &&
         ((fpImageWrapper != NULL && !fpImageWrapper->HasFastFlush()) ||
          (fpOuterWrapper != NULL && !fpOuterWrapper->HasFastFlush()) ))
@@ -667,11 +722,6 @@ DIError DiskImg::FlushImage(FlushMode mode)
         return kDIErrNone;
     }
 
-    /*
-     * Step 1: make sure any local caches have been flushed.
-     */
-    /* (none) */
-
     /*
      * Step 2: push changes from fpDataGFD to fpWrapperGFD.  This will
      * cause ImageWrapper to rebuild itself (SHK, DDD, whatever).  In
@@ -823,7 +873,7 @@ DIError DiskImg::AnalyzeImageFile(const char* pathName, char fssep)
     {
         LOGI("  DI found gz outer wrapper");
 
-        fpOuterWrapper = new OuterGzip();
+        fpOuterWrapper = new OuterGzip(fGzipMemoryLimit, fGzipIndexMode);
         if (fpOuterWrapper == NULL) {
             dierr = kDIErrMalloc;
             goto bail;
@@ -896,6 +946,26 @@ DIError DiskImg::AnalyzeImageFile(const char* pathName, char fssep)
         }
     }
 
+    /*
+     * If the format cache has seen this file before, skip the probing.
+     * The wrapper still has to be prepped, so we pick up at the switch
+     * below.  (The outer format can't really disagree, since the file
+     * and the name are the same, but don't trust it blindly.)
+     */
+    if (fFormatCacheHit) {
+        if (fFormatEntry.outerFormat == fOuterFormat) {
+            probableFormat = (FileFormat) fFormatEntry.fileFormat;
+            fPhysical = (PhysicalFormat) fFormatEntry.physical;
+            if (strcasecmp(ext, "hdv") == 0)
+                fExpandable = true;
+            LOGI(" DI format cache hit, file format %d", probableFormat);
+            goto prep;
+        }
+        LOGW(" DI format cache outer format mismatch (%d vs %d)",
+            fFormatEntry.outerFormat, fOuterFormat);
+        fFormatCacheHit = false;
+    }
+
     /*
      * Try to figure out what format the file is in.
      *
@@ -1063,6 +1133,7 @@ gotit: ;
      * important when we can't recognize the filesystem format (for correct
      * operation of disk tools).
      */
+prep:
     switch (probableFormat) {
     case kFileFormat2MG:
         fpImageWrapper = new Wrapper2MG();
@@ -1077,7 +1148,7 @@ gotit: ;
         fpImageWrapper = new WrapperTrackStar();
         break;
     case kFileFormatFDI:
-        fpImageWrapper = new WrapperFDI();
+        fpImageWrapper = new WrapperFDI(fProbeThreads);
         fReadOnly = true;       // writing to FDI not yet supported
         break;
     case kFileFormatNuFX:
@@ -1104,6 +1175,12 @@ gotit: ;
     }
     if (fpImageWrapper != NULL) {
         assert(fpDataGFD == NULL);
+        if (fUseMmap && fOuterFormat == kOuterFormatNone &&
+            (probableFormat == kFileFormatUnadorned ||
+             probableFormat == kFileFormat2MG))
+        {
+            MapImageFile(pathName);
+        }
         dierr = fpImageWrapper->Prep(fpWrapperGFD, fWrappedLength, fReadOnly,
                     &fLength, &fPhysical, &fOrder, &fDOSVolumeNum,
                     &fpBadBlockMap, &fpDataGFD);
@@ -1159,6 +1236,8 @@ bail:
  */
 DIError DiskImg::AnalyzeImage(void)
 {
+    OpTimer timer(this, kTimedAnalyze);
+
     assert(fLength >= 0);
     assert(fpDataGFD != NULL);
     assert(fFileFormat != kFileFormatUnknown);
@@ -1171,6 +1250,10 @@ DIError DiskImg::AnalyzeImage(void)
     if (fpDataGFD == NULL)
         return kDIErrInternal;
 
+    /* sector pairing changes the answers, so leave the cache out of it */
+    if (fSectorPairing)
+        fHaveFormatKey = fFormatCacheHit = false;
+
     /*
      * Figure out how many tracks and sectors the image has.
      *
@@ -1236,7 +1319,10 @@ DIError DiskImg::AnalyzeImage(void)
          * working with a TrackStar or FDI image.
          */
         DIError dierr;
-        dierr = AnalyzeNibbleData();    // sets nibbleDescr and DOS vol num
+        if (fFormatCacheHit)
+            dierr = UseCachedNibbleDescr();
+        else
+            dierr = AnalyzeNibbleData();    // sets nibbleDescr and DOS vol num
         if (dierr == kDIErrNone) {
             assert(fpNibbleDescr != NULL);
             fNumSectPerTrack = fpNibbleDescr->numSectors;
@@ -1306,7 +1392,12 @@ DIError DiskImg::AnalyzeImage(void)
      * We've got the track/sector/block layout sorted out; now figure out
      * what kind of filesystem we're dealing with.
      */
-    AnalyzeImageFS();
+    if (fFormatCacheHit)
+        UseCachedFSFormat();
+    else
+        AnalyzeImageFS();
+    if (fHaveFormatKey && !fFormatCacheHit)
+        StoreFormatCache();
 
     LOGI(" DI AnalyzeImage tracks=%ld sectors=%d blocks=%ld fileSysOrder=%d",
         fNumTracks, fNumSectPerTrack, fNumBlocks, fFileSysOrder);
@@ -1317,106 +1408,339 @@ DIError DiskImg::AnalyzeImage(void)
 }
 
 /*
- * Try to figure out what filesystem exists on this disk image.
+ * The filesystem tests, in the order AnalyzeImageFS applies them.  When
+ * more than one test matches, the earliest entry wins, so the order
+ * matters:
+ *
+ *  - We want to test for DOS before ProDOS, because sometimes they
+ *    overlap (e.g. 800K ProDOS disk with five 160K DOS volumes on it).
+ *  - The CFFA format doesn't have a partition map, but we do insist on
+ *    finding multiple volumes.  It needs to come after MicroDrive,
+ *    because a disk formatted for CFFA then subsequently partitioned for
+ *    MicroDrive will still look like valid CFFA unless you zero out the
+ *    blocks.
+ *  - The MSDOS test is really just a trap to catch CFFA cards that were
+ *    formatted for ProDOS and then re-formatted for MSDOS.  As such it
+ *    needs to come before the ProDOS test.  It only works on larger
+ *    volumes, and can be overridden, so it's pretty safe.
+ *
+ * In some circumstances it would be useful to have a set describing
+ * what filesystems we might expect to find, e.g. we're not likely to
+ * encounter RDOS embedded in a CF card.
+ */
+typedef DIError (*TestFSFunc)(DiskImg* pImg, DiskImg::SectorOrder* pOrder,
+    DiskImg::FSFormat* pFormat, DiskFS::FSLeniency leniency);
+enum {
+    kFSTestMacPart = 0,
+    kFSTestMicroDrive,
+    kFSTestFocusDrive,
+    kFSTestCFFA,
+    kFSTestFAT,
+    kFSTestDOS33,
+    kFSTestUNIDOSWide,
+    kFSTestUNIDOS,
+    kFSTestOzDOS,
+    kFSTestProDOS,
+    kFSTestPascal,
+    kFSTestCPM,
+    kFSTestRDOS,
+    kFSTestHFS,
+    kFSTestGutenberg,
+    kNumFSTests
+};
+static const TestFSFunc kFSTests[kNumFSTests] = {
+    DiskFSMacPart::TestFS,
+    DiskFSMicroDrive::TestFS,
+    DiskFSFocusDrive::TestFS,
+    DiskFSCFFA::TestFS,
+    DiskFSFAT::TestFS,
+    DiskFSDOS33::TestFS,
+    DiskFSUNIDOS::TestWideFS,
+    DiskFSUNIDOS::TestFS,
+    DiskFSOzDOS::TestFS,
+    DiskFSProDOS::TestFS,
+    DiskFSPascal::TestFS,
+    DiskFSCPM::TestFS,
+    DiskFSRDOS::TestFS,
+    DiskFSHFS::TestFS,
+    DiskFSGutenberg::TestFS,
+};
+
+/*
+ * I/O counters for one RunIOThreads worker thread.  While a worker is
+ * running, gpThreadIOStats points at its own set, so it isn't fighting
+ * the other workers over the root image's fIOStats; see GetIOStatsSink.
+ */
+typedef struct ThreadIOStats {
+    DiskImg::IOStats    stats;
+    di_off_t            lastIOEnd;  // for counting seeks on this thread
+} ThreadIOStats;
+static thread_local ThreadIOStats* gpThreadIOStats = NULL;
+
+/*
+ * Add the counters in "pSrc" to "pDst".
+ */
+static void AddIOStats(DiskImg::IOStats* pDst, const DiskImg::IOStats* pSrc)
+{
+    pDst->readCalls += pSrc->readCalls;
+    pDst->writeCalls += pSrc->writeCalls;
+    pDst->bytesRead += pSrc->bytesRead;
+    pDst->bytesWritten += pSrc->bytesWritten;
+    pDst->seeks += pSrc->seeks;
+    pDst->nibbleTrackLoads += pSrc->nibbleTrackLoads;
+    pDst->nibbleTrackScans += pSrc->nibbleTrackScans;
+    pDst->cacheHits += pSrc->cacheHits;
+    pDst->cacheMisses += pSrc->cacheMisses;
+    pDst->subVolumeProbes += pSrc->subVolumeProbes;
+    pDst->probeHits += pSrc->probeHits;
+    pDst->formatCacheHits += pSrc->formatCacheHits;
+    pDst->openUsec += pSrc->openUsec;
+    pDst->analyzeUsec += pSrc->analyzeUsec;
+    pDst->analyzeFSUsec += pSrc->analyzeFSUsec;
+    pDst->initializeUsec += pSrc->initializeUsec;
+}
+
+/*
+ * Get the counters that I/O on the calling thread should update, and
+ * optionally the offset just past the thread's last access.  That's the
+ * root image's, unless we're on a RunIOThreads worker.  Workers can open
+ * sub-volumes and run threads of their own, so this nests.
+ */
+DiskImg::IOStats* DiskImg::GetIOStatsSink(di_off_t** ppLastIOEnd) const
+{
+    if (gpThreadIOStats != NULL) {
+        if (ppLastIOEnd != NULL)
+            *ppLastIOEnd = &gpThreadIOStats->lastIOEnd;
+        return &gpThreadIOStats->stats;
+    }
+    if (ppLastIOEnd != NULL)
+        *ppLastIOEnd = &fLastIOEnd;
+    return &GetRootImage()->fIOStats;
+}
+
+typedef struct IOThreadState {
+    DiskImg::ThreadFunc func;
+    void*               arg;
+    ThreadIOStats*      ioStats;    // one per thread
+} IOThreadState;
+
+/*
+ * Thread body for RunIOThreads.  Thread 0 runs on the caller, which may
+ * itself be a worker, so put its counters back when we're done.
+ */
+static void IOThreadEntry(void* vState, int threadIdx)
+{
+    IOThreadState* pState = (IOThreadState*) vState;
+    ThreadIOStats* pOuterIOStats = gpThreadIOStats;
+
+    gpThreadIOStats = &pState->ioStats[threadIdx];
+    (*pState->func)(pState->arg, threadIdx);
+    gpThreadIOStats = pOuterIOStats;
+}
+
+/*
+ * Run "func" on "numThreads" threads, with each thread counting its I/O
+ * in a private ThreadIOStats.  The counts are added to the calling
+ * thread's once they're all done.
+ */
+void DiskImg::RunIOThreads(int numThreads, ThreadFunc func, void* arg) const
+{
+    IOThreadState state;
+
+    if (numThreads <= 1) {
+        RunThreads(numThreads, func, arg);
+        return;
+    }
+
+    state.func = func;
+    state.arg = arg;
+    state.ioStats = new ThreadIOStats[numThreads];
+    memset(state.ioStats, 0, sizeof(ThreadIOStats) * numThreads);
+
+    RunThreads(numThreads, IOThreadEntry, &state);
+
+    IOStats* pStats = GetIOStatsSink();
+    for (int i = 0; i < numThreads; i++)
+        AddIOStats(pStats, &state.ioStats[i].stats);
+    delete[] state.ioStats;
+}
+
+/*
+ * Shared state for RunFSTests.  Each test gets its own copy of the
+ * order and format, so concurrent tests don't see each other's guesses.
+ */
+typedef struct FSTestState {
+    DiskImg*                pImg;
+    DiskImg::SectorOrder    order[kNumFSTests];
+    DiskImg::FSFormat       format[kNumFSTests];
+    DIMutex                 lock;
+    int                     nextTest;   // next test to hand out
+    int                     firstMatch; // lowest-numbered match so far
+} FSTestState;
+
+/*
+ * Thread body for RunFSTests.  Tests are handed out in priority order,
+ * and a test is skipped once an earlier one has matched, because it can
+ * no longer affect the answer.  A test that precedes the eventual winner
+ * is never skipped, so the outcome is the same as running them serially.
+ */
+static void FSTestThread(void* vState, int /*threadIdx*/)
+{
+    FSTestState* pState = (FSTestState*) vState;
+
+    while (true) {
+        int idx;
+
+        pState->lock.Lock();
+        idx = pState->nextTest++;
+        if (idx >= pState->firstMatch) {
+            pState->lock.Unlock();
+            break;
+        }
+        pState->lock.Unlock();
+
+        DIError dierr = (*kFSTests[idx])(pState->pImg, &pState->order[idx],
+                            &pState->format[idx], DiskFS::kLeniencyNot);
+
+        if (dierr == kDIErrNone) {
+            DIAutoLock lock(&pState->lock);
+            if (idx < pState->firstMatch)
+                pState->firstMatch = idx;
+        }
+    }
+}
+
+/*
+ * Run the filesystem tests, on several threads if that's likely to help.
  *
- * We want to test for DOS before ProDOS, because sometimes they overlap (e.g.
- * 800K ProDOS disk with five 160K DOS volumes on it).
+ * Returns the index of the first test (in kFSTests order) that matched,
+ * with its order and format in "*pOrder" and "*pFormat", or -1 if
+ * nothing matched.
+ */
+int DiskImg::RunFSTests(SectorOrder* pOrder, FSFormat* pFormat)
+{
+    FSTestState state;
+    int numThreads = fProbeThreads;
+
+    if (numThreads < 1 || fHasNibbles || fpDataGFD->GetIsMemoryBased())
+        numThreads = 1;
+    if (numThreads > kNumFSTests)
+        numThreads = kNumFSTests;
+
+    state.pImg = this;
+    for (int i = 0; i < kNumFSTests; i++) {
+        state.order[i] = *pOrder;
+        state.format[i] = *pFormat;
+    }
+    state.nextTest = 0;
+    state.firstMatch = kNumFSTests;
+
+    if (numThreads > 1) {
+        LOGD(" DI running FS tests on %d threads", numThreads);
+        fParallelProbe = true;
+    }
+    RunIOThreads(numThreads, FSTestThread, &state);
+    fParallelProbe = false;
+
+    if (state.firstMatch == kNumFSTests)
+        return -1;
+    *pOrder = state.order[state.firstMatch];
+    *pFormat = state.format[state.firstMatch];
+    return state.firstMatch;
+}
+
+/*
+ * Try to figure out what filesystem exists on this disk image.
  *
  * Sets fFormat, fOrder, and fFileSysOrder.
  */
 void DiskImg::AnalyzeImageFS(void)
 {
-    /*
-     * In some circumstances it would be useful to have a set describing
-     * what filesystems we might expect to find, e.g. we're not likely to
-     * encounter RDOS embedded in a CF card.
-     */
-    if (DiskFSMacPart::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot) == kDIErrNone)
-    {
+    OpTimer timer(this, kTimedAnalyzeFS);
+
+    LoadProbeWindows();
+
+    switch (RunFSTests(&fOrder, &fFormat)) {
+    case kFSTestMacPart:
         assert(fFormat == kFormatMacPart);
         LOGI(" DI found MacPart, order=%d", fOrder);
-    } else if (DiskFSMicroDrive::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot) == kDIErrNone)
-    {
+        break;
+    case kFSTestMicroDrive:
         assert(fFormat == kFormatMicroDrive);
         LOGI(" DI found MicroDrive, order=%d", fOrder);
-    } else if (DiskFSFocusDrive::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot) == kDIErrNone)
-    {
+        break;
+    case kFSTestFocusDrive:
         assert(fFormat == kFormatFocusDrive);
         LOGI(" DI found FocusDrive, order=%d", fOrder);
-    } else if (DiskFSCFFA::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot) == kDIErrNone)
-    {
-        // The CFFA format doesn't have a partition map, but we do insist
-        // on finding multiple volumes.  It needs to come after MicroDrive,
-        // because a disk formatted for CFFA then subsequently partitioned
-        // for MicroDrive will still look like valid CFFA unless you zero
-        // out the blocks.
+        break;
+    case kFSTestCFFA:
         assert(fFormat == kFormatCFFA4 || fFormat == kFormatCFFA8);
         LOGI(" DI found CFFA, order=%d", fOrder);
-    } else if (DiskFSFAT::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot) == kDIErrNone)
-    {
-        // This is really just a trap to catch CFFA cards that were formatted
-        // for ProDOS and then re-formatted for MSDOS.  As such it needs to
-        // come before the ProDOS test.  It only works on larger volumes,
-        // and can be overridden, so it's pretty safe.
+        break;
+    case kFSTestFAT:
         assert(fFormat == kFormatMSDOS);
         LOGI(" DI found MSDOS, order=%d", fOrder);
-    } else if (DiskFSDOS33::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot) == kDIErrNone)
-    {
+        break;
+    case kFSTestDOS33:
         assert(fFormat == kFormatDOS32 || fFormat == kFormatDOS33);
         LOGI(" DI found DOS3.x, order=%d", fOrder);
         if (fNumSectPerTrack == 13)
             fFormat = kFormatDOS32;
-    } else if (DiskFSUNIDOS::TestWideFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot) == kDIErrNone)
-    {
+        break;
+    case kFSTestUNIDOSWide:
         // Should only succeed on 400K embedded chunks.
         assert(fFormat == kFormatDOS33);
         fNumSectPerTrack = 32;
         fNumTracks /= 2;
         LOGI(" DI found 'wide' DOS3.3, order=%d", fOrder);
-    } else if (DiskFSUNIDOS::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot) == kDIErrNone)
-    {
+        break;
+    case kFSTestUNIDOS:
         assert(fFormat == kFormatUNIDOS);
         fNumSectPerTrack = 32;
         fNumTracks /= 2;
         LOGI(" DI found UNIDOS, order=%d", fOrder);
-    } else if (DiskFSOzDOS::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot) == kDIErrNone)
-    {
+        break;
+    case kFSTestOzDOS:
         assert(fFormat == kFormatOzDOS);
         fNumSectPerTrack = 32;
         fNumTracks /= 2;
         LOGI(" DI found OzDOS, order=%d", fOrder);
-    } else if (DiskFSProDOS::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot) == kDIErrNone)
-    {
+        break;
+    case kFSTestProDOS:
         assert(fFormat == kFormatProDOS);
         LOGI(" DI found ProDOS, order=%d", fOrder);
-    } else if (DiskFSPascal::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot) == kDIErrNone)
-    {
+        break;
+    case kFSTestPascal:
         assert(fFormat == kFormatPascal);
         LOGI(" DI found Pascal, order=%d", fOrder);
-    } else if (DiskFSCPM::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot) == kDIErrNone)
-    {
+        break;
+    case kFSTestCPM:
         assert(fFormat == kFormatCPM);
         LOGI(" DI found CP/M, order=%d", fOrder);
-    } else if (DiskFSRDOS::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot) == kDIErrNone)
-    {
+        break;
+    case kFSTestRDOS:
         assert(fFormat == kFormatRDOS33 ||
                fFormat == kFormatRDOS32 ||
                fFormat == kFormatRDOS3);
         LOGI(" DI found RDOS 3.3, order=%d", fOrder);
-    } else if (DiskFSHFS::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot) == kDIErrNone)
-    {
+        break;
+    case kFSTestHFS:
         assert(fFormat == kFormatMacHFS);
         LOGI(" DI found HFS, order=%d", fOrder);
-    } else if (DiskFSGutenberg::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot) == kDIErrNone)
-    {
+        break;
+    case kFSTestGutenberg:
         assert(fFormat == kFormatGutenberg);
         LOGI(" DI found Gutenberg, order=%d", fOrder);
-    } else {
+        break;
+    default:
         fFormat = kFormatUnknown;
         LOGI(" DI no recognizeable filesystem found (fOrder=%d)",
             fOrder);
+        break;
     }
 
+    FreeProbeWindows();
+
     fFileSysOrder = CalcFSSectorOrder();
 }
 
@@ -1762,10 +2086,16 @@ bool DiskImg::UpdateScanProgress(const char* newStr)
     DiskImg* pImg = this;
     bool result = true;
 
-    /* search up the tree to find a progress updater */
+    /*
+     * Search up the tree to find a progress updater.  Sub-volumes opened
+     * by filesystem tests on worker threads stay quiet, since the
+     * callback generally expects to be called on the application's thread.
+     */
+    if (fParallelProbe)
+        return result;
     while (func == NULL) {
         pImg = pImg->fpParentImg;
-        if (pImg == NULL)
+        if (pImg == NULL || pImg->fParallelProbe)
             return result;      // none defined, bail out
         func = pImg->fpScanProgressCallback;
     }
@@ -1799,6 +2129,63 @@ bool DiskImg::UpdateScanProgress(const char* newStr)
  * ==========================================================================
  */
 
+/*
+ * Sector order conversion table, indexed by [imageOrder][fsOrder][sector].
+ * Converts a sector number in the filesystem's ordering to the sector
+ * number where it lives in a track of the image.
+ *
+ * Each entry is raw2<image>[<fs>2raw[sector]], using these skew tables:
+ *
+ *  raw2dos    = 0 7 14 6 13 5 12 4 11 3 10 2 9 1 8 15
+ *  dos2raw    = 0 13 11 9 7 5 3 1 14 12 10 8 6 4 2 15
+ *  raw2prodos = 0 8 1 9 2 10 3 11 4 12 5 13 6 14 7 15
+ *  prodos2raw = 0 2 4 6 8 10 12 14 1 3 5 7 9 11 13 15
+ *  raw2cpm    = 0 11 6 1 12 7 2 13 8 3 14 9 4 15 10 5
+ *  cpm2raw    = 0 3 6 9 12 15 2 5 8 11 14 1 4 7 10 13
+ *
+ * No table is needed for Copy ][+ format, which is equivalent to
+ * "physical".  "Unknown" should never happen, but is treated as physical.
+ */
+static const uint8_t kSectorOrderMap[DiskImg::kSectorOrderMax]
+    [DiskImg::kSectorOrderMax][16] =
+{
+    {   // image order: unknown
+        {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },   // fs: unknown
+        {  0,  2,  4,  6,  8, 10, 12, 14,  1,  3,  5,  7,  9, 11, 13, 15 },   // fs: ProDOS
+        {  0, 13, 11,  9,  7,  5,  3,  1, 14, 12, 10,  8,  6,  4,  2, 15 },   // fs: DOS
+        {  0,  3,  6,  9, 12, 15,  2,  5,  8, 11, 14,  1,  4,  7, 10, 13 },   // fs: CP/M
+        {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },   // fs: physical
+    },
+    {   // image order: ProDOS
+        {  0,  8,  1,  9,  2, 10,  3, 11,  4, 12,  5, 13,  6, 14,  7, 15 },   // fs: unknown
+        {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },   // fs: ProDOS
+        {  0, 14, 13, 12, 11, 10,  9,  8,  7,  6,  5,  4,  3,  2,  1, 15 },   // fs: DOS
+        {  0,  9,  3, 12,  6, 15,  1, 10,  4, 13,  7,  8,  2, 11,  5, 14 },   // fs: CP/M
+        {  0,  8,  1,  9,  2, 10,  3, 11,  4, 12,  5, 13,  6, 14,  7, 15 },   // fs: physical
+    },
+    {   // image order: DOS
+        {  0,  7, 14,  6, 13,  5, 12,  4, 11,  3, 10,  2,  9,  1,  8, 15 },   // fs: unknown
+        {  0, 14, 13, 12, 11, 10,  9,  8,  7,  6,  5,  4,  3,  2,  1, 15 },   // fs: ProDOS
+        {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },   // fs: DOS
+        {  0,  6, 12,  3,  9, 15, 14,  5, 11,  2,  8,  7, 13,  4, 10,  1 },   // fs: CP/M
+        {  0,  7, 14,  6, 13,  5, 12,  4, 11,  3, 10,  2,  9,  1,  8, 15 },   // fs: physical
+    },
+    {   // image order: CP/M
+        {  0, 11,  6,  1, 12,  7,  2, 13,  8,  3, 14,  9,  4, 15, 10,  5 },   // fs: unknown
+        {  0,  6, 12,  2,  8, 14,  4, 10, 11,  1,  7, 13,  3,  9, 15,  5 },   // fs: ProDOS
+        {  0, 15,  9,  3, 13,  7,  1, 11, 10,  4, 14,  8,  2, 12,  6,  5 },   // fs: DOS
+        {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },   // fs: CP/M
+        {  0, 11,  6,  1, 12,  7,  2, 13,  8,  3, 14,  9,  4, 15, 10,  5 },   // fs: physical
+    },
+    {   // image order: physical
+        {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },   // fs: unknown
+        {  0,  2,  4,  6,  8, 10, 12, 14,  1,  3,  5,  7,  9, 11, 13, 15 },   // fs: ProDOS
+        {  0, 13, 11,  9,  7,  5,  3,  1, 14, 12, 10,  8,  6,  4,  2, 15 },   // fs: DOS
+        {  0,  3,  6,  9, 12, 15,  2,  5,  8, 11, 14,  1,  4,  7, 10, 13 },   // fs: CP/M
+        {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },   // fs: physical
+    },
+};
+
 /*
  * Handle sector order conversions.
  */
@@ -1808,29 +2195,6 @@ DIError DiskImg::CalcSectorAndOffset(long track, int sector, SectorOrder imageOr
     if (!fHasSectors)
         return kDIErrUnsupportedAccess;
 
-    /*
-     * Sector order conversions.  No table is needed for Copy ][+ format,
-     * which is equivalent to "physical".
-     */
-    static const int raw2dos[16] = {
-        0, 7, 14, 6, 13, 5, 12, 4, 11, 3, 10, 2, 9, 1, 8, 15
-    };
-    static const int dos2raw[16] = {
-        0, 13, 11, 9, 7, 5, 3, 1, 14, 12, 10, 8, 6, 4, 2, 15
-    };
-    static const int raw2prodos[16] = {
-        0, 8, 1, 9, 2, 10, 3, 11, 4, 12, 5, 13, 6, 14, 7, 15
-    };
-    static const int prodos2raw[16] = {
-        0, 2, 4, 6, 8, 10, 12, 14, 1, 3, 5, 7, 9, 11, 13, 15
-    };
-    static const int raw2cpm[16] = {
-        0, 11, 6, 1, 12, 7, 2, 13, 8, 3, 14, 9, 4, 15, 10, 5
-    };
-    static const int cpm2raw[16] = {
-        0, 3, 6, 9, 12, 15, 2, 5, 8, 11, 14, 1, 4, 7, 10, 13
-    };
-
     if (track < 0 || track >= fNumTracks) {
         LOGI(" DI read invalid track %ld", track);
         return kDIErrInvalidTrack;
@@ -1872,48 +2236,13 @@ DIError DiskImg::CalcSectorAndOffset(long track, int sector, SectorOrder imageOr
         }
         assert(sector >= 0 && sector < 16);
 
-        /* convert request to "raw" sector number */
-        switch (fsOrder) {
-        case kSectorOrderProDOS:
-            newSector = prodos2raw[sector];
-            break;
-        case kSectorOrderDOS:
-            newSector = dos2raw[sector];
-            break;
-        case kSectorOrderCPM:
-            newSector = cpm2raw[sector];
-            break;
-        case kSectorOrderPhysical:  // used for Copy ][+
-            newSector = sector;
-            break;
-        case kSectorOrderUnknown:
-            // should never happen; fall through to "default"
-        default:
+        /* convert request to the image's ordering */
+        if (!IsValidOrder(fsOrder) || !IsValidOrder(imageOrder)) {
+            // should never happen
             assert(false);
             newSector = sector;
-            break;
-        }
-
-        /* convert "raw" request to the image's ordering */
-        switch (imageOrder) {
-        case kSectorOrderProDOS:
-            newSector = raw2prodos[newSector];
-            break;
-        case kSectorOrderDOS:
-            newSector = raw2dos[newSector];
-            break;
-        case kSectorOrderCPM:
-            newSector = raw2cpm[newSector];
-            break;
-        case kSectorOrderPhysical:
-            //newSector = newSector;
-            break;
-        case kSectorOrderUnknown:
-            // should never happen; fall through to "default"
-        default:
-            assert(false);
-            //newSector = newSector;
-            break;
+        } else {
+            newSector = kSectorOrderMap[imageOrder][fsOrder][sector];
         }
 
         if (imageOrder == fsOrder) {
@@ -2017,6 +2346,72 @@ DIError DiskImg::ReadTrackSectorSwapped(long track, int sector, void* buf,
     return dierr;
 }
 
+/*
+ * Read all of the sectors on a track, in the same order ReadTrackSector
+ * would return them.
+ *
+ * For nibble images this decodes the whole track at once, rather than
+ * looking up the track and sector map again for every sector.  Other
+ * images just read one sector at a time.
+ */
+DIError DiskImg::ReadTrack(long track, void* buf, uint32_t* pBadMask)
+{
+    DIError dierr;
+    uint8_t* outBuf = (uint8_t*) buf;
+    int sector;
+
+    if (buf == NULL || pBadMask == NULL)
+        return kDIErrInvalidArg;
+    if (!fHasSectors)
+        return kDIErrUnsupportedAccess;
+    if (track < 0 || track >= fNumTracks)
+        return kDIErrInvalidTrack;
+    assert(fNumSectPerTrack <= 32);
+
+    *pBadMask = 0;
+
+    if (IsNibbleFormat(fPhysical) && fpNibbleDescr != NULL &&
+        fNumSectPerTrack == fpNibbleDescr->numSectors && !fSectorPairing)
+    {
+        uint8_t trackBuf[kMaxNibbleSectors * kSectorSize];
+        uint32_t physBadMask;
+
+        dierr = ReadNibbleTrackSectors(track, trackBuf, &physBadMask,
+                    fpNibbleDescr);
+        if (dierr != kDIErrNone)
+            return dierr;
+
+        /* put them in file system order */
+        for (sector = 0; sector < fNumSectPerTrack; sector++) {
+            di_off_t offset;
+            int newSector = -1;
+
+            dierr = CalcSectorAndOffset(track, sector, fOrder, fFileSysOrder,
+                        &offset, &newSector);
+            if (dierr != kDIErrNone)
+                return dierr;
+            assert(newSector >= 0 && newSector < fNumSectPerTrack);
+
+            memcpy(outBuf + sector * kSectorSize,
+                trackBuf + newSector * kSectorSize, kSectorSize);
+            if ((physBadMask & (1UL << newSector)) != 0)
+                *pBadMask |= 1UL << sector;
+        }
+        return kDIErrNone;
+    }
+
+    for (sector = 0; sector < fNumSectPerTrack; sector++) {
+        uint8_t* sctBuf = outBuf + sector * kSectorSize;
+
+        dierr = ReadTrackSector(track, sector, sctBuf);
+        if (dierr != kDIErrNone) {
+            memset(sctBuf, 0, kSectorSize);
+            *pBadMask |= 1UL << sector;
+        }
+    }
+    return kDIErrNone;
+}
+
 /*
  * Write the specified track and sector, adjusting for sector ordering as
  * appropriate.
@@ -2150,11 +2545,15 @@ DIError DiskImg::ReadBlocks(long startBlock, int numBlocks, void* buf)
 
     if (!IsLinearBlocks(fOrder, fFileSysOrder)) {
         /*
-         * This isn't a collection of linear blocks, so we need to read it one
-         * block at a time with sector swapping.  This almost certainly means
-         * that we're not reading from physical media, so performance shouldn't
-         * be an issue.
+         * This isn't a collection of linear blocks, so we need to swap
+         * sectors around.  If the image is laid out in simple tracks we
+         * can read a track at a time and shuffle the sectors in memory;
+         * otherwise we read one block at a time.
          */
+        if (CanDoTrackBlockIO()) {
+            dierr = ReadBlocksByTrack(startBlock, numBlocks, buf);
+            goto bail;
+        }
         if (startBlock == 0) {
             LOGI(" ReadBlocks: nonlinear, not trying");
         }
@@ -2177,6 +2576,235 @@ bail:
     return dierr;
 }
 
+/*
+ * Determine whether we can do block I/O on a non-linear image a whole
+ * track at a time.  This requires plain 16- or 32-sector tracks stored
+ * one after another, with no sector pairing and known sector orders.
+ */
+bool DiskImg::CanDoTrackBlockIO(void) const
+{
+    return (IsSectorFormat(fPhysical) && fHasSectors && fHasBlocks &&
+            !fSectorPairing &&
+            (fNumSectPerTrack == 16 || fNumSectPerTrack == 32) &&
+            IsValidOrder(fOrder) && IsValidOrder(fFileSysOrder));
+}
+
+/*
+ * Read blocks from a non-linear image a track at a time.  Each track
+ * touched is read with a single call, and its sectors are permuted into
+ * the caller's buffer with the sector order map.
+ *
+ * Block N of a track holds filesystem sectors 2N and 2N+1.  The order map
+ * covers 16 sectors, so 32-sector tracks are handled as two halves.
+ */
+DIError DiskImg::ReadBlocksByTrack(long startBlock, int numBlocks, void* buf)
+{
+    DIError dierr = kDIErrNone;
+    const uint8_t* orderMap = kSectorOrderMap[fOrder][fFileSysOrder];
+    const int blocksPerTrack = fNumSectPerTrack / 2;
+    const int trackLen = fNumSectPerTrack * kSectorSize;
+    uint8_t trackBuf[32 * kSectorSize];
+    uint8_t* outp = (uint8_t*) buf;
+    long track;
+    int firstBlk, count, sct, imgSct;
+
+    assert(CanDoTrackBlockIO());
+    assert(trackLen <= (int) sizeof(trackBuf));
+
+    while (numBlocks > 0) {
+        track = startBlock / blocksPerTrack;
+        firstBlk = (int) (startBlock - track * blocksPerTrack);
+        count = blocksPerTrack - firstBlk;
+        if (count > numBlocks)
+            count = numBlocks;
+
+        dierr = CopyBytesOut(trackBuf, (di_off_t) track * trackLen, trackLen);
+        if (dierr != kDIErrNone)
+            break;
+
+        for (sct = firstBlk * 2; sct < (firstBlk + count) * 2; sct++) {
+            imgSct = (sct & ~0x0f) + orderMap[sct & 0x0f];
+            memcpy(outp, trackBuf + imgSct * kSectorSize, kSectorSize);
+            outp += kSectorSize;
+        }
+
+        startBlock += count;
+        numBlocks -= count;
+    }
+
+    return dierr;
+}
+
+/*
+ * Write blocks to a non-linear image a track at a time.  Whole tracks are
+ * assembled in memory and written with a single call; partial tracks are
+ * read, patched, and written back.
+ */
+DIError DiskImg::WriteBlocksByTrack(long startBlock, int numBlocks,
+    const void* buf)
+{
+    DIError dierr = kDIErrNone;
+    const uint8_t* orderMap = kSectorOrderMap[fOrder][fFileSysOrder];
+    const int blocksPerTrack = fNumSectPerTrack / 2;
+    const int trackLen = fNumSectPerTrack * kSectorSize;
+    uint8_t trackBuf[32 * kSectorSize];
+    const uint8_t* inp = (const uint8_t*) buf;
+    long track;
+    int firstBlk, count, sct, imgSct;
+
+    assert(CanDoTrackBlockIO());
+    assert(trackLen <= (int) sizeof(trackBuf));
+
+    while (numBlocks > 0) {
+        track = startBlock / blocksPerTrack;
+        firstBlk = (int) (startBlock - track * blocksPerTrack);
+        count = blocksPerTrack - firstBlk;
+        if (count > numBlocks)
+            count = numBlocks;
+
+        if (count != blocksPerTrack) {
+            dierr = CopyBytesOut(trackBuf, (di_off_t) track * trackLen,
+                        trackLen);
+            if (dierr != kDIErrNone)
+                break;
+        }
+
+        for (sct = firstBlk * 2; sct < (firstBlk + count) * 2; sct++) {
+            imgSct = (sct & ~0x0f) + orderMap[sct & 0x0f];
+            memcpy(trackBuf + imgSct * kSectorSize, inp, kSectorSize);
+            inp += kSectorSize;
+        }
+
+        dierr = CopyBytesIn(trackBuf, (di_off_t) track * trackLen, trackLen);
+        if (dierr != kDIErrNone)
+            break;
+
+        startBlock += count;
+        numBlocks -= count;
+    }
+
+    return dierr;
+}
+
+/*
+ * Read a list of blocks into a contiguous buffer.  Exactly one of
+ * "shortList" and "longList" is non-NULL.
+ *
+ * Runs of adjacent blocks are coalesced into a single ReadBlocks call, and
+ * each batch of runs is issued in ascending block order, so a contiguous
+ * file turns into one big read.  Sparse entries (zero in a short list,
+ * negative in a long list) are zero-filled.
+ *
+ * Like ReadBlocks, this returns immediately when a read fails.
+ */
+DIError DiskImg::ReadBlockList(const uint16_t* shortList, const long* longList,
+    int count, void* buf)
+{
+    const int kMaxRuns = 64;
+    struct {
+        long    block;
+        int     numBlocks;
+        int     index;      // offset into list
+    } runs[kMaxRuns], tmpRun;
+    DIError dierr = kDIErrNone;
+    int numRuns, idx, i, j;
+    long block;
+
+    assert((shortList == NULL) != (longList == NULL));
+    if (!fHasBlocks)
+        return kDIErrUnsupportedAccess;
+    if (count < 0 || buf == NULL)
+        return kDIErrInvalidArg;
+
+    idx = 0;
+    while (idx < count) {
+        /* gather up a batch of runs */
+        numRuns = 0;
+        while (idx < count && numRuns < kMaxRuns) {
+            if (shortList != NULL)
+                block = (shortList[idx] == 0) ? -1 : shortList[idx];
+            else
+                block = longList[idx];
+
+            if (block < 0) {
+                memset((uint8_t*) buf + (long) idx * kBlockSize, 0,
+                    kBlockSize);
+            } else if (block >= fNumBlocks) {
+                LOGI(" DI ReadBlockList: invalid block %ld (index %d)",
+                    block, idx);
+                return kDIErrInvalidBlock;
+            } else if (numRuns > 0 &&
+                runs[numRuns-1].index + runs[numRuns-1].numBlocks == idx &&
+                runs[numRuns-1].block + runs[numRuns-1].numBlocks == block)
+            {
+                runs[numRuns-1].numBlocks++;
+            } else {
+                runs[numRuns].block = block;
+                runs[numRuns].numBlocks = 1;
+                runs[numRuns].index = idx;
+                numRuns++;
+            }
+            idx++;
+        }
+
+        /* sort by block number; there aren't many, so insertion sort */
+        for (i = 1; i < numRuns; i++) {
+            tmpRun = runs[i];
+            for (j = i; j > 0 && runs[j-1].block > tmpRun.block; j--)
+                runs[j] = runs[j-1];
+            runs[j] = tmpRun;
+        }
+
+        for (i = 0; i < numRuns; i++) {
+            dierr = ReadBlocks(runs[i].block, runs[i].numBlocks,
+                        (uint8_t*) buf + (long) runs[i].index * kBlockSize);
+            if (dierr != kDIErrNone)
+                return dierr;
+        }
+    }
+
+    return dierr;
+}
+
+/*
+ * Get a pointer to the data for a range of blocks, avoiding the copy
+ * through CopyBytesOut.
+ *
+ * This only works when the blocks are stored linearly and the image data
+ * can be accessed in place, i.e. it's memory-mapped or sitting in a memory
+ * buffer.  If not, we return kDIErrNotSupported, and the caller should
+ * use ReadBlocks instead.
+ */
+DIError DiskImg::GetBlockPtr(long startBlock, int numBlocks,
+    const uint8_t** ppData)
+{
+    const uint8_t* ptr;
+
+    if (ppData == NULL)
+        return kDIErrInvalidArg;
+    *ppData = NULL;
+
+    if (!fHasBlocks)
+        return kDIErrUnsupportedAccess;
+    if (startBlock < 0 || numBlocks <= 0 ||
+        numBlocks + startBlock > GetNumBlocks())
+    {
+        return kDIErrInvalidBlock;
+    }
+    if (!IsSectorFormat(fPhysical) || !IsLinearBlocks(fOrder, fFileSysOrder))
+        return kDIErrNotSupported;
+    if (CheckForBadBlocks(startBlock, numBlocks))
+        return kDIErrReadFailed;
+
+    ptr = fpDataGFD->GetDirectPtr((di_off_t) startBlock * kBlockSize,
+                (size_t) numBlocks * kBlockSize);
+    if (ptr == NULL)
+        return kDIErrNotSupported;
+
+    *ppData = ptr;
+    return kDIErrNone;
+}
+
 /*
  * Check to see if any blocks in a range of blocks show up in the bad
  * block map.  This is primarily useful for 3.5" disk images converted
@@ -2260,11 +2888,16 @@ DIError DiskImg::WriteBlocks(long startBlock, int numBlocks, const void* buf)
 
     if (!IsLinearBlocks(fOrder, fFileSysOrder)) {
         /*
-         * This isn't a collection of linear blocks, so we need to write it
-         * one block at a time with sector swapping.  This almost certainly
-         * means that we're not reading from physical media, so performance
-         * shouldn't be an issue.
+         * This isn't a collection of linear blocks, so we need to swap
+         * sectors around.  Do it a track at a time if we can, otherwise
+         * write one block at a time.
          */
+        if (CanDoTrackBlockIO()) {
+            if (fReadOnly)
+                return kDIErrAccessDenied;
+            dierr = WriteBlocksByTrack(startBlock, numBlocks, buf);
+            goto bail;
+        }
         if (startBlock == 0) {
             LOGI(" WriteBlocks: nonlinear, not trying");
         }
@@ -2291,19 +2924,35 @@ bail:
 /*
  * Copy a chunk of bytes out of the disk image.
  *
- * (This is the lowest-level read routine in this class.)
+ * (This is the lowest-level read routine in this class.)  This uses
+ * positional I/O, so it doesn't disturb the GFD's file position.  If the
+ * GFD can't handle concurrent reads, we hold the lock on the outermost
+ * image, since embedded images share its GFD.
  */
 DIError DiskImg::CopyBytesOut(void* buf, di_off_t offset, int size) const
 {
     DIError dierr;
+    const DiskImg* pRoot = GetRootImage();
+    DIMutex* pLock = NULL;
+    di_off_t* pLastIOEnd;
+    IOStats* pStats = GetIOStatsSink(&pLastIOEnd);
 
-    dierr = fpDataGFD->Seek(offset, kSeekSet);
-    if (dierr != kDIErrNone) {
-        LOGI(" DI seek off=%ld failed (err=%d)", (long) offset, dierr);
-        return dierr;
+    if (fNumProbeWindows != 0 && ReadProbeWindow(buf, offset, size)) {
+        pStats->probeHits++;
+        return kDIErrNone;
     }
 
-    dierr = fpDataGFD->Read(buf, size);
+    pStats->readCalls++;
+    pStats->bytesRead += size;
+    if (offset != *pLastIOEnd)
+        pStats->seeks++;
+    *pLastIOEnd = offset + size;
+
+    if (!fpDataGFD->GetIsReadAtThreadSafe())
+        pLock = pRoot->fpLock;
+    DIAutoLock lock(pLock);
+
+    dierr = fpDataGFD->ReadAt(buf, size, offset);
     if (dierr != kDIErrNone) {
         LOGI(" DI read off=%ld size=%d failed (err=%d)",
             (long) offset, size, dierr);
@@ -2330,13 +2979,26 @@ DIError DiskImg::CopyBytesIn(const void* buf, di_off_t offset, int size)
     }
     assert(fpDataGFD != NULL);   // somebody closed the image?
 
-    dierr = fpDataGFD->Seek(offset, kSeekSet);
-    if (dierr != kDIErrNone) {
-        LOGI(" DI seek off=%ld failed (err=%d)", (long) offset, dierr);
-        return dierr;
-    }
+    const DiskImg* pRoot = GetRootImage();
+    DIMutex* pLock = NULL;
+
+    if (fNumProbeWindows != 0)
+        FreeProbeWindows();     // nobody writes while probing, but be safe
+
+    di_off_t* pLastIOEnd;
+    IOStats* pStats = GetIOStatsSink(&pLastIOEnd);
+
+    pStats->writeCalls++;
+    pStats->bytesWritten += size;
+    if (offset != *pLastIOEnd)
+        pStats->seeks++;
+    *pLastIOEnd = offset + size;
 
-    dierr = fpDataGFD->Write(buf, size);
+    if (!fpDataGFD->GetIsReadAtThreadSafe())
+        pLock = pRoot->fpLock;
+    DIAutoLock lock(pLock);
+
+    dierr = fpDataGFD->WriteAt(buf, size, offset);
     if (dierr != kDIErrNone) {
         LOGI(" DI write off=%ld size=%d failed (err=%d)",
             (long) offset, size, dierr);
@@ -2353,6 +3015,376 @@ DIError DiskImg::CopyBytesIn(const void* buf, di_off_t offset, int size)
     return kDIErrNone;
 }
 
+/*
+ * Load the probe windows used while AnalyzeImageFS runs the filesystem
+ * tests.  Each window is read with a single call, so an image that no
+ * test recognizes costs a couple of large reads instead of several dozen
+ * small ones.
+ *
+ * Failures aren't fatal; the tests just fall through to the GenericFD.
+ */
+void DiskImg::LoadProbeWindows(void)
+{
+    di_off_t offsets[kMaxProbeWindows];
+    long lengths[kMaxProbeWindows];
+    int count = 0;
+
+    assert(fNumProbeWindows == 0);
+
+    /* nothing to gain if the whole image is already in memory */
+    if (fpDataGFD == NULL || fpDataGFD->GetIsMemoryBased() || fLength <= 0)
+        return;
+
+    offsets[count] = 0;
+    lengths[count] = kProbeHeadSize;
+    count++;
+    if (fLength == kProbeUNIDOSImageLen) {
+        offsets[count] = kProbeUNIDOSOffset;
+        lengths[count] = kProbeUNIDOSSize;
+        count++;
+    }
+
+    const DiskImg* pRoot = GetRootImage();
+    IOStats* pStats = GetIOStatsSink();
+    DIMutex* pLock = NULL;
+    if (!fpDataGFD->GetIsReadAtThreadSafe())
+        pLock = pRoot->fpLock;
+
+    for (int i = 0; i < count; i++) {
+        ProbeWindow* pWindow = &fProbeWindows[fNumProbeWindows];
+        DIError dierr;
+
+        if (offsets[i] >= fLength)
+            continue;
+        if (offsets[i] + lengths[i] > fLength)
+            lengths[i] = (long) (fLength - offsets[i]);
+
+        pWindow->offset = offsets[i];
+        pWindow->length = lengths[i];
+        pWindow->buf = new uint8_t[lengths[i]];
+
+        pStats->readCalls++;
+        pStats->bytesRead += lengths[i];
+        pStats->seeks++;
+        {
+            DIAutoLock lock(pLock);
+            dierr = fpDataGFD->ReadAt(pWindow->buf, lengths[i], offsets[i]);
+        }
+        if (dierr != kDIErrNone) {
+            LOGI(" DI probe read off=%ld len=%ld failed (err=%d)",
+                (long) offsets[i], lengths[i], dierr);
+            delete[] pWindow->buf;
+            continue;
+        }
+
+        fNumProbeWindows++;
+    }
+}
+
+/*
+ * Discard the probe windows.
+ */
+void DiskImg::FreeProbeWindows(void)
+{
+    for (int i = 0; i < fNumProbeWindows; i++)
+        delete[] fProbeWindows[i].buf;
+    fNumProbeWindows = 0;
+}
+
+/*
+ * Satisfy a read from the probe windows, if one of them holds the entire
+ * range.  Returns "true" if the data was copied.
+ *
+ * The windows aren't modified while they exist, so this is safe to call
+ * from several threads at once.
+ */
+bool DiskImg::ReadProbeWindow(void* buf, di_off_t offset, int size) const
+{
+    for (int i = 0; i < fNumProbeWindows; i++) {
+        const ProbeWindow* pWindow = &fProbeWindows[i];
+
+        if (offset >= pWindow->offset &&
+            offset + size <= pWindow->offset + pWindow->length)
+        {
+            memcpy(buf, pWindow->buf + (offset - pWindow->offset), size);
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Compute the format cache key for the file we're opening, and see if
+ * the cache knows what it is.  We CRC the first and last chunks of the
+ * raw file, before any wrappers are peeled off, so this costs at most
+ * two reads.
+ *
+ * Failures just leave the cache out of it.
+ */
+void DiskImg::LookupFormatCache(const char* pathName, char fssep)
+{
+    FormatCache::Entry* pEntry = &fFormatEntry;
+    struct stat sbuf;
+    uint8_t* buf = NULL;
+    const char* name;
+    const char* ext;
+    di_off_t chunkLen;
+
+    assert(fpParentImg == NULL);
+    assert(fpWrapperGFD != NULL);
+
+    fHaveFormatKey = fFormatCacheHit = false;
+    if (stat(pathName, &sbuf) != 0 || sbuf.st_size == 0)
+        return;
+
+    memset(pEntry, 0, sizeof(*pEntry));
+    pEntry->length = sbuf.st_size;
+    pEntry->modWhen = sbuf.st_mtime;
+
+    chunkLen = FormatCache::kHashLen;
+    if (chunkLen > (di_off_t) sbuf.st_size)
+        chunkLen = sbuf.st_size;
+    buf = new uint8_t[(size_t) chunkLen];
+    if (fpWrapperGFD->ReadAt(buf, (size_t) chunkLen, 0) != kDIErrNone)
+        goto bail;
+    pEntry->headCRC = crc32(0L, buf, (uInt) chunkLen);
+    if (fpWrapperGFD->ReadAt(buf, (size_t) chunkLen,
+            sbuf.st_size - chunkLen) != kDIErrNone)
+    {
+        goto bail;
+    }
+    pEntry->tailCRC = crc32(0L, buf, (uInt) chunkLen);
+
+    /*
+     * Include the extension, which drives a lot of the decisions (e.g.
+     * ".do" vs. ".po" on an unformatted image).  We use everything from
+     * the first '.' on, so "foo.po.gz" and "foo.do.gz" are different.
+     */
+    name = FilenameOnly(pathName, fssep);
+    ext = strchr(name, '.');
+    if (ext != NULL) {
+        for ( ; *ext != '\0'; ext++) {
+            uint8_t ch = tolower((uint8_t) *ext);
+            pEntry->extCRC = crc32(pEntry->extCRC, &ch, 1);
+        }
+    }
+
+    fHaveFormatKey = true;
+    fFormatCacheHit = fpFormatCache->Lookup(pEntry);
+    if (fFormatCacheHit)
+        fIOStats.formatCacheHits++;
+    LOGD(" DI format cache %s for '%s'", fFormatCacheHit ? "hit" : "miss",
+        pathName);
+
+bail:
+    delete[] buf;
+}
+
+/*
+ * AnalyzeNibbleData, using the result from the format cache.
+ */
+DIError DiskImg::UseCachedNibbleDescr(void)
+{
+    int idx = fFormatEntry.nibbleDescrIdx;
+
+    assert(fFormatCacheHit);
+    fNumTracks = fFormatEntry.numTracks;
+    if (idx < 0 || idx >= fNumNibbleDescrEntries) {
+        LOGI(" DI cached: no nibble descriptor");
+        return kDIErrBadNibbleSectors;
+    }
+    fpNibbleDescr = &fpNibbleDescrTable[idx];
+    fDOSVolumeNum = fFormatEntry.dosVolumeNum;
+    LOGI(" DI cached: nibble descriptor '%s'", fpNibbleDescr->description);
+    return kDIErrNone;
+}
+
+/*
+ * AnalyzeImageFS, using the result from the format cache.
+ */
+void DiskImg::UseCachedFSFormat(void)
+{
+    assert(fFormatCacheHit);
+    fOrder = (SectorOrder) fFormatEntry.order;
+    fFormat = (FSFormat) fFormatEntry.fsFormat;
+    fNumTracks = fFormatEntry.numTracks;
+    fNumSectPerTrack = fFormatEntry.numSectPerTrack;
+    fFileSysOrder = CalcFSSectorOrder();
+    LOGI(" DI cached: format=%d order=%d", fFormat, fOrder);
+}
+
+/*
+ * Save the results of a successful analysis in the format cache.
+ *
+ * Custom nibble descriptors belong to the application, and may not be
+ * there next time, so we don't save images that needed one.
+ */
+void DiskImg::StoreFormatCache(void)
+{
+    FormatCache::Entry* pEntry = &fFormatEntry;
+    int idx = -1;
+
+    assert(fHaveFormatKey && fpFormatCache != NULL);
+    if (fpNibbleDescr != NULL) {
+        idx = (int) (fpNibbleDescr - fpNibbleDescrTable);
+        if (idx < 0 || idx >= kNibbleDescrCustom)
+            return;
+    }
+
+    pEntry->outerFormat = (uint8_t) fOuterFormat;
+    pEntry->fileFormat = (uint8_t) fFileFormat;
+    pEntry->physical = (uint8_t) fPhysical;
+    pEntry->order = (uint8_t) fOrder;
+    pEntry->fsFormat = (uint8_t) fFormat;
+    pEntry->nibbleDescrIdx = (int8_t) idx;
+    pEntry->dosVolumeNum = (int16_t) fDOSVolumeNum;
+    pEntry->numTracks = (int32_t) fNumTracks;
+    pEntry->numSectPerTrack = (int32_t) fNumSectPerTrack;
+    fpFormatCache->Store(pEntry);
+}
+
+/*
+ * Put a sector cache in front of fpDataGFD, if configured.
+ *
+ * We don't bother for data that already lives in memory (NuFX, DDD, .gz,
+ * and so on), or for nibble images, which are small and are decoded a
+ * track at a time anyway.  Embedded volumes use the parent's cache.
+ */
+void DiskImg::InstallBlockCache(void)
+{
+    assert(fpBlockCache == NULL);
+    assert(fpDataGFD != NULL);
+
+    if (fCacheMode == kCacheModeOff || fCacheMaxBytes < kSectorSize)
+        return;
+    if (fpParentImg != NULL || !IsSectorFormat(fPhysical))
+        return;
+    if (fpDataGFD->GetIsMemoryBased())
+        return;
+
+    GFDBlockCache* pCache = new GFDBlockCache;
+    DIError dierr = pCache->Open(fpDataGFD, fLength, fCacheMaxBytes,
+                        fCacheMode == kCacheModeWriteBack);
+    if (dierr != kDIErrNone) {
+        /* not fatal; we just run without it */
+        LOGW(" DI unable to create sector cache (err=%d)", dierr);
+        delete pCache;
+        return;
+    }
+
+    LOGD(" DI added %ldKB %s sector cache", fCacheMaxBytes / 1024,
+        fCacheMode == kCacheModeWriteBack ? "write-back" : "write-through");
+    fpDataGFD = fpBlockCache = pCache;
+}
+
+/*
+ * Replace the GFDFile in fpWrapperGFD with a memory-mapped view of the
+ * same file.  Only done when the caller asked for it with SetUseMmap, and
+ * only for formats that keep the disk data in the file as-is (unadorned
+ * and 2MG), so that we can hand out pointers into it and skip the
+ * seek/read pair on every access.
+ *
+ * The mapping can't grow, so read-write access to expandable images
+ * stays on the file.  If the mapping fails we just keep the file open.
+ */
+void DiskImg::MapImageFile(const char* pathName)
+{
+#ifdef HAVE_MMAP
+    if (!fReadOnly && fExpandable)
+        return;
+
+    GFDMmap* pGFDMmap = new GFDMmap;
+    DIError dierr = pGFDMmap->Open(pathName, fReadOnly);
+    if (dierr != kDIErrNone) {
+        LOGD(" DI not memory-mapping '%s' (err=%d)", pathName, dierr);
+        delete pGFDMmap;
+        return;
+    }
+
+    delete fpWrapperGFD;
+    fpWrapperGFD = pGFDMmap;
+#endif
+}
+
+/*
+ * Get the sector cache statistics.  Embedded volumes report the numbers
+ * for the cache they share with their parent.  For nibble images these
+ * count tracks rather than sectors.
+ */
+bool DiskImg::GetCacheStats(CacheStats* pStats) const
+{
+    const DiskImg* pImg = this;
+
+    while (pImg->fpParentImg != NULL)
+        pImg = pImg->fpParentImg;
+
+    if (pImg->fpBlockCache != NULL) {
+        pImg->fpBlockCache->GetStats(pStats);
+        return true;
+    }
+    if (pImg->fpNibbleSlots != NULL) {
+        *pStats = pImg->fNibbleCacheStats;
+        return true;
+    }
+    memset(pStats, 0, sizeof(*pStats));
+    return false;
+}
+
+/*
+ * Get the I/O statistics.  These are kept on the outermost image.
+ */
+void DiskImg::GetIOStats(IOStats* pStats) const
+{
+    const DiskImg* pRoot = GetRootImage();
+    CacheStats cacheStats;
+
+    *pStats = pRoot->fIOStats;
+    if (pRoot->GetCacheStats(&cacheStats)) {
+        pStats->cacheHits = cacheStats.hits;
+        pStats->cacheMisses = cacheStats.misses;
+    }
+}
+
+/*
+ * Zero out the I/O statistics.  Doesn't affect the sector cache counters.
+ */
+void DiskImg::ResetIOStats(void)
+{
+    const DiskImg* pRoot = GetRootImage();
+
+    memset(&pRoot->fIOStats, 0, sizeof(pRoot->fIOStats));
+}
+
+/*
+ * Start timing an operation.  Only the outermost image keeps timings, so
+ * work done on embedded images (which happens inside a call on the outer
+ * image) isn't counted twice.
+ */
+DiskImg::OpTimer::OpTimer(const DiskImg* pImg, TimedOp op)
+{
+    fpTotal = NULL;
+    fStart = 0;
+    if (pImg == NULL || pImg->fpParentImg != NULL)
+        return;
+
+    switch (op) {
+    case kTimedOpen:        fpTotal = &pImg->fIOStats.openUsec;         break;
+    case kTimedAnalyze:     fpTotal = &pImg->fIOStats.analyzeUsec;      break;
+    case kTimedAnalyzeFS:   fpTotal = &pImg->fIOStats.analyzeFSUsec;    break;
+    case kTimedInitialize:  fpTotal = &pImg->fIOStats.initializeUsec;   break;
+    default:
+        assert(false);
+        return;
+    }
+    fStart = GetTimeUsec();
+}
+
+DiskImg::OpTimer::~OpTimer(void)
+{
+    if (fpTotal != NULL)
+        *fpTotal += GetTimeUsec() - fStart;
+}
+
 
 /*
  * ===========================================================================
@@ -2682,6 +3714,9 @@ DIError DiskImg::CreateImageCommon(const char* pathName, const char* storageName
         assert(fpDataGFD != NULL);
     }
 
+    if (dierr == kDIErrNone)
+        InstallBlockCache();
+
 bail:
     return dierr;
 }
@@ -171,9 +171,16 @@ const int kD13Length = 256 * 13 * 35;   // length of a .d13 image
 /* largest expanse we allow access to on a volume (8GB in 512-byte blocks) */
 const long kVolumeMaxBlocks = 8*1024*(1024*1024 / kBlockSize);
 
-/* largest .gz file we'll open (uncompressed size) */
+/* largest .zip file we'll open, and largest .gz file we'll unpack into
+   memory by default (uncompressed size) */
 const long kGzipMax = 32*1024*1024;
 
+/* default size of the per-image sector cache */
+const long kDefaultCacheSize = 1024*1024;
+
+/* default number of threads AnalyzeImageFS may use for filesystem tests */
+const int kDefaultProbeThreads = 4;
+
 /* forward and external class definitions */
 class DiskFS;
 class A2File;
@@ -184,6 +191,9 @@ class ImageWrapper;
 class CircularBufferAccess;
 class ASPI;
 class LinearBitmap;
+class GFDBlockCache;
+class DIMutex;
+class FileArena;
 
 
 /*
@@ -210,14 +220,35 @@ public:
     // shortcut for fpASPI->GetVersion()
     static unsigned long GetASPIVersion(void);
 
+    // debug message severity, least to most severe
+    typedef enum {
+        kLogVerbose = 1,
+        kLogDebug,
+        kLogInfo,
+        kLogWarn,
+        kLogError,
+        kLogNone,           // pass to SetLogLevel to discard everything
+    } LogSeverity;
+
     // pointer to the debug message handler
-    typedef void (*DebugMsgHandler)(const char* file, int line, const char* msg);
+    typedef void (*DebugMsgHandler)(LogSeverity severity, const char* file,
+        int line, const char* msg);
     static DebugMsgHandler gDebugMsgHandler;
+    // messages below this severity are discarded before they're formatted
+    static LogSeverity gLogLevel;
 
     static DebugMsgHandler SetDebugMsgHandler(DebugMsgHandler handler);
-    static void PrintDebugMsg(const char* file, int line, const char* fmt, ...)
+    static void SetLogLevel(LogSeverity minSeverity) {
+        gLogLevel = minSeverity;
+    }
+    static LogSeverity GetLogLevel(void) { return gLogLevel; }
+    static bool IsLogEnabled(LogSeverity severity) {
+        return severity >= gLogLevel;
+    }
+    static void PrintDebugMsg(LogSeverity severity, const char* file,
+        int line, const char* fmt, ...)
         #if defined(__GNUC__)
-            __attribute__ ((format(printf, 3, 4)))
+            __attribute__ ((format(printf, 4, 5)))
         #endif
         ;
 
@@ -235,6 +266,113 @@ private:
 extern bool gAllowWritePhys0;   // ugh -- see Win32BlockIO.cpp
 
 
+/*
+ * Persistent cache of format-detection results.
+ *
+ * Working out what an image is means trying a dozen wrapper formats and
+ * fifteen filesystems, and test-decoding nibble tracks.  When the same
+ * collection of images is scanned again and again, the answers don't
+ * change.  The cache maps a fingerprint of the image file -- its length,
+ * modification date, the CRCs of its first and last 64KB, and its
+ * extension -- to what OpenImage and AnalyzeImage decided, so a later
+ * open of the same file can skip the probing.  Wrappers like gzip and
+ * NuFX are still unpacked, and the DiskFS still reads the catalog.
+ *
+ * Open loads the cache file into memory, Close writes it back out if
+ * anything was added.  Results from a different version of the library
+ * are discarded, and so are entries that haven't been looked up or
+ * stored for a while (see SetMaxAge), so fingerprints of files that have
+ * changed or gone away don't pile up.  Hand the cache to each DiskImg
+ * with SetFormatCache before calling OpenImage.  One cache may be shared
+ * by DiskImgs that are being opened on different threads.
+ */
+class DISKIMG_API FormatCache {
+public:
+    FormatCache(void);
+    ~FormatCache(void);
+
+    // load entries from a file; a file that doesn't exist yet is fine
+    DIError Open(const char* pathName);
+    // write the entries back out if anything changed, then discard them
+    DIError Close(void);
+
+    long GetNumEntries(void) const { return fNumEntries; }
+    long GetNumHits(void) const { return fNumHits; }
+    long GetNumMisses(void) const { return fNumMisses; }
+
+    // entries unused for this many days are dropped when the cache is closed
+    void SetMaxAge(long days) { fMaxAge = days; }
+    long GetMaxAge(void) const { return fMaxAge; }
+
+    /*
+     * One cached result.  The first five fields are the key.  The rest
+     * are DiskImg enums and values, stored as they were at the end of a
+     * successful AnalyzeImage.
+     */
+    typedef struct Entry {
+        uint64_t    length;
+        int64_t     modWhen;
+        uint32_t    headCRC;        // CRC-32 of the first kHashLen bytes
+        uint32_t    tailCRC;        // CRC-32 of the last kHashLen bytes
+        uint32_t    extCRC;         // CRC-32 of the lower-case extension
+
+        uint8_t     outerFormat;
+        uint8_t     fileFormat;
+        uint8_t     physical;
+        uint8_t     order;
+        uint8_t     fsFormat;
+        int8_t      nibbleDescrIdx; // index into the NibbleDescr table, or -1
+        int16_t     dosVolumeNum;
+        int32_t     numTracks;
+        int32_t     numSectPerTrack;
+
+        int64_t     lastUsed;       // set by the cache; see SetMaxAge
+    } Entry;
+
+    enum {
+        kHashLen = 64 * 1024,
+        kDefaultMaxAge = 90,        // days
+    };
+
+    // fill in the result fields of the entry whose key matches *pEntry
+    bool Lookup(Entry* pEntry);
+    // add an entry, replacing any with the same key
+    void Store(const Entry* pEntry);
+
+private:
+    enum {
+        kMinTableSize = 256,        // must be a power of 2
+        kFileVersion = 2,
+        kHeaderLen = 20,
+        kRecordLen = 52,
+        kTouchInterval = 24*60*60,  // seconds between lastUsed updates
+    };
+
+    FormatCache(const FormatCache&);
+    FormatCache& operator=(const FormatCache&);
+
+    static uint32_t HashKey(const Entry* pEntry);
+    static bool KeysMatch(const Entry* pEntry1, const Entry* pEntry2);
+    long FindSlot(const Entry* pEntry) const;
+    void Insert(const Entry* pEntry);
+    void Grow(void);
+    DIError Load(FILE* fp);
+    DIError Save(FILE* fp, int64_t cutoff, long numKeep) const;
+    long CountExpired(int64_t cutoff) const;
+    void Reset(void);
+
+    char*       fPathName;
+    Entry*      fTable;         // open-addressed; length==0 means unused
+    long        fTableSize;
+    long        fNumEntries;
+    long        fNumHits;
+    long        fNumMisses;
+    long        fMaxAge;        // days
+    bool        fDirty;
+    DIMutex*    fpLock;
+};
+
+
 /*
  * Disk I/O class, roughly equivalent to a GS/OS disk device driver.
  *
@@ -266,6 +404,15 @@ extern bool gAllowWritePhys0;   // ugh -- see Win32BlockIO.cpp
  * provide an instantaneous "revert" feature, and prevent formats like
  * DiskCopy42 (which has a CRC in its header) from being inconsistent for
  * long stretches.
+ *
+ * Thread safety: once an image has been opened and its DiskFS created,
+ * several threads may read from it at once -- sector and block reads, and
+ * reads through A2FileDescr objects opened read-only on different files.
+ * The nibble track buffer and any GFD that can't do concurrent positional
+ * reads are serialized internally.  Anything that modifies the image, or
+ * the DiskFS file list, must be done from a single thread.  (On a DiskFS
+ * initialized with kInitLazy, walking the file list can load directories
+ * and so counts as modifying it.)
  */
 class DISKIMG_API DiskImg {
 public:
@@ -504,6 +651,12 @@ public:
     }
     DIError ReadTrackSectorSwapped(long track, int sector,
         void* buf, SectorOrder imageOrder, SectorOrder fsOrder);
+    // read every sector on a track, in ReadTrackSector order, into "buf"
+    // (GetNumSectPerTrack() * kSectorSize bytes).  Unreadable sectors are
+    // zero-filled and have bit N set in "*pBadMask"; the call only fails
+    // if the track itself can't be read.  Nibble tracks are decoded in
+    // a single pass.
+    DIError ReadTrack(long track, void* buf, uint32_t* pBadMask);
     // write a 256-byte sector
     virtual DIError WriteTrackSector(long track, int sector, const void* buf);
 
@@ -515,6 +668,21 @@ public:
                 SectorOrder fsOrder);
     // read multiple blocks
     virtual DIError ReadBlocks(long startBlock, int numBlocks, void* buf);
+    // read a list of blocks into a contiguous buffer, coalescing runs of
+    // adjacent blocks into single reads.  For the uint16_t form, zero
+    // entries are sparse; for the long form, negative entries are.  Sparse
+    // blocks are returned as zeroes.
+    DIError ReadBlockList(const uint16_t* blocks, int count, void* buf) {
+        return ReadBlockList(blocks, NULL, count, buf);
+    }
+    DIError ReadBlockList(const long* blocks, int count, void* buf) {
+        return ReadBlockList(NULL, blocks, count, buf);
+    }
+    // get a pointer to blocks without copying them; only works for linear
+    // images held in memory or memory-mapped, returns kDIErrNotSupported
+    // otherwise.  The pointer is good until the next write or close.
+    DIError GetBlockPtr(long startBlock, int numBlocks,
+        const uint8_t** ppData);
     // check our virtual bad block map
     bool CheckForBadBlocks(long startBlock, int numBlocks);
     // write a 512-byte block
@@ -558,6 +726,173 @@ public:
     // must be set before image is opened or created
     void SetNuFXCompressionType(int val) { fNuFXCompressType = val; }
 
+    /*
+     * Sector cache configuration.  Images that aren't already held in
+     * memory get an LRU cache of recently-used sectors, so that repeated
+     * reads of directory and index blocks don't go back to the file.
+     *
+     * In write-back mode, modified sectors are held in memory until one
+     * of them has to be evicted or the image is flushed (FlushImage, with
+     * either mode, or CloseImage).  They're then written in ascending
+     * offset order, with adjacent sectors merged.  This must be set before
+     * the image is opened or created; embedded volumes share their
+     * parent's cache.
+     *
+     * Nibble images cache whole tracks instead, as many as fit in
+     * "maxBytes" (the default holds every track of a 5.25" disk).  With
+     * the cache off, only the most recently used track is kept.  The
+     * write-back rules are the same, so a flush writes only the tracks
+     * that were changed.
+     */
+    typedef enum {
+        kCacheModeOff = 0,
+        kCacheModeWriteThrough,
+        kCacheModeWriteBack,
+    } CacheMode;
+    typedef struct CacheStats {
+        long    hits;           // sector requests satisfied from the cache
+        long    misses;         // sector requests that went to the file
+        long    evictions;      // sectors discarded to make room
+        long    writeBacks;     // dirty sectors written out
+        long    flushes;        // times the dirty set was written out
+    } CacheStats;
+    void SetCacheMode(CacheMode mode, long maxBytes = kDefaultCacheSize) {
+        fCacheMode = mode;
+        fCacheMaxBytes = maxBytes;
+    }
+    CacheMode GetCacheMode(void) const { return fCacheMode; }
+    // returns false (and zeroes the struct) if there's no cache
+    bool GetCacheStats(CacheStats* pStats) const;
+
+    /*
+     * Number of threads AnalyzeImageFS may use to run the filesystem
+     * tests concurrently.  The result is the same as the serial search:
+     * the first format in the priority order wins.  Only used for sector
+     * images read through a file or device; when the image is in memory
+     * or nibble-encoded the tests are too cheap (or too contended) to
+     * split up.  Embedded volumes inherit the parent's value.  1 disables.
+     *
+     * Nibble images use the same number of threads to try the entries
+     * in the NibbleDescr table, again keeping the first one that works.
+     */
+    void SetProbeThreads(int numThreads) { fProbeThreads = numThreads; }
+    int GetProbeThreads(void) const { return fProbeThreads; }
+
+    /*
+     * Gzip-compressed images up to this size (uncompressed) are unpacked
+     * into memory.  Anything larger goes to a temp file, which is deleted
+     * when the image is closed.  Values over 256MB are treated as 256MB.
+     * Must be set before OpenImage.
+     */
+    void SetGzipMemoryLimit(long maxBytes = kGzipMax) {
+        fGzipMemoryLimit = maxBytes;
+    }
+    long GetGzipMemoryLimit(void) const { return fGzipMemoryLimit; }
+
+    /*
+     * Read-only opens of gzip images over the memory limit can use an
+     * index instead of a temp file.  One pass over the file records
+     * restart points, as many as half the memory limit will hold, and
+     * reads inflate only the part of the image they touch.  This pays off
+     * when the image is much bigger than what's read from it; otherwise
+     * the temp file is about as fast, so kGzipIndexNone is the default.
+     * With kGzipIndexPersist the index is saved beside the image (with
+     * ".gzidx" appended to the name) and reused until the image changes.
+     * Files with more than one gzip member are always unpacked.  Must be
+     * set before OpenImage.
+     */
+    typedef enum GzipIndexMode {
+        kGzipIndexNone = 0,     // always unpack to a temp file
+        kGzipIndexMemory,       // build the index on every open
+        kGzipIndexPersist,      // save the index, and reuse it
+    } GzipIndexMode;
+    void SetGzipIndexMode(GzipIndexMode mode) { fGzipIndexMode = mode; }
+    GzipIndexMode GetGzipIndexMode(void) const { return fGzipIndexMode; }
+
+    /*
+     * Memory-map unadorned and 2MG image files instead of going through
+     * seek/read, which also lets GetBlockPtr hand out pointers into the
+     * file.  Off by default: if another process truncates the file while
+     * it's mapped, touching the missing pages raises SIGBUS.  Only turn
+     * this on when the file is known to stay put while it's open.  Must
+     * be set before OpenImage.
+     */
+    void SetUseMmap(bool val) { fUseMmap = val; }
+    bool GetUseMmap(void) const { return fUseMmap; }
+
+    /*
+     * Use a FormatCache to skip format detection for files that have been
+     * seen before, and to remember the results for ones that haven't.
+     * Must be set before OpenImage.  Only images opened from a file use
+     * the cache; embedded volumes never do.  Pass NULL to disable.
+     */
+    void SetFormatCache(FormatCache* pCache) { fpFormatCache = pCache; }
+
+    /*
+     * I/O statistics, for figuring out where the time goes when an image
+     * is slow to open or scan.  Everything is accumulated on the outermost
+     * image, so embedded volumes (including the ones that are opened and
+     * discarded while probing for sub-volumes) are included, and calling
+     * GetIOStats on an embedded volume returns the totals for the whole
+     * file.  Times are in microseconds and are inclusive, e.g. the time
+     * spent in DiskFS::Initialize includes sub-volume analysis.
+     *
+     * The counters aren't locked, so they're approximate if several
+     * threads are reading at once.
+     */
+    typedef struct IOStats {
+        long        readCalls;      // reads that reached the GenericFD
+        long        writeCalls;     // CopyBytesIn calls
+        di_off_t    bytesRead;
+        di_off_t    bytesWritten;
+        long        seeks;          // accesses not adjacent to the last one
+        long        nibbleTrackLoads;
+        long        nibbleTrackScans;   // sector maps built; see MapNibbleTrack
+        long        cacheHits;      // from the sector cache, if any
+        long        cacheMisses;
+        long        subVolumeProbes;    // embedded images opened
+        long        probeHits;      // reads served by the probe windows
+        long        formatCacheHits;    // analysis skipped; see FormatCache
+        int64_t     openUsec;       // OpenImage, incl. wrapper expansion
+        int64_t     analyzeUsec;    // AnalyzeImage, incl. AnalyzeImageFS
+        int64_t     analyzeFSUsec;  // AnalyzeImageFS (format probing)
+        int64_t     initializeUsec; // DiskFS::Initialize (catalog reads)
+    } IOStats;
+    void GetIOStats(IOStats* pStats) const;
+    void ResetIOStats(void);
+
+    /*
+     * Run "func" on "numThreads" threads, the calling thread being #0.
+     * Each thread counts its I/O separately, and the counts are added to
+     * this image's totals once all threads finish.  Anything that reads
+     * the image from several threads at once should go through here.
+     */
+    typedef void (*ThreadFunc)(void* arg, int threadIdx);
+    void RunIOThreads(int numThreads, ThreadFunc func, void* arg) const;
+
+    /*
+     * Charges the time between construction and destruction to one of
+     * the IOStats timers.  Used by DiskImg and DiskFS::Initialize; does
+     * nothing for embedded images.
+     */
+    typedef enum {
+        kTimedOpen = 0,
+        kTimedAnalyze,
+        kTimedAnalyzeFS,
+        kTimedInitialize,
+    } TimedOp;
+    class DISKIMG_API OpTimer {
+    public:
+        OpTimer(const DiskImg* pImg, TimedOp op);
+        ~OpTimer(void);
+    private:
+        OpTimer& operator=(const OpTimer&);
+        OpTimer(const OpTimer&);
+
+        int64_t*    fpTotal;
+        int64_t     fStart;
+    };
+
     /*
      * Set up a progress callback to use when scanning a disk volume.  Pass
      * NULL for "func" to disable.
@@ -636,6 +971,13 @@ public:
     static DIError UnpackNibbleTrack35(const uint8_t* nibbleBuf,
         long nibbleLen, uint8_t* outputBuf, int cyl, int head,
         LinearBitmap* pBadBlockMap);
+    // same, but report bad sectors as a mask; safe to call from any thread
+    static DIError DecodeNibbleTrack35(const uint8_t* nibbleBuf,
+        long nibbleLen, uint8_t* outputBuf, int cyl, int head,
+        uint32_t* pBadSectors);
+    // merge a bad sector mask from DecodeNibbleTrack35 into a bad block map
+    static void MarkBadSectors35(int cyl, int head, uint32_t badSectors,
+        LinearBitmap* pBadBlockMap);
     // compute the #of sectors per track for cylinder N (0-79)
     static int SectorsPerTrack35(int cylinder);
 
@@ -723,11 +1065,85 @@ private:
     int             fNumSectPerTrack;   // (ditto)
     long            fNumBlocks;     // for 512-byte block-addressable images
 
-    uint8_t*        fNibbleTrackBuf;    // allocated on heap
-    int             fNibbleTrackLoaded; // track currently in buffer
+    uint8_t*        fNibbleTrackBuf;    // current track's slot buffer
+    int             fNibbleTrackLoaded; // track in fNibbleTrackBuf, or -1
+
+    /*
+     * Where the sectors are in a track buffer, as found by MapNibbleTrack
+     * with a particular NibbleDescr.  Cleared when the buffer is reloaded
+     * or rewritten.
+     */
+    enum { kMaxNibbleSectors = 16 };
+    typedef struct NibbleSectorMap {
+        const NibbleDescr*  pNibbleDescr;   // NULL if the map isn't valid
+        int     addrIdx[kMaxNibbleSectors]; // address field prolog, or -1
+        int     dataIdx[kMaxNibbleSectors]; // data field contents, or -1
+        short   vol[kMaxNibbleSectors];     // volume from address field
+    } NibbleSectorMap;
+
+    /*
+     * Recently-used nibble tracks.  The number of slots is set by the
+     * cache configuration (see SetCacheMode); in write-back mode, tracks
+     * changed by SaveNibbleTrack stay here until FlushNibbleTracks.
+     */
+    typedef struct NibbleTrackSlot {
+        uint8_t*        buf;        // kTrackAllocSize bytes, or NULL
+        int             track;      // -1 if the slot is empty
+        bool            dirty;      // needs to be written to fpDataGFD
+        unsigned long   lastUse;    // for LRU eviction
+        NibbleSectorMap map;
+    } NibbleTrackSlot;
+    NibbleTrackSlot* fpNibbleSlots;
+    int             fNumNibbleSlots;
+    NibbleTrackSlot* fpNibbleCurSlot;   // slot holding fNibbleTrackBuf
+    unsigned long   fNibbleUseCount;
+    CacheStats      fNibbleCacheStats;
+    DIMutex*        fpLock;         // guards nibble buffer, unsafe GFDs
 
     int             fNuFXCompressType;  // used when compressing a NuFX image
 
+    CacheMode       fCacheMode;     // how to configure fpBlockCache
+    long            fCacheMaxBytes;
+    GFDBlockCache*  fpBlockCache;   // == fpDataGFD when cache is active
+
+    // only meaningful on the outermost image; see GetIOStats
+    mutable IOStats     fIOStats;
+    mutable di_off_t    fLastIOEnd; // offset just past the last access
+
+    /*
+     * Pieces of the image that AnalyzeImageFS loads up front, one read
+     * apiece, so that the TestFS functions' scattered reads of the boot
+     * and directory blocks, VTOC, and catalog track are served from
+     * memory.  The windows hold raw image bytes, so they work for every
+     * sector order a test might try.  Empty outside AnalyzeImageFS.
+     */
+    enum {
+        kMaxProbeWindows = 2,
+        // all of a 5.25" disk, incl. track 17 of a 400K "wide" DOS volume
+        kProbeHeadSize = 160 * 1024,
+        // catalog track of the second UNIDOS volume on an 800K disk
+        kProbeUNIDOSImageLen = 800 * 1024,
+        kProbeUNIDOSOffset = 400 * 1024 + 17 * 32 * 256,
+        kProbeUNIDOSSize = 32 * 256,
+    };
+    typedef struct ProbeWindow {
+        di_off_t    offset;
+        long        length;
+        uint8_t*    buf;
+    } ProbeWindow;
+    ProbeWindow     fProbeWindows[kMaxProbeWindows];
+    int             fNumProbeWindows;
+    int             fProbeThreads;
+    bool            fParallelProbe; // tests running on worker threads
+    long            fGzipMemoryLimit;
+    GzipIndexMode   fGzipIndexMode;
+    bool            fUseMmap;
+
+    FormatCache*    fpFormatCache;
+    FormatCache::Entry  fFormatEntry;   // key for this file, result if hit
+    bool            fHaveFormatKey;
+    bool            fFormatCacheHit;
+
     char*           fNotes;         // warnings and FYIs about DiskImg/DiskFS
 
     LinearBitmap*   fpBadBlockMap;  // used for 3.5" nibble images
@@ -753,6 +1169,18 @@ private:
 
     DIError CopyBytesOut(void* buf, di_off_t offset, int size) const;
     DIError CopyBytesIn(const void* buf, di_off_t offset, int size);
+    void LoadProbeWindows(void);
+    int RunFSTests(SectorOrder* pOrder, FSFormat* pFormat);
+    void FreeProbeWindows(void);
+    bool ReadProbeWindow(void* buf, di_off_t offset, int size) const;
+    void LookupFormatCache(const char* pathName, char fssep);
+    DIError UseCachedNibbleDescr(void);
+    void UseCachedFSFormat(void);
+    void StoreFormatCache(void);
+    DIError ReadBlockList(const uint16_t* shortList, const long* longList,
+        int count, void* buf);
+    void InstallBlockCache(void);
+    void MapImageFile(const char* pathName);
     DIError AnalyzeImageFile(const char* pathName, char fssep);
     // Figure out the sector ordering for this filesystem, so we can decide
     //  how the sectors need to be re-arranged when we're reading them.
@@ -761,6 +1189,23 @@ private:
     DIError CalcSectorAndOffset(long track, int sector, SectorOrder ImageOrder,
         SectorOrder fsOrder, di_off_t* pOffset, int* pNewSector);
     inline bool IsLinearBlocks(SectorOrder imageOrder, SectorOrder fsOrder);
+    static bool IsValidOrder(SectorOrder order) {
+        return (order > kSectorOrderUnknown && order < kSectorOrderMax);
+    }
+    // Outermost image; embedded images share its GFD (and its lock).
+    const DiskImg* GetRootImage(void) const {
+        const DiskImg* pImg = this;
+        while (pImg->fpParentImg != NULL)
+            pImg = pImg->fpParentImg;
+        return pImg;
+    }
+    // Where I/O on the calling thread gets counted; see RunFSTests.
+    IOStats* GetIOStatsSink(di_off_t** ppLastIOEnd = NULL) const;
+    // Read/write non-linear blocks a track at a time.
+    bool CanDoTrackBlockIO(void) const;
+    DIError ReadBlocksByTrack(long startBlock, int numBlocks, void* buf);
+    DIError WriteBlocksByTrack(long startBlock, int numBlocks,
+        const void* buf);
 
     /*
      * Progress update during the filesystem scan.  This only exists in the
@@ -789,6 +1234,8 @@ private:
         const NibbleDescr* pNibbleDescr);
     DIError WriteNibbleSector(long track, int sector, const void* buf,
         const NibbleDescr* pNibbleDescr);
+    DIError ReadNibbleTrackSectors(long track, uint8_t* buf,
+        uint32_t* pBadMask, const NibbleDescr* pNibbleDescr);
     void DumpNibbleDescr(const NibbleDescr* pNibDescr) const;
     int GetNibbleTrackLength(long track) const;
     int GetNibbleTrackOffset(long track) const;
@@ -821,8 +1268,15 @@ private:
     }
     DIError LoadNibbleTrack(long track, long* pTrackLen);
     DIError SaveNibbleTrack(void);
-    int FindNibbleSectorStart(const CircularBufferAccess& buffer,
-        int track, int sector, const NibbleDescr* pNibbleDescr, int* pVol);
+    DIError WriteNibbleSlot(NibbleTrackSlot* pSlot);
+    DIError FlushNibbleTracks(void);
+    void FreeNibbleTracks(void);
+    void MapNibbleTrack(const uint8_t* trackBuf, long trackLen, int track,
+        const NibbleDescr* pNibbleDescr, NibbleSectorMap* pMap);
+    const NibbleSectorMap* GetNibbleSectorMap(int track, long trackLen,
+        const NibbleDescr* pNibbleDescr);
+    int FindNibbleSectorStart(int track, long trackLen, int sector,
+        const NibbleDescr* pNibbleDescr, int* pVol);
     void DecodeAddr(const CircularBufferAccess& buffer, int offset,
         short* pVol, short* pTrack, short* pSector, short* pChksum);
     inline uint16_t ConvFrom44(uint8_t val1, uint8_t val2) {
@@ -832,15 +1286,17 @@ private:
         uint8_t* sctBuf, const NibbleDescr* pNibbleDescr);
     void EncodeNibbleData(const CircularBufferAccess& buffer, int idx,
         const uint8_t* sctBuf, const NibbleDescr* pNibbleDescr) const;
-    DIError DecodeNibble62(const CircularBufferAccess& buffer, int idx,
-        uint8_t* sctBuf, const NibbleDescr* pNibbleDescr);
-    void EncodeNibble62(const CircularBufferAccess& buffer, int idx,
-        const uint8_t* sctBuf, const NibbleDescr* pNibbleDescr) const;
-    DIError DecodeNibble53(const CircularBufferAccess& buffer, int idx,
-        uint8_t* sctBuf, const NibbleDescr* pNibbleDescr);
-    void EncodeNibble53(const CircularBufferAccess& buffer, int idx,
-        const uint8_t* sctBuf, const NibbleDescr* pNibbleDescr) const;
-    int TestNibbleTrack(int track, const NibbleDescr* pNibbleDescr, int* pVol);
+    DIError DecodeNibble62(const uint8_t* nibBuf, uint8_t* sctBuf,
+        const NibbleDescr* pNibbleDescr);
+    void EncodeNibble62(uint8_t* nibBuf, const uint8_t* sctBuf,
+        const NibbleDescr* pNibbleDescr) const;
+    DIError DecodeNibble53(const uint8_t* nibBuf, uint8_t* sctBuf,
+        const NibbleDescr* pNibbleDescr);
+    void EncodeNibble53(uint8_t* nibBuf, const uint8_t* sctBuf,
+        const NibbleDescr* pNibbleDescr) const;
+    int TestNibbleTrack(const uint8_t* trackBuf, long trackLen, int track,
+        const NibbleDescr* pNibbleDescr, int* pVol);
+    static void NibbleTestThread(void* vState, int threadIdx);
     DIError AnalyzeNibbleData(void);
     inline uint8_t Conv44(uint16_t val, bool first) const {
         if (first)
@@ -855,12 +1311,12 @@ private:
     /*
      * 3.5" nibble access
      */
-    static int FindNextSector35(const CircularBufferAccess& buffer, int start,
+    static int FindNextSector35(const uint8_t* buffer, int start, int end,
         int cyl, int head, int* pSector);
-    static bool DecodeNibbleSector35(const CircularBufferAccess& buffer,
+    static bool DecodeNibbleSector35(const uint8_t* buffer,
         int start, uint8_t* sectorBuf, uint8_t* readChecksum,
         uint8_t* calcChecksum);
-    static bool UnpackChecksum35(const CircularBufferAccess& buffer,
+    static bool UnpackChecksum35(const uint8_t* buffer,
         int offset, uint8_t* checksumBuf);
     static void EncodeNibbleSector35(const uint8_t* sectorData,
         uint8_t* outBuf);
@@ -1093,7 +1549,18 @@ public:
 
     DiskFS(void) {
         fpA2Head = fpA2Tail = NULL;
+        fpInsertAfter = NULL;
+        fpHashTable = NULL;
+        fHashTableSize = 0;
+        fNumHashed = 0;
+        fpFileArena = NULL;
+        fpHandleTable = NULL;
+        fHandleTableSize = fNumHandles = 0;
+        fpFileTable = NULL;
+        fFileTableSize = fFileTableCount = 0;
+        fFileTableValid = false;
         fpSubVolumeHead = fpSubVolumeTail = NULL;
+        fLazyDirs = false;
         fpImg = NULL;
         fScanForSubVolumes = kScanSubDisabled;
 
@@ -1140,11 +1607,29 @@ public:
      * always do the full scan; this is an optimization.)  Guaranteed to
      * set the volume name and volume block/sector count.
      *
+     * "kInitLazy" is for callers that only need part of a big hierarchical
+     * volume.  Only the top-level directory is read; the contents of each
+     * subdirectory are read the first time GetNextFile steps into it, or
+     * when GetFileByName needs to look inside it.  Because not every file
+     * is known up front, the per-file volume usage scan, the damage
+     * checks, and the sub-volume scan are skipped, and sparse files report
+     * their full length.  Lazy loading is only done on read-only images;
+     * filesystems without directories, and writable images, get a full
+     * scan instead.
+     *
      * If a progress callback is set up, this can return with a "cancelled"
      * result, which should not be treated as a failure.
+     *
+     * Sub-classes implement DoInitialize; this charges the time to the
+     * image's IOStats.
      */
-    typedef enum { kInitUnknown = 0, kInitHeaderOnly, kInitFull } InitMode;
-    virtual DIError Initialize(DiskImg* pImg, InitMode initMode) = 0;
+    typedef enum {
+        kInitUnknown = 0, kInitHeaderOnly, kInitFull, kInitLazy
+    } InitMode;
+    DIError Initialize(DiskImg* pImg, InitMode initMode) {
+        DiskImg::OpTimer timer(pImg, DiskImg::kTimedInitialize);
+        return DoInitialize(pImg, initMode);
+    }
 
     /*
      * Format the disk with the appropriate filesystem, creating all filesystem
@@ -1230,6 +1715,10 @@ public:
     // Accessor
     DiskImg* GetDiskImg(void) const { return fpImg; }
 
+    // I/O statistics for the image file this volume lives in, including
+    // all sub-volumes; see DiskImg::GetIOStats
+    void GetIOStats(DiskImg::IOStats* pStats) const;
+
     // Test file and volume names (and volume numbers)
     // [these need to be static functions for some things... hmm]
     //virtual bool IsValidFileName(const char* name) const { return false; }
@@ -1261,15 +1750,38 @@ public:
     //  head of the list.  Returns NULL when the end of the list is reached.
     A2File* GetNextFile(A2File* pCurrent) const;
 
-    // Get a count of the files and directories on this disk.
+    // Get a count of the files and directories on this disk.  (Loads every
+    //  directory if the DiskFS was initialized with kInitLazy.)
     long GetFileCount(void) const;
 
+    /*
+     * Table access to the file list.
+     *
+     * Every file gets a handle when it's added to the list.  The handle
+     * stays valid until the file is deleted, and is never reused, so a
+     * stale handle just returns NULL.
+     *
+     * GetFileTable returns the entire list as an array, in list order.
+     * The array belongs to the DiskFS and is valid until the list changes.
+     * (Loads every directory if the DiskFS was initialized with kInitLazy.)
+     */
+    typedef long FileHandle;
+    enum { kInvalidFileHandle = -1 };
+    FileHandle GetFileHandle(const A2File* pFile) const;
+    A2File* GetFileByHandle(FileHandle handle) const;
+    A2File* const* GetFileTable(long* pCount) const;
+
     /*
      * Find a file by case-insensitive pathname.  Assumes fssep=':'.  The
      * compare function can be overridden for systems like HFS, where "case
      * insensitive" has a different meaning because of the native
      * character set.
      *
+     * Lookups go through a hash of the pathnames, which folds ASCII case
+     * and treats ' ', '.', and all high-ASCII characters as equal.  The
+     * compare function must not consider two names equal unless they
+     * are also equal under those rules.
+     *
      * The A2File* returned should not be deleted.
      */
     typedef int (*StringCompareFunc)(const char* str1, const char* str2);
@@ -1376,6 +1888,9 @@ public:
     void DumpFileList(void);
 
 protected:
+    // sub-class half of Initialize
+    virtual DIError DoInitialize(DiskImg* pImg, InitMode initMode) = 0;
+
     /*
      * Set the DiskImg pointer.  Updates the reference count in DiskImg.
      */
@@ -1391,10 +1906,38 @@ protected:
     void InsertFileInList(A2File* pFile, A2File* pPrev);
     // delete an entry
     void DeleteFileFromList(A2File* pFile);
+    // call after changing the pathname of a file that's already in the list
+    void ReindexFile(A2File* pFile);
+
+    /*
+     * Parent/child index for hierarchical filesystems, kept up to date by
+     * the list functions above.  The children of a directory are linked in
+     * the same order they appear in the file list.
+     *
+     * FindChild looks up "fileName" in "pDir" without building the full
+     * pathname, relying on the convention that a file's pathname is its
+     * directory's pathname, a ':', and its filename (or just the filename
+     * for files in the volume directory).  "func" compares filenames.
+     */
+    A2File* GetLastChild(const A2File* pDir) const;
+    A2File* GetPrevSibling(const A2File* pFile) const;
+    A2File* FindChild(A2File* pDir, const char* fileName,
+        StringCompareFunc func);
 
     // scan for damaged or suspicious files
     void ScanForDamagedFiles(bool* pDamaged, bool* pSuspicious);
 
+    /*
+     * Lazy directory loading (kInitLazy).  Initialize calls SetDirPending
+     * on each subdirectory instead of reading it; later, LoadSubdir is
+     * asked to add the directory's entries with AddFileToList.  Entries
+     * added from LoadSubdir go right after the directory, rather than at
+     * the end of the list, so the list stays in tree order.
+     */
+    virtual DIError LoadSubdir(A2File* pDir) { return kDIErrNotSupported; }
+    void SetDirPending(A2File* pDir);
+    bool        fLazyDirs;          // set by Initialize for kInitLazy
+
     // pointer to the DiskImg structure underlying this filesystem
     DiskImg*    fpImg;
 
@@ -1404,6 +1947,15 @@ protected:
 
 private:
     A2File* SkipSubdir(A2File* pSubdir);
+    void LoadPendingDir(A2File* pDir);
+    static uint32_t HashPathName(uint32_t hash, const char* str);
+    void IndexFile(A2File* pFile);
+    void UnindexFile(A2File* pFile);
+    void HashAdd(A2File* pFile);
+    void HashRemove(A2File* pFile);
+    A2File* LookupPathName(const char* pathName, StringCompareFunc func);
+    void AssignHandle(A2File* pFile);
+    void BuildFileTable(void);
     void CopyInheritables(DiskFS* pNewFS);
     void DeleteFileList(void);
     void DeleteSubVolumeList(void);
@@ -1412,6 +1964,20 @@ private:
 
     A2File*     fpA2Head;
     A2File*     fpA2Tail;
+    A2File*     fpInsertAfter;      // set while LoadSubdir runs
+    A2File**    fpHashTable;        // pathname hash; power-of-two size
+    uint32_t    fHashTableSize;
+    long        fNumHashed;
+
+    friend class A2File;            // for operator new
+    FileArena*  fpFileArena;        // A2File storage
+    A2File**    fpHandleTable;      // indexed by FileHandle
+    long        fHandleTableSize;
+    long        fNumHandles;
+    A2File**    fpFileTable;        // list order; see GetFileTable
+    long        fFileTableSize;
+    long        fFileTableCount;
+    bool        fFileTableValid;
     SubVolume*  fpSubVolumeHead;
     SubVolume*  fpSubVolumeTail;
 
@@ -1453,9 +2019,25 @@ public:
     A2File(DiskFS* pDiskFS) : fpDiskFS(pDiskFS) {
         fpPrev = fpNext = NULL;
         fFileQuality = kQualityGood;
+        fDirPending = false;
+        fPathHash = 0;
+        fpHashNext = NULL;
+        fpIdxParent = fpFirstChild = fpLastChild = NULL;
+        fpPrevSibling = fpNextSibling = NULL;
+        fHandle = DiskFS::kInvalidFileHandle;
     }
     virtual ~A2File(void) {}
 
+    /*
+     * A2File objects are carved out of an arena owned by the DiskFS,
+     * which saves a trip to the allocator for every file on large
+     * volumes.  Allocate them with "new (pDiskFS) A2FileXXX(pDiskFS)".
+     * They're deleted normally.
+     */
+    static void* operator new(size_t size, DiskFS* pDiskFS);
+    static void operator delete(void* ptr, DiskFS* pDiskFS);
+    static void operator delete(void* ptr);
+
     /*
      * All Apple II files have certain characteristics, of which ProDOS
      * is roughly a superset.  (Yes, you can have HFS on a IIgs, but
@@ -1565,6 +2147,19 @@ private:
 
     A2File*     fpPrev;
     A2File*     fpNext;
+    bool        fDirPending;    // directory contents not loaded yet
+
+    // DiskFS pathname hash and parent/child index
+    uint32_t    fPathHash;
+    A2File*     fpHashNext;
+    A2File*     fpIdxParent;
+    A2File*     fpFirstChild;
+    A2File*     fpLastChild;
+    A2File*     fpPrevSibling;
+    A2File*     fpNextSibling;
+
+    // DiskFS file table
+    long        fHandle;
 
 
 private:
@@ -1678,6 +2273,15 @@ private:
     void*               fProgressUpdateState;
 };
 
+
+/*
+ * Extract the data fork of every file on "pDiskFS" into the host directory
+ * "outDir", reading with up to "numThreads" threads at once.  See the
+ * thread-safety notes on DiskImg.
+ */
+DISKIMG_API DIError ExtractAll(DiskFS* pDiskFS, const char* outDir,
+    int numThreads);
+
 }   // namespace DiskImgLib
 
 #endif /*DISKIMG_DISKIMG_H*/
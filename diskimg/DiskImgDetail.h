@@ -25,6 +25,9 @@
 
 namespace DiskImgLib {
 
+class BitInputBuffer;       // in DiskImgPriv.h
+class BitOutputBuffer;
+
 /*
  * ===========================================================================
  *      Outer wrappers
@@ -70,7 +73,16 @@ private:
 
 class OuterGzip : public OuterWrapper {
 public:
-    OuterGzip(void) { fWrapperDamaged = false; }
+    // Images bigger than "memoryLimit" are unpacked to a temp file, or,
+    // if opened read-only, accessed through an index (see GFDGzip).
+    OuterGzip(long memoryLimit = kGzipMax,
+            DiskImg::GzipIndexMode indexMode = DiskImg::kGzipIndexNone) :
+        fMemoryLimit(memoryLimit), fIndexMode(indexMode)
+    {
+        fWrapperDamaged = false;
+        if (fMemoryLimit > kMaxMemoryLimit)
+            fMemoryLimit = kMaxMemoryLimit;
+    }
     virtual ~OuterGzip(void) {}
 
     static DIError Test(GenericFD* pGFD, di_off_t outerLength);
@@ -84,13 +96,29 @@ public:
     virtual const char* GetExtension(void) const override { return NULL; }
 
 private:
-    DIError ExtractGzipImage(gzFile gzfp, char** pBuf, di_off_t* pLength);
+    static bool GetExpectedLength(GenericFD* pGFD, di_off_t outerLength,
+        di_off_t* pLength);
+    DIError ExtractGzipImage(gzFile gzfp, di_off_t expectedLen, char** pBuf,
+        di_off_t* pLength);
+    DIError ExtractGzipToFile(gzFile gzfp, GenericFD* pGFD, di_off_t* pLength);
+    DIError OpenIndexed(const char* imagePath, di_off_t* pLength,
+        GenericFD** ppNewGFD);
+    static char* GetIndexPath(const char* imagePath);
     DIError CloseGzip(void);
 
-    // Largest possible ProDOS volume; quite a bit to hold in RAM. Add a
-    // little extra for .hdv format.
-    enum { kMaxUncompressedSize = kGzipMax +256 };
+    enum {
+        // Allow a little extra over the memory limit for .hdv headers, so
+        // the largest ProDOS volume still fits by default.
+        kHeaderSlop = 256,
+        // GFDBuffer won't take anything bigger.
+        kMaxMemoryLimit = 256 * 1024 * 1024 - kHeaderSlop,
+    };
+    // Largest image we'll unpack to a temp file.
+    static const di_off_t kMaxUncompressedSize;
+    static const char* kIndexSuffix;
 
+    long    fMemoryLimit;
+    DiskImg::GzipIndexMode fIndexMode;
     bool    fWrapperDamaged;
 };
 
@@ -501,7 +529,6 @@ public:
     };
 
 private:
-    class BitBuffer;
     enum {
         kNumTracks = 35,
         kNumSectors = 16,
@@ -515,10 +542,10 @@ private:
 
     static DIError UnpackDisk(GenericFD* pGFD, GenericFD* pNewGFD,
         short* pDiskVolNum);
-    static bool UnpackTrack(BitBuffer* pBitBuffer, uint8_t* trackBuf);
+    static bool UnpackTrack(BitInputBuffer* pBitBuffer, uint8_t* trackBuf);
     static DIError PackDisk(GenericFD* pSrcGFD, GenericFD* pWrapperGFD,
         short diskVolNum);
-    static void PackTrack(const uint8_t* trackBuf, BitBuffer* pBitBuf);
+    static void PackTrack(const uint8_t* trackBuf, BitOutputBuffer* pBitBuf);
     static void ComputeFreqCounts(const uint8_t* trackBuf,
         uint16_t* freqCounts);
     static void ComputeFavorites(uint16_t* freqCounts,
@@ -630,7 +657,10 @@ private:
 
 class WrapperFDI : public ImageWrapper {
 public:
-    WrapperFDI(void) {}
+    // Tracks are decoded on up to "numThreads" threads.
+    WrapperFDI(int numThreads = kDefaultProbeThreads) :
+        fNumThreads(numThreads)
+    {}
     virtual ~WrapperFDI(void) {}
 
     static DIError Test(GenericFD* pGFD, di_off_t wrappedLength);
@@ -735,6 +765,26 @@ private:
         struct HuffNode*    right;
     } HuffNode;
 
+    /*
+     * One track's worth of work for the unpack threads.  The input is read
+     * up front; each track is decoded into its own nibble buffer.
+     */
+    typedef struct UnpackTrack {
+        int             type;       // track type from the header
+        const uint8_t*  inputBuf;   // pulse data, or NULL if blank
+        long            inputLen;
+        int             bitRate;
+        uint8_t*        nibbleBuf;  // kNibbleBufLen bytes
+        long            nibbleLen;
+        bool            decoded;    // false if blank or decode failed
+        uint8_t*        blockBuf;   // 3.5" only: kMaxSectors35 blocks
+        uint32_t        badSectors; // 3.5" only: from DecodeNibbleTrack35
+        DIError         blockErr;
+    } UnpackTrack;
+    struct UnpackState;             // shared state, defined in FDI.cpp
+
+    int     fNumThreads;
+
     /* 
      * Keep a copy of the header around while we work.  None of the formats
      * we're interested in have more than kMaxHeaderBlockTracks tracks in
@@ -756,6 +806,9 @@ private:
     DIError UnpackDisk35(GenericFD* pGFD, GenericFD* pNewGFD, int numCyls,
         int numHeads, LinearBitmap* pBadBlockMap);
     void GetTrackInfo(int trk, int* pType, int* pLength256);
+    DIError DecodeTracks(GenericFD* pGFD, int numCyls, int numHeads,
+        bool is35, UnpackTrack** ppTracks, uint8_t** ppTrackData);
+    static void DecodeTrackThread(void* vState, int threadIdx);
 
     int BitRate35(int trk);
     void FixBadNibbles(uint8_t* nibbleBuf, long nibbleLen);
@@ -781,7 +834,7 @@ private:
         const uint32_t* idxStream, int numPulses, int maxIndex,
         int indexOffset, uint32_t totalAvg, int bitRate,
         uint8_t* outputBuf, int* pOutputLen);
-    int MyRand(void);
+    static int MyRand(int* pState);
     bool ConvertBitsToNibbles(const uint8_t* bitBuffer, int bitCount,
         uint8_t* nibbleBuf, long* pNibbleLen);
 
@@ -873,7 +926,7 @@ public:
     }
     virtual ~DiskFSUnknown(void) {}
 
-    virtual DIError Initialize(DiskImg* pImg, InitMode initMode) {
+    virtual DIError DoInitialize(DiskImg* pImg, InitMode initMode) {
         SetDiskImg(pImg);
         return kDIErrNone;
     }
@@ -943,7 +996,7 @@ public:
     static DIError TestWideFS(DiskImg* pImg, DiskImg::SectorOrder* pOrder,
         DiskImg::FSFormat* pFormat, FSLeniency leniency);
 
-    virtual DIError Initialize(DiskImg* pImg, InitMode initMode) override {
+    virtual DIError DoInitialize(DiskImg* pImg, InitMode initMode) override {
         SetDiskImg(pImg);
         return Initialize();
     }
@@ -980,7 +1033,7 @@ public:
     static DIError TestFS(DiskImg* pImg, DiskImg::SectorOrder* pOrder,
         DiskImg::FSFormat* pFormat, FSLeniency leniency);
 
-    virtual DIError Initialize(DiskImg* pImg, InitMode initMode) override {
+    virtual DIError DoInitialize(DiskImg* pImg, InitMode initMode) override {
         SetDiskImg(pImg);
         return Initialize();
     }
@@ -1014,7 +1067,7 @@ public:
     static DIError TestFS(DiskImg* pImg, DiskImg::SectorOrder* pOrder,
         DiskImg::FSFormat* pFormat, FSLeniency leniency);
 
-    virtual DIError Initialize(DiskImg* pImg, InitMode initMode) override {
+    virtual DIError DoInitialize(DiskImg* pImg, InitMode initMode) override {
         SetDiskImg(pImg);
         return Initialize();
     }
@@ -1062,7 +1115,7 @@ public:
     static DIError TestFS(DiskImg* pImg, DiskImg::SectorOrder* pOrder,
         DiskImg::FSFormat* pFormat, FSLeniency leniency);
 
-    virtual DIError Initialize(DiskImg* pImg, InitMode initMode) override {
+    virtual DIError DoInitialize(DiskImg* pImg, InitMode initMode) override {
         SetDiskImg(pImg);
         return Initialize();
     }
@@ -1115,7 +1168,7 @@ public:
     static DIError TestFS(DiskImg* pImg, DiskImg::SectorOrder* pOrder,
         DiskImg::FSFormat* pFormat, FSLeniency leniency);
 
-    virtual DIError Initialize(DiskImg* pImg, InitMode initMode) override {
+    virtual DIError DoInitialize(DiskImg* pImg, InitMode initMode) override {
         SetDiskImg(pImg);
         return Initialize();
     }
@@ -1164,7 +1217,7 @@ public:
     static DIError TestFS(DiskImg* pImg, DiskImg::SectorOrder* pOrder,
         DiskImg::FSFormat* pFormat, FSLeniency leniency);
 
-    virtual DIError Initialize(DiskImg* pImg, InitMode initMode) override {
+    virtual DIError DoInitialize(DiskImg* pImg, InitMode initMode) override {
         SetDiskImg(pImg);
         return Initialize();
     }
@@ -1222,7 +1275,7 @@ public:
     static DIError TestFS(DiskImg* pImg, DiskImg::SectorOrder* pOrder,
         DiskImg::FSFormat* pFormat, FSLeniency leniency);
 
-    virtual DIError Initialize(DiskImg* pImg, InitMode initMode) override {
+    virtual DIError DoInitialize(DiskImg* pImg, InitMode initMode) override {
         SetDiskImg(pImg);
         return Initialize(initMode);
     }
@@ -1550,7 +1603,7 @@ public:
     static DIError TestFS(DiskImg* pImg, DiskImg::SectorOrder* pOrder,
         DiskImg::FSFormat* pFormat, FSLeniency leniency);
 
-    virtual DIError Initialize(DiskImg* pImg, InitMode initMode) override {
+    virtual DIError DoInitialize(DiskImg* pImg, InitMode initMode) override {
         SetDiskImg(pImg);
         return Initialize(initMode);
     }
@@ -1626,6 +1679,7 @@ private:
         const uint8_t* blkBuf, bool skipFirst, int* pCount,
         const char* basePath, uint16_t thisBlock, int depth);
     DIError ReadExtendedInfo(A2FileProDOS* pFile);
+    virtual DIError LoadSubdir(A2File* pDir) override;
     DIError ScanFileUsage(void);
     void ScanBlockList(long blockCount, uint16_t* blockList,
         long indexCount, uint16_t* indexList, long* pSparseCount);
@@ -1634,7 +1688,7 @@ private:
         DiskImg** ppDiskImg, DiskFS** ppDiskFS);
     void MarkSubVolumeBlocks(long block, long count);
 
-    A2File* FindFileByKeyBlock(A2File* pStart, uint16_t keyBlock);
+    A2File* FindFileByKeyBlock(A2File* pDir, uint16_t keyBlock);
     DIError AllocInitialFileStorage(const CreateParms* pParms,
         const char* upperName, uint16_t dirBlock, int dirEntrySlot,
         long* pKeyBlock, int* pBlocksUsed, int* pNewEOF);
@@ -1647,10 +1701,9 @@ private:
         long* pDirLen, uint8_t** ppDirEntry, uint16_t* pDirKeyBlock,
         int* pDirEntrySlot, uint16_t* pDirBlock);
     uint8_t* GetPrevDirEntry(uint8_t* buf, uint8_t* ptr);
-    DIError MakeFileNameUnique(const uint8_t* dirBuf, long dirLen,
-        char* fileName);
-    bool NameExistsInDir(const uint8_t* dirBuf, long dirLen,
-        const char* fileName);
+    DIError MakeFileNameUnique(A2File* pDir, char* fileName);
+    bool NameExistsInDir(A2File* pDir, const char* fileName);
+    static int CompareUpperName(const char* name1, const char* name2);
 
     DIError FreeBlocks(long blockCount, uint16_t* blockList);
     DIError RegeneratePathName(A2FileProDOS* pFile);
@@ -1726,6 +1779,8 @@ public:
     void DumpBlockList(void) const;
 
 private:
+    enum { kMaxBlocksPerRead = 128 };   // whole blocks per ReadBlockList
+
     bool IsEmptyBlock(const uint8_t* blk);
     DIError WriteDirectory(const void* buf, size_t len, size_t* pActual);
 
@@ -1963,7 +2018,7 @@ public:
     static DIError TestFS(DiskImg* pImg, DiskImg::SectorOrder* pOrder,
         DiskImg::FSFormat* pFormat, FSLeniency leniency);
 
-    virtual DIError Initialize(DiskImg* pImg, InitMode initMode) override {
+    virtual DIError DoInitialize(DiskImg* pImg, InitMode initMode) override {
         SetDiskImg(pImg);
         return Initialize();
     }
@@ -2194,7 +2249,7 @@ public:
     static DIError TestFS(DiskImg* pImg, DiskImg::SectorOrder* pOrder,
         DiskImg::FSFormat* pFormat, FSLeniency leniency);
 
-    virtual DIError Initialize(DiskImg* pImg, InitMode initMode) override {
+    virtual DIError DoInitialize(DiskImg* pImg, InitMode initMode) override {
         SetDiskImg(pImg);
         return Initialize();
     }
@@ -2297,6 +2352,10 @@ public:
     virtual DIError GetStorage(long blockIdx, long* pBlock) const override;
 
 private:
+    enum { kMaxBlocksPerRead = 32 };    // CP/M blocks per ReadBlockList
+
+    long GetProDOSBlock(int blkIndex) const;
+
     //bool          fOpen;
     di_off_t        fOffset;
     long            fBlockCount;
@@ -2398,7 +2457,7 @@ public:
     static DIError TestFS(DiskImg* pImg, DiskImg::SectorOrder* pOrder,
         DiskImg::FSFormat* pFormat, FSLeniency leniency);
 
-    virtual DIError Initialize(DiskImg* pImg, InitMode initMode) override {
+    virtual DIError DoInitialize(DiskImg* pImg, InitMode initMode) override {
         SetDiskImg(pImg);
         return Initialize();
     }
@@ -2564,7 +2623,7 @@ public:
     static DIError TestFS(DiskImg* pImg, DiskImg::SectorOrder* pOrder,
         DiskImg::FSFormat* pFormat, FSLeniency leniency);
 
-    virtual DIError Initialize(DiskImg* pImg, InitMode initMode) override {
+    virtual DIError DoInitialize(DiskImg* pImg, InitMode initMode) override {
         SetDiskImg(pImg);
         return Initialize(initMode);
     }
@@ -2643,6 +2702,7 @@ private:
     void CreateFakeFile(void);
 #else
     DIError RecursiveDirAdd(A2File* pParent, const char* basePath, int depth);
+    virtual DIError LoadSubdir(A2File* pDir) override;
     //void Sanitize(uint8_t* str);
     DIError DoNormalizePath(const char* path, char fssep,
         char** pNormalizedPath);
@@ -2724,6 +2784,7 @@ class DISKIMG_API A2FileHFS : public A2File {
 public:
     A2FileHFS(DiskFS* pDiskFS) : A2File(pDiskFS) {
         fPathName = NULL;
+        fpParent = NULL;
         fpOpenFile = NULL;
 #ifdef EXCISE_GPL_CODE
         fFakeFileBuf = NULL;
@@ -2842,7 +2903,7 @@ public:
     static DIError TestFS(DiskImg* pImg, DiskImg::SectorOrder* pOrder,
         DiskImg::FSFormat* pFormat, FSLeniency leniency);
 
-    virtual DIError Initialize(DiskImg* pImg, InitMode initMode) override {
+    virtual DIError DoInitialize(DiskImg* pImg, InitMode initMode) override {
         SetDiskImg(pImg);
         return Initialize(initMode);
     }
@@ -3094,7 +3155,7 @@ public:
     static DIError TestFS(DiskImg* pImg, DiskImg::SectorOrder* pOrder,
         DiskImg::FSFormat* pFormat, FSLeniency leniency);
 
-    virtual DIError Initialize(DiskImg* pImg, InitMode initMode) override {
+    virtual DIError DoInitialize(DiskImg* pImg, InitMode initMode) override {
         SetDiskImg(pImg);
         return Initialize();
     }
@@ -23,21 +23,51 @@ namespace DiskImgLib {
 /*
  * Debug logging macros.
  *
- * The macro choice implies a severity level, but we don't currently
- * support that in the callback interface, so it's not used.
+ * The severity is checked against Global::gLogLevel before anything else
+ * happens, so a discarded message costs a compare and a branch: the
+ * arguments aren't evaluated and the string isn't formatted.
+ *
+ * LOGV and LOGD are compiled out of release builds (unless
+ * DISKIMG_DEBUG_LOGS is defined).  The call is kept inside "if (false)"
+ * so the format string is still checked and variables that are only
+ * logged don't generate "unused" warnings.
  */
-#define DLOG_BASE(file, line, format, ...) \
-        Global::PrintDebugMsg((file), (line), (format), ##__VA_ARGS__)
-
-//#ifdef SHOW_LOGV
-# define LOGV(format, ...) DLOG_BASE(__FILE__, __LINE__, (format), ##__VA_ARGS__)
-//#else
-//# define LOGV(format, ...) ((void) 0)
-//#endif
-#define LOGD(format, ...) DLOG_BASE(__FILE__, __LINE__, (format), ##__VA_ARGS__)
-#define LOGI(format, ...) DLOG_BASE(__FILE__, __LINE__, (format), ##__VA_ARGS__)
-#define LOGW(format, ...) DLOG_BASE(__FILE__, __LINE__, (format), ##__VA_ARGS__)
-#define LOGE(format, ...) DLOG_BASE(__FILE__, __LINE__, (format), ##__VA_ARGS__)
+#define DLOG_BASE(severity, file, line, format, ...) \
+    do { \
+        if (Global::IsLogEnabled(severity)) { \
+            Global::PrintDebugMsg((severity), (file), (line), (format), \
+                ##__VA_ARGS__); \
+        } \
+    } while (false)
+#define DLOG_NONE(severity, file, line, format, ...) \
+    do { \
+        if (false) { \
+            Global::PrintDebugMsg((severity), (file), (line), (format), \
+                ##__VA_ARGS__); \
+        } \
+    } while (false)
+
+#if defined(_DEBUG) && !defined(DISKIMG_DEBUG_LOGS)
+# define DISKIMG_DEBUG_LOGS
+#endif
+
+#ifdef DISKIMG_DEBUG_LOGS
+# define LOGV(format, ...) \
+    DLOG_BASE(Global::kLogVerbose, __FILE__, __LINE__, (format), ##__VA_ARGS__)
+# define LOGD(format, ...) \
+    DLOG_BASE(Global::kLogDebug, __FILE__, __LINE__, (format), ##__VA_ARGS__)
+#else
+# define LOGV(format, ...) \
+    DLOG_NONE(Global::kLogVerbose, __FILE__, __LINE__, (format), ##__VA_ARGS__)
+# define LOGD(format, ...) \
+    DLOG_NONE(Global::kLogDebug, __FILE__, __LINE__, (format), ##__VA_ARGS__)
+#endif
+#define LOGI(format, ...) \
+    DLOG_BASE(Global::kLogInfo, __FILE__, __LINE__, (format), ##__VA_ARGS__)
+#define LOGW(format, ...) \
+    DLOG_BASE(Global::kLogWarn, __FILE__, __LINE__, (format), ##__VA_ARGS__)
+#define LOGE(format, ...) \
+    DLOG_BASE(Global::kLogError, __FILE__, __LINE__, (format), ##__VA_ARGS__)
 
 /* put this in to break on interesting events when built debug */
 #if defined(_DEBUG)
@@ -86,6 +116,18 @@ DIError LastErrorToDIError(void);
 bool IsWin9x(void);
 #endif
 
+/*
+ * Run "func" on "numThreads" threads, passing each its index in
+ * [0, numThreads), and wait for all of them to finish.  If threads can't
+ * be created, the remaining indices are run on the calling thread, so
+ * "func" is always called exactly "numThreads" times.
+ */
+typedef void (*DIThreadFunc)(void* arg, int threadIdx);
+void RunThreads(int numThreads, DIThreadFunc func, void* arg);
+
+/* monotonic-ish wall clock, in microseconds; for statistics only */
+int64_t GetTimeUsec(void);
+
 
 /*
  * Provide access to a buffer of data as if it were a circular buffer.
@@ -117,11 +159,16 @@ public:
         return fBuf[idx];
     }
 
-    //uint8_t* GetPointer(int idx) const {
-    //    while (idx >= fLen)
-    //        idx -= fLen;
-    //    return &fBuf[idx];
-    //}
+    /*
+     * Get a plain pointer to "len" bytes starting at "idx", or NULL if
+     * the span wraps around the end of the buffer.
+     */
+    uint8_t* GetLinearPointer(int idx, int len) const {
+        idx = Normalize(idx);
+        if (idx + len > fLen)
+            return NULL;
+        return &fBuf[idx];
+    }
 
     int Normalize(int idx) const {
         while (idx >= fLen)
@@ -139,168 +186,238 @@ private:
 };
 
 /*
- * Manage an output buffer into which we write one bit at a time.
+ * Manage an output buffer into which we write bits.
  *
  * Bits fill in from the MSB to the LSB.  If we write 10 bits, the
  * output buffer will look like this:
  *
  *  xxxxxxxx xx000000
  *
- * Call WriteBit() repeatedly.  When done, call Finish() to write any pending
- * data and return the number of bits in the buffer.
+ * Bits are collected in a 64-bit accumulator and stored a byte at a time,
+ * so the bounds check happens once per byte rather than once per bit.
+ * Call WriteBit() or WriteBits() repeatedly.  When done, call Finish() to
+ * write any pending data and return the number of bits in the buffer.
  */
 class BitOutputBuffer {
 public:
     /* pass in the output buffer and the output buffer's size */
     BitOutputBuffer(uint8_t* buf, int size) {
         fBufStart = fBuf = buf;
-        fBufSize = size;
-        fBitMask = 0x80;
-        fByte = 0;
+        fBufEnd = buf + size;
+        fAccum = 0;
+        fAccumBits = 0;
         fOverflow = false;
     }
     virtual ~BitOutputBuffer(void) {}
 
     /* write a single bit */
     void WriteBit(int val) {
-        if (fBuf - fBufStart >= fBufSize) {
-            if (!fOverflow) {
-                LOGI("Overran bit output buffer");
-                DebugBreak();
-                fOverflow = true;
-            }
-            return;
-        }
+        WriteBits(val != 0, 1);
+    }
 
-        if (val)
-            fByte |= fBitMask;
-        fBitMask >>= 1;
-        if (fBitMask == 0) {
-            *fBuf++ = fByte;
-            fBitMask = 0x80;
-            fByte = 0;
-        }
+    /* write the low "numBits" bits of "val", most significant first */
+    void WriteBits(uint32_t val, int numBits) {
+        assert(numBits > 0 && numBits <= 32);
+        if (numBits < 32)
+            val &= (1U << numBits) - 1;
+        fAccum |= (uint64_t) val << (64 - fAccumBits - numBits);
+        fAccumBits += numBits;
+        if (fAccumBits >= 32)
+            Drain();
     }
 
     /* flush pending bits; returns length in bits (or -1 on overrun) */
     int Finish(void) {
         int outputBits;
 
+        Drain();
         if (fOverflow)
             return -1;
 
-        outputBits = (fBuf - fBufStart) * 8;
-
-        if (fBitMask != 0x80) {
-            *fBuf++ = fByte;
-
-            assert(fBitMask != 0);
-            while (fBitMask != 0x80) {
-                outputBits++;
-                fBitMask <<= 1;
-            }
+        outputBits = (fBuf - fBufStart) * 8 + fAccumBits;
+        if (fAccumBits != 0) {
+            /* partial byte; Drain left room for it */
+            assert(fBuf < fBufEnd);
+            *fBuf++ = (uint8_t) (fAccum >> 56);
+            fAccum = 0;
+            fAccumBits = 0;
         }
         return outputBits;
     }
 
 private:
+    /* store all complete bytes from the accumulator */
+    void Drain(void) {
+        while (fAccumBits >= 8) {
+            if (fBuf == fBufEnd) {
+                if (!fOverflow) {
+                    LOGI("Overran bit output buffer");
+                    DebugBreak();
+                    fOverflow = true;
+                }
+                fAccum = 0;
+                fAccumBits = 0;
+                return;
+            }
+            *fBuf++ = (uint8_t) (fAccum >> 56);
+            fAccum <<= 8;
+            fAccumBits -= 8;
+        }
+        if (fAccumBits != 0 && fBuf == fBufEnd && !fOverflow) {
+            /* no room for the partial byte either */
+            LOGI("Overran bit output buffer");
+            DebugBreak();
+            fOverflow = true;
+        }
+    }
+
     uint8_t*    fBufStart;
     uint8_t*    fBuf;
-    int         fBufSize;
-    uint8_t     fBitMask;
-    uint8_t     fByte;
+    uint8_t*    fBufEnd;
+    uint64_t    fAccum;         // pending bits, left-aligned
+    int         fAccumBits;     // #of bits in fAccum (0-63)
     bool        fOverflow;
 };
 
 /*
- * Extract data from the buffer one bit or one byte at a time.
+ * Extract data from a buffer of bits, MSB first.
+ *
+ * By default the buffer is circular, which is what we want for a disk
+ * track: reading past the last bit continues from the first, and the
+ * caller is told that it happened.  The last byte may be partial.  If the
+ * buffer isn't circular, reading past the end yields zeroes and sets a
+ * flag that GetOverrun() reports.
+ *
+ * Up to 64 bits are kept in an accumulator, refilled a byte at a time
+ * (or eight bytes at a time when the read position is byte-aligned), so
+ * GetBits(n) and PeekBits(n) cost about the same as GetBit().
  */
 class BitInputBuffer {
 public:
-    BitInputBuffer(const uint8_t* buf, int bitCount) {
-        fBufStart = fBuf = buf;
+    BitInputBuffer(const uint8_t* buf, int bitCount, bool circular = true) {
+        assert(bitCount > 0);
+        fBufStart = buf;
         fBitCount = bitCount;
-        fCurrentBit = 0;
-        fBitPosn = 7;
+        fCircular = circular;
+        fOverrun = false;
         fBitsConsumed = 0;
+        SetStartPosition(0);
     }
     virtual ~BitInputBuffer(void) {}
 
     /*
-     * Get the next bit.  Returns 0 or 1.
+     * Get the next "numBits" bits (1-32), MSB first.
      *
      * If we wrapped around to the start of the buffer, and "pWrap" is
      * non-null, set "*pWrap". (This does *not* set it to "false" if we
      * don't wrap.)
      */
-    uint8_t GetBit(bool* pWrap) {
-        uint8_t val;
+    uint32_t GetBits(int numBits, bool* pWrap) {
+        uint32_t val;
+
+        assert(numBits > 0 && numBits <= 32);
+        if (fAccumBits < numBits) {
+            Refill();
+            if (fAccumBits < numBits) {
+                /* non-circular buffer ran dry; low bits of fAccum are zero */
+                fOverrun = true;
+                fAccumBits = numBits;
+            }
+        }
 
-        //assert(fBitPosn == 7 - (fCurrentBit & 0x07));
+        val = (uint32_t) (fAccum >> (64 - numBits));
+        fAccum <<= numBits;
+        fAccumBits -= numBits;
 
-        if (fCurrentBit == fBitCount) {
-            /* end reached, wrap to start */
-            fCurrentBit = 0;
-            fBitPosn = 7;
-            fBuf = fBufStart;
-            //fByte = *fBuf++;
+        fCurrentBit += numBits;
+        while (fCurrentBit > fBitCount) {
+            /* passed the end; we've read bit 0 again */
+            fCurrentBit -= fBitCount;
             if (pWrap != NULL)
                 *pWrap = true;
         }
-
-        val = (*fBuf >> fBitPosn) & 0x01;
-
-        fCurrentBit++;
-        fBitPosn--;
-        if (fBitPosn < 0) {
-            fBitPosn = 7;
-            fBuf++;
-        }
-
-        fBitsConsumed++;
+        fBitsConsumed += numBits;
         return val;
     }
 
     /*
-     * Get the next 8 bits.
+     * Return the next "numBits" bits (1-32) without consuming them.
      */
-    uint8_t GetByte(bool* pWrap) {
-        uint8_t val;
-        int i;
-
-        if (true || fCurrentBit > fBitCount-8) {
-            /* near end, use single-bit function iteratively */
-            val = 0;
-            for (i = 0; i < 8; i++)
-                val = (val << 1) | GetBit(pWrap);
-        } else {
-            /* room to spare, grab it in one or two chunks */
-            assert(false);
-        }
-        return val;
+    uint32_t PeekBits(int numBits) {
+        assert(numBits > 0 && numBits <= 32);
+        if (fAccumBits < numBits)
+            Refill();
+        return (uint32_t) (fAccum >> (64 - numBits));
     }
 
+    /* get the next bit; returns 0 or 1 */
+    uint8_t GetBit(bool* pWrap) { return (uint8_t) GetBits(1, pWrap); }
+
+    /* get the next 8 bits */
+    uint8_t GetByte(bool* pWrap) { return (uint8_t) GetBits(8, pWrap); }
+
     /*
      * Set the start position.
      */
     void SetStartPosition(int bitOffset) {
         assert(bitOffset >= 0 && bitOffset < fBitCount);
-        fCurrentBit = bitOffset;
-        fBitPosn = 7 - (bitOffset & 0x07);      // mod 8, 0 to MSB
-        fBuf = fBufStart + (bitOffset >> 3);    // div 8
+        fCurrentBit = fLoadBit = bitOffset;
+        fAccum = 0;
+        fAccumBits = 0;
     }
 
     /* used to ensure we consume exactly 100% of bits */
     void ResetBitsConsumed(void) { fBitsConsumed = 0; }
     int GetBitsConsumed(void) const { return fBitsConsumed; }
 
+    /* true if we tried to read past the end of a non-circular buffer */
+    bool GetOverrun(void) const { return fOverrun; }
+
 private:
+    /*
+     * Load bits until the accumulator has more than 56, or we run out.
+     */
+    void Refill(void) {
+        while (fAccumBits <= 56) {
+            if (fLoadBit == fBitCount) {
+                if (!fCircular)
+                    break;
+                fLoadBit = 0;
+            }
+
+            int avail = fBitCount - fLoadBit;
+            const uint8_t* ptr = fBufStart + (fLoadBit >> 3);
+            int bitOff = fLoadBit & 0x07;
+
+            if (bitOff == 0 && fAccumBits == 0 && avail >= 64) {
+                /* byte-aligned with room to spare, grab eight at once */
+                fAccum = (uint64_t) ptr[0] << 56 | (uint64_t) ptr[1] << 48 |
+                         (uint64_t) ptr[2] << 40 | (uint64_t) ptr[3] << 32 |
+                         (uint64_t) ptr[4] << 24 | (uint64_t) ptr[5] << 16 |
+                         (uint64_t) ptr[6] << 8 | (uint64_t) ptr[7];
+                fAccumBits = 64;
+                fLoadBit += 64;
+                break;
+            }
+
+            int take = 8 - bitOff;
+            if (take > avail)
+                take = avail;
+            uint64_t bits = (*ptr >> (8 - bitOff - take)) & ((1 << take) - 1);
+            fAccum |= bits << (64 - fAccumBits - take);
+            fAccumBits += take;
+            fLoadBit += take;
+        }
+    }
+
     const uint8_t*  fBufStart;
-    const uint8_t*  fBuf;
     int             fBitCount;          // #of bits in buffer
-    int             fCurrentBit;        // where we are in buffer
-    int             fBitPosn;           // which bit to access within byte
-    //uint8_t fByte;
+    bool            fCircular;          // wrap around at the end?
+    bool            fOverrun;           // read past end of non-circular buf
+    int             fCurrentBit;        // where the caller is in buffer
+    int             fLoadBit;           // where the accumulator is
+    uint64_t        fAccum;             // upcoming bits, left-aligned
+    int             fAccumBits;         // #of valid bits in fAccum
 
     int             fBitsConsumed;      // sanity check - all bits used?
 };
@@ -338,6 +455,89 @@ private:
 };
 
 
+
+/*
+ * Simple arena for the DiskFS file list.  Memory comes from large chunks
+ * and is handed back all at once when the arena is destroyed.  Freed
+ * pieces are kept on per-size free lists, since a given filesystem only
+ * allocates objects of one or two sizes.
+ */
+class FileArena {
+public:
+    FileArena(void);
+    ~FileArena(void);
+
+    void* Alloc(size_t size);
+    void Free(void* ptr, size_t size);
+
+private:
+    FileArena(const FileArena&);
+    FileArena& operator=(const FileArena&);
+
+    enum { kChunkSize = 64 * 1024, kAlign = 16, kMaxFreeLists = 8 };
+
+    typedef struct FreeList {
+        size_t  size;
+        void*   pHead;
+    } FreeList;
+
+    static size_t RoundUp(size_t size) {
+        return (size + kAlign-1) & ~((size_t) kAlign-1);
+    }
+    uint8_t* NewChunk(size_t size);
+
+    uint8_t*    fpChunkList;        // chunks start with a "next" pointer
+    uint8_t*    fpCur;              // unused part of the current chunk
+    size_t      fAvail;
+    FreeList    fFreeLists[kMaxFreeLists];
+    int         fNumFreeLists;
+};
+
+/*
+ * Recursive mutex.  The thread that holds it may lock it again, which
+ * lets locked entry points call each other.
+ */
+class DIMutex {
+public:
+    DIMutex(void);
+    ~DIMutex(void);
+
+    void Lock(void);
+    void Unlock(void);
+
+private:
+    DIMutex(const DIMutex&);
+    DIMutex& operator=(const DIMutex&);
+
+#ifdef _WIN32
+    CRITICAL_SECTION    fCritSec;
+#else
+    pthread_mutex_t     fMutex;
+#endif
+};
+
+/*
+ * Hold a DIMutex for the lifetime of the object.  A NULL mutex is allowed,
+ * and makes this a no-op.
+ */
+class DIAutoLock {
+public:
+    DIAutoLock(DIMutex* pMutex) : fpMutex(pMutex) {
+        if (fpMutex != NULL)
+            fpMutex->Lock();
+    }
+    ~DIAutoLock(void) {
+        if (fpMutex != NULL)
+            fpMutex->Unlock();
+    }
+
+private:
+    DIAutoLock(const DIAutoLock&);
+    DIAutoLock& operator=(const DIAutoLock&);
+
+    DIMutex*    fpMutex;
+};
+
 }   // namespace DiskImgLib
 
 /*
@@ -338,7 +338,7 @@ void DiskFSFAT::CreateFakeFile(void)
         capacity,
         (double) capacity / 2048.0);
 
-    pFile = new A2FileFAT(this);
+    pFile = new (this) A2FileFAT(this);
     pFile->SetFakeFile(buf, strlen(buf));
     strcpy(pFile->fFileName, "(not supported)");
 
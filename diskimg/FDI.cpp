@@ -47,112 +47,260 @@ DIError WrapperFDI::PackDisk(GenericFD* pSrcGFD, GenericFD* pWrapperGFD)
  */
 
 /*
- * Unpack an FDI-encoded disk image from "pGFD" to a new memory buffer
- * created in "*ppNewGFD".  The output is a collection of variable-length
- * nibble tracks.
+ * Shared state for the DecodeTracks threads.
+ */
+struct WrapperFDI::UnpackState {
+    WrapperFDI*     pWrapper;
+    UnpackTrack*    tracks;
+    int             numTracks;
+    int             numHeads;
+    DIMutex         lock;
+    int             nextTrack;  // next track to hand out
+};
+
+/*
+ * Thread body for DecodeTracks.  Tracks are handed out in order; each one
+ * is decoded into its own buffer, so the threads share nothing else.
  *
- * "pNewGFD" will need to hold (kTrackAllocSize * numCyls * numHeads)
- * bytes of data.
+ * Blank tracks, and tracks the decoder chokes on, are filled with 0xff.
  *
- * Fills in "fNibbleTrackInfo".
+ * For 3.5" disks we go on to decode the sectors, leaving the bad sector
+ * mask in the track for the caller to merge into the bad block map.
  */
-DIError WrapperFDI::UnpackDisk525(GenericFD* pGFD, GenericFD* pNewGFD,
-    int numCyls, int numHeads)
+/*static*/ void WrapperFDI::DecodeTrackThread(void* vState, int /*threadIdx*/)
+{
+    UnpackState* pState = (UnpackState*) vState;
+
+    while (true) {
+        int trk;
+
+        pState->lock.Lock();
+        trk = pState->nextTrack++;
+        pState->lock.Unlock();
+        if (trk >= pState->numTracks)
+            break;
+
+        UnpackTrack* pTrack = &pState->tracks[trk];
+        if (pTrack->type != 0x00) {
+            /* low-level pulse-index */
+            pTrack->nibbleLen = kNibbleBufLen;
+            pTrack->decoded = pState->pWrapper->DecodePulseTrack(
+                        pTrack->inputBuf, pTrack->inputLen, pTrack->bitRate,
+                        pTrack->nibbleBuf, &pTrack->nibbleLen);
+        }
+        if (!pTrack->decoded) {
+            /* blank, or something failed in the decoder; fake it */
+            memset(pTrack->nibbleBuf, 0xff, kNibbleBufLen);
+            pTrack->nibbleLen = kTrackLenNb2525;
+        }
+
+        if (pTrack->blockBuf != NULL && pTrack->nibbleLen <= kNibbleBufLen) {
+            pTrack->blockErr = DiskImg::DecodeNibbleTrack35(
+                        pTrack->nibbleBuf, pTrack->nibbleLen, pTrack->blockBuf,
+                        trk / pState->numHeads, trk % pState->numHeads,
+                        &pTrack->badSectors);
+        }
+    }
+}
+
+/*
+ * Read the pulse data for every track from "pGFD", then convert all of
+ * them to nibbles.  If "is35" is set, the nibbles are further decoded to
+ * blocks.  The decoding is done on up to fNumThreads threads (the image's
+ * probe thread count); the results don't depend on how many are used.
+ *
+ * On success, "*ppTracks" holds an array of (numCyls * numHeads) entries,
+ * with the input, nibble, and block buffers in "*ppTrackData".  The caller
+ * must delete[] both.
+ */
+DIError WrapperFDI::DecodeTracks(GenericFD* pGFD, int numCyls, int numHeads,
+    bool is35, UnpackTrack** ppTracks, uint8_t** ppTrackData)
 {
     DIError dierr = kDIErrNone;
-    uint8_t nibbleBuf[kNibbleBufLen];
-    uint8_t* inputBuf = NULL;
-    bool goodTracks[kMaxNibbleTracks525];
-    int inputBufLen = -1;
-    int badTracks = 0;
+    UnpackState state;
+    UnpackTrack* tracks = NULL;
+    uint8_t* trackData = NULL;
+    uint8_t* inputBuf;
+    uint8_t* nibbleBufs;
+    uint8_t* blockBufs;
+    const int numTracks = numCyls * numHeads;
+    long inputLen = 0;
+    long blockLen = 0;
+    int numThreads;
     int trk, type, length256;
-    long nibbleLen;
-    bool result;
 
-    assert(numHeads == 1);
-    memset(goodTracks, false, sizeof(goodTracks));
-
-    dierr = pGFD->Seek(kMinHeaderLen, kSeekSet);
-    if (dierr != kDIErrNone) {
-        LOGI("FDI: track seek failed (offset=%d)", kMinHeaderLen);
+    tracks = new UnpackTrack[numTracks];
+    if (tracks == NULL) {
+        dierr = kDIErrMalloc;
         goto bail;
     }
 
-    for (trk = 0; trk < numCyls * numHeads; trk++) {
+    /*
+     * Pull the track types and lengths out of the header, and make sure
+     * we know what to do with all of them before we start.
+     */
+    for (trk = 0; trk < numTracks; trk++) {
         GetTrackInfo(trk, &type, &length256);
         LOGI("%2d.%d: t=0x%02x l=%d (%d)", trk / numHeads, trk % numHeads,
             type, length256, length256 * 256);
 
-        /* if we have data to read, read it */
-        if (length256 > 0) {
-            if (length256  * 256 > inputBufLen) {
-                /* allocate or increase the size of the input buffer */
-                delete[] inputBuf;
-                inputBufLen = length256 * 256;
-                inputBuf = new uint8_t[inputBufLen];
-                if (inputBuf == NULL) {
-                    dierr = kDIErrMalloc;
-                    goto bail;
-                }
-            }
-
-            dierr = pGFD->Read(inputBuf, length256 * 256);
-            if (dierr != kDIErrNone)
-                goto bail;
-        } else {
-            assert(type == 0x00);
-        }
-
-        /* figure out what we want to do with this track */
         switch (type) {
         case 0x00:
             /* blank track */
-            badTracks++;
-            memset(nibbleBuf, 0xff, sizeof(nibbleBuf));
-            nibbleLen = kTrackLenNb2525;
             break;
         case 0x80:
         case 0x90:
         case 0xa0:
         case 0xb0:
             /* low-level pulse-index */
-            nibbleLen = kNibbleBufLen;
-            result = DecodePulseTrack(inputBuf, length256*256, kBitRate525,
-                        nibbleBuf, &nibbleLen);
-            if (!result) {
-                /* something failed in the decoder; fake it */
-                badTracks++;
-                memset(nibbleBuf, 0xff, sizeof(nibbleBuf));
-                nibbleLen = kTrackLenNb2525;
-            } else {
-                goodTracks[trk] = true;
-            }
-            if (nibbleLen > kTrackAllocSize) {
-                LOGI(" FDI: decoded %ld nibbles, buffer is only %d",
-                    nibbleLen, kTrackAllocSize);
-                dierr = kDIErrBadRawData;
-                goto bail;
-            }
             break;
         default:
             LOGI("FDI: unexpected track type 0x%04x", type);
             dierr = kDIErrUnsupportedImageFeature;
             goto bail;
         }
+        if (length256 == 0)
+            assert(type == 0x00);
+
+        tracks[trk].type = type;
+        tracks[trk].inputBuf = NULL;
+        tracks[trk].inputLen = length256 * 256;
+        if (is35)
+            tracks[trk].bitRate = BitRate35(trk / numHeads);
+        else
+            tracks[trk].bitRate = kBitRate525;
+        tracks[trk].nibbleBuf = NULL;
+        tracks[trk].nibbleLen = 0;
+        tracks[trk].decoded = false;
+        tracks[trk].blockBuf = NULL;
+        tracks[trk].badSectors = 0;
+        tracks[trk].blockErr = kDIErrNone;
+        inputLen += tracks[trk].inputLen;
+    }
+
+    /*
+     * The track data is stored contiguously after the header, so grab all
+     * of it with one read.
+     */
+    if (is35)
+        blockLen = kMaxSectors35 * kBlockSize;
+    trackData = new uint8_t[inputLen + numTracks * (kNibbleBufLen + blockLen)];
+    if (trackData == NULL) {
+        dierr = kDIErrMalloc;
+        goto bail;
+    }
+    inputBuf = trackData;
+    nibbleBufs = trackData + inputLen;
+    blockBufs = nibbleBufs + numTracks * kNibbleBufLen;
+    if (is35) {
+        /* sectors we can't find are left zeroed */
+        memset(blockBufs, 0, numTracks * blockLen);
+    }
+
+    dierr = pGFD->Seek(kMinHeaderLen, kSeekSet);
+    if (dierr != kDIErrNone) {
+        LOGI("FDI: track seek failed (offset=%d)", kMinHeaderLen);
+        goto bail;
+    }
+    if (inputLen > 0) {
+        dierr = pGFD->Read(inputBuf, inputLen);
+        if (dierr != kDIErrNone)
+            goto bail;
+    }
+
+    for (trk = 0; trk < numTracks; trk++) {
+        if (tracks[trk].type != 0x00)
+            tracks[trk].inputBuf = inputBuf;
+        inputBuf += tracks[trk].inputLen;
+        tracks[trk].nibbleBuf = nibbleBufs + trk * kNibbleBufLen;
+        if (is35)
+            tracks[trk].blockBuf = blockBufs + trk * blockLen;
+    }
+
+    /*
+     * Decode the tracks.
+     */
+    state.pWrapper = this;
+    state.tracks = tracks;
+    state.numTracks = numTracks;
+    state.numHeads = numHeads;
+    state.nextTrack = 0;
+
+    numThreads = fNumThreads;
+    if (numThreads < 1)
+        numThreads = 1;
+    if (numThreads > numTracks)
+        numThreads = numTracks;
+    if (numThreads > 1)
+        LOGD(" FDI: decoding %d tracks on %d threads", numTracks, numThreads);
+    RunThreads(numThreads, DecodeTrackThread, &state);
+
+    *ppTracks = tracks;
+    *ppTrackData = trackData;
+    tracks = NULL;
+    trackData = NULL;
+
+bail:
+    delete[] tracks;
+    delete[] trackData;
+    return dierr;
+}
+
+/*
+ * Unpack an FDI-encoded disk image from "pGFD" to a new memory buffer
+ * created in "*ppNewGFD".  The output is a collection of variable-length
+ * nibble tracks.
+ *
+ * "pNewGFD" will need to hold (kTrackAllocSize * numCyls * numHeads)
+ * bytes of data.
+ *
+ * Fills in "fNibbleTrackInfo".
+ */
+DIError WrapperFDI::UnpackDisk525(GenericFD* pGFD, GenericFD* pNewGFD,
+    int numCyls, int numHeads)
+{
+    DIError dierr = kDIErrNone;
+    uint8_t nibbleBuf[kNibbleBufLen];
+    UnpackTrack* tracks = NULL;
+    uint8_t* trackData = NULL;
+    bool goodTracks[kMaxNibbleTracks525];
+    int badTracks = 0;
+    int trk;
+    long nibbleLen;
+
+    assert(numHeads == 1);
+    memset(goodTracks, false, sizeof(goodTracks));
+
+    dierr = DecodeTracks(pGFD, numCyls, numHeads, false, &tracks, &trackData);
+    if (dierr != kDIErrNone)
+        goto bail;
+
+    for (trk = 0; trk < numCyls * numHeads; trk++) {
+        UnpackTrack* pTrack = &tracks[trk];
+
+        nibbleLen = pTrack->nibbleLen;
+        if (!pTrack->decoded) {
+            badTracks++;
+        } else {
+            goodTracks[trk] = true;
+        }
+        if (nibbleLen > kTrackAllocSize) {
+            LOGI(" FDI: decoded %ld nibbles, buffer is only %d",
+                nibbleLen, kTrackAllocSize);
+            dierr = kDIErrBadRawData;
+            goto bail;
+        }
 
         fNibbleTrackInfo.offset[trk] = trk * kTrackAllocSize;
         fNibbleTrackInfo.length[trk] = nibbleLen;
-        FixBadNibbles(nibbleBuf, nibbleLen);
+        FixBadNibbles(pTrack->nibbleBuf, nibbleLen);
         dierr = pNewGFD->Seek(fNibbleTrackInfo.offset[trk], kSeekSet);
         if (dierr != kDIErrNone)
             goto bail;
-        dierr = pNewGFD->Write(nibbleBuf, nibbleLen);
+        dierr = pNewGFD->Write(pTrack->nibbleBuf, nibbleLen);
         if (dierr != kDIErrNone)
             goto bail;
         LOGI("  FDI: track %d: wrote %ld nibbles", trk, nibbleLen);
-
-        //offset += 256 * length256;
-        //break;        // DEBUG DEBUG
     }
 
     LOGI(" FDI: %d of %d tracks bad or blank",
@@ -198,7 +346,7 @@ DIError WrapperFDI::UnpackDisk525(GenericFD* pGFD, GenericFD* pNewGFD,
         dierr = pNewGFD->Seek(fNibbleTrackInfo.offset[trk], kSeekSet);
         if (dierr != kDIErrNone)
             goto bail;
-        dierr = pNewGFD->Write(nibbleBuf, nibbleLen);
+        dierr = pNewGFD->Write(nibbleBuf, kTrackLenNb2525);
         if (dierr != kDIErrNone)
             goto bail;
     }
@@ -207,7 +355,8 @@ DIError WrapperFDI::UnpackDisk525(GenericFD* pGFD, GenericFD* pNewGFD,
     fNibbleTrackInfo.numTracks = trk;
 
 bail:
-    delete[] inputBuf;
+    delete[] tracks;
+    delete[] trackData;
     return dierr;
 }
 
@@ -225,104 +374,39 @@ DIError WrapperFDI::UnpackDisk35(GenericFD* pGFD, GenericFD* pNewGFD, int numCyl
     int numHeads, LinearBitmap* pBadBlockMap)
 {
     DIError dierr = kDIErrNone;
-    uint8_t nibbleBuf[kNibbleBufLen];
-    uint8_t* inputBuf = NULL;
-    uint8_t outputBuf[kMaxSectors35 * kBlockSize];    // 6KB
-    int inputBufLen = -1;
-    int badTracks = 0;
-    int trk, type, length256;
+    UnpackTrack* tracks = NULL;
+    uint8_t* trackData = NULL;
+    int trk;
     long nibbleLen;
-    bool result;
 
     assert(numHeads == 2);
 
-    dierr = pGFD->Seek(kMinHeaderLen, kSeekSet);
-    if (dierr != kDIErrNone) {
-        LOGI("FDI: track seek failed (offset=%d)", kMinHeaderLen);
+    dierr = DecodeTracks(pGFD, numCyls, numHeads, true, &tracks, &trackData);
+    if (dierr != kDIErrNone)
         goto bail;
-    }
 
     pNewGFD->Rewind();
 
     for (trk = 0; trk < numCyls * numHeads; trk++) {
-        GetTrackInfo(trk, &type, &length256);
-        LOGI("%2d.%d: t=0x%02x l=%d (%d)", trk / numHeads, trk % numHeads,
-            type, length256, length256 * 256);
+        UnpackTrack* pTrack = &tracks[trk];
 
-        /* if we have data to read, read it */
-        if (length256 > 0) {
-            if (length256  * 256 > inputBufLen) {
-                /* allocate or increase the size of the input buffer */
-                delete[] inputBuf;
-                inputBufLen = length256 * 256;
-                inputBuf = new uint8_t[inputBufLen];
-                if (inputBuf == NULL) {
-                    dierr = kDIErrMalloc;
-                    goto bail;
-                }
-            }
-
-            dierr = pGFD->Read(inputBuf, length256 * 256);
-            if (dierr != kDIErrNone)
-                goto bail;
-        } else {
-            assert(type == 0x00);
-        }
-
-        /* figure out what we want to do with this track */
-        switch (type) {
-        case 0x00:
-            /* blank track */
-            badTracks++;
-            memset(nibbleBuf, 0xff, sizeof(nibbleBuf));
-            nibbleLen = kTrackLenNb2525;
-            break;
-        case 0x80:
-        case 0x90:
-        case 0xa0:
-        case 0xb0:
-            /* low-level pulse-index */
-            nibbleLen = kNibbleBufLen;
-            result = DecodePulseTrack(inputBuf, length256*256,
-                        BitRate35(trk/numHeads), nibbleBuf, &nibbleLen);
-            if (!result) {
-                /* something failed in the decoder; fake it */
-                badTracks++;
-                memset(nibbleBuf, 0xff, sizeof(nibbleBuf));
-                nibbleLen = kTrackLenNb2525;
-            } 
-            if (nibbleLen > kNibbleBufLen) {
-                LOGI(" FDI: decoded %ld nibbles, buffer is only %d",
-                    nibbleLen, kTrackAllocSize);
-                dierr = kDIErrBadRawData;
-                goto bail;
-            }
-            break;
-        default:
-            LOGI("FDI: unexpected track type 0x%04x", type);
-            dierr = kDIErrUnsupportedImageFeature;
+        nibbleLen = pTrack->nibbleLen;
+        if (nibbleLen > kNibbleBufLen) {
+            LOGI(" FDI: decoded %ld nibbles, buffer is only %d",
+                nibbleLen, kTrackAllocSize);
+            dierr = kDIErrBadRawData;
             goto bail;
         }
 
         LOGI(" FDI: track %d got %ld nibbles", trk, nibbleLen);
 
-        /*
-        fNibbleTrackInfo.offset[trk] = trk * kTrackAllocSize;
-        fNibbleTrackInfo.length[trk] = nibbleLen;
-        dierr = pNewGFD->Seek(fNibbleTrackInfo.offset[trk], kSeekSet);
-        if (dierr != kDIErrNone)
-            goto bail;
-        dierr = pNewGFD->Write(nibbleBuf, nibbleLen);
-        if (dierr != kDIErrNone)
-            goto bail;
-        */
-
-        dierr = DiskImg::UnpackNibbleTrack35(nibbleBuf, nibbleLen, outputBuf,
-                    trk / numHeads, trk % numHeads, pBadBlockMap);
+        dierr = pTrack->blockErr;
         if (dierr != kDIErrNone)
             goto bail;
+        DiskImg::MarkBadSectors35(trk / numHeads, trk % numHeads,
+            pTrack->badSectors, pBadBlockMap);
 
-        dierr = pNewGFD->Write(outputBuf,
+        dierr = pNewGFD->Write(pTrack->blockBuf,
                     kBlockSize * DiskImg::SectorsPerTrack35(trk / numHeads));
         if (dierr != kDIErrNone) {
             LOGI("FDI: failed writing disk blocks (%d * %d)",
@@ -334,7 +418,8 @@ DIError WrapperFDI::UnpackDisk35(GenericFD* pGFD, GenericFD* pNewGFD, int numCyl
     //fNibbleTrackInfo.numTracks = numCyls * numHeads;
 
 bail:
-    delete[] inputBuf;
+    delete[] tracks;
+    delete[] trackData;
     return dierr;
 }
 
@@ -1056,26 +1141,30 @@ private:
 #define MY_RANDOM
 #ifdef MY_RANDOM
 /* replace rand() with my function */
-#define rand() MyRand()
+#define rand() MyRand(&randState)
 
 /*
  * My psuedo-random number generator, which is even less random than
  * rand().  It is, however, consistent across all platforms, and the
  * value for RAND_MAX is small enough to avoid some integer overflow
  * problems that the code has with (2^31-1) implementations.
+ *
+ * The caller holds the state in "*pState", so tracks can be decoded on
+ * several threads at once without affecting each other's results.
  */
 #undef RAND_MAX
 #define RAND_MAX    32767
-int WrapperFDI::MyRand(void)
+/*static*/ int WrapperFDI::MyRand(int* pState)
 {
     const int kNumStates = 31;
     const int kQuantum = RAND_MAX / (kNumStates+1);
-    static int state = 0;
+    int state = *pState;
     int retVal;
 
     state++;
     if (state == kNumStates)
         state = 0;
+    *pState = state;
 
     retVal = (kQuantum * state) + (kQuantum / 2);
     assert(retVal >= 0 && retVal <= RAND_MAX);
@@ -1109,8 +1198,16 @@ bool WrapperFDI::ConvertPulsesToBits(const uint32_t* avgStream,
     int i;
     //int debugCounter = 0;
 
-    /* sample code doesn't do this, but I want consistent results */
+    /*
+     * Sample code doesn't do this, but I want consistent results.  Every
+     * track starts from the same state, so the output doesn't depend on
+     * which tracks (or images) were decoded before this one.
+     */
+#ifdef MY_RANDOM
+    int randState = 0;
+#else
     srand(0);
+#endif
 
     /*
      * "detects a long-enough stable pulse coming just after another
@@ -1402,9 +1499,11 @@ bool WrapperFDI::ConvertPulsesToBits(const uint32_t* avgStream,
         if (step == 1) {
             int j;
 
-            for (j = realSize; j > 1; j--)
-                bitOutput.WriteBit(0);
-            bitOutput.WriteBit(1);
+            /* (realSize-1) zeroes followed by a one */
+            assert(realSize > 0);
+            for (j = realSize; j > 32; j -= 32)
+                bitOutput.WriteBits(0, 32);
+            bitOutput.WriteBits(1, j);
         }
 
         /*
@@ -1432,6 +1531,25 @@ bail:
 }
 
 
+/*
+ * Get the next byte from a stream of GCR bits, skipping up to two leading
+ * zeroes the way the disk controller's shift register does.  If there are
+ * more than two, the high bit of the result will be clear.
+ */
+static uint8_t GetNibble(BitInputBuffer* pBuffer, bool* pWrap)
+{
+    uint32_t peek = pBuffer->PeekBits(10);
+    int zeroes;
+
+    if ((peek & 0x200) != 0)
+        zeroes = 0;
+    else if ((peek & 0x100) != 0)
+        zeroes = 1;
+    else
+        zeroes = 2;
+    return (uint8_t) pBuffer->GetBits(8 + zeroes, pWrap);
+}
+
 /*
  * Convert a stream of GCR bits into nibbles.
  *
@@ -1467,11 +1585,7 @@ bool WrapperFDI::ConvertBitsToNibbles(const uint8_t* bitBuffer, int bitCount,
      */
     wrap = false;
     while (!wrap) {
-        val = inputBuffer.GetByte(&wrap);
-        if ((val & 0x80) == 0)
-            val = (val << 1) | inputBuffer.GetBit(&wrap);
-        if ((val & 0x80) == 0)
-            val = (val << 1) | inputBuffer.GetBit(&wrap);
+        val = GetNibble(&inputBuffer, &wrap);
         if ((val & 0x80) == 0) {
             // not allowed by GCR encoding, probably garbage between sectors
             LOGI(" FDI: WARNING: more than 2 consecutive zeroes (sync)");
@@ -1484,11 +1598,7 @@ bool WrapperFDI::ConvertBitsToNibbles(const uint8_t* bitBuffer, int bitCount,
     inputBuffer.ResetBitsConsumed();
     wrap = false;
     while (true) {
-        val = inputBuffer.GetByte(&wrap);
-        if ((val & 0x80) == 0)
-            val = (val << 1) | inputBuffer.GetBit(&wrap);
-        if ((val & 0x80) == 0)
-            val = (val << 1) | inputBuffer.GetBit(&wrap);
+        val = GetNibble(&inputBuffer, &wrap);
         if ((val & 0x80) == 0) {
             LOGW(" FDI: WARNING: more than 2 consecutive zeroes (read)");
         }
@@ -0,0 +1,445 @@
+/*
+ * CiderPress
+ * Copyright (C) 2009 by CiderPress authors.  All Rights Reserved.
+ * See the file LICENSE for distribution terms.
+ */
+/*
+ * Persistent cache of format-detection results.  See FormatCache in
+ * DiskImg.h for the overview; the DiskImg side (computing the key,
+ * applying a hit) is in DiskImg.cpp.
+ *
+ * The file is a 20-byte header followed by fixed-size 52-byte records, all
+ * little-endian:
+ *
+ *  +00 4 magic "DIfc"
+ *  +04 2 file version (kFileVersion)
+ *  +06 2 record length (kRecordLen)
+ *  +08 2 library major version
+ *  +0a 2 library minor version
+ *  +0c 2 library bug version
+ *  +0e 2 (reserved)
+ *  +10 4 number of records
+ *
+ * If anything in the header doesn't match, the file is ignored and will
+ * be replaced by Close.  In memory the entries live in an open-addressed
+ * hash table with linear probing.
+ *
+ * Each record ends with the time the entry was last stored or hit.  Close
+ * leaves out anything older than the max age, so the file tracks the
+ * images that are actually being opened instead of growing forever.  To
+ * keep a session of pure hits from rewriting the file every time, a hit
+ * only refreshes the time if it's more than kTouchInterval old.
+ */
+#include "StdAfx.h"
+#include "DiskImgPriv.h"
+
+static const char kMagic[4] = { 'D', 'I', 'f', 'c' };
+
+
+/*
+ * Initialize an empty cache.
+ */
+FormatCache::FormatCache(void)
+{
+    fPathName = NULL;
+    fTable = NULL;
+    fTableSize = 0;
+    fNumEntries = 0;
+    fNumHits = fNumMisses = 0;
+    fMaxAge = kDefaultMaxAge;
+    fDirty = false;
+    fpLock = new DIMutex;
+}
+
+FormatCache::~FormatCache(void)
+{
+    if (fDirty) {
+        LOGW("FormatCache destroyed with unsaved entries");
+    }
+    Reset();
+    delete fpLock;
+}
+
+/*
+ * Throw out all entries.
+ */
+void FormatCache::Reset(void)
+{
+    delete[] fTable;
+    fTable = NULL;
+    fTableSize = 0;
+    fNumEntries = 0;
+    delete[] fPathName;
+    fPathName = NULL;
+    fDirty = false;
+}
+
+/*
+ * Load the cache from "pathName".  If the file doesn't exist, or was
+ * written by a different version of the library, we start out empty.
+ */
+DIError FormatCache::Open(const char* pathName)
+{
+    DIError dierr = kDIErrNone;
+    FILE* fp = NULL;
+
+    DIAutoLock lock(fpLock);
+
+    if (fPathName != NULL) {
+        LOGW("FormatCache already open on '%s'", fPathName);
+        return kDIErrAlreadyOpen;
+    }
+
+    fTableSize = kMinTableSize;
+    fTable = new Entry[fTableSize];
+    memset(fTable, 0, sizeof(Entry) * fTableSize);
+    fPathName = StrcpyNew(pathName);
+
+    fp = fopen(pathName, "rb");
+    if (fp == NULL) {
+        if (errno == ENOENT) {
+            LOGI("FormatCache: '%s' not found, starting empty", pathName);
+        } else {
+            dierr = ErrnoOrGeneric();
+            LOGW("FormatCache: unable to open '%s': %s", pathName,
+                DIStrError(dierr));
+            Reset();
+        }
+        goto bail;
+    }
+
+    dierr = Load(fp);
+    if (dierr != kDIErrNone) {
+        /* bad or stale file; start over, and replace it when we close */
+        LOGI("FormatCache: discarding contents of '%s'", pathName);
+        memset(fTable, 0, sizeof(Entry) * fTableSize);
+        fNumEntries = 0;
+        fDirty = true;
+        dierr = kDIErrNone;
+    }
+
+    LOGI("FormatCache: loaded %ld entries from '%s'", fNumEntries, pathName);
+
+bail:
+    if (fp != NULL)
+        fclose(fp);
+    return dierr;
+}
+
+/*
+ * Read the header and records from "fp".
+ */
+DIError FormatCache::Load(FILE* fp)
+{
+    uint8_t hdr[kHeaderLen];
+    uint8_t rec[kRecordLen];
+    int32_t major, minor, bug;
+    uint32_t count;
+
+    if (fread(hdr, sizeof(hdr), 1, fp) != 1)
+        return kDIErrBadFileFormat;
+    if (memcmp(hdr, kMagic, sizeof(kMagic)) != 0 ||
+        GetShortLE(hdr + 0x04) != kFileVersion ||
+        GetShortLE(hdr + 0x06) != kRecordLen)
+    {
+        LOGI("FormatCache: not a cache file, or wrong file version");
+        return kDIErrBadFileFormat;
+    }
+
+    Global::GetVersion(&major, &minor, &bug);
+    if (GetShortLE(hdr + 0x08) != major || GetShortLE(hdr + 0x0a) != minor ||
+        GetShortLE(hdr + 0x0c) != bug)
+    {
+        LOGI("FormatCache: written by library v%d.%d.%d",
+            GetShortLE(hdr + 0x08), GetShortLE(hdr + 0x0a),
+            GetShortLE(hdr + 0x0c));
+        return kDIErrBadFileFormat;
+    }
+    count = GetLongLE(hdr + 0x10);
+
+    for (uint32_t i = 0; i < count; i++) {
+        Entry entry;
+
+        if (fread(rec, sizeof(rec), 1, fp) != 1) {
+            LOGW("FormatCache: file truncated at record %u of %u", i, count);
+            return kDIErrBadFileFormat;
+        }
+        entry.length = GetLongLE(rec + 0x00) |
+                        (uint64_t) GetLongLE(rec + 0x04) << 32;
+        entry.modWhen = (int64_t) (GetLongLE(rec + 0x08) |
+                        (uint64_t) GetLongLE(rec + 0x0c) << 32);
+        entry.headCRC = GetLongLE(rec + 0x10);
+        entry.tailCRC = GetLongLE(rec + 0x14);
+        entry.extCRC = GetLongLE(rec + 0x18);
+        entry.outerFormat = rec[0x1c];
+        entry.fileFormat = rec[0x1d];
+        entry.physical = rec[0x1e];
+        entry.order = rec[0x1f];
+        entry.fsFormat = rec[0x20];
+        entry.nibbleDescrIdx = (int8_t) rec[0x21];
+        entry.dosVolumeNum = (int16_t) GetShortLE(rec + 0x22);
+        entry.numTracks = (int32_t) GetLongLE(rec + 0x24);
+        entry.numSectPerTrack = (int32_t) GetLongLE(rec + 0x28);
+        entry.lastUsed = (int64_t) (GetLongLE(rec + 0x2c) |
+                        (uint64_t) GetLongLE(rec + 0x30) << 32);
+
+        if (entry.length == 0)
+            return kDIErrBadFileFormat;
+        Insert(&entry);
+    }
+
+    return kDIErrNone;
+}
+
+/*
+ * Write the entries out, if they've changed or some have expired, and
+ * discard the table.
+ *
+ * We write to a temp file and rename it over the original, so a crash
+ * or a full disk can't leave a half-written cache behind.
+ */
+DIError FormatCache::Close(void)
+{
+    DIError dierr = kDIErrNone;
+    char* tmpPath = NULL;
+    FILE* fp = NULL;
+    int64_t cutoff;
+    long numExpired;
+
+    DIAutoLock lock(fpLock);
+
+    if (fPathName == NULL)
+        return kDIErrNotReady;
+
+    /* a max age of zero or less keeps everything */
+    if (fMaxAge > 0)
+        cutoff = (int64_t) time(NULL) - (int64_t) fMaxAge * 24*60*60;
+    else
+        cutoff = 0;
+    numExpired = CountExpired(cutoff);
+
+    LOGI("FormatCache: %ld hits, %ld misses, %ld entries, %ld expired",
+        fNumHits, fNumMisses, fNumEntries, numExpired);
+    if (!fDirty && numExpired == 0)
+        goto bail;
+
+    tmpPath = new char[strlen(fPathName) + 5];
+    strcpy(tmpPath, fPathName);
+    strcat(tmpPath, ".tmp");
+
+    fp = fopen(tmpPath, "wb");
+    if (fp == NULL) {
+        dierr = ErrnoOrGeneric();
+        LOGW("FormatCache: unable to create '%s': %s", tmpPath,
+            DIStrError(dierr));
+        goto bail;
+    }
+    dierr = Save(fp, cutoff, fNumEntries - numExpired);
+    if (fclose(fp) != 0 && dierr == kDIErrNone)
+        dierr = kDIErrWriteFailed;
+    fp = NULL;
+    if (dierr != kDIErrNone) {
+        LOGW("FormatCache: failed writing '%s'", tmpPath);
+        (void) remove(tmpPath);
+        goto bail;
+    }
+
+#ifdef _WIN32
+    /* rename() won't replace an existing file */
+    (void) remove(fPathName);
+#endif
+    if (rename(tmpPath, fPathName) != 0) {
+        dierr = ErrnoOrGeneric();
+        LOGW("FormatCache: unable to rename '%s' to '%s': %s", tmpPath,
+            fPathName, DIStrError(dierr));
+        (void) remove(tmpPath);
+        goto bail;
+    }
+    LOGI("FormatCache: wrote %ld entries to '%s'", fNumEntries - numExpired,
+        fPathName);
+
+bail:
+    delete[] tmpPath;
+    Reset();
+    return dierr;
+}
+
+/*
+ * Count the entries that were last used before "cutoff".
+ */
+long FormatCache::CountExpired(int64_t cutoff) const
+{
+    long count = 0;
+
+    for (long i = 0; i < fTableSize; i++) {
+        if (fTable[i].length != 0 && fTable[i].lastUsed < cutoff)
+            count++;
+    }
+    return count;
+}
+
+/*
+ * Write the header and the "numKeep" entries that were used at or after
+ * "cutoff" to "fp".
+ */
+DIError FormatCache::Save(FILE* fp, int64_t cutoff, long numKeep) const
+{
+    uint8_t hdr[kHeaderLen];
+    uint8_t rec[kRecordLen];
+    int32_t major, minor, bug;
+
+    Global::GetVersion(&major, &minor, &bug);
+    memset(hdr, 0, sizeof(hdr));
+    memcpy(hdr, kMagic, sizeof(kMagic));
+    PutShortLE(hdr + 0x04, kFileVersion);
+    PutShortLE(hdr + 0x06, kRecordLen);
+    PutShortLE(hdr + 0x08, (uint16_t) major);
+    PutShortLE(hdr + 0x0a, (uint16_t) minor);
+    PutShortLE(hdr + 0x0c, (uint16_t) bug);
+    PutLongLE(hdr + 0x10, numKeep);
+    if (fwrite(hdr, sizeof(hdr), 1, fp) != 1)
+        return kDIErrWriteFailed;
+
+    for (long i = 0; i < fTableSize; i++) {
+        const Entry* pEntry = &fTable[i];
+
+        if (pEntry->length == 0 || pEntry->lastUsed < cutoff)
+            continue;
+        PutLongLE(rec + 0x00, (uint32_t) pEntry->length);
+        PutLongLE(rec + 0x04, (uint32_t) (pEntry->length >> 32));
+        PutLongLE(rec + 0x08, (uint32_t) pEntry->modWhen);
+        PutLongLE(rec + 0x0c, (uint32_t) ((uint64_t) pEntry->modWhen >> 32));
+        PutLongLE(rec + 0x10, pEntry->headCRC);
+        PutLongLE(rec + 0x14, pEntry->tailCRC);
+        PutLongLE(rec + 0x18, pEntry->extCRC);
+        rec[0x1c] = pEntry->outerFormat;
+        rec[0x1d] = pEntry->fileFormat;
+        rec[0x1e] = pEntry->physical;
+        rec[0x1f] = pEntry->order;
+        rec[0x20] = pEntry->fsFormat;
+        rec[0x21] = (uint8_t) pEntry->nibbleDescrIdx;
+        PutShortLE(rec + 0x22, (uint16_t) pEntry->dosVolumeNum);
+        PutLongLE(rec + 0x24, (uint32_t) pEntry->numTracks);
+        PutLongLE(rec + 0x28, (uint32_t) pEntry->numSectPerTrack);
+        PutLongLE(rec + 0x2c, (uint32_t) pEntry->lastUsed);
+        PutLongLE(rec + 0x30, (uint32_t) ((uint64_t) pEntry->lastUsed >> 32));
+        if (fwrite(rec, sizeof(rec), 1, fp) != 1)
+            return kDIErrWriteFailed;
+    }
+
+    return kDIErrNone;
+}
+
+/*
+ * Look up the entry whose key matches the key fields in *pEntry.  If we
+ * find it, copy the result fields into *pEntry and return true.  A hit
+ * counts as a use for aging purposes.
+ */
+bool FormatCache::Lookup(Entry* pEntry)
+{
+    DIAutoLock lock(fpLock);
+
+    if (fTable == NULL)
+        return false;
+
+    long idx = FindSlot(pEntry);
+    if (fTable[idx].length == 0) {
+        fNumMisses++;
+        return false;
+    }
+    int64_t now = (int64_t) time(NULL);
+    if (now - fTable[idx].lastUsed > kTouchInterval) {
+        fTable[idx].lastUsed = now;
+        fDirty = true;
+    }
+    *pEntry = fTable[idx];
+    fNumHits++;
+    return true;
+}
+
+/*
+ * Add an entry to the cache, replacing the existing one if the key
+ * matches.  The entry's lastUsed is set to the current time.
+ */
+void FormatCache::Store(const Entry* pEntry)
+{
+    DIAutoLock lock(fpLock);
+
+    if (fTable == NULL || pEntry->length == 0)
+        return;
+    Entry entry = *pEntry;
+    entry.lastUsed = (int64_t) time(NULL);
+    Insert(&entry);
+    fDirty = true;
+}
+
+/*
+ * Hash the key fields.  The CRCs are already well mixed, so we just need
+ * to fold the length and date in.
+ */
+/*static*/ uint32_t FormatCache::HashKey(const Entry* pEntry)
+{
+    uint32_t hash;
+
+    hash = pEntry->headCRC ^ (pEntry->tailCRC * 31) ^ pEntry->extCRC;
+    hash ^= (uint32_t) pEntry->length ^ (uint32_t) (pEntry->length >> 32);
+    hash ^= (uint32_t) pEntry->modWhen * 2654435761U;
+    return hash;
+}
+
+/*static*/ bool FormatCache::KeysMatch(const Entry* pEntry1,
+    const Entry* pEntry2)
+{
+    return pEntry1->length == pEntry2->length &&
+           pEntry1->modWhen == pEntry2->modWhen &&
+           pEntry1->headCRC == pEntry2->headCRC &&
+           pEntry1->tailCRC == pEntry2->tailCRC &&
+           pEntry1->extCRC == pEntry2->extCRC;
+}
+
+/*
+ * Find the slot that holds the entry matching "pEntry", or the empty
+ * slot where it would go.  The table is never full, so this terminates.
+ */
+long FormatCache::FindSlot(const Entry* pEntry) const
+{
+    long mask = fTableSize - 1;
+    long idx = HashKey(pEntry) & mask;
+
+    while (fTable[idx].length != 0 && !KeysMatch(&fTable[idx], pEntry))
+        idx = (idx + 1) & mask;
+    return idx;
+}
+
+/*
+ * Put an entry into the table, growing it if it's more than half full.
+ */
+void FormatCache::Insert(const Entry* pEntry)
+{
+    if ((fNumEntries + 1) * 2 > fTableSize)
+        Grow();
+
+    long idx = FindSlot(pEntry);
+    if (fTable[idx].length == 0)
+        fNumEntries++;
+    fTable[idx] = *pEntry;
+}
+
+/*
+ * Double the size of the table and re-hash everything into it.
+ */
+void FormatCache::Grow(void)
+{
+    Entry* oldTable = fTable;
+    long oldSize = fTableSize;
+
+    fTableSize *= 2;
+    fTable = new Entry[fTableSize];
+    memset(fTable, 0, sizeof(Entry) * fTableSize);
+
+    for (long i = 0; i < oldSize; i++) {
+        if (oldTable[i].length != 0)
+            fTable[FindSlot(&oldTable[i])] = oldTable[i];
+    }
+    delete[] oldTable;
+}
@@ -68,6 +68,33 @@ bail:
     return dierr;
 }
 
+/*
+ * Default positional read, for GFDs that don't have anything better.  This
+ * moves the file position, so it's not safe to use from multiple threads.
+ */
+DIError GenericFD::ReadAt(void* buf, size_t length, di_off_t offset)
+{
+    DIError dierr;
+
+    dierr = Seek(offset, kSeekSet);
+    if (dierr != kDIErrNone)
+        return dierr;
+    return Read(buf, length);
+}
+
+/*
+ * Default positional write.  Same caveats as ReadAt.
+ */
+DIError GenericFD::WriteAt(const void* buf, size_t length, di_off_t offset)
+{
+    DIError dierr;
+
+    dierr = Seek(offset, kSeekSet);
+    if (dierr != kDIErrNone)
+        return dierr;
+    return Write(buf, length);
+}
+
 
 /*
  * ===========================================================================
@@ -120,6 +147,24 @@ DIError GFDFile::Open(const char* filename, bool readOnly)
     return dierr;
 }
 
+DIError GFDFile::OpenTemp(void)
+{
+    if (fFp != NULL)
+        return kDIErrAlreadyOpen;
+
+    delete[] fPathName;
+    fPathName = NULL;
+
+    fFp = tmpfile();
+    if (fFp == NULL) {
+        DIError dierr = ErrnoOrGeneric();
+        LOGW("  GDFile unable to create temp file (err=%d)", dierr);
+        return dierr;
+    }
+    fReadOnly = false;
+    return kDIErrNone;
+}
+
 DIError GFDFile::Read(void* buf, size_t length, size_t* pActual)
 {
     DIError dierr = kDIErrNone;
@@ -127,6 +172,13 @@ DIError GFDFile::Read(void* buf, size_t length, size_t* pActual)
 
     if (fFp == NULL)
         return kDIErrNotReady;
+#ifdef HAVE_PREAD
+    if (fReadStale) {
+        /* a pwrite may have changed data in the stdio buffer; toss it */
+        ::fseeko(fFp, ::ftello(fFp), SEEK_SET);
+        fReadStale = false;
+    }
+#endif
     actual = ::fread(buf, 1, length, fFp);
     if (actual == 0) {
         if (feof(fFp))
@@ -167,6 +219,9 @@ DIError GFDFile::Write(const void* buf, size_t length, size_t* pActual)
             (unsigned long) length, dierr);
         return dierr;
     }
+#ifdef HAVE_PREAD
+    fWritePending = true;
+#endif
     return dierr;
 }
 
@@ -185,6 +240,10 @@ DIError GFDFile::Seek(di_off_t offset, DIWhence whence)
         LOGI("  GDFile Seek failed (err=%d)", dierr);
         return dierr;
     }
+#ifdef HAVE_PREAD
+    /* fseeko flushes pending writes and discards the read buffer */
+    fWritePending = fReadStale = false;
+#endif
     return dierr;
 }
 
@@ -229,12 +288,92 @@ DIError GFDFile::Close(void)
     if (fFp == NULL)
         return kDIErrNotReady;
 
-    LOGI("  GFDFile closing '%s'", fPathName);
+    LOGI("  GFDFile closing '%s'",
+        fPathName != NULL ? fPathName : "(temp)");
     fclose(fFp);
     fFp = NULL;
     return kDIErrNone;
 }
 
+#ifdef HAVE_PREAD
+/*
+ * Positional read with pread(), which doesn't touch the file position and
+ * so can be used from several threads at once.
+ *
+ * This goes around stdio, so if there's buffered write data we need to
+ * push it out first.
+ */
+DIError GFDFile::ReadAt(void* buf, size_t length, di_off_t offset)
+{
+    DIError dierr = kDIErrNone;
+    uint8_t* ptr = (uint8_t*) buf;
+    ssize_t actual;
+
+    if (fFp == NULL)
+        return kDIErrNotReady;
+    if (fWritePending) {
+        ::fflush(fFp);
+        fWritePending = false;
+    }
+
+    while (length != 0) {
+        actual = ::pread(fileno(fFp), ptr, length, offset);
+        if (actual < 0) {
+            if (errno == EINTR)
+                continue;
+            dierr = ErrnoOrGeneric();
+            LOGW("  GDFile ReadAt failed on %lu bytes at %ld (err=%d)",
+                (unsigned long) length, (long) offset, dierr);
+            return dierr;
+        } else if (actual == 0) {
+            LOGW("  GDFile ReadAt hit EOF at %ld", (long) offset);
+            return kDIErrDataUnderrun;
+        }
+        ptr += actual;
+        offset += actual;
+        length -= actual;
+    }
+    return dierr;
+}
+
+/*
+ * Positional write with pwrite().  Anything stdio has buffered for reading
+ * may now be wrong, so we flag it for the next Read.
+ */
+DIError GFDFile::WriteAt(const void* buf, size_t length, di_off_t offset)
+{
+    DIError dierr = kDIErrNone;
+    const uint8_t* ptr = (const uint8_t*) buf;
+    ssize_t actual;
+
+    if (fFp == NULL)
+        return kDIErrNotReady;
+    if (fReadOnly)
+        return kDIErrAccessDenied;
+    if (fWritePending) {
+        ::fflush(fFp);
+        fWritePending = false;
+    }
+
+    while (length != 0) {
+        actual = ::pwrite(fileno(fFp), ptr, length, offset);
+        if (actual < 0) {
+            if (errno == EINTR)
+                continue;
+            dierr = ErrnoOrGeneric();
+            LOGW("  GDFile WriteAt failed on %lu bytes at %ld (err=%d)",
+                (unsigned long) length, (long) offset, dierr);
+            return dierr;
+        }
+        ptr += actual;
+        offset += actual;
+        length -= actual;
+    }
+    fReadStale = true;
+    return dierr;
+}
+#endif /*HAVE_PREAD*/
+
 #else /*HAVE_FSEEKO*/
 
 DIError GFDFile::Open(const char* filename, bool readOnly)
@@ -271,6 +410,37 @@ DIError GFDFile::Open(const char* filename, bool readOnly)
     return dierr;
 }
 
+/*
+ * tmpfile() wants to put the file in the root directory under Windows,
+ * which often isn't writable, so make our own in the temp directory.
+ */
+DIError GFDFile::OpenTemp(void)
+{
+    DIError dierr = kDIErrNone;
+    char* tempName;
+
+    if (fFd >= 0)
+        return kDIErrAlreadyOpen;
+
+    delete[] fPathName;
+    fPathName = NULL;
+
+    tempName = _tempnam(NULL, "cpdi");
+    if (tempName == NULL)
+        return kDIErrInternal;
+    fFd = open(tempName, O_RDWR|O_BINARY|O_CREAT|O_EXCL|_O_TEMPORARY,
+            _S_IREAD|_S_IWRITE);
+    if (fFd < 0) {
+        dierr = ErrnoOrGeneric();
+        LOGW("  GDFile unable to create temp file '%s' (err=%d)",
+            tempName, dierr);
+    } else {
+        fReadOnly = false;
+    }
+    free(tempName);
+    return dierr;
+}
+
 DIError GFDFile::Read(void* buf, size_t length, size_t* pActual)
 {
     DIError dierr;
@@ -390,7 +560,8 @@ DIError GFDFile::Close(void)
     if (fFd < 0)
         return kDIErrNotReady;
 
-    LOGI("  GFDFile closing '%s'", fPathName);
+    LOGI("  GFDFile closing '%s'",
+        fPathName != NULL ? fPathName : "(temp)");
     ::close(fFd);
     fFd = -1;
     return kDIErrNone;
@@ -398,6 +569,210 @@ DIError GFDFile::Close(void)
 #endif /*HAVE_FSEEKO else*/
 
 
+#ifdef HAVE_MMAP
+/*
+ * ===========================================================================
+ *      GFDMmap
+ * ===========================================================================
+ */
+
+/*
+ * Map a file into memory.  Only regular files are mapped; devices and
+ * empty files are rejected, and the caller should fall back on GFDFile.
+ */
+DIError GFDMmap::Open(const char* filename, bool readOnly)
+{
+    DIError dierr = kDIErrNone;
+    struct stat sb;
+    void* base;
+
+    if (fBase != NULL)
+        return kDIErrAlreadyOpen;
+    if (filename == NULL)
+        return kDIErrInvalidArg;
+    if (filename[0] == '\0')
+        return kDIErrInvalidArg;
+
+    delete[] fPathName;
+    fPathName = new char[strlen(filename) +1];
+    strcpy(fPathName, filename);
+
+    fFd = open(filename, readOnly ? O_RDONLY : O_RDWR, 0);
+    if (fFd < 0) {
+        if (errno == EACCES)
+            dierr = kDIErrAccessDenied;
+        else
+            dierr = ErrnoOrGeneric();
+        LOGI("  GFDMmap Open failed opening '%s', ro=%d (err=%d)",
+            filename, readOnly, dierr);
+        return dierr;
+    }
+
+    if (fstat(fFd, &sb) != 0) {
+        dierr = ErrnoOrGeneric();
+        goto bail;
+    }
+    if (!S_ISREG(sb.st_mode) || sb.st_size == 0) {
+        dierr = kDIErrNotSupported;
+        goto bail;
+    }
+    if ((di_off_t) (size_t) sb.st_size != sb.st_size) {
+        dierr = kDIErrTooBig;
+        goto bail;
+    }
+
+    base = mmap(NULL, (size_t) sb.st_size,
+                readOnly ? PROT_READ : PROT_READ | PROT_WRITE,
+                MAP_SHARED, fFd, 0);
+    if (base == MAP_FAILED) {
+        dierr = ErrnoOrGeneric();
+        LOGI("  GFDMmap mmap failed on '%s' (err=%d)", filename, dierr);
+        goto bail;
+    }
+
+    fBase = (uint8_t*) base;
+    fLength = sb.st_size;
+    fCurrentOffset = 0;
+    fReadOnly = readOnly;
+
+bail:
+    if (dierr != kDIErrNone) {
+        close(fFd);
+        fFd = -1;
+    }
+    return dierr;
+}
+
+DIError GFDMmap::Read(void* buf, size_t length, size_t* pActual)
+{
+    if (fBase == NULL)
+        return kDIErrNotReady;
+
+    if (fCurrentOffset + (di_off_t) length > fLength) {
+        if (pActual == NULL) {
+            LOGW("  GFDMmap underrun off=%ld len=%lu flen=%ld",
+                (long) fCurrentOffset, (unsigned long) length, (long) fLength);
+            return kDIErrDataUnderrun;
+        }
+        length = (size_t) (fLength - fCurrentOffset);
+        if (length == 0) {
+            *pActual = 0;
+            return kDIErrEOF;
+        }
+    }
+    if (pActual != NULL)
+        *pActual = length;
+
+    memcpy(buf, fBase + fCurrentOffset, length);
+    fCurrentOffset += length;
+    return kDIErrNone;
+}
+
+DIError GFDMmap::Write(const void* buf, size_t length, size_t* pActual)
+{
+    if (fBase == NULL)
+        return kDIErrNotReady;
+    if (fReadOnly)
+        return kDIErrAccessDenied;
+    assert(pActual == NULL);     // not handling this yet
+
+    if (fCurrentOffset + (di_off_t) length > fLength) {
+        LOGI("  GFDMmap overrun off=%ld len=%lu flen=%ld",
+            (long) fCurrentOffset, (unsigned long) length, (long) fLength);
+        return kDIErrDataOverrun;
+    }
+
+    memcpy(fBase + fCurrentOffset, buf, length);
+    fCurrentOffset += length;
+    return kDIErrNone;
+}
+
+DIError GFDMmap::Seek(di_off_t offset, DIWhence whence)
+{
+    di_off_t newOffset;
+
+    if (fBase == NULL)
+        return kDIErrNotReady;
+
+    switch (whence) {
+    case kSeekSet:
+        newOffset = offset;
+        break;
+    case kSeekEnd:
+        newOffset = fLength + offset;
+        break;
+    case kSeekCur:
+        newOffset = fCurrentOffset + offset;
+        break;
+    default:
+        assert(false);
+        return kDIErrInvalidArg;
+    }
+
+    /* can sit at EOF, but not past it; the file can't grow */
+    if (newOffset < 0 || newOffset > fLength)
+        return kDIErrInvalidArg;
+    fCurrentOffset = newOffset;
+    return kDIErrNone;
+}
+
+di_off_t GFDMmap::Tell(void)
+{
+    if (fBase == NULL)
+        return (di_off_t) -1;
+    return fCurrentOffset;
+}
+
+DIError GFDMmap::Close(void)
+{
+    if (fBase == NULL)
+        return kDIErrNotReady;
+
+    LOGI("  GFDMmap closing '%s'", fPathName);
+    munmap(fBase, (size_t) fLength);
+    close(fFd);
+    fBase = NULL;
+    fFd = -1;
+    return kDIErrNone;
+}
+
+DIError GFDMmap::ReadAt(void* buf, size_t length, di_off_t offset)
+{
+    if (fBase == NULL)
+        return kDIErrNotReady;
+    if (offset < 0 || offset + (di_off_t) length > fLength) {
+        LOGW("  GFDMmap underrun off=%ld len=%lu flen=%ld",
+            (long) offset, (unsigned long) length, (long) fLength);
+        return kDIErrDataUnderrun;
+    }
+    memcpy(buf, fBase + offset, length);
+    return kDIErrNone;
+}
+
+DIError GFDMmap::WriteAt(const void* buf, size_t length, di_off_t offset)
+{
+    if (fBase == NULL)
+        return kDIErrNotReady;
+    if (fReadOnly)
+        return kDIErrAccessDenied;
+    if (offset < 0 || offset + (di_off_t) length > fLength) {
+        LOGI("  GFDMmap overrun off=%ld len=%lu flen=%ld",
+            (long) offset, (unsigned long) length, (long) fLength);
+        return kDIErrDataOverrun;
+    }
+    memcpy(fBase + offset, buf, length);
+    return kDIErrNone;
+}
+
+const uint8_t* GFDMmap::GetDirectPtr(di_off_t offset, size_t length) const
+{
+    if (fBase == NULL || offset < 0 || offset + (di_off_t) length > fLength)
+        return NULL;
+    return fBase + offset;
+}
+#endif /*HAVE_MMAP*/
+
+
 /*
  * ===========================================================================
  *      GFDBuffer
@@ -558,6 +933,41 @@ di_off_t GFDBuffer::Tell(void)
     return fCurrentOffset;
 }
 
+DIError GFDBuffer::ReadAt(void* buf, size_t length, di_off_t offset)
+{
+    if (fBuffer == NULL)
+        return kDIErrNotReady;
+    if (offset < 0 || offset + (long)length > fLength) {
+        LOGW("  GFDBuffer underrrun off=%ld len=%lu flen=%ld",
+            (long) offset, (unsigned long) length, (long) fLength);
+        return kDIErrDataUnderrun;
+    }
+    memcpy(buf, (const char*)fBuffer + offset, length);
+    return kDIErrNone;
+}
+
+DIError GFDBuffer::WriteAt(const void* buf, size_t length, di_off_t offset)
+{
+    if (fBuffer == NULL)
+        return kDIErrNotReady;
+    if (offset < 0 || offset > fLength)
+        return kDIErrInvalidArg;
+
+    if (offset + (long)length > fLength) {
+        /* let Write deal with expanding the buffer */
+        di_off_t savedOffset = fCurrentOffset;
+        DIError dierr;
+
+        fCurrentOffset = offset;
+        dierr = Write(buf, length);
+        fCurrentOffset = savedOffset;
+        return dierr;
+    }
+
+    memcpy((char*)fBuffer + offset, buf, length);
+    return kDIErrNone;
+}
+
 DIError GFDBuffer::Close(void)
 {
     if (fBuffer == NULL)
@@ -112,11 +112,33 @@ public:
     // Flush-data call, only needed for physical devices
     virtual DIError Flush(void) { return kDIErrNone; }
 
+    // Positional read/write.  These transfer exactly "length" bytes at
+    // "offset", and neither use nor change the current file position.
+    // The default implementation is a Seek followed by a Read or Write,
+    // so it isn't safe to call from more than one thread.
+    virtual DIError ReadAt(void* buf, size_t length, di_off_t offset);
+    virtual DIError WriteAt(const void* buf, size_t length, di_off_t offset);
+
+    // Returns "true" if ReadAt can be called from several threads at once
+    // (as long as nobody is writing).
+    virtual bool GetIsReadAtThreadSafe(void) const { return false; }
+
     // Utility functions.
     virtual DIError Rewind(void) { return Seek(0, kSeekSet); }
 
     virtual bool GetReadOnly(void) const { return fReadOnly; }
 
+    // Returns "true" if the data already lives in memory, which means
+    // there's no benefit to caching it.
+    virtual bool GetIsMemoryBased(void) const { return false; }
+
+    // Returns a pointer to "length" bytes at "offset" if the data can be
+    // accessed in place, or NULL if it has to be copied out with Read().
+    // The pointer is only good until the next Write() or Close().
+    virtual const uint8_t* GetDirectPtr(di_off_t offset, size_t length) const {
+        return NULL;
+    }
+
     /*
     typedef enum {
         kGFDTypeUnknown = 0,
@@ -144,7 +166,10 @@ protected:
 
 class GFDFile : public GenericFD {
 public:
-#ifdef HAVE_FSEEKO
+#if defined(HAVE_FSEEKO) && defined(HAVE_PREAD)
+    GFDFile(void) : fPathName(NULL), fFp(NULL), fWritePending(false),
+        fReadStale(false) {}
+#elif defined(HAVE_FSEEKO)
     GFDFile(void) : fPathName(NULL), fFp(NULL) {}
 #else
     GFDFile(void) : fPathName(NULL), fFd(-1) {}
@@ -152,6 +177,9 @@ public:
     virtual ~GFDFile(void) { Close(); delete[] fPathName; }
 
     virtual DIError Open(const char* filename, bool readOnly);
+    // Create a read-write temp file that is deleted when closed.  It has
+    // no pathname.
+    virtual DIError OpenTemp(void);
     virtual DIError Read(void* buf, size_t length,
         size_t* pActual = NULL);
     virtual DIError Write(const void* buf, size_t length,
@@ -162,16 +190,67 @@ public:
     virtual DIError Close(void);
     virtual const char* GetPathName(void) const { return fPathName; }
 
+#ifdef HAVE_PREAD
+    virtual DIError ReadAt(void* buf, size_t length, di_off_t offset);
+    virtual DIError WriteAt(const void* buf, size_t length, di_off_t offset);
+    virtual bool GetIsReadAtThreadSafe(void) const { return true; }
+#endif
+
 private:
     char*       fPathName;
 
 #ifdef HAVE_FSEEKO
     FILE*       fFp;
+# ifdef HAVE_PREAD
+    // pread/pwrite go around stdio, so we have to keep the two in sync
+    bool        fWritePending;  // stdio may be holding unwritten data
+    bool        fReadStale;     // stdio read buffer may be out of date
+# endif
 #else
     int         fFd;
 #endif
 };
 
+#ifdef HAVE_MMAP
+/*
+ * Memory-mapped file.  Read-write files use a shared mapping, so changes
+ * go straight to the file.
+ *
+ * The mapping covers the file as it was when it was opened, so the file
+ * can't change size: writes past the end fail, and Truncate isn't
+ * supported.  Don't use this for anything that might need to grow.
+ */
+class GFDMmap : public GenericFD {
+public:
+    GFDMmap(void) : fPathName(NULL), fFd(-1), fBase(NULL), fLength(0),
+        fCurrentOffset(0) {}
+    virtual ~GFDMmap(void) { Close(); delete[] fPathName; }
+
+    virtual DIError Open(const char* filename, bool readOnly);
+    virtual DIError Read(void* buf, size_t length,
+        size_t* pActual = NULL);
+    virtual DIError Write(const void* buf, size_t length,
+        size_t* pActual = NULL);
+    virtual DIError Seek(di_off_t offset, DIWhence whence);
+    virtual di_off_t Tell(void);
+    virtual DIError Truncate(void) { return kDIErrNotSupported; }
+    virtual DIError Close(void);
+    virtual const char* GetPathName(void) const { return fPathName; }
+    virtual bool GetIsMemoryBased(void) const { return true; }
+    virtual const uint8_t* GetDirectPtr(di_off_t offset, size_t length) const;
+    virtual DIError ReadAt(void* buf, size_t length, di_off_t offset);
+    virtual DIError WriteAt(const void* buf, size_t length, di_off_t offset);
+    virtual bool GetIsReadAtThreadSafe(void) const { return true; }
+
+private:
+    char*       fPathName;
+    int         fFd;
+    uint8_t*    fBase;
+    di_off_t    fLength;
+    di_off_t    fCurrentOffset;
+};
+#endif
+
 #ifdef _WIN32
 class GFDWinVolume : public GenericFD {
 public:
@@ -229,6 +308,18 @@ public:
     }
     virtual DIError Close(void);
     virtual const char* GetPathName(void) const { return NULL; }
+    virtual bool GetIsMemoryBased(void) const { return true; }
+    virtual const uint8_t* GetDirectPtr(di_off_t offset, size_t length) const {
+        if (fBuffer == NULL || offset < 0 ||
+            offset + (di_off_t) length > fLength)
+        {
+            return NULL;
+        }
+        return (const uint8_t*) fBuffer + (long) offset;
+    }
+    virtual DIError ReadAt(void* buf, size_t length, di_off_t offset);
+    virtual DIError WriteAt(const void* buf, size_t length, di_off_t offset);
+    virtual bool GetIsReadAtThreadSafe(void) const { return true; }
 
     // Back door; try not to use this.
     void* GetBuffer(void) const { return fBuffer; }
@@ -306,12 +397,277 @@ public:
         return kDIErrNone;
     }
     virtual const char* GetPathName(void) const { return fpGFD->GetPathName(); }
+    virtual bool GetIsMemoryBased(void) const {
+        return fpGFD->GetIsMemoryBased();
+    }
+    virtual const uint8_t* GetDirectPtr(di_off_t offset, size_t length) const {
+        return fpGFD->GetDirectPtr(offset + fOffset, length);
+    }
+    virtual DIError ReadAt(void* buf, size_t length, di_off_t offset) {
+        return fpGFD->ReadAt(buf, length, offset + fOffset);
+    }
+    virtual DIError WriteAt(const void* buf, size_t length, di_off_t offset) {
+        return fpGFD->WriteAt(buf, length, offset + fOffset);
+    }
+    virtual bool GetIsReadAtThreadSafe(void) const {
+        return fpGFD->GetIsReadAtThreadSafe();
+    }
 
 private:
     GenericFD*  fpGFD;
     di_off_t    fOffset;
 };
 
+/*
+ * Size-bounded LRU cache of 256-byte sectors, layered on top of another GFD.
+ *
+ * DiskImg slides this in as fpDataGFD when the image data isn't already in
+ * memory.  Because embedded volumes open a GFDGFD on the parent's
+ * fpDataGFD, sub-volumes go through the same cache, so there are no
+ * coherency issues between parent and child.
+ *
+ * In write-through mode, writes go straight to the underlying GFD and the
+ * cached copies are updated.  In write-back mode, writes are held in the
+ * cache until a dirty sector must be evicted or the cache is flushed; at
+ * that point all dirty sectors are written in offset order, with adjacent
+ * sectors merged.  Flush() also flushes the underlying GFD, which matters
+ * for physical volumes.
+ *
+ * Requests that extend past the end of the data, or that are larger than
+ * the cache can sensibly hold, bypass the cache.  Anything we hold is
+ * copied over the data read from the underlying GFD, so the caller always
+ * sees the most recent data.
+ *
+ * Positional I/O and the flush calls hold an internal lock, so ReadAt
+ * may be used from several threads even if the underlying GFD doesn't
+ * support it.  Read/Write/Seek share a file position and do not.
+ *
+ * This object owns the underlying GFD, and will close and delete it.
+ */
+class GFDBlockCache : public GenericFD {
+public:
+    GFDBlockCache(void) : fpGFD(NULL), fLength(0), fCurrentOffset(0),
+        fWriteBack(false), fNumEntries(0), fNumUsed(0), fNumDirty(0),
+        fHashMask(0), fLruHead(-1), fLruTail(-1), fKeys(NULL),
+        fHashNext(NULL), fLruPrev(NULL), fLruNext(NULL), fDirtyFlags(NULL),
+        fHashHeads(NULL), fData(NULL), fRunBuf(NULL), fSortKeys(NULL),
+        fFlushBuf(NULL), fWriteGen(0)
+        { memset(&fStats, 0, sizeof(fStats)); }
+    virtual ~GFDBlockCache(void) { Close(); }
+
+    // "length" is the length of the data; reads and writes beyond it are
+    // passed straight through.
+    DIError Open(GenericFD* pGFD, di_off_t length, long maxBytes,
+        bool writeBack);
+    virtual DIError Read(void* buf, size_t length,
+        size_t* pActual = NULL);
+    virtual DIError Write(const void* buf, size_t length,
+        size_t* pActual = NULL);
+    virtual DIError Seek(di_off_t offset, DIWhence whence);
+    virtual di_off_t Tell(void) { return fCurrentOffset; }
+    virtual DIError Truncate(void);
+    virtual DIError Close(void);
+    virtual const char* GetPathName(void) const {
+        return fpGFD != NULL ? fpGFD->GetPathName() : NULL;
+    }
+    virtual DIError ReadAt(void* buf, size_t length, di_off_t offset) {
+        return DoRead(buf, length, offset, NULL);
+    }
+    virtual DIError WriteAt(const void* buf, size_t length, di_off_t offset) {
+        return DoWrite(buf, length, offset);
+    }
+    virtual bool GetIsReadAtThreadSafe(void) const { return true; }
+
+    // write dirty sectors, then flush the underlying GFD
+    virtual DIError Flush(void);
+
+    // write dirty sectors to the underlying GFD, sorted and merged
+    DIError FlushDirty(void);
+    // discard everything (dirty sectors are written first)
+    DIError Invalidate(void);
+
+    void GetStats(DiskImg::CacheStats* pStats) const { *pStats = fStats; }
+
+private:
+    enum {
+        kUnitSize = kSectorSize,
+        kUnitShift = 8,
+        kMaxRunUnits = 16,          // max #of units read in one miss run
+    };
+
+    DIError DoRead(void* buf, size_t length, di_off_t offset,
+        size_t* pActual);
+    DIError DoWrite(const void* buf, size_t length, di_off_t offset);
+    int Find(long unit) const;
+    int Lookup(long unit);
+    DIError AllocEntry(long unit, int* pIdx);
+    void RemoveEntry(int idx);
+    void LruUnlink(int idx);
+    void LruPushHead(int idx);
+    void HashUnlink(int idx);
+    DIError WriteRun(const long* units, long numUnits);
+    static int CompareUnits(const void* v1, const void* v2);
+    DIError LoadRun(long firstUnit, long numUnits);
+    DIError ReadRun(long firstUnit, long numUnits, di_off_t dataLen,
+        uint8_t* buf);
+    DIError AddRun(long firstUnit, long numUnits, const uint8_t* buf);
+    DIError ReadDirect(void* buf, di_off_t offset, size_t length,
+        size_t* pActual);
+    void OverlayCached(uint8_t* buf, di_off_t offset, size_t length);
+    void UpdateCached(const uint8_t* buf, di_off_t offset, size_t length);
+    bool IsBypass(di_off_t offset, size_t length) const {
+        return (offset + (di_off_t) length > fLength ||
+                (long) length > (fNumEntries * kUnitSize) / 4);
+    }
+    uint8_t* UnitData(int idx) const { return fData + (long) idx * kUnitSize; }
+
+    GenericFD*  fpGFD;
+    di_off_t    fLength;
+    di_off_t    fCurrentOffset;
+    bool        fWriteBack;
+
+    int         fNumEntries;    // max #of units we can hold
+    int         fNumUsed;       // #of entries handed out so far
+    int         fNumDirty;      // #of entries with fDirtyFlags set
+    int         fHashMask;      // hash table size - 1 (power of 2)
+    int         fLruHead;       // most recently used
+    int         fLruTail;       // least recently used
+
+    long*       fKeys;          // unit number held in each entry
+    int*        fHashNext;
+    int*        fLruPrev;
+    int*        fLruNext;
+    bool*       fDirtyFlags;
+    int*        fHashHeads;
+    uint8_t*    fData;          // fNumEntries * kUnitSize
+    uint8_t*    fRunBuf;        // kMaxRunUnits * kUnitSize
+    long*       fSortKeys;      // write-back only: dirty units, sorted
+    uint8_t*    fFlushBuf;      // write-back only: merged run to write
+    unsigned long fWriteGen;    // bumped whenever cached data may change
+
+    DiskImg::CacheStats fStats;
+    DIMutex     fLock;          // guards everything above
+};
+
+/*
+ * Read-only random access to the contents of a single-member gzip file,
+ * through an index of restart points built with one pass over the data.
+ * See GzipIndex.cpp.
+ */
+class GFDGzip : public GenericFD {
+public:
+    GFDGzip(void) : fInputLen(0), fInputModWhen(0), fLength(0),
+        fCurrentOffset(0), fSpan(kMinSpan), fPoints(NULL), fWindows(NULL),
+        fNumPoints(0), fMaxPoints(0), fPointLimit(0), fCache(NULL),
+        fNumCachedChunks(0), fUseCounter(0), fNumRestarts(0)
+    {
+        memset(fTrailer, 0, sizeof(fTrailer));
+        memset(fStreams, 0, sizeof(fStreams));
+    }
+    virtual ~GFDGzip(void) { Reset(); }
+
+    // Open and index the gzip file "pathName".  If "indexPath" is non-NULL,
+    // the index is loaded from there if it's current, and saved there if
+    // it had to be built.  The index and the cache are kept within
+    // "memoryLimit" bytes; if that can't be done, this returns
+    // kDIErrTooBig.
+    DIError Open(const char* pathName, const char* indexPath,
+        long memoryLimit);
+    virtual DIError Read(void* buf, size_t length,
+        size_t* pActual = NULL);
+    virtual DIError Write(const void* buf, size_t length,
+        size_t* pActual = NULL) { return kDIErrAccessDenied; }
+    virtual DIError Seek(di_off_t offset, DIWhence whence);
+    virtual di_off_t Tell(void) { return fCurrentOffset; }
+    virtual DIError Truncate(void) { return kDIErrNotSupported; }
+    virtual DIError Close(void);
+    virtual const char* GetPathName(void) const { return NULL; }
+    virtual DIError ReadAt(void* buf, size_t length, di_off_t offset);
+    virtual DIError WriteAt(const void* buf, size_t length, di_off_t offset) {
+        return kDIErrAccessDenied;
+    }
+    virtual bool GetIsReadAtThreadSafe(void) const { return true; }
+
+    // length of the uncompressed data
+    di_off_t GetLength(void) const { return fLength; }
+
+private:
+    enum {
+        kMinSpan = 65536,           // output between restart points
+        kMaxSpan = 64 * 1024 * 1024,
+        kWindowSize = 32768,        // deflate's maximum reach
+        kChunkSize = 65536,         // unit of caching
+        kMaxCachedChunks = 256,
+        kNumStreams = 4,            // one per probe thread
+        kStreamBufSize = 16384,     // compressed input
+        kStreamOverhead = kWindowSize + kStreamBufSize + 8192,
+        kTrailerLen = 8,            // gzip CRC32 and ISIZE
+        kFileVersion = 2,
+        kHeaderLen = 0x30,
+        kRecordLen = 0x14 + kWindowSize,
+    };
+    typedef struct Point {
+        di_off_t    out;        // offset in the uncompressed data
+        di_off_t    in;         // offset of the next compressed byte
+        int         bits;       // unused bits in the byte before "in" (0-7)
+    } Point;
+    // An inflate stream, left where the last read stopped, so reading on
+    // from there doesn't have to go back to a restart point.  We keep a
+    // few, because the filesystem probes read from several places at once.
+    typedef struct Stream {
+        z_stream    strm;
+        bool        open;
+        di_off_t    out;        // offset of the next output byte
+        di_off_t    in;         // offset of the next compressed byte to read
+        uint8_t*    inBuf;      // kStreamBufSize
+        unsigned long lastUse;
+    } Stream;
+    typedef struct CachedChunk {
+        di_off_t    offset;     // start of the chunk, or -1 if unused
+        uint8_t*    buf;        // kChunkSize bytes
+        unsigned long lastUse;
+    } CachedChunk;
+
+    void Reset(void);
+    DIError BuildIndex(void);
+    DIError AddPoint(int bits, di_off_t in, di_off_t out, int left,
+        const uint8_t* window);
+    DIError ThinPoints(void);
+    DIError SizeCache(long memoryLimit);
+    DIError LoadIndex(const char* indexPath);
+    DIError SaveIndex(const char* indexPath) const;
+    long FindPoint(di_off_t offset) const;
+    Stream* ChooseStream(di_off_t offset, di_off_t pointOut);
+    DIError StartStream(Stream* pStream, long point);
+    DIError InflateTo(Stream* pStream, uint8_t* buf, long len);
+    static void EndStream(Stream* pStream);
+    DIError GetChunk(di_off_t offset, const CachedChunk** ppChunk);
+    uint8_t* GetWindow(long point) const {
+        return fWindows + point * kWindowSize;
+    }
+
+    GFDFile     fInput;         // the gzip file
+    di_off_t    fInputLen;
+    int64_t     fInputModWhen;
+    uint8_t     fTrailer[kTrailerLen];
+    di_off_t    fLength;
+    di_off_t    fCurrentOffset;
+    long        fSpan;          // kMinSpan, doubled to stay in fPointLimit
+
+    Point*      fPoints;
+    uint8_t*    fWindows;       // kWindowSize bytes per point
+    long        fNumPoints;
+    long        fMaxPoints;     // allocated
+    long        fPointLimit;    // most we'll keep, from the memory limit
+
+    Stream      fStreams[kNumStreams];
+    CachedChunk* fCache;
+    int         fNumCachedChunks;
+    unsigned long fUseCounter;
+    long        fNumRestarts;   // #of times we went to a restart point
+    DIMutex     fLock;          // guards fStreams, fCache, and fInput
+};
+
 };  // namespace DiskImgLib
 
 #endif /*__GENERIC_FD__*/
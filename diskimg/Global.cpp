@@ -140,6 +140,11 @@ const char* DiskImgLib::kASPIDev = "ASPI:";
  */
 /*static*/ Global::DebugMsgHandler Global::gDebugMsgHandler = NULL;
 
+/*
+ * Least severe message that gets formatted and passed to the handler.
+ */
+/*static*/ Global::LogSeverity Global::gLogLevel = Global::kLogVerbose;
+
 /*
  * Change the debug message handler.  The previous handler is returned.
  */
@@ -157,9 +162,16 @@ Global::DebugMsgHandler Global::SetDebugMsgHandler(DebugMsgHandler handler)
  *
  * Even if _DEBUG_MSGS is disabled we can still get here from the NuFX error
  * handler.
+ *
+ * The LOGx macros check the severity before calling here, so the arguments
+ * aren't evaluated for discarded messages; we check again for the benefit
+ * of direct callers.
  */
-/*static*/ void Global::PrintDebugMsg(const char* file, int line, const char* fmt, ...)
+/*static*/ void Global::PrintDebugMsg(LogSeverity severity, const char* file,
+    int line, const char* fmt, ...)
 {
+    if (!IsLogEnabled(severity))
+        return;
     if (gDebugMsgHandler == NULL) {
         /*
          * This can happen if the app decides to bail with an exit()
@@ -187,5 +199,5 @@ Global::DebugMsgHandler Global::SetDebugMsgHandler(DebugMsgHandler handler)
 
     buf[sizeof(buf)-1] = '\0';
 
-    (*gDebugMsgHandler)(file, line, buf);
+    (*gDebugMsgHandler)(severity, file, line, buf);
 }
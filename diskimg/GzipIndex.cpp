@@ -0,0 +1,893 @@
+/*
+ * CiderPress
+ * Copyright (C) 2009 by CiderPress authors.  All Rights Reserved.
+ * See the file LICENSE for distribution terms.
+ */
+/*
+ * Random access to the contents of a gzip file, implemented as a read-only
+ * GenericFD.  This is the technique from zlib's examples/zran.c.
+ *
+ * Open makes one pass over the compressed data, recording a restart point
+ * at the first deflate block boundary after every fSpan bytes of output.
+ * A point holds the offset in the compressed data (plus the unused bits of
+ * the previous byte, since blocks aren't byte-aligned) and the 32KB of
+ * output that precedes it, which is as far back as deflate can reach.
+ * Reads inflate from the restart point before the data.  What they
+ * inflate is cached in kChunkSize pieces, since filesystem reads tend to
+ * cluster, and the stream is left where it stopped, so reading on from
+ * there doesn't go back to the restart point.
+ *
+ * The index and the cache have to fit in the caller's memory limit.  The
+ * windows get half of it, and the span is the smallest power of two (at
+ * least kMinSpan) that fits the uncompressed length from the gzip trailer
+ * in that half, so the points are as close together as we can afford.
+ * Points can only go on block boundaries, so in very compressible data
+ * they'll be further apart.  If the windows would still use more than
+ * half of the limit -- the trailer only has the low 32 bits of the
+ * length -- we drop every other point and double the span.  Whatever the
+ * windows leave decides how many chunks we cache.  If the span would have
+ * to exceed kMaxSpan, reads would be too slow, and Open fails.
+ *
+ * The index can be saved beside the image and reloaded on the next open,
+ * which skips the pass over the data.  The file is a 48-byte header and
+ * one record per point, all little-endian:
+ *
+ *  +00 4 magic "DIgz"
+ *  +04 2 file version (kFileVersion)
+ *  +06 2 (reserved)
+ *  +08 8 length of the gzip file
+ *  +10 8 modification date of the gzip file
+ *  +18 8 length of the uncompressed data
+ *  +20 4 span
+ *  +24 4 number of points
+ *  +28 8 last 8 bytes of the gzip file (CRC32 and ISIZE)
+ *
+ *  +00 8 output offset
+ *  +08 8 input offset
+ *  +10 1 bits
+ *  +11 3 (reserved)
+ *  +14 32768 window
+ *
+ * If the gzip file's length, date, or trailer don't match, the index is
+ * rebuilt.  The date only has a resolution of one second, and copies can
+ * preserve it, but a rewritten image will almost never have the same CRC.
+ * OuterGzip also removes the index when it rewrites the image.
+ *
+ * Only single-member gzip files are handled.  Anything after the first
+ * member -- another member, or junk -- makes Open fail, and the caller
+ * should unpack the file the usual way.
+ */
+#include "StdAfx.h"
+#include "DiskImgPriv.h"
+
+static const char kMagic[4] = { 'D', 'I', 'g', 'z' };
+
+static uint64_t Get64LE(const uint8_t* buf)
+{
+    return GetLongLE(buf) | (uint64_t) GetLongLE(buf + 4) << 32;
+}
+
+static void Put64LE(uint8_t* buf, uint64_t val)
+{
+    PutLongLE(buf, (uint32_t) val);
+    PutLongLE(buf + 4, (uint32_t) (val >> 32));
+}
+
+
+/*
+ * Open the gzip file and index it.
+ *
+ * If "indexPath" is non-NULL, try to load the index from there first.  If
+ * it's missing or out of date, build the index and save it there.
+ */
+DIError GFDGzip::Open(const char* pathName, const char* indexPath,
+    long memoryLimit)
+{
+    DIError dierr = kDIErrNone;
+    struct stat sbuf;
+
+    if (fPoints != NULL)
+        return kDIErrAlreadyOpen;
+
+    if (stat(pathName, &sbuf) != 0) {
+        dierr = ErrnoOrGeneric();
+        goto bail;
+    }
+    fInputLen = sbuf.st_size;
+    fInputModWhen = sbuf.st_mtime;
+    if (fInputLen < kTrailerLen) {
+        dierr = kDIErrBadCompressedData;
+        goto bail;
+    }
+
+    dierr = fInput.Open(pathName, true);
+    if (dierr != kDIErrNone)
+        goto bail;
+    dierr = fInput.ReadAt(fTrailer, kTrailerLen, fInputLen - kTrailerLen);
+    if (dierr != kDIErrNone)
+        goto bail;
+
+    /* half of the limit is for the windows */
+    fPointLimit = (memoryLimit / 2) / kWindowSize;
+    if (fPointLimit < 2) {
+        dierr = kDIErrTooBig;
+        goto bail;
+    }
+
+    if (indexPath == NULL || LoadIndex(indexPath) != kDIErrNone) {
+        dierr = BuildIndex();
+        if (dierr != kDIErrNone)
+            goto bail;
+        dierr = SizeCache(memoryLimit);
+        if (dierr != kDIErrNone)
+            goto bail;
+        if (indexPath != NULL)
+            (void) SaveIndex(indexPath);    // failure is not fatal
+    } else {
+        dierr = SizeCache(memoryLimit);
+        if (dierr != kDIErrNone)
+            goto bail;
+    }
+
+    fCurrentOffset = 0;
+    fReadOnly = true;
+    LOGI(" GFDGzip: %ld bytes, %ld restart points, span=%ld, chunks=%d",
+        (long) fLength, fNumPoints, fSpan, fNumCachedChunks);
+
+bail:
+    if (dierr != kDIErrNone)
+        Reset();
+    return dierr;
+}
+
+DIError GFDGzip::Close(void)
+{
+    if (fPoints == NULL)
+        return kDIErrNotReady;
+
+    LOGI("  GFDGzip closing (restarts=%ld)", fNumRestarts);
+    Reset();
+    return kDIErrNone;
+}
+
+/*
+ * Discard the index, the stream, and the cache, and close the gzip file.
+ */
+void GFDGzip::Reset(void)
+{
+    int i;
+
+    delete[] fPoints;
+    delete[] fWindows;
+    fPoints = NULL;
+    fWindows = NULL;
+    fNumPoints = fMaxPoints = 0;
+    for (i = 0; i < kNumStreams; i++) {
+        EndStream(&fStreams[i]);
+        delete[] fStreams[i].inBuf;
+        fStreams[i].inBuf = NULL;
+        fStreams[i].lastUse = 0;
+    }
+    for (i = 0; i < fNumCachedChunks; i++)
+        delete[] fCache[i].buf;
+    delete[] fCache;
+    fCache = NULL;
+    fNumCachedChunks = 0;
+    fSpan = kMinSpan;
+    fLength = 0;
+    fCurrentOffset = 0;
+    fNumRestarts = 0;
+    (void) fInput.Close();
+}
+
+/*
+ * Add a restart point.  "window" is the circular output buffer, and
+ * "left" is the amount of space left in it, so the oldest byte is at
+ * window + kWindowSize - left.
+ */
+DIError GFDGzip::AddPoint(int bits, di_off_t in, di_off_t out, int left,
+    const uint8_t* window)
+{
+    uint8_t* pWindow;
+
+    assert(fNumPoints < fPointLimit);
+    if (fNumPoints == fMaxPoints) {
+        long newMax = fMaxPoints == 0 ? 16 : fMaxPoints * 2;
+        if (newMax > fPointLimit)
+            newMax = fPointLimit;
+        Point* newPoints = new Point[newMax];
+        uint8_t* newWindows = new uint8_t[newMax * kWindowSize];
+        if (newPoints == NULL || newWindows == NULL) {
+            delete[] newPoints;
+            delete[] newWindows;
+            return kDIErrMalloc;
+        }
+        if (fNumPoints > 0) {
+            memcpy(newPoints, fPoints, fNumPoints * sizeof(Point));
+            memcpy(newWindows, fWindows, fNumPoints * kWindowSize);
+        }
+        delete[] fPoints;
+        delete[] fWindows;
+        fPoints = newPoints;
+        fWindows = newWindows;
+        fMaxPoints = newMax;
+    }
+
+    fPoints[fNumPoints].out = out;
+    fPoints[fNumPoints].in = in;
+    fPoints[fNumPoints].bits = bits;
+    pWindow = GetWindow(fNumPoints);
+    if (left != 0)
+        memcpy(pWindow, window + kWindowSize - left, left);
+    if (left < kWindowSize)
+        memcpy(pWindow + left, window, kWindowSize - left);
+    fNumPoints++;
+    return kDIErrNone;
+}
+
+/*
+ * The index is full.  Drop every other restart point, and double the span
+ * so we don't fill it up again right away.
+ *
+ * Returns kDIErrTooBig if the span gets longer than kMaxSpan.
+ */
+DIError GFDGzip::ThinPoints(void)
+{
+    long i, j;
+
+    for (i = j = 0; i < fNumPoints; i += 2, j++) {
+        if (i != j) {
+            fPoints[j] = fPoints[i];
+            memcpy(GetWindow(j), GetWindow(i), kWindowSize);
+        }
+    }
+    fNumPoints = j;
+    fSpan *= 2;
+    LOGD("GFDGzip: thinned index to %ld points, span=%ld", fNumPoints, fSpan);
+
+    if (fSpan > kMaxSpan) {
+        LOGI("GFDGzip: not enough memory for the index");
+        return kDIErrTooBig;
+    }
+    return kDIErrNone;
+}
+
+/*
+ * Set up the cache, using the part of the memory limit that the index and
+ * the streams don't.  The chunk buffers are allocated as they're needed.
+ */
+DIError GFDGzip::SizeCache(long memoryLimit)
+{
+    long avail = memoryLimit - fNumPoints * kWindowSize -
+        kNumStreams * kStreamOverhead;
+    int i, numChunks;
+
+    if (avail < kChunkSize) {
+        LOGI("GFDGzip: no room for the cache");
+        return kDIErrTooBig;
+    }
+    numChunks = kMaxCachedChunks;
+    if (avail / kChunkSize < numChunks)
+        numChunks = (int) (avail / kChunkSize);
+
+    fCache = new CachedChunk[numChunks];
+    if (fCache == NULL)
+        return kDIErrMalloc;
+    fNumCachedChunks = numChunks;
+    for (i = 0; i < fNumCachedChunks; i++) {
+        fCache[i].offset = -1;
+        fCache[i].buf = NULL;
+        fCache[i].lastUse = 0;
+    }
+    return kDIErrNone;
+}
+
+/*
+ * Inflate the whole file, adding restart points as we go.
+ *
+ * Z_BLOCK makes inflate return at the end of the gzip header and at every
+ * block boundary.  We add a point at the first of those, and at the first
+ * block boundary after each fSpan bytes of output.
+ */
+DIError GFDGzip::BuildIndex(void)
+{
+    DIError dierr = kDIErrNone;
+    const int kInputChunk = 65536;
+    uint8_t* input = NULL;
+    uint8_t* window = NULL;
+    z_stream strm;
+    bool inflateOpen = false;
+    di_off_t totalIn, totalOut, last;
+    uint32_t expectedLen;
+    int zerr = Z_OK;
+
+    memset(&strm, 0, sizeof(strm));
+    input = new uint8_t[kInputChunk];
+    window = new uint8_t[kWindowSize];
+    if (input == NULL || window == NULL) {
+        dierr = kDIErrMalloc;
+        goto bail;
+    }
+    /* the first point's window is saved before there's anything in it */
+    memset(window, 0, kWindowSize);
+
+    /*
+     * Space the points so that the whole file fits in fPointLimit, going
+     * by the length in the gzip trailer.  That's only the low 32 bits, so
+     * ThinPoints still has to step in for files past 4GB.
+     */
+    expectedLen = GetLongLE(fTrailer + 4);
+    fSpan = kMinSpan;
+    while (fSpan < kMaxSpan && expectedLen / fSpan >= fPointLimit)
+        fSpan *= 2;
+
+    zerr = inflateInit2(&strm, 47);     // 15-bit window, gzip header
+    if (zerr != Z_OK) {
+        LOGE("GFDGzip: inflateInit2 failed (zerr=%d)", zerr);
+        dierr = kDIErrInternal;
+        goto bail;
+    }
+    inflateOpen = true;
+
+    dierr = fInput.Rewind();
+    if (dierr != kDIErrNone)
+        goto bail;
+
+    totalIn = totalOut = last = 0;
+    strm.avail_out = 0;
+    do {
+        size_t actual;
+
+        dierr = fInput.Read(input, kInputChunk, &actual);
+        if (dierr == kDIErrEOF) {
+            LOGI("GFDGzip: unexpected EOF in compressed data");
+            dierr = kDIErrBadCompressedData;
+            goto bail;
+        } else if (dierr != kDIErrNone) {
+            goto bail;
+        }
+        strm.next_in = input;
+        strm.avail_in = (uInt) actual;
+
+        do {
+            if (strm.avail_out == 0) {
+                strm.next_out = window;
+                strm.avail_out = kWindowSize;
+            }
+
+            totalIn += strm.avail_in;
+            totalOut += strm.avail_out;
+            zerr = inflate(&strm, Z_BLOCK);
+            totalIn -= strm.avail_in;
+            totalOut -= strm.avail_out;
+            if (zerr == Z_NEED_DICT || zerr == Z_DATA_ERROR ||
+                zerr == Z_MEM_ERROR)
+            {
+                LOGI("GFDGzip: inflate failed at %ld (zerr=%d)",
+                    (long) totalIn, zerr);
+                dierr = kDIErrBadCompressedData;
+                goto bail;
+            }
+            if (zerr == Z_STREAM_END)
+                break;
+
+            if ((strm.data_type & 128) != 0 && (strm.data_type & 64) == 0 &&
+                (totalOut == 0 || totalOut - last > fSpan))
+            {
+                if (fNumPoints == fPointLimit) {
+                    dierr = ThinPoints();
+                    if (dierr != kDIErrNone)
+                        goto bail;
+                    last = fPoints[fNumPoints-1].out;
+                }
+                if (totalOut == 0 || totalOut - last > fSpan) {
+                    dierr = AddPoint(strm.data_type & 7, totalIn, totalOut,
+                                strm.avail_out, window);
+                    if (dierr != kDIErrNone)
+                        goto bail;
+                    last = totalOut;
+                }
+            }
+        } while (strm.avail_in != 0);
+    } while (zerr != Z_STREAM_END);
+
+    if (strm.avail_in != 0 || totalIn != fInputLen) {
+        LOGI("GFDGzip: found %ld bytes past the end of the first member",
+            (long) (fInputLen - totalIn));
+        dierr = kDIErrUnsupportedImageFeature;
+        goto bail;
+    }
+    if (totalOut == 0 || fNumPoints == 0) {
+        dierr = kDIErrBadCompressedData;
+        goto bail;
+    }
+
+    fLength = totalOut;
+
+bail:
+    if (inflateOpen)
+        inflateEnd(&strm);
+    delete[] input;
+    delete[] window;
+    return dierr;
+}
+
+/*
+ * Load the index from "indexPath", if it's there and matches the file.
+ */
+DIError GFDGzip::LoadIndex(const char* indexPath)
+{
+    DIError dierr = kDIErrNone;
+    uint8_t hdr[kHeaderLen];
+    uint8_t rec[kRecordLen];
+    uint32_t count, i;
+    FILE* fp;
+
+    fp = fopen(indexPath, "rb");
+    if (fp == NULL)
+        return kDIErrFileNotFound;
+
+    if (fread(hdr, sizeof(hdr), 1, fp) != 1 ||
+        memcmp(hdr, kMagic, sizeof(kMagic)) != 0 ||
+        GetShortLE(hdr + 0x04) != kFileVersion)
+    {
+        LOGI("GFDGzip: '%s' is not an index file", indexPath);
+        dierr = kDIErrBadFileFormat;
+        goto bail;
+    }
+    if (Get64LE(hdr + 0x08) != (uint64_t) fInputLen ||
+        (int64_t) Get64LE(hdr + 0x10) != fInputModWhen ||
+        memcmp(hdr + 0x28, fTrailer, kTrailerLen) != 0)
+    {
+        LOGI("GFDGzip: index '%s' is out of date", indexPath);
+        dierr = kDIErrBadFileFormat;
+        goto bail;
+    }
+    fLength = (di_off_t) Get64LE(hdr + 0x18);
+    fSpan = GetLongLE(hdr + 0x20);
+    count = GetLongLE(hdr + 0x24);
+    if (fSpan < kMinSpan || count == 0 || fLength <= 0) {
+        dierr = kDIErrBadFileFormat;
+        goto bail;
+    }
+    if (count > (uint32_t) fPointLimit) {
+        /* saved with a larger memory limit; rebuild for this one */
+        LOGI("GFDGzip: index '%s' has too many points (%u)", indexPath,
+            count);
+        dierr = kDIErrBadFileFormat;
+        goto bail;
+    }
+
+    for (i = 0; i < count; i++) {
+        Point* pPoint;
+
+        if (fread(rec, sizeof(rec), 1, fp) != 1) {
+            LOGI("GFDGzip: index truncated at point %u of %u", i, count);
+            dierr = kDIErrBadFileFormat;
+            goto bail;
+        }
+        dierr = AddPoint(0, 0, 0, kWindowSize, rec + 0x14);
+        if (dierr != kDIErrNone)
+            goto bail;
+        pPoint = &fPoints[fNumPoints-1];
+        pPoint->out = (di_off_t) Get64LE(rec + 0x00);
+        pPoint->in = (di_off_t) Get64LE(rec + 0x08);
+        pPoint->bits = rec[0x10];
+        if (pPoint->bits > 7 || pPoint->in > fInputLen ||
+            pPoint->out >= fLength ||
+            (i == 0 ? pPoint->out != 0 :
+                      pPoint->out <= fPoints[fNumPoints-2].out))
+        {
+            LOGI("GFDGzip: bad point %u in index", i);
+            dierr = kDIErrBadFileFormat;
+            goto bail;
+        }
+    }
+
+    LOGI("GFDGzip: loaded %ld points from '%s'", fNumPoints, indexPath);
+
+bail:
+    fclose(fp);
+    if (dierr != kDIErrNone) {
+        /* start over */
+        delete[] fPoints;
+        delete[] fWindows;
+        fPoints = NULL;
+        fWindows = NULL;
+        fNumPoints = fMaxPoints = 0;
+        fSpan = kMinSpan;
+        fLength = 0;
+    }
+    return dierr;
+}
+
+/*
+ * Save the index to "indexPath".  Like FormatCache, we write to a temp
+ * file and rename it into place.
+ */
+DIError GFDGzip::SaveIndex(const char* indexPath) const
+{
+    DIError dierr = kDIErrNone;
+    uint8_t hdr[kHeaderLen];
+    uint8_t rec[kRecordLen];
+    char* tmpPath = NULL;
+    FILE* fp = NULL;
+    long i;
+
+    tmpPath = new char[strlen(indexPath) + 5];
+    strcpy(tmpPath, indexPath);
+    strcat(tmpPath, ".tmp");
+
+    fp = fopen(tmpPath, "wb");
+    if (fp == NULL) {
+        dierr = ErrnoOrGeneric();
+        LOGI("GFDGzip: unable to create '%s': %s", tmpPath,
+            DIStrError(dierr));
+        goto bail;
+    }
+
+    memset(hdr, 0, sizeof(hdr));
+    memcpy(hdr, kMagic, sizeof(kMagic));
+    PutShortLE(hdr + 0x04, kFileVersion);
+    Put64LE(hdr + 0x08, fInputLen);
+    Put64LE(hdr + 0x10, fInputModWhen);
+    Put64LE(hdr + 0x18, fLength);
+    PutLongLE(hdr + 0x20, fSpan);
+    PutLongLE(hdr + 0x24, fNumPoints);
+    memcpy(hdr + 0x28, fTrailer, kTrailerLen);
+    if (fwrite(hdr, sizeof(hdr), 1, fp) != 1)
+        dierr = kDIErrWriteFailed;
+
+    for (i = 0; i < fNumPoints && dierr == kDIErrNone; i++) {
+        memset(rec, 0, 0x14);
+        Put64LE(rec + 0x00, fPoints[i].out);
+        Put64LE(rec + 0x08, fPoints[i].in);
+        rec[0x10] = fPoints[i].bits;
+        memcpy(rec + 0x14, GetWindow(i), kWindowSize);
+        if (fwrite(rec, sizeof(rec), 1, fp) != 1)
+            dierr = kDIErrWriteFailed;
+    }
+
+    if (fclose(fp) != 0 && dierr == kDIErrNone)
+        dierr = kDIErrWriteFailed;
+    fp = NULL;
+    if (dierr != kDIErrNone) {
+        LOGI("GFDGzip: failed writing '%s'", tmpPath);
+        (void) remove(tmpPath);
+        goto bail;
+    }
+
+#ifdef _WIN32
+    /* rename() won't replace an existing file */
+    (void) remove(indexPath);
+#endif
+    if (rename(tmpPath, indexPath) != 0) {
+        dierr = ErrnoOrGeneric();
+        LOGI("GFDGzip: unable to rename '%s' to '%s': %s", tmpPath,
+            indexPath, DIStrError(dierr));
+        (void) remove(tmpPath);
+        goto bail;
+    }
+    LOGI("GFDGzip: wrote %ld points to '%s'", fNumPoints, indexPath);
+
+bail:
+    delete[] tmpPath;
+    return dierr;
+}
+
+/*
+ * Find the last restart point at or before "offset".
+ */
+long GFDGzip::FindPoint(di_off_t offset) const
+{
+    long lo = 0, hi = fNumPoints - 1;
+
+    assert(fNumPoints > 0 && fPoints[0].out == 0);
+    while (lo < hi) {
+        long mid = (lo + hi + 1) / 2;
+        if (fPoints[mid].out <= offset)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+/*
+ * Pick a stream to read "offset" with: the one that will get there soonest
+ * without going back to the restart point at "pointOut".  If none can, the
+ * least recently used one is returned, and the caller must restart it.
+ */
+GFDGzip::Stream* GFDGzip::ChooseStream(di_off_t offset, di_off_t pointOut)
+{
+    Stream* pBest = NULL;
+    Stream* pOldest = &fStreams[0];
+    int i;
+
+    for (i = 0; i < kNumStreams; i++) {
+        Stream* pStream = &fStreams[i];
+
+        if (pStream->open && pStream->out <= offset &&
+            pStream->out >= pointOut &&
+            (pBest == NULL || pStream->out > pBest->out))
+        {
+            pBest = pStream;
+        }
+        if (pStream->lastUse < pOldest->lastUse)
+            pOldest = pStream;
+    }
+    return pBest != NULL ? pBest : pOldest;
+}
+
+/*
+ * Position "pStream" at restart point "point".
+ */
+DIError GFDGzip::StartStream(Stream* pStream, long point)
+{
+    DIError dierr = kDIErrNone;
+    const Point* pPoint = &fPoints[point];
+    int zerr;
+
+    if (pStream->inBuf == NULL) {
+        pStream->inBuf = new uint8_t[kStreamBufSize];
+        if (pStream->inBuf == NULL)
+            return kDIErrMalloc;
+    }
+    if (pStream->open) {
+        zerr = inflateReset(&pStream->strm);
+    } else {
+        memset(&pStream->strm, 0, sizeof(pStream->strm));
+        zerr = inflateInit2(&pStream->strm, -15);   // raw deflate
+    }
+    if (zerr != Z_OK) {
+        LOGE("GFDGzip: inflate init failed (zerr=%d)", zerr);
+        pStream->open = false;
+        return kDIErrInternal;
+    }
+    pStream->open = true;
+
+    if (pPoint->bits != 0) {
+        uint8_t prev;
+
+        dierr = fInput.ReadAt(&prev, 1, pPoint->in - 1);
+        if (dierr != kDIErrNone)
+            goto bail;
+        inflatePrime(&pStream->strm, pPoint->bits,
+            prev >> (8 - pPoint->bits));
+    }
+    inflateSetDictionary(&pStream->strm, GetWindow(point), kWindowSize);
+
+    pStream->strm.avail_in = 0;
+    pStream->in = pPoint->in;
+    pStream->out = pPoint->out;
+    fNumRestarts++;
+
+bail:
+    if (dierr != kDIErrNone)
+        EndStream(pStream);
+    return dierr;
+}
+
+/*
+ * Inflate the next "len" bytes from "pStream" into "buf".  On failure the
+ * stream is shut down, and will be started over when it's next used.
+ */
+DIError GFDGzip::InflateTo(Stream* pStream, uint8_t* buf, long len)
+{
+    DIError dierr = kDIErrNone;
+    z_stream* pStrm = &pStream->strm;
+    int zerr;
+
+    assert(pStream->open);
+    pStrm->next_out = buf;
+    pStrm->avail_out = len;
+    while (pStrm->avail_out != 0) {
+        if (pStrm->avail_in == 0) {
+            di_off_t chunk = fInputLen - pStream->in;
+
+            if (chunk > kStreamBufSize)
+                chunk = kStreamBufSize;
+            if (chunk <= 0) {
+                dierr = kDIErrBadCompressedData;
+                goto bail;
+            }
+            dierr = fInput.ReadAt(pStream->inBuf, (size_t) chunk,
+                        pStream->in);
+            if (dierr != kDIErrNone)
+                goto bail;
+            pStream->in += chunk;
+            pStrm->next_in = pStream->inBuf;
+            pStrm->avail_in = (uInt) chunk;
+        }
+
+        zerr = inflate(pStrm, Z_NO_FLUSH);
+        if (zerr == Z_NEED_DICT || zerr == Z_DATA_ERROR ||
+            zerr == Z_MEM_ERROR)
+        {
+            LOGI("GFDGzip: inflate failed at %ld (zerr=%d)",
+                (long) (pStream->out + len - pStrm->avail_out), zerr);
+            dierr = kDIErrBadCompressedData;
+            goto bail;
+        }
+        if (zerr == Z_STREAM_END)
+            break;
+    }
+    if (pStrm->avail_out != 0) {
+        LOGI("GFDGzip: data ended %u bytes short at %ld",
+            pStrm->avail_out, (long) pStream->out);
+        dierr = kDIErrBadCompressedData;
+        goto bail;
+    }
+    pStream->out += len;
+
+bail:
+    if (dierr != kDIErrNone)
+        EndStream(pStream);
+    return dierr;
+}
+
+/*
+ * Shut down "pStream".  Its input buffer is kept.
+ */
+/*static*/ void GFDGzip::EndStream(Stream* pStream)
+{
+    if (pStream->open) {
+        inflateEnd(&pStream->strm);
+        pStream->open = false;
+    }
+}
+
+/*
+ * Get the chunk that starts at "offset", from the cache if we have it.
+ * Otherwise the least recently used entry is replaced.
+ */
+DIError GFDGzip::GetChunk(di_off_t offset, const CachedChunk** ppChunk)
+{
+    DIError dierr;
+    CachedChunk* pChunk;
+    Stream* pStream;
+    long point, len;
+    int i, oldest;
+
+    assert(offset % kChunkSize == 0);
+    oldest = 0;
+    for (i = 0; i < fNumCachedChunks; i++) {
+        if (fCache[i].offset == offset) {
+            fCache[i].lastUse = ++fUseCounter;
+            *ppChunk = &fCache[i];
+            return kDIErrNone;
+        }
+        if (fCache[i].lastUse < fCache[oldest].lastUse)
+            oldest = i;
+    }
+
+    pChunk = &fCache[oldest];
+    pChunk->offset = -1;
+    if (pChunk->buf == NULL) {
+        pChunk->buf = new uint8_t[kChunkSize];
+        if (pChunk->buf == NULL)
+            return kDIErrMalloc;
+    }
+    len = kChunkSize;
+    if (offset + len > fLength)
+        len = (long) (fLength - offset);
+
+    point = FindPoint(offset);
+    pStream = ChooseStream(offset, fPoints[point].out);
+    if (!pStream->open || pStream->out > offset ||
+        pStream->out < fPoints[point].out)
+    {
+        dierr = StartStream(pStream, point);
+        if (dierr != kDIErrNone)
+            return dierr;
+    }
+    pStream->lastUse = ++fUseCounter;
+
+    /* skip ahead, using the chunk's buffer as scratch */
+    while (pStream->out < offset) {
+        long skip = kChunkSize;
+        if (offset - pStream->out < skip)
+            skip = (long) (offset - pStream->out);
+        dierr = InflateTo(pStream, pChunk->buf, skip);
+        if (dierr != kDIErrNone)
+            return dierr;
+    }
+    dierr = InflateTo(pStream, pChunk->buf, len);
+    if (dierr != kDIErrNone)
+        return dierr;
+
+    pChunk->offset = offset;
+    pChunk->lastUse = ++fUseCounter;
+    *ppChunk = pChunk;
+    return kDIErrNone;
+}
+
+DIError GFDGzip::ReadAt(void* buf, size_t length, di_off_t offset)
+{
+    DIError dierr = kDIErrNone;
+    uint8_t* outPtr = (uint8_t*) buf;
+
+    if (fPoints == NULL)
+        return kDIErrNotReady;
+    if (offset < 0 || offset + (di_off_t) length > fLength) {
+        LOGW("  GFDGzip underrun off=%ld len=%lu flen=%ld",
+            (long) offset, (unsigned long) length, (long) fLength);
+        return kDIErrDataUnderrun;
+    }
+
+    DIAutoLock lock(&fLock);
+
+    while (length > 0) {
+        const CachedChunk* pChunk;
+        di_off_t chunkStart = offset - offset % kChunkSize;
+        long chunkOffset = (long) (offset - chunkStart);
+        long chunkLen = kChunkSize;
+        size_t chunk;
+
+        if (chunkStart + chunkLen > fLength)
+            chunkLen = (long) (fLength - chunkStart);
+
+        dierr = GetChunk(chunkStart, &pChunk);
+        if (dierr != kDIErrNone)
+            break;
+
+        chunk = chunkLen - chunkOffset;
+        if (chunk > length)
+            chunk = length;
+        memcpy(outPtr, pChunk->buf + chunkOffset, chunk);
+        outPtr += chunk;
+        offset += chunk;
+        length -= chunk;
+    }
+
+    return dierr;
+}
+
+DIError GFDGzip::Read(void* buf, size_t length, size_t* pActual)
+{
+    DIError dierr;
+
+    if (fPoints == NULL)
+        return kDIErrNotReady;
+
+    if (fCurrentOffset + (di_off_t) length > fLength) {
+        if (pActual == NULL)
+            return kDIErrDataUnderrun;
+        length = (size_t) (fLength - fCurrentOffset);
+        if (length == 0)
+            return kDIErrEOF;
+    }
+
+    dierr = ReadAt(buf, length, fCurrentOffset);
+    if (dierr != kDIErrNone)
+        return dierr;
+    fCurrentOffset += length;
+    if (pActual != NULL)
+        *pActual = length;
+    return kDIErrNone;
+}
+
+DIError GFDGzip::Seek(di_off_t offset, DIWhence whence)
+{
+    if (fPoints == NULL)
+        return kDIErrNotReady;
+
+    switch (whence) {
+    case kSeekSet:
+        break;
+    case kSeekEnd:
+        offset += fLength;
+        break;
+    case kSeekCur:
+        offset += fCurrentOffset;
+        break;
+    default:
+        assert(false);
+        return kDIErrInvalidArg;
+    }
+    if (offset < 0 || offset > fLength)
+        return kDIErrInvalidArg;
+
+    fCurrentOffset = offset;
+    return kDIErrNone;
+}
@@ -283,7 +283,7 @@ DIError DiskFSHFS::LoadVolHeader(void)
      * must come first in the file list.
      */
     A2FileHFS* pFile;
-    pFile = new A2FileHFS(this);
+    pFile = new (this) A2FileHFS(this);
     if (pFile == NULL) {
         dierr = kDIErrMalloc;
         goto bail;
@@ -381,6 +381,11 @@ DIError DiskFSHFS::Initialize(InitMode initMode)
         LOGI(" HFS - headerOnly set, skipping file load");
         goto bail;
     }
+    if (initMode == kInitLazy && !fpImg->GetReadOnly()) {
+        LOGI(" HFS - image is writable, ignoring lazy load request");
+        initMode = kInitFull;
+    }
+    fLazyDirs = (initMode == kInitLazy);
 
     sprintf(msg, "Scanning %s", fVolumeName);
     if (!fpImg->UpdateScanProgress(msg)) {
@@ -542,7 +547,7 @@ DIError DiskFSHFS::RecursiveDirAdd(A2File* pParent, const char* basePath, int de
     while (hfs_readdir(dir, &dirEntry) != -1) {
         A2FileHFS* pFile;
 
-        pFile = new A2FileHFS(this);
+        pFile = new (this) A2FileHFS(this);
 
         pFile->InitEntry(&dirEntry);
 
@@ -556,7 +561,9 @@ DIError DiskFSHFS::RecursiveDirAdd(A2File* pParent, const char* basePath, int de
             goto bail;
         }
 
-        if (dirEntry.flags & HFS_ISDIR) {
+        if ((dirEntry.flags & HFS_ISDIR) && fLazyDirs) {
+            SetDirPending(pFile);
+        } else if (dirEntry.flags & HFS_ISDIR) {
             strcpy(pathBuf + nameOffset, dirEntry.name);
             dierr = RecursiveDirAdd(pFile, pathBuf, depth+1);
             if (dierr != kDIErrNone)
@@ -880,10 +887,9 @@ bail:
  * The first time this is called we don't know if the name is unique or not,
  * so we need to start by checking that.
  *
- * We have our choice between the DiskFS GetFileByName(), which traverses
- * a linear list, and hfs_stat(), which uses more efficient data structures
- * but may require disk reads.  We use the DiskFS interface, on the assumption
- * that someday we'll switch the linear list to a tree structure.
+ * We have our choice between the DiskFS GetFileByName(), which uses the
+ * in-memory pathname hash, and hfs_stat(), which may require disk reads.
+ * We use the DiskFS interface.
  */
 DIError DiskFSHFS::MakeFileNameUnique(const char* pathName, char** pUniqueName)
 {
@@ -1217,7 +1223,7 @@ DIError DiskFSHFS::CreateFile(const CreateParms* pParms, A2File** ppNewFile)
      *
      * Create a new entry and set the structure fields.
      */
-    pNewFile = new A2FileHFS(this);
+    pNewFile = new (this) A2FileHFS(this);
     pNewFile->InitEntry(&dirEnt);
     pNewFile->SetPathName(basePath == NULL ? "" : basePath, pNewFile->fFileName);
     pNewFile->SetParent(pSubdir);
@@ -1236,38 +1242,26 @@ DIError DiskFSHFS::CreateFile(const CreateParms* pParms, A2File** ppNewFile)
      * is reopened.
      *
      * All files in a subdir appear in the list after that subdir, but there
-     * might be intervening entries from deeper directories.  So we have to
-     * chase through some or all of the file list to find the right place.
-     * Not great, but we don't have enough files or do adds often enough to
-     * make this worth optimizing.
+     * might be intervening entries from deeper directories.  We walk
+     * backward through the subdir's contents, so adding files in sorted
+     * order (the common case) finds the spot right away, and let
+     * InsertFileInList skip past the contents of the entry we land on.
      */
     A2File* pLastSubdirFile;
-    A2File* pPrevFile;
-    A2File* pNextFile;
-
-    pPrevFile = pLastSubdirFile = pSubdir;
-    pNextFile = GetNextFile(pPrevFile);
-    while (pNextFile != NULL) {
-        if (pNextFile->GetParent() == pNewFile->GetParent()) {
-            /* in same subdir, compare names */
-            if (CompareMacFileNames(pNextFile->GetPathName(),
-                pNewFile->GetPathName()) > 0)
-            {
-                /* passed it; insert new after previous file */
-                pLastSubdirFile = pPrevFile;
-                LOGI("  HFS Found '%s' > cur(%s)", pNextFile->GetPathName(),
-                    pNewFile->GetPathName());
-                break;
-            }
 
-            /* still too early; save in case it's last one in dir */
-            pLastSubdirFile = pNextFile;
+    pLastSubdirFile = GetLastChild(pSubdir);
+    while (pLastSubdirFile != NULL) {
+        if (CompareMacFileNames(pLastSubdirFile->GetPathName(),
+            pNewFile->GetPathName()) <= 0)
+        {
+            break;
         }
-        pPrevFile = pNextFile;
-        pNextFile = GetNextFile(pNextFile);
+        pLastSubdirFile = GetPrevSibling(pLastSubdirFile);
     }
+    if (pLastSubdirFile == NULL)
+        pLastSubdirFile = pSubdir;
 
-    /* insert us after last file we saw that was part of the same subdir */
+    /* insert us after last file in the subdir that sorts ahead of us */
     LOGI("  HFS inserting '%s' after '%s'", pNewFile->GetPathName(),
         pLastSubdirFile->GetPathName());
     InsertFileInList(pNewFile, pLastSubdirFile);
@@ -1493,6 +1487,7 @@ DIError DiskFSHFS::RegeneratePathName(A2FileHFS* pFile)
 
     LOGI("Replacing '%s' with '%s'", pFile->GetPathName(), buf);
     pFile->SetPathName("", buf);
+    ReindexFile(pFile);
     delete[] buf;
 
     return kDIErrNone;
@@ -1540,6 +1535,7 @@ DIError DiskFSHFS::RenameVolume(const char* newName)
     SetVolumeID();
     strcpy(pFile->fFileName, newName);
     pFile->SetPathName("", newName);
+    ReindexFile(pFile);
 
 bail:
     delete[] oldNameColon;
@@ -1738,6 +1734,13 @@ void A2FileHFS::SetPathName(const char* basePath, const char* fileName)
 
 #ifndef EXCISE_GPL_CODE
 
+/*
+ * libhfs keeps global state (hfs_error, the list of mounted volumes) and
+ * per-volume block caches, so file I/O through it is serialized.  This
+ * lets callers read files on an HFS volume from several threads.
+ */
+static DIMutex gLibHFSLock;
+
 /*
  * Return a copy of the pathname that libhfs will like.
  *
@@ -1754,6 +1757,29 @@ char* A2FileHFS::GetLibHFSPathName(void) const
     return nameBuf;
 }
 
+/*
+ * Read the entries of a subdirectory that was skipped by a lazy
+ * Initialize.  This can happen long after Initialize, while other threads
+ * are reading files, so we need the libhfs lock.
+ */
+DIError DiskFSHFS::LoadSubdir(A2File* pDir)
+{
+    DIAutoLock lock(&gLibHFSLock);
+    char* pathName = ((A2FileHFS*) pDir)->GetLibHFSPathName();
+    int depth = 0;
+    DIError dierr;
+
+    for (A2File* pParent = pDir; pParent->GetParent() != NULL;
+            pParent = pParent->GetParent())
+    {
+        depth++;
+    }
+
+    dierr = RecursiveDirAdd(pDir, pathName, depth);
+    delete[] pathName;
+    return dierr;
+}
+
 /*
  * Convert numeric file/aux type to HFS strings.  "pType" and "pCreator" must
  * be able to hold 5 bytes each (4-byte type + nul).
@@ -1814,6 +1840,7 @@ DIError A2FileHFS::Open(A2FileDescr** ppOpenFile, bool readOnly,
     A2FDHFS* pOpenFile = NULL;
     hfsfile* pHfsFile;
     char* nameBuf = NULL;
+    DIAutoLock lock(&gLibHFSLock);
 
     if (fpOpenFile != NULL)
         return kDIErrAlreadyOpen;
@@ -1854,6 +1881,7 @@ bail:
 DIError A2FDHFS::Read(void* buf, size_t len, size_t* pActual)
 {
     long result;
+    DIAutoLock lock(&gLibHFSLock);
 
     LOGD(" HFS reading %lu bytes from '%s' (offset=%ld)",
         (unsigned long) len, fpFile->GetPathName(),
@@ -1896,6 +1924,7 @@ DIError A2FDHFS::Read(void* buf, size_t len, size_t* pActual)
 DIError A2FDHFS::Write(const void* buf, size_t len, size_t* pActual)
 {
     long result;
+    DIAutoLock lock(&gLibHFSLock);
 
     LOGD(" HFS writing %lu bytes to '%s' (offset=%ld)",
         (unsigned long) len, fpFile->GetPathName(),
@@ -1937,6 +1966,7 @@ DIError A2FDHFS::Seek(di_off_t offset, DIWhence whence)
 {
     int hfsWhence;
     unsigned long result;
+    DIAutoLock lock(&gLibHFSLock);
 
     switch (whence) {
     case kSeekSet:      hfsWhence = HFS_SEEK_SET;   break;
@@ -1961,6 +1991,7 @@ DIError A2FDHFS::Seek(di_off_t offset, DIWhence whence)
 di_off_t A2FDHFS::Tell(void)
 {
     di_off_t offset;
+    DIAutoLock lock(&gLibHFSLock);
 
     /* get current position without moving pointer */
     offset = hfs_seek(fHfsFile, 0, HFS_SEEK_CUR);
@@ -1973,6 +2004,7 @@ di_off_t A2FDHFS::Tell(void)
 DIError A2FDHFS::Close(void)
 {
     hfsdirent dirEnt;
+    DIAutoLock lock(&gLibHFSLock);
 
     /*
      * If the file was written to, update our info.
@@ -2122,7 +2154,7 @@ void DiskFSHFS::CreateFakeFile(void)
         fNumDirectories,
         dateBuf);
 
-    pFile = new A2FileHFS(this);
+    pFile = new (this) A2FileHFS(this);
     pFile->fIsDir = false;
     pFile->fIsVolumeDir = false;
     pFile->fType = 0;
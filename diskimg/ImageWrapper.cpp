@@ -209,11 +209,11 @@ DIError Wrapper2MG::Flush(GenericFD* pWrapperGFD, GenericFD* pDataGFD,
     const NuErrorMessage* pErrorMessage = (const NuErrorMessage*) vErrorMessage;
 
     if (pErrorMessage->isDebug) {
-        Global::PrintDebugMsg(pErrorMessage->file, pErrorMessage->line,
-            "[D] %s\n", pErrorMessage->message);
+        Global::PrintDebugMsg(Global::kLogDebug, pErrorMessage->file,
+            pErrorMessage->line, "[D] %s\n", pErrorMessage->message);
     } else {
-        Global::PrintDebugMsg(pErrorMessage->file, pErrorMessage->line,
-            "%s\n", pErrorMessage->message);
+        Global::PrintDebugMsg(Global::kLogWarn, pErrorMessage->file,
+            pErrorMessage->line, "%s\n", pErrorMessage->message);
     }
 
     return kNuOK;
@@ -61,116 +61,165 @@
 }
 
 /*
- * Find the start of the data field of a sector in nibblized data.
+ * Find every sector on a track, in a single pass, and record them in
+ * "*pMap".
  *
- * Returns the index start on success or -1 on failure.
+ * For each address field we check the track number, checksum, and epilog
+ * as the NibbleDescr asks, then look a short distance ahead for the data
+ * field.  If a sector appears more than once, the first good copy wins.
  */
-int DiskImg::FindNibbleSectorStart(const CircularBufferAccess& buffer, int track,
-    int sector, const NibbleDescr* pNibbleDescr, int* pVol)
+void DiskImg::MapNibbleTrack(const uint8_t* trackBuf, long trackLen,
+    int track, const NibbleDescr* pNibbleDescr, NibbleSectorMap* pMap)
 {
     const int kMaxDataReach = 48;       // fairly arbitrary
-    //DIError dierr;
-    long trackLen = buffer.GetSize();
-
-    assert(sector >= 0 && sector < 16);
-
+    CircularBufferAccess buffer(trackBuf, trackLen);
+    const bool skipFirst =
+        (pNibbleDescr->special == kNibbleSpecialSkipFirstAddrByte);
+    const uint8_t* addrProlog = pNibbleDescr->addrProlog;
     int i;
 
-    for (i = 0; i < trackLen; i++) {
-        bool foundAddr = false;
+    for (i = 0; i < kMaxNibbleSectors; i++) {
+        pMap->addrIdx[i] = pMap->dataIdx[i] = -1;
+        pMap->vol[i] = 0;
+    }
 
-        if (pNibbleDescr->special == kNibbleSpecialSkipFirstAddrByte) {
-            if (/*buffer[i] == pNibbleDescr->addrProlog[0] &&*/
-                buffer[i+1] == pNibbleDescr->addrProlog[1] &&
-                buffer[i+2] == pNibbleDescr->addrProlog[2])
+    for (i = 0; i < trackLen; i++) {
+        /*
+         * Look for the address prolog.  Only the last couple of positions
+         * wrap around the end of the buffer, so use the circular accessor
+         * just for those.
+         */
+        if (i + 2 < trackLen) {
+            if (trackBuf[i+1] != addrProlog[1] ||
+                trackBuf[i+2] != addrProlog[2] ||
+                (!skipFirst && trackBuf[i] != addrProlog[0]))
             {
-                foundAddr = true;
+                continue;
             }
         } else {
-            if (buffer[i] == pNibbleDescr->addrProlog[0] &&
-                buffer[i+1] == pNibbleDescr->addrProlog[1] &&
-                buffer[i+2] == pNibbleDescr->addrProlog[2])
+            if (buffer[i+1] != addrProlog[1] ||
+                buffer[i+2] != addrProlog[2] ||
+                (!skipFirst && buffer[i] != addrProlog[0]))
             {
-                foundAddr = true;
+                continue;
             }
         }
 
-        if (foundAddr) {
-            //i += 3;
+        /* found the address header, decode the address */
+        int addrIdx = i;
+        short hdrVol, hdrTrack, hdrSector, hdrChksum;
+        DecodeAddr(buffer, i+3, &hdrVol, &hdrTrack, &hdrSector,
+            &hdrChksum);
 
-            /* found the address header, decode the address */
-            short hdrVol, hdrTrack, hdrSector, hdrChksum;
-            DecodeAddr(buffer, i+3, &hdrVol, &hdrTrack, &hdrSector,
-                &hdrChksum);
+        if (pNibbleDescr->addrVerifyTrack && track != hdrTrack) {
+            LOGI("  Track mismatch (T=%d) got T=%d,S=%d",
+                track, hdrTrack, hdrSector);
+            continue;
+        }
 
-            if (pNibbleDescr->addrVerifyTrack && track != hdrTrack) {
-                LOGI("  Track mismatch (T=%d) got T=%d,S=%d",
+        if (pNibbleDescr->addrVerifyChecksum) {
+            if ((pNibbleDescr->addrChecksumSeed ^
+                hdrVol ^ hdrTrack ^ hdrSector ^ hdrChksum) != 0)
+            {
+                LOGW("   Addr checksum mismatch (T=%d, got T=%d,S=%d)",
                     track, hdrTrack, hdrSector);
                 continue;
             }
+        }
 
-            if (pNibbleDescr->addrVerifyChecksum) {
-                if ((pNibbleDescr->addrChecksumSeed ^
-                    hdrVol ^ hdrTrack ^ hdrSector ^ hdrChksum) != 0)
-                {
-                    LOGW("   Addr checksum mismatch (want T=%d,S=%d, got "
-                          "T=%d,S=%d)",
-                        track, sector, hdrTrack, hdrSector);
-                    continue;
-                }
-            }
-
-            i += 3;
+        i += 3;
 
-            int j;
-            for (j = 0; j < pNibbleDescr->addrEpilogVerifyCount; j++) {
-                if (buffer[i+8+j] != pNibbleDescr->addrEpilog[j]) {
-                    //LOGI("   Bad epilog byte %d (%02x vs %02x)",
-                    //    j, buffer[i+8+j], pNibbleDescr->addrEpilog[j]);
-                    break;
-                }
+        int j;
+        for (j = 0; j < pNibbleDescr->addrEpilogVerifyCount; j++) {
+            if (buffer[i+8+j] != pNibbleDescr->addrEpilog[j]) {
+                //LOGI("   Bad epilog byte %d (%02x vs %02x)",
+                //    j, buffer[i+8+j], pNibbleDescr->addrEpilog[j]);
+                break;
             }
-            if (j != pNibbleDescr->addrEpilogVerifyCount)
-                continue;
+        }
+        if (j != pNibbleDescr->addrEpilogVerifyCount)
+            continue;
 
 #ifdef NIB_VERBOSE_DEBUG
-            LOGI("    Good header, T=%d,S=%d (looking for T=%d,S=%d)",
-                hdrTrack, hdrSector, track, sector);
+        LOGI("    Good header, T=%d,S=%d", hdrTrack, hdrSector);
 #endif
 
-            if (pNibbleDescr->special == kNibbleSpecialMuse) {
-                /* e.g. original Castle Wolfenstein */
-                if (track > 2) {
-                    if ((hdrSector & 0x01) != 0)
-                        continue;
-                    hdrSector /= 2;
-                }
+        if (pNibbleDescr->special == kNibbleSpecialMuse) {
+            /* e.g. original Castle Wolfenstein */
+            if (track > 2) {
+                if ((hdrSector & 0x01) != 0)
+                    continue;
+                hdrSector /= 2;
             }
+        }
 
-            if (sector != hdrSector)
-                continue;
+        if (hdrSector < 0 || hdrSector >= kMaxNibbleSectors ||
+            pMap->dataIdx[hdrSector] >= 0)
+        {
+            continue;
+        }
 
-            /*
-             * Scan forward and look for data prolog.  We want to limit
-             * the reach of our search so we don't blunder into the data
-             * field of the next sector.
-             */
-            for (j = 0; j < kMaxDataReach; j++) {
-                if (buffer[i + j] == pNibbleDescr->dataProlog[0] &&
-                    buffer[i + j +1] == pNibbleDescr->dataProlog[1] &&
-                    buffer[i + j +2] == pNibbleDescr->dataProlog[2])
-                {
-                    *pVol = hdrVol;
-                    return buffer.Normalize(i + j + 3);
-                }
+        /*
+         * Scan forward and look for data prolog.  We want to limit
+         * the reach of our search so we don't blunder into the data
+         * field of the next sector.
+         */
+        for (j = 0; j < kMaxDataReach; j++) {
+            if (buffer[i + j] == pNibbleDescr->dataProlog[0] &&
+                buffer[i + j +1] == pNibbleDescr->dataProlog[1] &&
+                buffer[i + j +2] == pNibbleDescr->dataProlog[2])
+            {
+                pMap->addrIdx[hdrSector] = addrIdx;
+                pMap->dataIdx[hdrSector] = buffer.Normalize(i + j + 3);
+                pMap->vol[hdrSector] = hdrVol;
+                break;
             }
         }
     }
 
+    pMap->pNibbleDescr = pNibbleDescr;
+}
+
+/*
+ * Get the sector map for the loaded track, mapping it first if we haven't
+ * already done so with this NibbleDescr.
+ */
+const DiskImg::NibbleSectorMap* DiskImg::GetNibbleSectorMap(int track,
+    long trackLen, const NibbleDescr* pNibbleDescr)
+{
+    assert(track == fNibbleTrackLoaded);
+
+    NibbleSectorMap* pMap = &fpNibbleCurSlot->map;
+    if (pMap->pNibbleDescr != pNibbleDescr) {
+        MapNibbleTrack(fNibbleTrackBuf, trackLen, track, pNibbleDescr, pMap);
+        GetIOStatsSink()->nibbleTrackScans++;
+    }
+    return pMap;
+}
+
+/*
+ * Find the start of the data field of a sector in the loaded track.
+ *
+ * Returns the index start on success or -1 on failure.
+ */
+int DiskImg::FindNibbleSectorStart(int track, long trackLen, int sector,
+    const NibbleDescr* pNibbleDescr, int* pVol)
+{
+    assert(sector >= 0 && sector < kMaxNibbleSectors);
+
+    const NibbleSectorMap* pMap =
+        GetNibbleSectorMap(track, trackLen, pNibbleDescr);
+
+    int idx = pMap->dataIdx[sector];
+    if (idx < 0) {
 #ifdef NIB_VERBOSE_DEBUG
-    LOGI("   Couldn't find T=%d,S=%d", track, sector);
+        LOGI("   Couldn't find T=%d,S=%d", track, sector);
 #endif
-    return -1;
+        return -1;
+    }
+
+    *pVol = pMap->vol[sector];
+    return idx;
 }
 
 /*
@@ -191,19 +240,40 @@ void DiskImg::DecodeAddr(const CircularBufferAccess& buffer, int offset,
  * Decode the sector pointed to by "pData" and described by "pNibbleDescr".
  * This invokes the appropriate function (e.g. 5&3 or 6&2) to decode the
  * data into a 256-byte sector.
+ *
+ * The decoders work on a straight run of bytes.  If the data field wraps
+ * around the end of the track, we copy it out first.
  */
 DIError DiskImg::DecodeNibbleData(const CircularBufferAccess& buffer, int idx,
     uint8_t* sctBuf, const NibbleDescr* pNibbleDescr)
 {
+    uint8_t linearBuf[kDataSize53];
+    const uint8_t* nibBuf;
+    int len, i;
+
     switch (pNibbleDescr->encoding) {
     case kNibbleEnc62:
-        return DecodeNibble62(buffer, idx, sctBuf, pNibbleDescr);
+        len = kDataSize62;
+        break;
     case kNibbleEnc53:
-        return DecodeNibble53(buffer, idx, sctBuf, pNibbleDescr);
+        len = kDataSize53;
+        break;
     default:
         assert(false);
         return kDIErrInternal;
     }
+
+    nibBuf = buffer.GetLinearPointer(idx, len);
+    if (nibBuf == NULL) {
+        for (i = 0; i < len; i++)
+            linearBuf[i] = buffer[idx + i];
+        nibBuf = linearBuf;
+    }
+
+    if (pNibbleDescr->encoding == kNibbleEnc62)
+        return DecodeNibble62(nibBuf, sctBuf, pNibbleDescr);
+    else
+        return DecodeNibble53(nibBuf, sctBuf, pNibbleDescr);
 }
 
 /*
@@ -214,70 +284,97 @@ DIError DiskImg::DecodeNibbleData(const CircularBufferAccess& buffer, int idx,
 void DiskImg::EncodeNibbleData(const CircularBufferAccess& buffer, int idx,
     const uint8_t* sctBuf, const NibbleDescr* pNibbleDescr) const
 {
+    uint8_t linearBuf[kDataSize53];
+    uint8_t* nibBuf;
+    int len, i;
+
     switch (pNibbleDescr->encoding) {
     case kNibbleEnc62:
-        EncodeNibble62(buffer, idx, sctBuf, pNibbleDescr);
+        len = kDataSize62;
         break;
     case kNibbleEnc53:
-        EncodeNibble53(buffer, idx, sctBuf, pNibbleDescr);
+        len = kDataSize53;
         break;
     default:
         assert(false);
-        break;
+        return;
+    }
+
+    nibBuf = buffer.GetLinearPointer(idx, len);
+    if (nibBuf == NULL)
+        nibBuf = linearBuf;
+
+    if (pNibbleDescr->encoding == kNibbleEnc62)
+        EncodeNibble62(nibBuf, sctBuf, pNibbleDescr);
+    else
+        EncodeNibble53(nibBuf, sctBuf, pNibbleDescr);
+
+    if (nibBuf == linearBuf) {
+        for (i = 0; i < len; i++)
+            buffer[idx + i] = linearBuf[i];
     }
 }
 
 /*
- * Decode 6&2 encoding.
+ * Decode 6&2 encoding.  "nibBuf" holds kDataSize62 disk bytes.
+ *
+ * Each disk byte holds the 6-bit value XORed with the one before it.
+ * We translate all of them through the table first, then undo the XOR
+ * chain, then reassemble the sector from the "twos" and the top bits.
+ * The last two steps don't branch, so the compiler can vectorize them.
  */
-DIError DiskImg::DecodeNibble62(const CircularBufferAccess& buffer, int idx,
-    uint8_t* sctBuf, const NibbleDescr* pNibbleDescr)
+DIError DiskImg::DecodeNibble62(const uint8_t* nibBuf, uint8_t* sctBuf,
+    const NibbleDescr* pNibbleDescr)
 {
-    uint8_t twos[kChunkSize62 * 3];   // 258
-    int chksum = pNibbleDescr->dataChecksumSeed;
-    uint8_t decodedVal;
+    uint8_t vals[kDataSize62];
+    const uint8_t* top = vals + kChunkSize62;
+    uint8_t chksum, invalid;
     int i;
 
     /*
-     * Pull the 342 bytes out, convert them from disk bytes to 6-bit
-     * values, and arrange them into a DOS-like pair of buffers.
+     * Convert the 343 bytes from disk bytes to 6-bit values.  Valid
+     * values are < 64, so any of the high bits means we hit a bad one.
      */
-    for (i = 0; i < kChunkSize62; i++) {
-        decodedVal = kInvDiskBytes62[buffer[idx++]];
-        if (decodedVal == kInvInvalidValue)
-            return kDIErrInvalidDiskByte;
-        assert(decodedVal < sizeof(kDiskBytes62));
-
-        chksum ^= decodedVal;
-        twos[i] =
-            ((chksum & 0x01) << 1) | ((chksum & 0x02) >> 1);
-        twos[i + kChunkSize62] =
-            ((chksum & 0x04) >> 1) | ((chksum & 0x08) >> 3);
-        twos[i + kChunkSize62*2] =
-            ((chksum & 0x10) >> 3) | ((chksum & 0x20) >> 5);
+    invalid = 0;
+    for (i = 0; i < kDataSize62; i++) {
+        vals[i] = kInvDiskBytes62[nibBuf[i]];
+        invalid |= vals[i];
     }
+    if ((invalid & 0xc0) != 0)
+        return kDIErrInvalidDiskByte;
 
-    for (i = 0; i < 256; i++) {
-        decodedVal = kInvDiskBytes62[buffer[idx++]];
-        if (decodedVal == kInvInvalidValue)
-            return kDIErrInvalidDiskByte;
-        assert(decodedVal < sizeof(kDiskBytes62));
+    chksum = pNibbleDescr->dataChecksumSeed;
+    for (i = 0; i < kDataSize62; i++) {
+        chksum ^= vals[i];
+        vals[i] = chksum;
+    }
 
-        chksum ^= decodedVal;
-        sctBuf[i] = (chksum << 2) | twos[i];
+    /*
+     * The first 86 values hold the low two bits of each data byte, with
+     * the bits swapped, for bytes i, i+86, and i+172.
+     */
+    for (i = 0; i < kChunkSize62; i++) {
+        unsigned int twos = vals[i];
+        sctBuf[i] = (uint8_t) (top[i] << 2) |
+            ((twos & 0x01) << 1) | ((twos & 0x02) >> 1);
+    }
+    for (i = 0; i < kChunkSize62; i++) {
+        unsigned int twos = vals[i];
+        sctBuf[i + kChunkSize62] = (uint8_t) (top[i + kChunkSize62] << 2) |
+            ((twos & 0x04) >> 1) | ((twos & 0x08) >> 3);
+    }
+    for (i = 0; i < 256 - kChunkSize62*2; i++) {
+        unsigned int twos = vals[i];
+        sctBuf[i + kChunkSize62*2] =
+            (uint8_t) (top[i + kChunkSize62*2] << 2) |
+            ((twos & 0x10) >> 3) | ((twos & 0x20) >> 5);
     }
 
     /*
-     * Grab the 343rd byte (the checksum byte) and see if we did this
-     * right.
+     * The 343rd byte is the checksum, so everything XORed together
+     * should come out to zero.
      */
     //printf("Dec checksum value is 0x%02x\n", chksum);
-    decodedVal = kInvDiskBytes62[buffer[idx++]];
-    if (decodedVal == kInvInvalidValue)
-        return kDIErrInvalidDiskByte;
-    assert(decodedVal < sizeof(kDiskBytes62));
-    chksum ^= decodedVal;
-
     if (pNibbleDescr->dataVerifyChecksum && chksum != 0) {
         LOGI("    NIB bad data checksum");
         return kDIErrBadChecksum;
@@ -286,100 +383,91 @@ DIError DiskImg::DecodeNibble62(const CircularBufferAccess& buffer, int idx,
 }
 
 /*
- * Encode 6&2 encoding.
+ * Encode 6&2 encoding.  Fills kDataSize62 bytes of "nibBuf".
  */
-void DiskImg::EncodeNibble62(const CircularBufferAccess& buffer, int idx,
-    const uint8_t* sctBuf, const NibbleDescr* pNibbleDescr) const
+void DiskImg::EncodeNibble62(uint8_t* nibBuf, const uint8_t* sctBuf,
+    const NibbleDescr* pNibbleDescr) const
 {
-    uint8_t top[256];
-    uint8_t twos[kChunkSize62];
-    int twoPosn, twoShift;
+    uint8_t vals[kDataSize62 - 1];      // twos, then top
+    uint8_t* top = vals + kChunkSize62;
     int i;
 
-    memset(twos, 0, sizeof(twos));
-
-    twoShift = 0;
-    for (i = 0, twoPosn = kChunkSize62-1; i < 256; i++) {
-        unsigned int val = sctBuf[i];
-        top[i] = val >> 2;
-        twos[twoPosn] |= ((val & 0x01) << 1 | (val & 0x02) >> 1) << twoShift;
-
-        if (twoPosn == 0) {
-            twoPosn = kChunkSize62;
-            twoShift += 2;
-        }
-        twoPosn--;
-    }
-
-    int chksum = pNibbleDescr->dataChecksumSeed;
-    for (i = kChunkSize62-1; i >= 0; i--) {
-        assert(twos[i] < sizeof(kDiskBytes62));
-        buffer[idx++] = kDiskBytes62[twos[i] ^ chksum];
-        chksum = twos[i];
+    /*
+     * Gather the low bits, swapped, from bytes i, i+86, and i+172.  This
+     * is the reverse of what DecodeNibble62 does.
+     */
+    for (i = 0; i < kChunkSize62; i++) {
+        unsigned int val1 = sctBuf[i];
+        unsigned int val2 = sctBuf[i + kChunkSize62];
+        unsigned int val3 =
+            (i + kChunkSize62*2 < 256) ? sctBuf[i + kChunkSize62*2] : 0;
+        vals[i] = ((val1 & 0x01) << 1 | (val1 & 0x02) >> 1) |
+            ((val2 & 0x01) << 1 | (val2 & 0x02) >> 1) << 2 |
+            ((val3 & 0x01) << 1 | (val3 & 0x02) >> 1) << 4;
     }
-
-    for (i = 0; i < 256; i++) {
-        assert(top[i] < sizeof(kDiskBytes62));
-        buffer[idx++] = kDiskBytes62[top[i] ^ chksum];
-        chksum = top[i];
+    for (i = 0; i < 256; i++)
+        top[i] = sctBuf[i] >> 2;
+
+    uint8_t chksum = pNibbleDescr->dataChecksumSeed;
+    for (i = 0; i < kDataSize62 - 1; i++) {
+        assert(vals[i] < sizeof(kDiskBytes62));
+        nibBuf[i] = kDiskBytes62[(vals[i] ^ chksum) & 0x3f];
+        chksum = vals[i];
     }
 
     //printf("Enc checksum value is 0x%02x\n", chksum);
-    buffer[idx++] = kDiskBytes62[chksum];
+    nibBuf[i] = kDiskBytes62[chksum];
 }
 
 /*
- * Decode 5&3 encoding.
+ * Decode 5&3 encoding.  "nibBuf" holds kDataSize53 disk bytes.
  */
-DIError DiskImg::DecodeNibble53(const CircularBufferAccess& buffer, int idx,
-    uint8_t* sctBuf, const NibbleDescr* pNibbleDescr)
+DIError DiskImg::DecodeNibble53(const uint8_t* nibBuf, uint8_t* sctBuf,
+    const NibbleDescr* pNibbleDescr)
 {
+    uint8_t vals[kDataSize53];
     uint8_t base[256];
     uint8_t threes[kThreeSize];
-    int chksum = pNibbleDescr->dataChecksumSeed;
-    uint8_t decodedVal;
+    uint8_t chksum, invalid;
     int i;
 
     /*
-     * Pull the 410 bytes out, convert them from disk bytes to 5-bit
-     * values, and arrange them into a DOS-like pair of buffers.
+     * Convert the 411 bytes from disk bytes to 5-bit values, and undo
+     * the XOR chain.  Valid values are < 32.
      */
-    for (i = kThreeSize-1; i >= 0; i--) {
-        decodedVal = kInvDiskBytes53[buffer[idx++]];
-        if (decodedVal == kInvInvalidValue)
-            return kDIErrInvalidDiskByte;
-        assert(decodedVal < sizeof(kDiskBytes53));
-
-        chksum ^= decodedVal;
-        threes[i] = chksum;
+    invalid = 0;
+    for (i = 0; i < kDataSize53; i++) {
+        vals[i] = kInvDiskBytes53[nibBuf[i]];
+        invalid |= vals[i];
     }
+    if ((invalid & 0xe0) != 0)
+        return kDIErrInvalidDiskByte;
 
-    for (i = 0; i < 256; i++) {
-        decodedVal = kInvDiskBytes53[buffer[idx++]];
-        if (decodedVal == kInvInvalidValue)
-            return kDIErrInvalidDiskByte;
-        assert(decodedVal < sizeof(kDiskBytes53));
-
-        chksum ^= decodedVal;
-        base[i] = (chksum << 3);
+    chksum = pNibbleDescr->dataChecksumSeed;
+    for (i = 0; i < kDataSize53; i++) {
+        chksum ^= vals[i];
+        vals[i] = chksum;
     }
 
     /*
-     * Grab the 411th byte (the checksum byte) and see if we did this
-     * right.
+     * The 411th byte is the checksum, so everything XORed together
+     * should come out to zero.
      */
     //printf("Dec checksum value is 0x%02x\n", chksum);
-    decodedVal = kInvDiskBytes53[buffer[idx++]];
-    if (decodedVal == kInvInvalidValue)
-        return kDIErrInvalidDiskByte;
-    assert(decodedVal < sizeof(kDiskBytes53));
-    chksum ^= decodedVal;
-
     if (pNibbleDescr->dataVerifyChecksum && chksum != 0) {
         LOGI("    NIB bad data checksum (0x%02x)", chksum);
         return kDIErrBadChecksum;
     }
 
+    /*
+     * Arrange them into a DOS-like pair of buffers.  The "threes" are
+     * stored backward.
+     */
+    for (i = 0; i < kThreeSize; i++)
+        threes[i] = vals[kThreeSize-1 - i];
+    for (i = 0; i < 256; i++)
+        base[i] = (uint8_t) (vals[kThreeSize + i] << 3);
+
     /*
      * Convert this pile of stuff into 256 data bytes.
      */
@@ -412,10 +500,10 @@ DIError DiskImg::DecodeNibble53(const CircularBufferAccess& buffer, int idx,
 }
 
 /*
- * Encode 5&3 encoding.
+ * Encode 5&3 encoding.  Fills kDataSize53 bytes of "nibBuf".
  */
-void DiskImg::EncodeNibble53(const CircularBufferAccess& buffer, int idx,
-    const uint8_t* sctBuf, const NibbleDescr* pNibbleDescr) const
+void DiskImg::EncodeNibble53(uint8_t* nibBuf, const uint8_t* sctBuf,
+    const NibbleDescr* pNibbleDescr) const
 {
     uint8_t top[kChunkSize53 * 5 +1];     // (255 / 0xff) +1
     uint8_t threes[kChunkSize53 * 3 +1];  // (153 / 0x99) +1
@@ -465,21 +553,20 @@ void DiskImg::EncodeNibble53(const CircularBufferAccess& buffer, int idx,
     int chksum = pNibbleDescr->dataChecksumSeed;
     for (i = sizeof(threes)-1; i >= 0; i--) {
         assert(threes[i] < sizeof(kDiskBytes53));
-        buffer[idx++] = kDiskBytes53[threes[i] ^ chksum];
+        *nibBuf++ = kDiskBytes53[threes[i] ^ chksum];
         chksum = threes[i];
     }
 
     for (i = 0; i < 256; i++) {
         assert(top[i] < sizeof(kDiskBytes53));
-        buffer[idx++] = kDiskBytes53[top[i] ^ chksum];
+        *nibBuf++ = kDiskBytes53[top[i] ^ chksum];
         chksum = top[i];
     }
 
     //printf("Enc checksum value is 0x%02x\n", chksum);
-    buffer[idx++] = kDiskBytes53[chksum];
+    *nibBuf++ = kDiskBytes53[chksum];
 }
 
-
 /*
  * ===========================================================================
  *      Higher-level functions
@@ -546,12 +633,19 @@ void DiskImg::DumpNibbleDescr(const NibbleDescr* pNibDescr) const
 
 
 /*
- * Load a nibble track into our track buffer.
+ * Load a nibble track, making it the current track (fNibbleTrackBuf).
+ *
+ * Tracks are kept in a small LRU cache, so switching back and forth
+ * between a few tracks doesn't re-read them.  If the least-recently-used
+ * slot holds a modified track, it's written out before being reused.
  */
 DIError DiskImg::LoadNibbleTrack(long track, long* pTrackLen)
 {
     DIError dierr = kDIErrNone;
+    NibbleTrackSlot* pSlot = NULL;
+    NibbleTrackSlot* pVictim = NULL;
     long offset;
+    int i;
     assert(track >= 0 && track < kMaxNibbleTracks525);
 
     *pTrackLen = GetNibbleTrackLength(track);
@@ -563,35 +657,99 @@ DIError DiskImg::LoadNibbleTrack(long track, long* pTrackLen)
 #ifdef NIB_VERBOSE_DEBUG
         LOGI("  DI track %d already loaded", track);
 #endif
+        fNibbleCacheStats.hits++;
+        fpNibbleCurSlot->lastUse = ++fNibbleUseCount;
         return kDIErrNone;
-    } else {
-        LOGI("  DI loading track %ld", track);
     }
 
-    /* invalidate in case we fail with partial read */
-    fNibbleTrackLoaded = -1;
-
-    /* alloc track buffer if needed */
-    if (fNibbleTrackBuf == NULL) {
-        fNibbleTrackBuf = new uint8_t[kTrackAllocSize];
-        if (fNibbleTrackBuf == NULL)
+    /* alloc the slot table if needed */
+    if (fpNibbleSlots == NULL) {
+        if (fCacheMode == kCacheModeOff)
+            fNumNibbleSlots = 1;
+        else
+            fNumNibbleSlots = (int) (fCacheMaxBytes / kTrackAllocSize);
+        if (fNumNibbleSlots < 1)
+            fNumNibbleSlots = 1;
+        else if (fNumNibbleSlots > kMaxNibbleTracks525)
+            fNumNibbleSlots = kMaxNibbleTracks525;
+
+        fpNibbleSlots = new NibbleTrackSlot[fNumNibbleSlots];
+        if (fpNibbleSlots == NULL)
             return kDIErrMalloc;
+        for (i = 0; i < fNumNibbleSlots; i++) {
+            fpNibbleSlots[i].buf = NULL;
+            fpNibbleSlots[i].track = -1;
+            fpNibbleSlots[i].dirty = false;
+            fpNibbleSlots[i].lastUse = 0;
+            fpNibbleSlots[i].map.pNibbleDescr = NULL;
+        }
+        LOGD(" DI nibble track cache has %d slots", fNumNibbleSlots);
     }
 
-    /*
-     * Read the entire track into memory.
-     */
-    dierr = CopyBytesOut(fNibbleTrackBuf, offset, *pTrackLen);
-    if (dierr != kDIErrNone)
-        return dierr;
+    /* see if we have it; if not, find the least-recently-used slot */
+    for (i = 0; i < fNumNibbleSlots; i++) {
+        if (fpNibbleSlots[i].track == track) {
+            pSlot = &fpNibbleSlots[i];
+            break;
+        }
+        if (pVictim == NULL || fpNibbleSlots[i].lastUse < pVictim->lastUse)
+            pVictim = &fpNibbleSlots[i];
+    }
+
+    if (pSlot != NULL) {
+        fNibbleCacheStats.hits++;
+    } else {
+        LOGI("  DI loading track %ld", track);
+        fNibbleCacheStats.misses++;
+        pSlot = pVictim;
+
+        if (pSlot->track >= 0) {
+            if (pSlot->dirty) {
+                dierr = WriteNibbleSlot(pSlot);
+                if (dierr != kDIErrNone)
+                    return dierr;
+            }
+            fNibbleCacheStats.evictions++;
+        }
+
+        /* invalidate in case we fail with partial read */
+        pSlot->track = -1;
+        pSlot->map.pNibbleDescr = NULL;
+        if (pSlot == fpNibbleCurSlot) {
+            fpNibbleCurSlot = NULL;
+            fNibbleTrackBuf = NULL;
+            fNibbleTrackLoaded = -1;
+        }
+
+        /* alloc track buffer if needed */
+        if (pSlot->buf == NULL) {
+            pSlot->buf = new uint8_t[kTrackAllocSize];
+            if (pSlot->buf == NULL)
+                return kDIErrMalloc;
+        }
+
+        /*
+         * Read the entire track into memory.
+         */
+        dierr = CopyBytesOut(pSlot->buf, offset, *pTrackLen);
+        if (dierr != kDIErrNone)
+            return dierr;
+        GetIOStatsSink()->nibbleTrackLoads++;
+
+        pSlot->track = track;
+    }
 
+    pSlot->lastUse = ++fNibbleUseCount;
+    fpNibbleCurSlot = pSlot;
+    fNibbleTrackBuf = pSlot->buf;
     fNibbleTrackLoaded = track;
 
     return dierr;
 }
 
 /*
- * Save the track buffer back to disk.
+ * Save the current track buffer back to disk.  In write-back mode the
+ * track is just marked as dirty, and written by FlushNibbleTracks.
  */
 DIError DiskImg::SaveNibbleTrack(void)
 {
@@ -599,46 +757,134 @@ DIError DiskImg::SaveNibbleTrack(void)
         LOGI("ERROR: tried to save track without loading it first");
         return kDIErrInternal;
     }
-    assert(fNibbleTrackBuf != NULL);
+    assert(fpNibbleCurSlot != NULL);
+    assert(fpNibbleCurSlot->track == fNibbleTrackLoaded);
+
+    /* the caller changed the buffer; re-map before the next lookup */
+    fpNibbleCurSlot->map.pNibbleDescr = NULL;
+
+    if (fCacheMode == kCacheModeWriteBack) {
+        fpNibbleCurSlot->dirty = true;
+
+        /* CopyBytesIn would do this; set it here and everywhere above */
+        DiskImg* pImg = this;
+        while (pImg != NULL) {
+            pImg->fDirty = true;
+            pImg = pImg->fpParentImg;
+        }
+        return kDIErrNone;
+    }
+
+    return WriteNibbleSlot(fpNibbleCurSlot);
+}
+
+/*
+ * Write a cached track to fpDataGFD.
+ */
+DIError DiskImg::WriteNibbleSlot(NibbleTrackSlot* pSlot)
+{
+    DIError dierr;
+    long trackLen = GetNibbleTrackLength(pSlot->track);
+    long offset = GetNibbleTrackOffset(pSlot->track);
+
+    dierr = CopyBytesIn(pSlot->buf, offset, trackLen);
+    if (dierr != kDIErrNone)
+        return dierr;
+
+    if (pSlot->dirty) {
+        fNibbleCacheStats.writeBacks++;
+        pSlot->dirty = false;
+    }
+    return kDIErrNone;
+}
 
+/*
+ * Write all modified tracks, in ascending track order.
+ */
+DIError DiskImg::FlushNibbleTracks(void)
+{
     DIError dierr = kDIErrNone;
-    long trackLen = GetNibbleTrackLength(fNibbleTrackLoaded);
-    long offset = GetNibbleTrackOffset(fNibbleTrackLoaded);
+    DIAutoLock lock(fpLock);     // protects the track cache
+    bool wrote = false;
+    int track, i;
 
-    /* write the track to fpDataGFD */
-    dierr = CopyBytesIn(fNibbleTrackBuf, offset, trackLen);
-    return dierr;
+    if (fpNibbleSlots == NULL)
+        return kDIErrNone;
+
+    for (track = 0; track < kMaxNibbleTracks525; track++) {
+        for (i = 0; i < fNumNibbleSlots; i++) {
+            if (fpNibbleSlots[i].track == track && fpNibbleSlots[i].dirty)
+                break;
+        }
+        if (i == fNumNibbleSlots)
+            continue;
+
+        dierr = WriteNibbleSlot(&fpNibbleSlots[i]);
+        if (dierr != kDIErrNone) {
+            LOGI("  DI failed writing nibble track %d", track);
+            return dierr;
+        }
+        wrote = true;
+    }
+
+    if (wrote)
+        fNibbleCacheStats.flushes++;
+    return kDIErrNone;
 }
 
+/*
+ * Discard the track cache.  Anything modified should already have been
+ * flushed.
+ */
+void DiskImg::FreeNibbleTracks(void)
+{
+    int i;
+
+    for (i = 0; i < fNumNibbleSlots; i++) {
+        if (fpNibbleSlots[i].dirty) {
+            LOGW("  DI discarding modified nibble track %d",
+                fpNibbleSlots[i].track);
+        }
+        delete[] fpNibbleSlots[i].buf;
+    }
+    delete[] fpNibbleSlots;
+    fpNibbleSlots = NULL;
+    fNumNibbleSlots = 0;
+    fpNibbleCurSlot = NULL;
+    fNibbleTrackBuf = NULL;
+    fNibbleTrackLoaded = -1;
+}
 
 /*
- * Count up the number of readable sectors found on this track, and
- * return it.  If "pVol" is non-NULL, return the volume number from
- * one of the readable sectors.
+ * Count up the number of readable sectors found on a copy of a track,
+ * and return it.  If "pVol" is non-NULL, return the volume number from
+ * one of the sectors.
+ *
+ * This doesn't touch the track cache, so it's safe to call from several
+ * threads at once.
  */
-int DiskImg::TestNibbleTrack(int track, const NibbleDescr* pNibbleDescr,
-    int* pVol)
+int DiskImg::TestNibbleTrack(const uint8_t* trackBuf, long trackLen,
+    int track, const NibbleDescr* pNibbleDescr, int* pVol)
 {
-    long trackLen;
+    NibbleSectorMap map;
     int count = 0;
 
     assert(track >= 0 && track < kTrackCount525);
     assert(pNibbleDescr != NULL);
 
-    if (LoadNibbleTrack(track, &trackLen) != kDIErrNone) {
-        LOGI("   DI FindNibbleSectorStart: LoadNibbleTrack failed");
-        return 0;
-    }
+    if (trackLen <= 0)
+        return 0;       // couldn't load it
 
-    CircularBufferAccess buffer(fNibbleTrackBuf, trackLen);
+    MapNibbleTrack(trackBuf, trackLen, track, pNibbleDescr, &map);
+
+    CircularBufferAccess buffer(trackBuf, trackLen);
 
     int i, sectorIdx;
     for (i = 0; i < pNibbleDescr->numSectors; i++) {
-        int vol;
-        sectorIdx = FindNibbleSectorStart(buffer, track, i, pNibbleDescr, &vol);
+        sectorIdx = map.dataIdx[i];
         if (sectorIdx >= 0) {
             if (pVol != NULL)
-                *pVol = vol;
+                *pVol = map.vol[i];
 
             uint8_t sctBuf[256];
             if (DecodeNibbleData(buffer, sectorIdx, sctBuf, pNibbleDescr) == kDIErrNone)
@@ -652,6 +898,75 @@ int DiskImg::TestNibbleTrack(int track, const NibbleDescr* pNibbleDescr,
     return count;
 }
 
+/*
+ * Shared state for the NibbleDescr tests in AnalyzeNibbleData.
+ */
+enum { kNumNibbleProbeTracks = 4 };
+static const int kNibbleProbeTracks[kNumNibbleProbeTracks] = { 1, 16, 17, 26 };
+static const int kNibbleProbeVolTrack = 2;      // index of track 17
+
+typedef struct NibbleTestState {
+    DiskImg*        pImg;
+    const uint8_t*  trackBuf[kNumNibbleProbeTracks];
+    long            trackLen[kNumNibbleProbeTracks];    // 0 if not loaded
+    int*            vol;        // per-descr volume, or kVolumeNumNotSet
+    DIMutex         lock;
+    int             nextDescr;  // next descr to hand out
+    int             firstMatch; // lowest-numbered match so far
+    long            numScans;   // for fIOStats.nibbleTrackScans
+} NibbleTestState;
+
+/*
+ * Thread body for AnalyzeNibbleData.  Works like FSTestThread: entries are
+ * handed out in table order, and once one matches, the ones after it
+ * are skipped.
+ */
+/*static*/ void DiskImg::NibbleTestThread(void* vState, int /*threadIdx*/)
+{
+    NibbleTestState* pState = (NibbleTestState*) vState;
+    DiskImg* pImg = pState->pImg;
+
+    while (true) {
+        int idx;
+
+        pState->lock.Lock();
+        idx = pState->nextDescr++;
+        if (idx >= pState->firstMatch) {
+            pState->lock.Unlock();
+            break;
+        }
+        pState->lock.Unlock();
+
+        const NibbleDescr* pNibbleDescr = &pImg->fpNibbleDescrTable[idx];
+        if (pNibbleDescr->numSectors == 0) {
+            /* uninitialized "custom" entry */
+            LOGI("  Skipping '%s'", pNibbleDescr->description);
+            continue;
+        }
+        LOGI("  Trying '%s'", pNibbleDescr->description);
+
+        /*
+         * Try to read sectors from tracks 1, 16, 17, and 26.  If we can
+         * get at least 13 out of 16 (or 10 out of 13) on three out of four
+         * tracks, we have a winner.
+         */
+        int goodTracks = 0;
+        for (int i = 0; i < kNumNibbleProbeTracks; i++) {
+            int good = pImg->TestNibbleTrack(pState->trackBuf[i],
+                        pState->trackLen[i], kNibbleProbeTracks[i],
+                        pNibbleDescr,
+                        (i == kNibbleProbeVolTrack) ? &pState->vol[idx] : NULL);
+            if (good > pNibbleDescr->numSectors - 4)
+                goodTracks++;
+        }
+
+        DIAutoLock lock(&pState->lock);
+        pState->numScans += kNumNibbleProbeTracks;
+        if (goodTracks >= 3 && idx < pState->firstMatch)
+            pState->firstMatch = idx;
+    }
+}
+
 /*
  * Analyze the nibblized track data.
  *
@@ -662,6 +977,10 @@ int DiskImg::TestNibbleTrack(int track, const NibbleDescr* pNibbleDescr,
  *  fpNibbleDescr points to the most-likely-to-succeed NibbleDescr
  *  fDOSVolumeNum holds a volume number from one of the tracks
  *  fNumTracks holds the number of tracks on the disk
+ *
+ * The probe tracks are copied out once, and the NibbleDescr entries
+ * tested against the copies on up to fProbeThreads threads.  The first
+ * entry in the table that works is the one we pick, as before.
  */
 DIError DiskImg::AnalyzeNibbleData(void)
 {
@@ -676,51 +995,72 @@ DIError DiskImg::AnalyzeNibbleData(void)
         fNumTracks = kTrackCount525;
     }
 
-    /*
-     * Try to read sectors from tracks 1, 16, 17, and 26.  If we can get
-     * at least 13 out of 16 (or 10 out of 13) on three out of four tracks,
-     * we have a winner.
-     */
-    int i, good, goodTracks;
-    int protoVol = kVolumeNumNotSet;
+    DIError dierr = kDIErrNone;
+    NibbleTestState state;
+    uint8_t* trackBufs = new uint8_t[kNumNibbleProbeTracks * kTrackAllocSize];
+    int numThreads = fProbeThreads;
+    int i;
 
-    for (i = 0; i < fNumNibbleDescrEntries; i++) {
-        if (fpNibbleDescrTable[i].numSectors == 0) {
-            /* uninitialized "custom" entry */
-            LOGI("  Skipping '%s'", fpNibbleDescrTable[i].description);
+    state.pImg = this;
+    state.vol = new int[fNumNibbleDescrEntries];
+    state.nextDescr = 0;
+    state.firstMatch = fNumNibbleDescrEntries;
+    state.numScans = 0;
+    for (i = 0; i < fNumNibbleDescrEntries; i++)
+        state.vol[i] = kVolumeNumNotSet;
+
+    for (i = 0; i < kNumNibbleProbeTracks; i++) {
+        long trackLen;
+
+        state.trackBuf[i] = trackBufs + i * kTrackAllocSize;
+        state.trackLen[i] = 0;
+        if (LoadNibbleTrack(kNibbleProbeTracks[i], &trackLen) != kDIErrNone) {
+            LOGI("   DI AnalyzeNibbleData: LoadNibbleTrack %d failed",
+                kNibbleProbeTracks[i]);
             continue;
         }
-        LOGI("  Trying '%s'", fpNibbleDescrTable[i].description);
-        goodTracks = 0;
-
-        good = TestNibbleTrack(1, &fpNibbleDescrTable[i], NULL);
-        if (good > fpNibbleDescrTable[i].numSectors - 4)
-            goodTracks++;
-        good = TestNibbleTrack(16, &fpNibbleDescrTable[i], NULL);
-        if (good > fpNibbleDescrTable[i].numSectors - 4)
-            goodTracks++;
-        good = TestNibbleTrack(17, &fpNibbleDescrTable[i], &protoVol);
-        if (good > fpNibbleDescrTable[i].numSectors - 4)
-            goodTracks++;
-        good = TestNibbleTrack(26, &fpNibbleDescrTable[i], NULL);
-        if (good > fpNibbleDescrTable[i].numSectors - 4)
-            goodTracks++;
-
-        if (goodTracks >= 3) {
-            LOGI("  Looks like '%s' (%d-sector), vol=%d",
-                fpNibbleDescrTable[i].description,
-                fpNibbleDescrTable[i].numSectors, protoVol);
-            fpNibbleDescr = &fpNibbleDescrTable[i];
-            fDOSVolumeNum = protoVol;
-            break;
-        }
+        memcpy(trackBufs + i * kTrackAllocSize, fNibbleTrackBuf, trackLen);
+        state.trackLen[i] = trackLen;
     }
-    if (i == fNumNibbleDescrEntries) {
+
+    if (numThreads < 1)
+        numThreads = 1;
+    if (numThreads > fNumNibbleDescrEntries)
+        numThreads = fNumNibbleDescrEntries;
+    if (numThreads > 1)
+        LOGD(" DI testing nibble formats on %d threads", numThreads);
+    RunThreads(numThreads, NibbleTestThread, &state);
+    GetIOStatsSink()->nibbleTrackScans += state.numScans;
+
+    if (state.firstMatch == fNumNibbleDescrEntries) {
         LOGI("AnalyzeNibbleData did not find matching NibbleDescr");
-        return kDIErrBadNibbleSectors;
+        dierr = kDIErrBadNibbleSectors;
+        goto bail;
     }
 
-    return kDIErrNone;
+    /*
+     * Entries tested before the winner could have set the volume number
+     * when the serial loop ran them, so take the latest one.
+     */
+    {
+        int protoVol = kVolumeNumNotSet;
+        for (i = state.firstMatch; i >= 0; i--) {
+            if (state.vol[i] != kVolumeNumNotSet) {
+                protoVol = state.vol[i];
+                break;
+            }
+        }
+
+        fpNibbleDescr = &fpNibbleDescrTable[state.firstMatch];
+        fDOSVolumeNum = protoVol;
+        LOGI("  Looks like '%s' (%d-sector), vol=%d",
+            fpNibbleDescr->description, fpNibbleDescr->numSectors, protoVol);
+    }
+
+bail:
+    delete[] state.vol;
+    delete[] trackBufs;
+    return dierr;
 }
 
 /*
@@ -751,6 +1091,7 @@ DIError DiskImg::ReadNibbleSector(long track, int sector, void* buf,
     DIError dierr = kDIErrNone;
     long trackLen;
     int sectorIdx, vol;
+    DIAutoLock lock(fpLock);     // protects fNibbleTrackBuf
 
     dierr = LoadNibbleTrack(track, &trackLen);
     if (dierr != kDIErrNone) {
@@ -759,7 +1100,7 @@ DIError DiskImg::ReadNibbleSector(long track, int sector, void* buf,
     }
 
     CircularBufferAccess buffer(fNibbleTrackBuf, trackLen);
-    sectorIdx = FindNibbleSectorStart(buffer, track, sector, pNibbleDescr,
+    sectorIdx = FindNibbleSectorStart(track, trackLen, sector, pNibbleDescr,
                     &vol);
     if (sectorIdx < 0)
         return kDIErrSectorUnreadable;
@@ -770,6 +1111,61 @@ DIError DiskImg::ReadNibbleSector(long track, int sector, void* buf,
     return dierr;
 }
 
+/*
+ * Read all of the sectors on a nibble track, in physical order.  "buf"
+ * must hold pNibbleDescr->numSectors * kSectorSize bytes.
+ *
+ * The track is loaded and mapped once, and each sector decoded straight
+ * from the track buffer.  Sectors that can't be found or decoded are
+ * zeroed and have their bit set in "*pBadMask".
+ */
+DIError DiskImg::ReadNibbleTrackSectors(long track, uint8_t* buf,
+    uint32_t* pBadMask, const NibbleDescr* pNibbleDescr)
+{
+    if (pNibbleDescr == NULL) {
+        /* disk has no recognizable sectors */
+        LOGI(" DI ReadNibbleTrackSectors: pNibbleDescr is NULL");
+        return kDIErrBadNibbleSectors;
+    }
+
+    assert(IsNibbleFormat(fPhysical));
+    assert(track >= 0 && track < GetNumTracks());
+    assert(pNibbleDescr->numSectors <= kMaxNibbleSectors);
+
+    DIError dierr = kDIErrNone;
+    long trackLen;
+    int sector;
+    DIAutoLock lock(fpLock);     // protects fNibbleTrackBuf
+
+    *pBadMask = 0;
+
+    dierr = LoadNibbleTrack(track, &trackLen);
+    if (dierr != kDIErrNone) {
+        LOGI("   DI ReadNibbleTrackSectors: LoadNibbleTrack %ld failed",
+            track);
+        return dierr;
+    }
+
+    const NibbleSectorMap* pMap =
+        GetNibbleSectorMap(track, trackLen, pNibbleDescr);
+
+    CircularBufferAccess buffer(fNibbleTrackBuf, trackLen);
+    for (sector = 0; sector < pNibbleDescr->numSectors; sector++) {
+        uint8_t* sctBuf = buf + sector * kSectorSize;
+        int sectorIdx = pMap->dataIdx[sector];
+
+        if (sectorIdx < 0 ||
+            DecodeNibbleData(buffer, sectorIdx, sctBuf,
+                pNibbleDescr) != kDIErrNone)
+        {
+            memset(sctBuf, 0, kSectorSize);
+            *pBadMask |= 1UL << sector;
+        }
+    }
+
+    return kDIErrNone;
+}
+
 /*
  * Write a sector to a nibble image.
  */
@@ -785,6 +1181,7 @@ DIError DiskImg::WriteNibbleSector(long track, int sector, const void* buf,
     DIError dierr = kDIErrNone;
     long trackLen;
     int sectorIdx, vol;
+    DIAutoLock lock(fpLock);     // protects fNibbleTrackBuf
 
     dierr = LoadNibbleTrack(track, &trackLen);
     if (dierr != kDIErrNone) {
@@ -793,7 +1190,7 @@ DIError DiskImg::WriteNibbleSector(long track, int sector, const void* buf,
     }
 
     CircularBufferAccess buffer(fNibbleTrackBuf, trackLen);
-    sectorIdx = FindNibbleSectorStart(buffer, track, sector, pNibbleDescr,
+    sectorIdx = FindNibbleSectorStart(track, trackLen, sector, pNibbleDescr,
                     &vol);
     if (sectorIdx < 0)
         return kDIErrSectorUnreadable;
@@ -817,6 +1214,7 @@ DIError DiskImg::WriteNibbleSector(long track, int sector, const void* buf,
 DIError DiskImg::ReadNibbleTrack(long track, uint8_t* buf, long* pTrackLen)
 {
     DIError dierr;
+    DIAutoLock lock(fpLock);     // protects fNibbleTrackBuf
 
     dierr = LoadNibbleTrack(track, pTrackLen);
     if (dierr != kDIErrNone) {
@@ -839,6 +1237,7 @@ DIError DiskImg::WriteNibbleTrack(long track, const uint8_t* buf, long trackLen)
 {
     DIError dierr;
     long oldTrackLen;
+    DIAutoLock lock(fpLock);     // protects fNibbleTrackBuf
 
     /* load the track to set the "current track" stuff */
     dierr = LoadNibbleTrack(track, &oldTrackLen);
@@ -54,6 +54,16 @@ const int kChunkSize35 = 175;       // ceil(524 / 3)
 const int kOffsetToChecksum = 699;
 const int kNibblizedOutputLen = (kOffsetToChecksum + 4);
 const int kMaxDataReach = 48;       // should only be 6 bytes */
+const int kAddrFieldLen = 10;       // prolog + 5 values + epilog
+
+/*
+ * How far past the end of the track the sector scan can look.  An address
+ * field that starts on the last byte is followed by up to kMaxDataReach
+ * bytes of junk, the data prolog and sector number, the nibblized data and
+ * checksum, and the epilog.
+ */
+const int kMaxTrackOverrun =
+    kAddrFieldLen + kMaxDataReach + 4 + kNibblizedOutputLen + 2;
 
 enum {
     kAddrProlog0 = 0xd5,
@@ -110,20 +120,62 @@ enum {
     long nibbleLen, uint8_t* outputBuf, int cyl, int head,
     LinearBitmap* pBadBlockMap)
 {
-    CircularBufferAccess buffer(nibbleBuf, nibbleLen);
+    DIError dierr;
+    uint32_t badSectors;
+
+    dierr = DecodeNibbleTrack35(nibbleBuf, nibbleLen, outputBuf, cyl, head,
+                &badSectors);
+    if (dierr != kDIErrNone)
+        return dierr;
+
+    MarkBadSectors35(cyl, head, badSectors, pBadBlockMap);
+    return kDIErrNone;
+}
+
+/*
+ * Decode all sectors on a nibble track.  Sector N is written to
+ * outputBuf + 512 * N, and bit N of "*pBadSectors" is set if the sector
+ * was missing or had a bad checksum.
+ *
+ * This doesn't touch anything but its arguments, so tracks can be decoded
+ * on separate threads and the bad sectors merged into the disk's bad block
+ * map afterward with MarkBadSectors35().
+ *
+ * "outputBuf" must be able to hold 512 * 12 sectors of decoded sector data.
+ */
+/*static*/ DIError DiskImg::DecodeNibbleTrack35(const uint8_t* nibbleBuf,
+    long nibbleLen, uint8_t* outputBuf, int cyl, int head,
+    uint32_t* pBadSectors)
+{
     bool foundSector[kMaxSectorsPerTrack];
     uint8_t sectorBuf[kSectorSize35];
     uint8_t readSum[kDataChecksumLen];
     uint8_t calcSum[kDataChecksumLen];
+    uint8_t* buffer;
+    uint32_t badSectors = 0;
     int i;
 
+    assert(nibbleLen > 0);
+
+    /*
+     * The track is circular, so a sector can straddle the end of the
+     * buffer.  Rather than wrapping every index, make a copy with the
+     * start of the track repeated past the end, and scan that linearly.
+     */
+    buffer = new uint8_t[nibbleLen + kMaxTrackOverrun];
+    if (buffer == NULL)
+        return kDIErrMalloc;
+    memcpy(buffer, nibbleBuf, nibbleLen);
+    for (i = 0; i < kMaxTrackOverrun; i++)
+        buffer[nibbleLen + i] = buffer[i];  // works even if track is short
+
     memset(&foundSector, 0, sizeof(foundSector));
 
     i = 0;
     while (i < nibbleLen) {
         int sector;
 
-        i = FindNextSector35(buffer, i, cyl, head, &sector);
+        i = FindNextSector35(buffer, i, nibbleLen, cyl, head, &sector);
         if (i < 0)
             break;
 
@@ -150,21 +202,23 @@ enum {
                     LOGI("Nib35:  marking cyl=%d head=%d sect=%d (block=%d)",
                         cyl, head, sector,
                         CylHeadSect35ToBlock(cyl, head, sector));
-                    pBadBlockMap->Set(CylHeadSect35ToBlock(cyl, head, sector));
+                    badSectors |= 1 << sector;
                 }
             }
         }
     }
 
+    delete[] buffer;
+
     /*
-     * Check to see if we have all our parts.  Anything missing sets
-     * a flag in the "bad block" map.
+     * Check to see if we have all our parts.  Anything missing is
+     * reported as bad.
      */
     for (i = SectorsPerTrack35(cyl)-1; i >= 0; i--) {
         if (!foundSector[i]) {
             LOGI("Nib35: didn't find cyl=%d head=%d sect=%d (block=%d)",
                 cyl, head, i, CylHeadSect35ToBlock(cyl, head, i));
-            pBadBlockMap->Set(CylHeadSect35ToBlock(cyl, head, i));
+            badSectors |= 1 << i;
         }
 
         /*
@@ -175,21 +229,37 @@ enum {
         {
             LOGI("DEBUG: setting bad %d/%d/%d (%d)",
                 cyl, head, i, CylHeadSect35ToBlock(cyl, head, i));
-            pBadBlockMap->Set(CylHeadSect35ToBlock(cyl, head, i));
+            badSectors |= 1 << i;
         }
         */
     }
 
+    *pBadSectors = badSectors;
     return kDIErrNone;      // maybe return an error if nothing found?
 }
 
+/*
+ * Set the blocks for the sectors in "badSectors" in the bad block map.
+ */
+/*static*/ void DiskImg::MarkBadSectors35(int cyl, int head,
+    uint32_t badSectors, LinearBitmap* pBadBlockMap)
+{
+    int sect;
+
+    for (sect = 0; sect < SectorsPerTrack35(cyl); sect++) {
+        if (badSectors & (1 << sect))
+            pBadBlockMap->Set(CylHeadSect35ToBlock(cyl, head, sect));
+    }
+}
+
 /*
  * Returns the offset of the next sector, or -1 if we went off the end.
+ *
+ * Address fields must start before "end", but may extend past it.
  */
-/*static*/ int DiskImg::FindNextSector35(const CircularBufferAccess& buffer,
-    int start, int cyl, int head, int* pSector)
+/*static*/ int DiskImg::FindNextSector35(const uint8_t* buffer, int start,
+    int end, int cyl, int head, int* pSector)
 {
-    int end = buffer.GetSize();
     int i;
 
     for (i = start; i < end; i++) {
@@ -271,7 +341,7 @@ enum {
  * not return false on a checksum mismatch -- it's up to the caller to
  * verify the checksum if desired.
  */
-/*static*/ bool DiskImg::DecodeNibbleSector35(const CircularBufferAccess& buffer,
+/*static*/ bool DiskImg::DecodeNibbleSector35(const uint8_t* buffer,
     int start, uint8_t* sectorBuf, uint8_t* readChecksum,
     uint8_t* calcChecksum)
 {
@@ -439,7 +509,7 @@ enum {
  *
  * Returns "true" if all goes well, "false" otherwise.
  */
-/*static*/ bool DiskImg::UnpackChecksum35(const CircularBufferAccess& buffer,
+/*static*/ bool DiskImg::UnpackChecksum35(const uint8_t* buffer,
     int offset, uint8_t* checksumBuf)
 {
     uint8_t nib0, nib1, nib2, twos;
@@ -62,24 +62,77 @@
 }
 
 /*
- * The gzip file format has a length embedded in the footer, but
- * unfortunately there is no interface to access it.  So, we have
- * to keep reading until we run out of data, extending the buffer
- * to accommodate the new data each time.  (We could also just read
- * the footer directly, but that requires that there are no garbage
- * bytes at the end of the file, which is a real concern on some FTP sites.)
+ * Suffix added to the image's name to get the name of its saved index.
+ */
+/*static*/ const char* OuterGzip::kIndexSuffix = ".gzidx";
+
+/*
+ * Largest image we're willing to unpack to a temp file.  This is the
+ * largest volume we'll access, plus room for a header.
+ */
+/*static*/ const di_off_t OuterGzip::kMaxUncompressedSize =
+    (di_off_t) kVolumeMaxBlocks * kBlockSize + kHeaderSlop;
+
+/*
+ * The last four bytes of a gzip file hold the length of the uncompressed
+ * data (ISIZE), mod 2^32.  zlib doesn't give us access to it, and we can't
+ * rely on it entirely -- some files have garbage bytes at the end, which
+ * is a real concern on some FTP sites, and multi-member files only
+ * record the length of the last member -- but if it's plausible for the
+ * amount of compressed data we have, it's a very good guess.
+ *
+ * Returns "true" and sets "*pLength" if the value looks usable.
+ */
+/*static*/ bool OuterGzip::GetExpectedLength(GenericFD* pGFD,
+    di_off_t outerLength, di_off_t* pLength)
+{
+    const int kMinGzipLen = 10 + 2 + 8;     // header, empty deflate, footer
+    const int kMaxDeflateRatio = 1032;
+    const int kMaxHeaderLen = 4096;         // generous, for filename/comment
+    uint8_t footer[4];
+    di_off_t isize, compLen;
+
+    if (outerLength < kMinGzipLen)
+        return false;
+    if (pGFD->Seek(outerLength - 4, kSeekSet) != kDIErrNone ||
+        pGFD->Read(footer, sizeof(footer)) != kDIErrNone)
+    {
+        return false;
+    }
+    isize = GetLongLE(footer);
+    compLen = outerLength - kMinGzipLen;
+
+    /*
+     * Deflate can't do better than about 1032:1, and can't do worse
+     * than 5 bytes per 64KB stored block.
+     */
+    if (isize == 0 || isize > compLen * kMaxDeflateRatio ||
+        compLen > isize + (isize / 65535 + 1) * 5 + kMaxHeaderLen)
+    {
+        LOGI("  ExGZ ignoring implausible ISIZE %ld (comp=%ld)",
+            (long) isize, (long) compLen);
+        return false;
+    }
+
+    *pLength = isize;
+    return true;
+}
+
+/*
+ * Unpack the image into a memory buffer.
  *
- * Start out by trying sizes that we think will work (140K, 800K),
- * then grow quickly.
+ * If we have an expected length from the footer we allocate that much
+ * (plus a byte, so that we can see EOF without growing the buffer).  If
+ * the footer lied, or we didn't have one, we have to keep reading until
+ * we run out of data, extending the buffer to accommodate the new data
+ * each time.  Without a hint we start out by trying sizes that we think
+ * will work (140K, 800K), then grow quickly.
  *
- * The largest possible ProDOS image is 32MB, but it's possible to
- * have an HFS volume or a partitioned image larger than that.  We currently
- * cap the limit to avoid nasty behavior when encountering really
- * large .gz files.  This isn't great -- we ought to support extracting
- * to a temp file, or allowing the caller to specify what the largest
- * size they can handle is.
+ * If the image turns out to be larger than the memory limit, this
+ * returns kDIErrTooBig, and the caller should try again with a temp file.
  */
-DIError OuterGzip::ExtractGzipImage(gzFile gzfp, char** pBuf, di_off_t* pLength)
+DIError OuterGzip::ExtractGzipImage(gzFile gzfp, di_off_t expectedLen,
+    char** pBuf, di_off_t* pLength)
 {
     DIError dierr = kDIErrNone;
     const int kMinEmpty = 256 * 1024;
@@ -87,7 +140,7 @@ DIError OuterGzip::ExtractGzipImage(gzFile gzfp, char** pBuf, di_off_t* pLength)
     const int kNextSize1 = 801 * 1024;
     const int kNextSize2 = 1024 * 1024;
     const int kMaxIncr = 4096 * 1024;
-    const int kAbsoluteMax = kMaxUncompressedSize;
+    const long kAbsoluteMax = fMemoryLimit + kHeaderSlop;
     char* buf = NULL;
     char* newBuf = NULL;
     long curSize, maxSize;
@@ -95,9 +148,13 @@ DIError OuterGzip::ExtractGzipImage(gzFile gzfp, char** pBuf, di_off_t* pLength)
     assert(gzfp != NULL);
     assert(pBuf != NULL);
     assert(pLength != NULL);
+    assert(expectedLen <= kAbsoluteMax);
 
     curSize = 0;
-    maxSize = kStartSize;
+    if (expectedLen > 0)
+        maxSize = (long) expectedLen + 1;
+    else
+        maxSize = kStartSize;
 
     buf = new char[maxSize];
     if (buf == NULL) {
@@ -162,6 +219,14 @@ DIError OuterGzip::ExtractGzipImage(gzFile gzfp, char** pBuf, di_off_t* pLength)
                     else
                         maxSize += kMaxIncr;
                 }
+                if (maxSize > kAbsoluteMax + 1)
+                    maxSize = kAbsoluteMax + 1;
+                if (curSize > kAbsoluteMax) {
+                    LOGI("  ExGZ image is larger than memory limit (%ld)",
+                        kAbsoluteMax);
+                    dierr = kDIErrTooBig;
+                    goto bail;
+                }
 
                 newBuf = new char[maxSize];
                 if (newBuf == NULL) {
@@ -184,12 +249,11 @@ DIError OuterGzip::ExtractGzipImage(gzFile gzfp, char** pBuf, di_off_t* pLength)
             }
         }
         assert(curSize < maxSize);
+    }
 
-        if (curSize > kAbsoluteMax) {
-            LOGI("  ExGZ excessive size, probably not a disk image");
-            dierr = kDIErrTooBig;   // close enough
-            goto bail;
-        }
+    if (expectedLen > 0 && curSize != expectedLen) {
+        LOGI("  ExGZ footer said %ld bytes, got %ld",
+            (long) expectedLen, curSize);
     }
 
     if (curSize + (1024*1024) < maxSize) {
@@ -217,15 +281,126 @@ bail:
 }
 
 /*
- * Open the archive, and extract the disk image into a memory buffer.
+ * Unpack the image into "pGFD", which should be an empty temp file.
+ */
+DIError OuterGzip::ExtractGzipToFile(gzFile gzfp, GenericFD* pGFD,
+    di_off_t* pLength)
+{
+    DIError dierr = kDIErrNone;
+    const int kChunkSize = 256 * 1024;
+    char* buf = NULL;
+    di_off_t curSize = 0;
+
+    buf = new char[kChunkSize];
+    if (buf == NULL) {
+        dierr = kDIErrMalloc;
+        goto bail;
+    }
+
+    while (1) {
+        long len;
+
+        len = gzread(gzfp, buf, kChunkSize);
+        if (len < 0) {
+            LOGI("  ExGZ Call to gzread failed, errno=%d", errno);
+            dierr = kDIErrReadFailed;
+            goto bail;
+        } else if (len == 0) {
+            break;
+        }
+
+        dierr = pGFD->Write(buf, len);
+        if (dierr != kDIErrNone) {
+            LOGI("  ExGZ failed writing to temp file (err=%d)", dierr);
+            goto bail;
+        }
+        curSize += len;
+
+        if (curSize > kMaxUncompressedSize) {
+            LOGI("  ExGZ excessive size, probably not a disk image");
+            dierr = kDIErrTooBig;   // close enough
+            goto bail;
+        }
+    }
+
+    if (curSize == 0) {
+        LOGI("  ExGZ no data in gzip file");
+        dierr = kDIErrReadFailed;
+        goto bail;
+    }
+
+    *pLength = curSize;
+    LOGI("  ExGZ final size = %ld (in temp file)", (long) curSize);
+
+bail:
+    delete[] buf;
+    return dierr;
+}
+
+/*
+ * Get the name of the saved index for "imagePath".  The caller must
+ * delete[] the result.
+ */
+/*static*/ char* OuterGzip::GetIndexPath(const char* imagePath)
+{
+    char* indexPath;
+
+    indexPath = new char[strlen(imagePath) + strlen(kIndexSuffix) + 1];
+    strcpy(indexPath, imagePath);
+    strcat(indexPath, kIndexSuffix);
+    return indexPath;
+}
+
+/*
+ * Index the gzip file, so that reads only need to inflate the part of the
+ * image they touch.  The index is kept beside the image if we've been
+ * asked to.
+ *
+ * This fails on some files that gzread handles, e.g. ones with more than
+ * one member, so the caller should be ready to unpack the image instead.
+ */
+DIError OuterGzip::OpenIndexed(const char* imagePath, di_off_t* pLength,
+    GenericFD** ppNewGFD)
+{
+    DIError dierr;
+    GFDGzip* pGzipGFD = NULL;
+    char* indexPath = NULL;
+
+    if (fIndexMode == DiskImg::kGzipIndexPersist)
+        indexPath = GetIndexPath(imagePath);
+
+    pGzipGFD = new GFDGzip;
+    dierr = pGzipGFD->Open(imagePath, indexPath, fMemoryLimit);
+    if (dierr != kDIErrNone) {
+        LOGI("  ExGZ unable to index '%s' (err=%d)", imagePath, dierr);
+        goto bail;
+    }
+
+    *pLength = pGzipGFD->GetLength();
+    *ppNewGFD = pGzipGFD;
+    pGzipGFD = NULL;
+
+bail:
+    delete pGzipGFD;
+    delete[] indexPath;
+    return dierr;
+}
+
+/*
+ * Open the archive, and extract the disk image into a memory buffer.  If
+ * it's larger than our memory limit, read-only opens use an index into
+ * the compressed data instead, and everything else is unpacked into a
+ * temp file.
  */
 DIError OuterGzip::Load(GenericFD* pOuterGFD, di_off_t outerLength, bool readOnly,
     di_off_t* pWrapperLength, GenericFD** ppWrapperGFD)
 {
     DIError dierr = kDIErrNone;
     GFDBuffer* pNewGFD = NULL;
+    GFDFile* pTempGFD = NULL;
     char* buf = NULL;
     di_off_t length = -1;
+    di_off_t expectedLen = -1;
     const char* imagePath;
     gzFile gzfp = NULL;
 
@@ -235,6 +410,9 @@ DIError OuterGzip::Load(GenericFD* pOuterGFD, di_off_t outerLength, bool readOnl
         return kDIErrNotSupported;
     }
 
+    if (GetExpectedLength(pOuterGFD, outerLength, &expectedLen))
+        LOGI("  ExGZ footer says %ld bytes", (long) expectedLen);
+
     gzfp = gzopen(imagePath, "rb");        // use "readOnly" here
     if (gzfp == NULL) { // DON'T retry RO -- should be done at higher level?
         LOGI("gzopen failed, errno=%d", errno);
@@ -242,33 +420,68 @@ DIError OuterGzip::Load(GenericFD* pOuterGFD, di_off_t outerLength, bool readOnl
         goto bail;
     }
 
-    dierr = ExtractGzipImage(gzfp, &buf, &length);
-    if (dierr != kDIErrNone)
-        goto bail;
+    if (expectedLen <= fMemoryLimit + kHeaderSlop) {
+        dierr = ExtractGzipImage(gzfp, expectedLen, &buf, &length);
+        if (dierr == kDIErrTooBig) {
+            /* footer was wrong or missing; start over */
+            if (gzrewind(gzfp) != 0) {
+                LOGI("gzrewind failed");
+                dierr = kDIErrGeneric;
+                goto bail;
+            }
+        } else if (dierr != kDIErrNone) {
+            goto bail;
+        }
+    } else {
+        dierr = kDIErrTooBig;
+    }
 
-    /*
-     * Everything is going well.  Now we substitute a memory-based GenericFD
-     * for the existing GenericFD.
-     */
-    pNewGFD = new GFDBuffer;
-    dierr = pNewGFD->Open(buf, length, true, false, readOnly);
-    if (dierr != kDIErrNone)
-        goto bail;
-    buf = NULL;      // now owned by pNewGFD;
+    if (dierr == kDIErrNone) {
+        /*
+         * Everything is going well.  Now we substitute a memory-based
+         * GenericFD for the existing GenericFD.
+         */
+        pNewGFD = new GFDBuffer;
+        dierr = pNewGFD->Open(buf, length, true, false, readOnly);
+        if (dierr != kDIErrNone)
+            goto bail;
+        buf = NULL;      // now owned by pNewGFD;
+
+        *ppWrapperGFD = pNewGFD;
+        pNewGFD = NULL;
+    } else if (readOnly && fIndexMode != DiskImg::kGzipIndexNone &&
+        OpenIndexed(imagePath, &length, ppWrapperGFD) == kDIErrNone)
+    {
+        /* we'll inflate pieces on demand */
+        dierr = kDIErrNone;
+    } else {
+        /*
+         * Too big to hold in memory, so unpack into a temp file instead.
+         * It goes away when the GFD is closed.
+         */
+        LOGI("  ExGZ unpacking to temp file");
+        pTempGFD = new GFDFile;
+        dierr = pTempGFD->OpenTemp();
+        if (dierr != kDIErrNone)
+            goto bail;
+        dierr = ExtractGzipToFile(gzfp, pTempGFD, &length);
+        if (dierr != kDIErrNone)
+            goto bail;
+
+        *ppWrapperGFD = pTempGFD;
+        pTempGFD = NULL;
+    }
 
     /*
      * Success!
      */
     assert(dierr == kDIErrNone);
-    *ppWrapperGFD = pNewGFD;
-    pNewGFD = NULL;
-
     *pWrapperLength = length;
 
 bail:
-    if (dierr != kDIErrNone) {
-        delete pNewGFD;
-    }
+    delete[] buf;
+    delete pNewGFD;
+    delete pTempGFD;
     if (gzfp != NULL)
         gzclose(gzfp);
     return dierr;
@@ -286,6 +499,7 @@ DIError OuterGzip::Save(GenericFD* pOuterGFD, GenericFD* pWrapperGFD,
 {
     DIError dierr = kDIErrNone;
     const char* imagePath;
+    char* indexPath;
     gzFile gzfp = NULL;
 
     LOGI(" GZ save (wrapperLen=%ld)", (long) wrapperLength);
@@ -300,6 +514,15 @@ DIError OuterGzip::Save(GenericFD* pOuterGFD, GenericFD* pWrapperGFD,
         return kDIErrNotSupported;
     }
 
+    /*
+     * A saved index won't match the new contents.  It would be rejected
+     * anyway, but don't leave it lying around.
+     */
+    indexPath = GetIndexPath(imagePath);
+    if (remove(indexPath) == 0)
+        LOGI(" GZ removed stale index '%s'", indexPath);
+    delete[] indexPath;
+
     gzfp = gzopen(imagePath, "wb");
     if (gzfp == NULL) {
         LOGI("gzopen for write failed, errno=%d", errno);
@@ -324,7 +324,7 @@ DIError DiskFSPascal::ProcessCatalog(void)
 
     dirPtr = fDirectory + kDirectoryEntryLen;       // skip vol dir entry
     for (i = 0; i < fNumFiles; i++) {
-        pFile = new A2FilePascal(this);
+        pFile = new (this) A2FilePascal(this);
 
         pFile->fStartBlock = GetShortLE(&dirPtr[0x00]);
         pFile->fNextBlock = GetShortLE(&dirPtr[0x02]);
@@ -956,7 +956,7 @@ DIError DiskFSPascal::CreateFile(const CreateParms* pParms, A2File** ppNewFile)
      * Make a new entry.
      */
     time_t now;
-    pNewFile = new A2FilePascal(this);
+    pNewFile = new (this) A2FilePascal(this);
     if (pNewFile == NULL) {
         dierr = kDIErrMalloc;
         goto bail;
@@ -1258,6 +1258,7 @@ DIError DiskFSPascal::RenameFile(A2File* pGenericFile, const char* newName)
     pEntry[0x06] = strlen(normalName);
     memcpy(&pEntry[0x07], normalName, A2FilePascal::kMaxFileName);
     strcpy(pFile->fFileName, normalName);
+    ReindexFile(pFile);
 
     dierr = SaveCatalog();
     if (dierr != kDIErrNone)
@@ -1595,10 +1596,12 @@ DIError A2FDPascal::Read(void* buf, size_t len, size_t* pActual)
     long incrLen = len;
 
     DIError dierr = kDIErrNone;
+    DiskImg* pDiskImg = pFile->GetDiskFS()->GetDiskImg();
     uint8_t blkBuf[kBlkSize];
     long block = pFile->fStartBlock + (long) (fOffset / kBlkSize);
     int bufOffset = (long) (fOffset % kBlkSize);        // (& 0x01ff)
     size_t thisCount;
+    long numBlocks;
 
     if (len == 0)
         return kDIErrNone;
@@ -1607,21 +1610,42 @@ DIError A2FDPascal::Read(void* buf, size_t len, size_t* pActual)
     while (len) {
         assert(block >= pFile->fStartBlock && block < pFile->fNextBlock);
 
-        dierr = pFile->GetDiskFS()->GetDiskImg()->ReadBlock(block, blkBuf);
-        if (dierr != kDIErrNone) {
-            LOGI(" Pascal error reading file '%s'", pFile->fFileName);
-            return dierr;
-        }
-        thisCount = kBlkSize - bufOffset;
-        if (thisCount > len)
-            thisCount = len;
+        if (bufOffset != 0 || len < kBlkSize) {
+            /* partial block, read it into a temp buffer */
+            dierr = pDiskImg->ReadBlock(block, blkBuf);
+            if (dierr != kDIErrNone) {
+                LOGI(" Pascal error reading file '%s'", pFile->fFileName);
+                return dierr;
+            }
+            thisCount = kBlkSize - bufOffset;
+            if (thisCount > len)
+                thisCount = len;
 
-        memcpy(buf, blkBuf + bufOffset, thisCount);
+            memcpy(buf, blkBuf + bufOffset, thisCount);
+            numBlocks = 1;
+        } else {
+            /*
+             * Pascal files are contiguous, so all of the whole blocks can
+             * be read straight into the caller's buffer in one shot.
+             */
+            numBlocks = (long) (len / kBlkSize);
+            if (block + numBlocks > pDiskImg->GetNumBlocks()) {
+                LOGI(" Pascal file '%s' runs off end of disk",
+                    pFile->fFileName);
+                return kDIErrInvalidBlock;
+            }
+            dierr = pDiskImg->ReadBlocks(block, (int) numBlocks, buf);
+            if (dierr != kDIErrNone) {
+                LOGI(" Pascal error reading file '%s'", pFile->fFileName);
+                return dierr;
+            }
+            thisCount = numBlocks * kBlkSize;
+        }
         len -= thisCount;
         buf = (char*)buf + thisCount;
 
         bufOffset = 0;
-        block++;
+        block += numBlocks;
     }
 
     fOffset += incrLen;
@@ -157,6 +157,11 @@ DIError DiskFSProDOS::Initialize(InitMode initMode)
         LOGI(" ProDOS - headerOnly set, skipping file load");
         goto bail;
     }
+    if (initMode == kInitLazy && !fpImg->GetReadOnly()) {
+        LOGI(" ProDOS - image is writable, ignoring lazy load request");
+        initMode = kInitFull;
+    }
+    fLazyDirs = (initMode == kInitLazy);
 
     sprintf(msg, "Scanning %s", fVolumeName);
     if (!fpImg->UpdateScanProgress(msg)) {
@@ -175,6 +180,13 @@ DIError DiskFSProDOS::Initialize(InitMode initMode)
         goto bail;
     }
 
+    if (fLazyDirs) {
+        /* the rest needs every file; the image is read-only anyway */
+        LOGI(" ProDOS - lazy load, skipping usage scan");
+        fDiskIsGood = !fEarlyDamage;
+        goto bail;
+    }
+
     sprintf(msg, "Processing %s", fVolumeName);
     if (!fpImg->UpdateScanProgress(msg)) {
         LOGI(" ProDOS cancelled by user");
@@ -335,7 +347,7 @@ DIError DiskFSProDOS::LoadVolHeader(void)
      * directory.  Here, we synthesize them from the volume dir header.
      */
     A2FileProDOS* pFile;
-    pFile = new A2FileProDOS(this);
+    pFile = new (this) A2FileProDOS(this);
     if (pFile == NULL) {
         dierr = kDIErrMalloc;
         goto bail;
@@ -921,7 +933,7 @@ DIError DiskFSProDOS::SlurpEntries(A2File* pParent, const DirHeader* pHeader,
             continue;
         }
 
-        pFile = new A2FileProDOS(this);
+        pFile = new (this) A2FileProDOS(this);
         if (pFile == NULL) {
             dierr = kDIErrMalloc;
             goto bail;
@@ -950,6 +962,17 @@ DIError DiskFSProDOS::SlurpEntries(A2File* pParent, const DirHeader* pHeader,
             }
         }
 
+        if (fLazyDirs) {
+            /* ScanFileUsage won't run, so we don't know about sparse blocks */
+            if (pEntry->storageType == A2FileProDOS::kStorageExtended) {
+                pFile->fSparseDataEof = pFile->fExtData.eof;
+                pFile->fSparseRsrcEof = pFile->fExtRsrc.eof;
+            } else if (pEntry->storageType != A2FileProDOS::kStorageDirectory) {
+                pFile->fSparseDataEof = pEntry->eof;
+                pFile->fSparseRsrcEof = 0;
+            }
+        }
+
         //pFile->Dump();
         AddFileToList(pFile);
         (*pCount)++;
@@ -960,7 +983,11 @@ DIError DiskFSProDOS::SlurpEntries(A2File* pParent, const DirHeader* pHeader,
             goto bail;
         }
 
-        if (pEntry->storageType == A2FileProDOS::kStorageDirectory) {
+        if (pEntry->storageType == A2FileProDOS::kStorageDirectory &&
+            fLazyDirs)
+        {
+            SetDirPending(pFile);
+        } else if (pEntry->storageType == A2FileProDOS::kStorageDirectory) {
             // don't need to check for kStorageVolumeDirHeader here
             dierr = RecursiveDirAdd(pFile, pEntry->keyPointer,
                         pFile->GetPathName(), depth+1);
@@ -979,6 +1006,26 @@ bail:
     return dierr;
 }
 
+/*
+ * Read the entries of a subdirectory that was skipped by a lazy
+ * Initialize.  The depth is recomputed from the parent chain, so loop
+ * detection works the same as in the full scan.
+ */
+DIError DiskFSProDOS::LoadSubdir(A2File* pDir)
+{
+    A2FileProDOS* pSubdir = (A2FileProDOS*) pDir;
+    int depth = 0;
+
+    for (A2File* pParent = pDir; pParent->GetParent() != NULL;
+            pParent = pParent->GetParent())
+    {
+        depth++;
+    }
+
+    return RecursiveDirAdd(pSubdir, pSubdir->fDirEntry.keyPointer,
+                pSubdir->GetPathName(), depth);
+}
+
 /*
  * Pull the directory header out of the first block of a directory.
  */
@@ -1972,10 +2019,10 @@ DIError DiskFSProDOS::CreateFile(const CreateParms* pParms, A2File** ppNewFile)
     if (createUnique &&
         pParms->storageType != A2FileProDOS::kStorageDirectory)
     {
-        MakeFileNameUnique(subdirBuf, dirLen, upperName);
+        MakeFileNameUnique(pSubdir, upperName);
     } else {
         /* check to see if it already exists */
-        if (NameExistsInDir(subdirBuf, dirLen, upperName)) {
+        if (NameExistsInDir(pSubdir, upperName)) {
             if (pParms->storageType == A2FileProDOS::kStorageDirectory)
                 dierr = kDIErrDirectoryExists;
             else
@@ -2078,7 +2125,7 @@ DIError DiskFSProDOS::CreateFile(const CreateParms* pParms, A2File** ppNewFile)
      * - Regen or update internal VolumeUsage map??  Throw it away or mark
      * it as invalid?
      */
-    pNewFile = new A2FileProDOS(this);
+    pNewFile = new (this) A2FileProDOS(this);
 
     A2FileProDOS::DirEntry* pEntry;
     pEntry = &pNewFile->fDirEntry;
@@ -2142,7 +2189,7 @@ DIError DiskFSProDOS::CreateFile(const CreateParms* pParms, A2File** ppNewFile)
         assert((prevDirEntryPtr[0x00] & 0xf0) != 0);        // verify storage type
         prevKeyBlock = GetShortLE(&prevDirEntryPtr[0x11]);
         A2File* pPrev;
-        pPrev = FindFileByKeyBlock(pNewFile->GetParent(), prevKeyBlock);
+        pPrev = FindFileByKeyBlock(pSubdir, prevKeyBlock);
         if (pPrev == NULL) {
             /* should be impossible! */
             assert(false);
@@ -2172,18 +2219,23 @@ bail:
 }
 
 /*
- * Run through the DiskFS file list, looking for an entry with a matching
- * key block.
+ * Look through the contents of directory "pDir" for an entry with a
+ * matching key block.
+ *
+ * We start from the end, because we're usually looking for the entry just
+ * ahead of a file we've appended to the directory.
  */
-A2File* DiskFSProDOS::FindFileByKeyBlock(A2File* pStart, uint16_t keyBlock)
+A2File* DiskFSProDOS::FindFileByKeyBlock(A2File* pDir, uint16_t keyBlock)
 {
-    while (pStart != NULL) {
-        A2FileProDOS* pPro = (A2FileProDOS*) pStart;
+    A2File* pFile = GetLastChild(pDir);
+
+    while (pFile != NULL) {
+        A2FileProDOS* pPro = (A2FileProDOS*) pFile;
 
         if (pPro->fDirEntry.keyPointer == keyBlock)
-            return pStart;
+            return pFile;
 
-        pStart = GetNextFile(pStart);
+        pFile = GetPrevSibling(pFile);
     }
 
     return NULL;
@@ -3024,24 +3076,21 @@ uint8_t* DiskFSProDOS::GetPrevDirEntry(uint8_t* buf, uint8_t* ptr)
 }
 
 /*
- * Make the name pointed to by "fileName" unique within the directory
- * loaded in "subdirBuf".  The name should already be trimmed to 15 chars
- * or less and converted to upper-case only, and be in a buffer that can
- * hold at least kMaxFileName+1 bytes.
+ * Make the name pointed to by "fileName" unique within directory "pDir".
+ * The name should already be trimmed to 15 chars or less and converted to
+ * upper-case only, and be in a buffer that can hold at least
+ * kMaxFileName+1 bytes.
  *
  * Returns an error on failure, which should only happen if there are a
  * large number of files with similar names.
  */
-DIError DiskFSProDOS::MakeFileNameUnique(const uint8_t* dirBuf, long dirLen,
-    char* fileName)
+DIError DiskFSProDOS::MakeFileNameUnique(A2File* pDir, char* fileName)
 {
-    assert(dirBuf != NULL);
-    assert(dirLen > 0);
-    assert((dirLen % 512) == 0);
+    assert(pDir != NULL);
     assert(fileName != NULL);
     assert(strlen(fileName) <= A2FileProDOS::kMaxFileName);
 
-    if (!NameExistsInDir(dirBuf, dirLen, fileName))
+    if (!NameExistsInDir(pDir, fileName))
         return kDIErrNone;
 
     LOGI(" ProDOS   found duplicate of '%s', making unique", fileName);
@@ -3094,7 +3143,7 @@ DIError DiskFSProDOS::MakeFileNameUnique(const uint8_t* dirBuf, long dirLen,
         memcpy(fileName + copyOffset, digitBuf, digitLen);
         if (dotLen != 0)
             memcpy(fileName + copyOffset + digitLen, dotBuf, dotLen);
-    } while (NameExistsInDir(dirBuf, dirLen, fileName));
+    } while (NameExistsInDir(pDir, fileName));
 
     LOGI(" ProDOS  converted to unique name: %s", fileName);
 
@@ -3102,41 +3151,38 @@ DIError DiskFSProDOS::MakeFileNameUnique(const uint8_t* dirBuf, long dirLen,
 }
 
 /*
- * Determine whether the specified file name exists in the raw directory
- * buffer.
+ * Determine whether the specified file name exists in directory "pDir".
  *
  * This should be called with the upper-case-only version of the filename.
+ * The names in the file list may have been converted to lower case, so
+ * we compare with CompareUpperName.
  */
-bool DiskFSProDOS::NameExistsInDir(const uint8_t* dirBuf, long dirLen,
-    const char* fileName)
+bool DiskFSProDOS::NameExistsInDir(A2File* pDir, const char* fileName)
 {
-    const uint8_t* pDirEntry;
-    int blockIdx;
-    int entryIdx;
-    int nameLen = strlen(fileName);
-
-    assert(nameLen <= A2FileProDOS::kMaxFileName);
-
-    for (blockIdx = 0; blockIdx < dirLen / 512; blockIdx++) {
-        pDirEntry = dirBuf + 512*blockIdx + 4;      // skip 4 bytes of prev/next
+    assert(strlen(fileName) <= A2FileProDOS::kMaxFileName);
 
-        for (entryIdx = 0; entryIdx < kEntriesPerBlock;
-                                        entryIdx++, pDirEntry += kEntryLength)
-        {
-            /* skip directory header */
-            if (blockIdx == 0 && entryIdx == 0)
-                continue;
+    return FindChild(pDir, fileName, CompareUpperName) != NULL;
+}
 
-            if ((pDirEntry[0x00] & 0xf0) != 0 &&
-                (pDirEntry[0x00] & 0x0f) == nameLen &&
-                strncmp((char*) &pDirEntry[0x01], fileName, nameLen) == 0)
-            {
-                return true;
-            }
-        }
+/*
+ * Compare two filenames, ignoring the GS/OS lower-case conversion (which
+ * turns '.' into ' ').
+ */
+/*static*/ int DiskFSProDOS::CompareUpperName(const char* name1,
+    const char* name2)
+{
+    const uint8_t* str1 = (const uint8_t*) name1;
+    const uint8_t* str2 = (const uint8_t*) name2;
+    int ch1, ch2;
+
+    while (true) {
+        ch1 = (*str1 == ' ') ? '.' : toupper(*str1);
+        ch2 = (*str2 == ' ') ? '.' : toupper(*str2);
+        if (ch1 != ch2 || ch1 == '\0')
+            return ch1 - ch2;
+        str1++;
+        str2++;
     }
-
-    return false;
 }
 
 /*
@@ -3631,6 +3677,7 @@ DIError DiskFSProDOS::RegeneratePathName(A2FileProDOS* pFile)
 
     LOGI("Replacing '%s' with '%s'", pFile->GetPathName(), buf);
     pFile->SetPathName("", buf);
+    ReindexFile(pFile);
     delete[] buf;
 
     return kDIErrNone;
@@ -3800,6 +3847,7 @@ DIError DiskFSProDOS::RenameVolume(const char* newName)
 
     /* update the entry in the linear file list */
     pFile->SetPathName(":", fVolumeName);
+    ReindexFile(pFile);
 
 bail:
     return dierr;
@@ -4449,10 +4497,12 @@ DIError A2FDProDOS::Read(void* buf, size_t len, size_t* pActual)
     long incrLen = len;
 
     DIError dierr = kDIErrNone;
+    DiskImg* pDiskImg = fpFile->GetDiskFS()->GetDiskImg();
     uint8_t blkBuf[kBlkSize];
     long blockIndex = (long) (fOffset / kBlkSize);
     int bufOffset = (int) (fOffset % kBlkSize);     // (& 0x01ff)
     size_t thisCount;
+    long numBlocks;
     long progressCounter = 0;
 
     if (len == 0) {
@@ -4465,31 +4515,55 @@ DIError A2FDProDOS::Read(void* buf, size_t len, size_t* pActual)
     assert(blockIndex >= 0 && blockIndex < fBlockCount);
 
     while (len) {
-        if (fBlockList[blockIndex] == 0) {
-            //LOGI(" ProDOS sparse index %d", blockIndex);
-            memset(blkBuf, 0, sizeof(blkBuf));
+        if (bufOffset != 0 || len < kBlkSize) {
+            /* partial block, read it into a temp buffer */
+            if (fBlockList[blockIndex] == 0) {
+                //LOGI(" ProDOS sparse index %d", blockIndex);
+                memset(blkBuf, 0, sizeof(blkBuf));
+            } else {
+                //LOGI(" ProDOS non-sparse index %d", blockIndex);
+                dierr = pDiskImg->ReadBlock(fBlockList[blockIndex], blkBuf);
+                if (dierr != kDIErrNone) {
+                    LOGI(" ProDOS error reading block [%ld]=%d of '%s'",
+                        blockIndex, fBlockList[blockIndex],
+                        fpFile->GetPathName());
+                    return dierr;
+                }
+            }
+            thisCount = kBlkSize - bufOffset;
+            if (thisCount > len)
+                thisCount = len;
+
+            memcpy(buf, blkBuf + bufOffset, thisCount);
+            numBlocks = 1;
         } else {
-            //LOGI(" ProDOS non-sparse index %d", blockIndex);
-            dierr = fpFile->GetDiskFS()->GetDiskImg()->ReadBlock(fBlockList[blockIndex],
-                        blkBuf);
+            /*
+             * Read whole blocks straight into the caller's buffer.  The
+             * block list handles sparse entries and merges contiguous
+             * runs.  We cap the size so we can update progress.
+             */
+            numBlocks = (long) (len / kBlkSize);
+            if (numBlocks > kMaxBlocksPerRead)
+                numBlocks = kMaxBlocksPerRead;
+            assert(blockIndex + numBlocks <= fBlockCount);
+
+            dierr = pDiskImg->ReadBlockList(&fBlockList[blockIndex],
+                        (int) numBlocks, buf);
             if (dierr != kDIErrNone) {
-                LOGI(" ProDOS error reading block [%ld]=%d of '%s'",
-                    blockIndex, fBlockList[blockIndex], fpFile->GetPathName());
+                LOGI(" ProDOS error reading blocks [%ld-%ld] of '%s'",
+                    blockIndex, blockIndex + numBlocks - 1,
+                    fpFile->GetPathName());
                 return dierr;
             }
+            thisCount = numBlocks * kBlkSize;
         }
-        thisCount = kBlkSize - bufOffset;
-        if (thisCount > len)
-            thisCount = len;
-
-        memcpy(buf, blkBuf + bufOffset, thisCount);
         len -= thisCount;
         buf = (char*)buf + thisCount;
 
         bufOffset = 0;
-        blockIndex++;
+        blockIndex += numBlocks;
 
-        progressCounter++;
+        progressCounter += numBlocks;
         if (progressCounter > 100 && len) {
             progressCounter = 0;
             /*
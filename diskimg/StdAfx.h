@@ -22,10 +22,15 @@
 #include <sys/time.h>
 #include <fcntl.h>
 #include <ctype.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
 
 #define O_BINARY 0
 
 #define HAVE_VSNPRINTF
+#define HAVE_MMAP
+#define HAVE_PREAD
 #define HAVE_FSEEKO
 #define HAVE_FTRUNCATE
 
@@ -0,0 +1,1684 @@
+/*
+ * CiderPress
+ * Copyright (C) 2007 by faddenSoft, LLC.  All Rights Reserved.
+ * See the file LICENSE for distribution terms.
+ */
+/*
+ * Generate a synthetic corpus of disk images, then time the common
+ * operations on it.
+ *
+ * Every image is built from scratch with CreateImage/FormatImage/CreateFile,
+ * using a fixed pseudo-random sequence for names, sizes, and contents, so
+ * two runs on two machines operate on the same files.  (Volume creation
+ * dates still come from the clock.)  Results go to stdout as CSV; progress
+ * chatter goes to stderr.
+ */
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <assert.h>
+#include <ftw.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <zlib.h>
+#include "../diskimg/DiskImg.h"
+#include "../nufxlib/NufxLib.h"
+/* the sector cache and bit buffer benchmarks use library internals */
+#include "../diskimg/StdAfx.h"
+#include "../diskimg/DiskImgPriv.h"
+
+using namespace DiskImgLib;
+
+#define nil NULL
+#define ASSERT assert
+
+/*
+ * Globals.
+ */
+FILE* gLog = nil;
+pid_t gPid = getpid();
+
+/*
+ * One image in the corpus.
+ *
+ * If "numBlocks" is zero, the image is created by tracks and sectors.
+ */
+typedef struct CorpusSpec {
+    const char*     name;           // also the file name, inside the work dir
+    DiskImg::OuterFormat    outer;
+    DiskImg::FileFormat     fileFormat;
+    DiskImg::PhysicalFormat physical;
+    DiskImg::SectorOrder    order;
+    DiskImg::FSFormat       genericFormat;
+    DiskImg::FSFormat       fsFormat;
+    long            numBlocks;
+    long            numTracks;
+    long            numSectPerTrack;
+    const char*     volName;
+    int             numFiles;
+    int             numDirs;        // 0 for flat filesystems
+    int             fillPercent;    // how much of the volume the files use
+} CorpusSpec;
+
+static const CorpusSpec kCorpus[] = {
+    { "prodos-140k.po",
+        DiskImg::kOuterFormatNone, DiskImg::kFileFormatUnadorned,
+        DiskImg::kPhysicalFormatSectors, DiskImg::kSectorOrderProDOS,
+        DiskImg::kFormatGenericProDOSOrd, DiskImg::kFormatProDOS,
+        280, 0, 0, "BENCH.140K", 40, 0, 70 },
+    { "prodos-800k.po",
+        DiskImg::kOuterFormatNone, DiskImg::kFileFormatUnadorned,
+        DiskImg::kPhysicalFormatSectors, DiskImg::kSectorOrderProDOS,
+        DiskImg::kFormatGenericProDOSOrd, DiskImg::kFormatProDOS,
+        1600, 0, 0, "BENCH.800K", 240, 6, 70 },
+    { "prodos-32m.po",
+        DiskImg::kOuterFormatNone, DiskImg::kFileFormatUnadorned,
+        DiskImg::kPhysicalFormatSectors, DiskImg::kSectorOrderProDOS,
+        DiskImg::kFormatGenericProDOSOrd, DiskImg::kFormatProDOS,
+        65535, 0, 0, "BENCH.32M", 2000, 40, 60 },
+    { "dos33.do",
+        DiskImg::kOuterFormatNone, DiskImg::kFileFormatUnadorned,
+        DiskImg::kPhysicalFormatSectors, DiskImg::kSectorOrderDOS,
+        DiskImg::kFormatGenericDOSOrd, DiskImg::kFormatDOS33,
+        0, 35, 16, "DOS", 80, 0, 50 },
+    { "pascal.po",
+        DiskImg::kOuterFormatNone, DiskImg::kFileFormatUnadorned,
+        DiskImg::kPhysicalFormatSectors, DiskImg::kSectorOrderProDOS,
+        DiskImg::kFormatGenericProDOSOrd, DiskImg::kFormatPascal,
+        280, 0, 0, "BENCH", 60, 0, 70 },
+    { "hfs-800k.po",
+        DiskImg::kOuterFormatNone, DiskImg::kFileFormatUnadorned,
+        DiskImg::kPhysicalFormatSectors, DiskImg::kSectorOrderProDOS,
+        DiskImg::kFormatGenericProDOSOrd, DiskImg::kFormatMacHFS,
+        1600, 0, 0, "Bench HFS", 200, 5, 60 },
+    { "prodos-140k.nib",
+        DiskImg::kOuterFormatNone, DiskImg::kFileFormatUnadorned,
+        DiskImg::kPhysicalFormatNib525_6656, DiskImg::kSectorOrderPhysical,
+        DiskImg::kFormatGenericProDOSOrd, DiskImg::kFormatProDOS,
+        0, 35, 16, "BENCH.NIB", 40, 0, 70 },
+    { "dos33.ddd",
+        DiskImg::kOuterFormatNone, DiskImg::kFileFormatDDD,
+        DiskImg::kPhysicalFormatSectors, DiskImg::kSectorOrderDOS,
+        DiskImg::kFormatGenericDOSOrd, DiskImg::kFormatDOS33,
+        0, 35, 16, "DOS", 80, 0, 50 },
+    { "prodos-800k.2mg",
+        DiskImg::kOuterFormatNone, DiskImg::kFileFormat2MG,
+        DiskImg::kPhysicalFormatSectors, DiskImg::kSectorOrderProDOS,
+        DiskImg::kFormatGenericProDOSOrd, DiskImg::kFormatProDOS,
+        1600, 0, 0, "BENCH.2MG", 240, 6, 70 },
+    { "prodos-800k.po.gz",
+        DiskImg::kOuterFormatGzip, DiskImg::kFileFormatUnadorned,
+        DiskImg::kPhysicalFormatSectors, DiskImg::kSectorOrderProDOS,
+        DiskImg::kFormatGenericProDOSOrd, DiskImg::kFormatProDOS,
+        1600, 0, 0, "BENCH.GZ", 240, 6, 70 },
+    { "prodos-800k.po.zip",
+        DiskImg::kOuterFormatZip, DiskImg::kFileFormatUnadorned,
+        DiskImg::kPhysicalFormatSectors, DiskImg::kSectorOrderProDOS,
+        DiskImg::kFormatGenericProDOSOrd, DiskImg::kFormatProDOS,
+        1600, 0, 0, "BENCH.ZIP", 240, 6, 70 },
+    { "prodos-800k.sdk",
+        DiskImg::kOuterFormatNone, DiskImg::kFileFormatNuFX,
+        DiskImg::kPhysicalFormatSectors, DiskImg::kSectorOrderProDOS,
+        DiskImg::kFormatGenericProDOSOrd, DiskImg::kFormatProDOS,
+        1600, 0, 0, "BENCH.SDK", 240, 6, 70 },
+};
+
+/*
+ * Run-wide options.
+ */
+typedef struct BenchOpts {
+    const char*     workDir;
+    int             iterations;     // for the cheap read-only operations
+    int             numThreads;     // for the multi-threaded extract
+    bool            keepCorpus;
+} BenchOpts;
+
+
+/*
+ * ===========================================================================
+ *      Utility functions
+ * ===========================================================================
+ */
+
+/*
+ * Handle a debug message from the DiskImg library.
+ */
+/*static*/ void
+MsgHandler(Global::LogSeverity severity, const char* file, int line,
+    const char* msg)
+{
+    ASSERT(file != nil);
+    ASSERT(msg != nil);
+
+#ifdef _DEBUG
+    fprintf(gLog, "%05u %s", gPid, msg);
+#endif
+}
+/*
+ * Handle a global error message from the NufxLib library by shoving it
+ * through the DiskImgLib message function.
+ */
+NuResult
+NufxErrorMsgHandler(NuArchive* /*pArchive*/, void* vErrorMessage)
+{
+    const NuErrorMessage* pErrorMessage = (const NuErrorMessage*) vErrorMessage;
+
+    if (pErrorMessage->isDebug) {
+        Global::PrintDebugMsg(Global::kLogDebug, pErrorMessage->file,
+            pErrorMessage->line, "<nufxlib> [D] %s\n", pErrorMessage->message);
+    } else {
+        Global::PrintDebugMsg(Global::kLogWarn, pErrorMessage->file,
+            pErrorMessage->line, "<nufxlib> %s\n", pErrorMessage->message);
+    }
+
+    return kNuOK;
+}
+
+/*
+ * Get the current time, in microseconds.
+ */
+long long
+GetUsec(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, nil);
+    return (long long) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/*
+ * Deterministic pseudo-random number generator (an LCG with the usual
+ * ANSI C constants).  We don't use rand() because its sequence varies
+ * between C libraries, and the corpus must not.
+ */
+class BenchRandom {
+public:
+    BenchRandom(unsigned long seed) : fState(seed) {}
+
+    unsigned long Next(void) {
+        fState = (fState * 1103515245UL + 12345UL) & 0x7fffffffUL;
+        return fState >> 8;
+    }
+
+private:
+    unsigned long   fState;
+};
+
+/*
+ * Emit one result line.
+ *
+ * "bytes" may be zero for operations where throughput is meaningless.
+ */
+void
+Report(const char* op, const char* image, int iterations, long long bytes,
+    long long usec)
+{
+    double mbPerSec = 0.0;
+
+    if (usec <= 0)
+        usec = 1;
+    if (bytes > 0)
+        mbPerSec = (double) bytes / (double) usec;  // bytes/usec == MB/s
+    printf("%s,%s,%d,%lld,%lld,%.1f,%.3f\n", op, image, iterations, bytes,
+        usec, (double) usec / iterations, mbPerSec);
+    fflush(stdout);
+}
+
+/*
+ * Build the full pathname of a file in the work directory.
+ */
+void
+WorkPath(const BenchOpts* pOpts, const char* name, char* buf, size_t bufLen)
+{
+    snprintf(buf, bufLen, "%s/%s", pOpts->workDir, name);
+}
+
+/*
+ * Callback for RemoveTree.
+ */
+static int
+RemoveOne(const char* path, const struct stat* /*sb*/, int /*typeflag*/,
+    struct FTW* /*ftwbuf*/)
+{
+    if (remove(path) != 0) {
+        fprintf(stderr, "WARNING: unable to remove '%s': %s\n", path,
+            strerror(errno));
+    }
+    return 0;
+}
+
+/*
+ * Remove a directory and everything in it.
+ */
+void
+RemoveTree(const char* path)
+{
+    if (access(path, F_OK) == 0)
+        nftw(path, RemoveOne, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+/*
+ * Open a disk image and find its filesystem.  On success, the caller
+ * must delete the DiskFS before the DiskImg.
+ */
+DIError
+OpenDiskFS(const char* pathName, DiskImg* pDiskImg, DiskFS** ppDiskFS,
+    DiskFS::InitMode initMode = DiskFS::kInitFull)
+{
+    DIError dierr;
+    DiskFS* pDiskFS;
+
+    *ppDiskFS = nil;
+
+    dierr = pDiskImg->OpenImage(pathName, '/', true);
+    if (dierr != kDIErrNone)
+        return dierr;
+    dierr = pDiskImg->AnalyzeImage();
+    if (dierr != kDIErrNone)
+        return dierr;
+    if (pDiskImg->GetFSFormat() == DiskImg::kFormatUnknown)
+        return kDIErrFilesystemNotFound;
+
+    pDiskFS = pDiskImg->OpenAppropriateDiskFS();
+    if (pDiskFS == nil)
+        return kDIErrUnsupportedFSFmt;
+
+    dierr = pDiskFS->Initialize(pDiskImg, initMode);
+    if (dierr != kDIErrNone) {
+        delete pDiskFS;
+        return dierr;
+    }
+
+    *ppDiskFS = pDiskFS;
+    return kDIErrNone;
+}
+
+
+/*
+ * ===========================================================================
+ *      Corpus generation
+ * ===========================================================================
+ */
+
+/*
+ * Create an empty image as described by "pSpec".
+ */
+DIError
+CreateEmptyImage(const CorpusSpec* pSpec, const char* pathName,
+    DiskImg* pDiskImg)
+{
+    const DiskImg::NibbleDescr* pNibbleDescr = nil;
+    DIError dierr;
+
+    if (pSpec->physical != DiskImg::kPhysicalFormatSectors) {
+        pNibbleDescr =
+            DiskImg::GetStdNibbleDescr(DiskImg::kNibbleDescrDOS33Std);
+    }
+
+    if (pSpec->numBlocks != 0) {
+        dierr = pDiskImg->CreateImage(pathName, "BENCH",
+                    pSpec->outer, pSpec->fileFormat, pSpec->physical,
+                    pNibbleDescr, pSpec->order, pSpec->genericFormat,
+                    pSpec->numBlocks, true);
+    } else {
+        dierr = pDiskImg->CreateImage(pathName, "BENCH",
+                    pSpec->outer, pSpec->fileFormat, pSpec->physical,
+                    pNibbleDescr, pSpec->order, pSpec->genericFormat,
+                    pSpec->numTracks, pSpec->numSectPerTrack,
+                    pNibbleDescr == nil);   // nibble images need formatting
+    }
+    if (dierr != kDIErrNone)
+        return dierr;
+
+    return pDiskImg->FormatImage(pSpec->fsFormat, pSpec->volName);
+}
+
+/*
+ * Work out the file sizes for an image.  The sizes are drawn from the
+ * spec's random sequence, then scaled down if the total would exceed the
+ * requested fraction of the volume.
+ *
+ * Returns the total number of bytes.
+ */
+long long
+ChooseFileSizes(const CorpusSpec* pSpec, BenchRandom* pRand, long* sizes)
+{
+    long long capacity, budget, total;
+    long maxSize;
+    int i;
+
+    if (pSpec->numBlocks != 0)
+        capacity = (long long) pSpec->numBlocks * 512;
+    else
+        capacity = (long long) pSpec->numTracks * pSpec->numSectPerTrack * 256;
+    budget = capacity * pSpec->fillPercent / 100;
+
+    /* mean size is half the max, so this lands near the budget */
+    maxSize = (long) (budget * 2 / pSpec->numFiles);
+    if (maxSize > 0xffff)
+        maxSize = 0xffff;       // keep DOS 3.3 and Pascal happy
+
+    total = 0;
+    for (i = 0; i < pSpec->numFiles; i++) {
+        sizes[i] = 1 + (long) (pRand->Next() % maxSize);
+        total += sizes[i];
+    }
+    if (total > budget) {
+        long long scaled = 0;
+        for (i = 0; i < pSpec->numFiles; i++) {
+            sizes[i] = 1 + (long) ((sizes[i] - 1) * budget / total);
+            scaled += sizes[i];
+        }
+        total = scaled;
+    }
+
+    return total;
+}
+
+/*
+ * Fill a disk image with files.
+ *
+ * Returns the number of bytes written, or -1 on failure.
+ */
+long long
+PopulateImage(const CorpusSpec* pSpec, DiskFS* pDiskFS)
+{
+    BenchRandom rand(0x5eed + pSpec->numFiles);
+    long* sizes = nil;
+    unsigned char* buf = nil;
+    long long total = -1;
+    long maxSize = 0;
+    char fssep, pathName[64];
+    DIError dierr;
+    int i;
+
+    sizes = new long[pSpec->numFiles];
+    (void) ChooseFileSizes(pSpec, &rand, sizes);
+    for (i = 0; i < pSpec->numFiles; i++) {
+        if (sizes[i] > maxSize)
+            maxSize = sizes[i];
+    }
+
+    /*
+     * Mix of compressible text-ish bytes and noise, so that gzip, ZIP,
+     * and NuFX images do a realistic amount of work.
+     */
+    buf = new unsigned char[maxSize];
+    for (long j = 0; j < maxSize; j++) {
+        if ((j & 0x400) != 0)
+            buf[j] = (unsigned char) rand.Next();
+        else
+            buf[j] = 'A' + (unsigned char) (j % 26);
+    }
+
+    fssep = (pSpec->fsFormat == DiskImg::kFormatMacHFS) ? ':' : '/';
+
+    total = 0;
+    for (i = 0; i < pSpec->numFiles; i++) {
+        DiskFS::CreateParms parms;
+        A2File* pNewFile;
+        A2FileDescr* pFD;
+
+        if (pSpec->numDirs != 0) {
+            snprintf(pathName, sizeof(pathName), "DIR%02d%cFILE%04d",
+                i % pSpec->numDirs, fssep, i);
+        } else {
+            snprintf(pathName, sizeof(pathName), "FILE%04d", i);
+        }
+
+        parms.pathName = pathName;
+        parms.fssep = fssep;
+        parms.storageType = DiskFS::kStorageSeedling;
+        parms.fileType = 0x06;      // BIN
+        parms.auxType = 0x2000;
+        parms.access = DiskFS::kFileAccessUnlocked;
+        parms.createWhen = parms.modWhen = 0x40000000;
+
+        dierr = pDiskFS->CreateFile(&parms, &pNewFile);
+        if (dierr != kDIErrNone) {
+            fprintf(stderr, "ERROR: %s: unable to create '%s': %s\n",
+                pSpec->name, pathName, DIStrError(dierr));
+            total = -1;
+            goto bail;
+        }
+
+        dierr = pNewFile->Open(&pFD, true);
+        if (dierr != kDIErrNone) {
+            fprintf(stderr, "ERROR: %s: unable to open '%s': %s\n",
+                pSpec->name, pathName, DIStrError(dierr));
+            total = -1;
+            goto bail;
+        }
+
+        /* start at a different spot in the buffer for each file */
+        long offset = (long) (rand.Next() % (maxSize - sizes[i] + 1));
+        dierr = pFD->Write(buf + offset, sizes[i]);
+        if (dierr == kDIErrNone)
+            dierr = pFD->Close();
+        else
+            pFD->Close();
+        if (dierr != kDIErrNone) {
+            fprintf(stderr, "ERROR: %s: unable to write '%s': %s\n",
+                pSpec->name, pathName, DIStrError(dierr));
+            total = -1;
+            goto bail;
+        }
+
+        total += sizes[i];
+    }
+
+bail:
+    delete[] sizes;
+    delete[] buf;
+    return total;
+}
+
+/*
+ * Create one image of the corpus, timing the whole thing.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int
+GenerateImage(const CorpusSpec* pSpec, const char* pathName,
+    DiskImg::CacheMode cacheMode, const char* opName)
+{
+    DiskImg diskImg;
+    DiskFS* pDiskFS = nil;
+    long long start, bytes;
+    DIError dierr;
+
+    (void) remove(pathName);
+
+    start = GetUsec();
+
+    diskImg.SetCacheMode(cacheMode);
+    dierr = CreateEmptyImage(pSpec, pathName, &diskImg);
+    if (dierr != kDIErrNone) {
+        fprintf(stderr, "ERROR: unable to create '%s': %s\n", pathName,
+            DIStrError(dierr));
+        return -1;
+    }
+
+    pDiskFS = diskImg.OpenAppropriateDiskFS(false);
+    if (pDiskFS == nil) {
+        fprintf(stderr, "ERROR: no DiskFS for '%s'\n", pathName);
+        return -1;
+    }
+    dierr = pDiskFS->Initialize(&diskImg, DiskFS::kInitFull);
+    if (dierr != kDIErrNone) {
+        fprintf(stderr, "ERROR: unable to initialize '%s': %s\n", pathName,
+            DIStrError(dierr));
+        delete pDiskFS;
+        return -1;
+    }
+
+    bytes = PopulateImage(pSpec, pDiskFS);
+    delete pDiskFS;
+    if (bytes < 0)
+        return -1;
+
+    dierr = diskImg.CloseImage();
+    if (dierr != kDIErrNone) {
+        fprintf(stderr, "ERROR: close of '%s' failed: %s\n", pathName,
+            DIStrError(dierr));
+        return -1;
+    }
+
+    Report(opName, pSpec->name, 1, bytes, GetUsec() - start);
+    return 0;
+}
+
+
+/*
+ * ===========================================================================
+ *      Benchmarks
+ * ===========================================================================
+ */
+
+/*
+ * Open the image and identify its format, over and over.
+ */
+int
+BenchOpenAnalyze(const BenchOpts* pOpts, const CorpusSpec* pSpec,
+    const char* pathName)
+{
+    long long start = GetUsec();
+
+    for (int i = 0; i < pOpts->iterations; i++) {
+        DiskImg diskImg;
+        DIError dierr;
+
+        diskImg.SetUseMmap(true);
+        dierr = diskImg.OpenImage(pathName, '/', true);
+        if (dierr == kDIErrNone)
+            dierr = diskImg.AnalyzeImage();
+        if (dierr == kDIErrNone &&
+            diskImg.GetFSFormat() != pSpec->fsFormat)
+        {
+            dierr = kDIErrFilesystemNotFound;
+        }
+        if (dierr != kDIErrNone) {
+            fprintf(stderr, "ERROR: open+analyze of '%s' failed: %s\n",
+                pathName, DIStrError(dierr));
+            return -1;
+        }
+    }
+
+    Report("open_analyze", pSpec->name, pOpts->iterations, 0,
+        GetUsec() - start);
+    return 0;
+}
+
+/*
+ * Open the image and load the full catalog, over and over.
+ */
+int
+BenchCatalog(const BenchOpts* pOpts, const CorpusSpec* pSpec,
+    const char* pathName)
+{
+    long long start = GetUsec();
+
+    for (int i = 0; i < pOpts->iterations; i++) {
+        DiskImg diskImg;
+        DiskFS* pDiskFS;
+        DIError dierr;
+        long count = 0;
+
+        /* nothing else touches the corpus, so it's safe to map */
+        diskImg.SetUseMmap(true);
+        dierr = OpenDiskFS(pathName, &diskImg, &pDiskFS);
+        if (dierr != kDIErrNone) {
+            fprintf(stderr, "ERROR: catalog of '%s' failed: %s\n",
+                pathName, DIStrError(dierr));
+            return -1;
+        }
+
+        A2File* pFile = pDiskFS->GetNextFile(nil);
+        while (pFile != nil) {
+            if (!pFile->IsDirectory() && !pFile->IsVolumeDirectory())
+                count++;
+            pFile = pDiskFS->GetNextFile(pFile);
+        }
+        delete pDiskFS;
+
+        if (count != pSpec->numFiles) {
+            fprintf(stderr, "ERROR: '%s' has %ld files, expected %d\n",
+                pathName, count, pSpec->numFiles);
+            return -1;
+        }
+    }
+
+    Report("catalog", pSpec->name, pOpts->iterations, 0, GetUsec() - start);
+    return 0;
+}
+
+/*
+ * Open the image and look up the last file in the last directory, the
+ * way a caller that wants one file would.  Compares a full catalog load
+ * against kInitLazy.  Only done for images with subdirectories.
+ */
+int
+BenchFirstFile(const BenchOpts* pOpts, const CorpusSpec* pSpec,
+    const char* pathName, DiskFS::InitMode initMode)
+{
+    char fileName[64];
+    long long start;
+    int last = pSpec->numFiles - 1;
+
+    if (pSpec->numDirs == 0)
+        return 0;
+    snprintf(fileName, sizeof(fileName), "DIR%02d%cFILE%04d",
+        last % pSpec->numDirs, DiskFS::kDIFssep, last);
+
+    start = GetUsec();
+    for (int i = 0; i < pOpts->iterations; i++) {
+        DiskImg diskImg;
+        DiskFS* pDiskFS;
+        DIError dierr;
+        A2File* pFile;
+
+        diskImg.SetUseMmap(true);
+        dierr = OpenDiskFS(pathName, &diskImg, &pDiskFS, initMode);
+        if (dierr != kDIErrNone) {
+            fprintf(stderr, "ERROR: open of '%s' failed: %s\n",
+                pathName, DIStrError(dierr));
+            return -1;
+        }
+
+        pFile = pDiskFS->GetFileByName(fileName);
+        delete pDiskFS;
+
+        if (pFile == nil) {
+            fprintf(stderr, "ERROR: '%s' not found in '%s'\n",
+                fileName, pathName);
+            return -1;
+        }
+    }
+
+    Report(initMode == DiskFS::kInitLazy ? "first_file_lazy" :
+        "first_file_full", pSpec->name, pOpts->iterations, 0,
+        GetUsec() - start);
+    return 0;
+}
+
+/*
+ * Extract every file to the work directory with ExtractAll.  The open and
+ * catalog load are not included in the time.  The image is opened the
+ * default way, without memory-mapping, so all the threads go through the
+ * one sector cache.
+ */
+int
+BenchExtractAll(const BenchOpts* pOpts, const CorpusSpec* pSpec,
+    const char* pathName, int numThreads)
+{
+    DiskImg diskImg;
+    DiskFS* pDiskFS;
+    DIError dierr;
+    char outDir[256], opName[32];
+    long long start, elapsed, bytes = 0;
+
+    dierr = OpenDiskFS(pathName, &diskImg, &pDiskFS);
+    if (dierr != kDIErrNone) {
+        fprintf(stderr, "ERROR: open of '%s' failed: %s\n",
+            pathName, DIStrError(dierr));
+        return -1;
+    }
+
+    A2File* pFile = pDiskFS->GetNextFile(nil);
+    while (pFile != nil) {
+        if (!pFile->IsDirectory() && !pFile->IsVolumeDirectory()) {
+            bytes += pFile->GetDataLength();
+            if (pFile->GetRsrcLength() > 0)
+                bytes += pFile->GetRsrcLength();
+        }
+        pFile = pDiskFS->GetNextFile(pFile);
+    }
+
+    WorkPath(pOpts, "extract", outDir, sizeof(outDir));
+    RemoveTree(outDir);
+
+    start = GetUsec();
+    dierr = ExtractAll(pDiskFS, outDir, numThreads);
+    elapsed = GetUsec() - start;
+    delete pDiskFS;
+
+    RemoveTree(outDir);
+    if (dierr != kDIErrNone) {
+        fprintf(stderr, "ERROR: extract of '%s' failed: %s\n",
+            pathName, DIStrError(dierr));
+        return -1;
+    }
+
+    snprintf(opName, sizeof(opName), "extract_all_t%d", numThreads);
+    Report(opName, pSpec->name, 1, bytes, elapsed);
+    return 0;
+}
+
+/*
+ * Copy the image, block by block or sector by sector, into a new
+ * ProDOS-ordered unadorned image, as "iconv" does.
+ */
+int
+BenchConvert(const BenchOpts* pOpts, const CorpusSpec* pSpec,
+    const char* pathName)
+{
+    DiskImg srcImg, dstImg;
+    DIError dierr;
+    char outPath[256];
+    long long start, bytes = 0;
+
+    WorkPath(pOpts, "convert.tmp", outPath, sizeof(outPath));
+    (void) remove(outPath);
+
+    start = GetUsec();
+
+    srcImg.SetUseMmap(true);
+    dierr = srcImg.OpenImage(pathName, '/', true);
+    if (dierr == kDIErrNone)
+        dierr = srcImg.AnalyzeImage();
+    if (dierr == kDIErrNone) {
+        dierr = srcImg.OverrideFormat(srcImg.GetPhysicalFormat(),
+                    DiskImg::kFormatGenericProDOSOrd, srcImg.GetSectorOrder());
+    }
+    if (dierr != kDIErrNone)
+        goto bail;
+
+    if (srcImg.GetHasBlocks()) {
+        unsigned char blkBuf[512];
+        long numBlocks = srcImg.GetNumBlocks();
+
+        dierr = dstImg.CreateImage(outPath, nil,
+                    DiskImg::kOuterFormatNone,
+                    DiskImg::kFileFormatUnadorned,
+                    DiskImg::kPhysicalFormatSectors,
+                    nil,
+                    DiskImg::kSectorOrderProDOS,
+                    DiskImg::kFormatGenericProDOSOrd,
+                    numBlocks, true);
+        long block = 0;
+        if (srcImg.GetHasNibbles() && srcImg.GetNumSectPerTrack() == 16) {
+            /* whole-track decode, 8 blocks per track */
+            unsigned char trkBuf[16 * 256];
+            uint32_t badMask;
+            for ( ; dierr == kDIErrNone && block + 8 <= numBlocks;
+                block += 8)
+            {
+                dierr = srcImg.ReadTrack(block / 8, trkBuf, &badMask);
+                if (dierr == kDIErrNone && badMask != 0)
+                    dierr = kDIErrSectorUnreadable;
+                for (int i = 0; dierr == kDIErrNone && i < 8; i++)
+                    dierr = dstImg.WriteBlock(block + i, trkBuf + i * 512);
+            }
+        }
+        for ( ; dierr == kDIErrNone && block < numBlocks; block++) {
+            dierr = srcImg.ReadBlock(block, blkBuf);
+            if (dierr == kDIErrNone)
+                dierr = dstImg.WriteBlock(block, blkBuf);
+        }
+        bytes = (long long) numBlocks * 512;
+    } else {
+        unsigned char trkBuf[32 * 256];
+        uint32_t badMask;
+        long numTracks = srcImg.GetNumTracks();
+        long numSectPerTrack = srcImg.GetNumSectPerTrack();
+
+        dierr = dstImg.CreateImage(outPath, nil,
+                    DiskImg::kOuterFormatNone,
+                    DiskImg::kFileFormatUnadorned,
+                    DiskImg::kPhysicalFormatSectors,
+                    nil,
+                    DiskImg::kSectorOrderDOS,
+                    DiskImg::kFormatGenericDOSOrd,
+                    numTracks, numSectPerTrack, true);
+        for (long track = 0; dierr == kDIErrNone && track < numTracks;
+            track++)
+        {
+            dierr = srcImg.ReadTrack(track, trkBuf, &badMask);
+            if (dierr == kDIErrNone && badMask != 0)
+                dierr = kDIErrSectorUnreadable;
+            for (long sector = 0; dierr == kDIErrNone &&
+                sector < numSectPerTrack; sector++)
+            {
+                dierr = dstImg.WriteTrackSector(track, sector,
+                            trkBuf + sector * 256);
+            }
+        }
+        bytes = (long long) numTracks * numSectPerTrack * 256;
+    }
+    if (dierr != kDIErrNone)
+        goto bail;
+
+    dierr = dstImg.CloseImage();
+    if (dierr != kDIErrNone)
+        goto bail;
+
+    Report("convert", pSpec->name, 1, bytes, GetUsec() - start);
+
+bail:
+    (void) remove(outPath);
+    if (dierr != kDIErrNone) {
+        fprintf(stderr, "ERROR: convert of '%s' failed: %s\n",
+            pathName, DIStrError(dierr));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Time file creation with and without the write-back block cache, on
+ * the plain sector images.  The corpus itself was built with the cache
+ * off, so that run already provides the baseline.
+ */
+int
+BenchWriteBack(const BenchOpts* pOpts, const CorpusSpec* pSpec)
+{
+    char pathName[256];
+    int result;
+
+    if (pSpec->outer != DiskImg::kOuterFormatNone ||
+        pSpec->fileFormat != DiskImg::kFileFormatUnadorned ||
+        pSpec->physical != DiskImg::kPhysicalFormatSectors)
+    {
+        return 0;
+    }
+
+    WorkPath(pOpts, "writeback.tmp", pathName, sizeof(pathName));
+    result = GenerateImage(pSpec, pathName, DiskImg::kCacheModeWriteBack,
+                "write_files_wb");
+    (void) remove(pathName);
+    return result;
+}
+
+/*
+ * Create a couple thousand empty files in a single directory of a fresh
+ * image, the way a large import would.  Only done for the big images
+ * with subdirectories.
+ */
+int
+BenchOneDir(const BenchOpts* pOpts, const CorpusSpec* pSpec)
+{
+    const int kNumFiles = 2000;
+    DiskImg diskImg;
+    DiskFS* pDiskFS = nil;
+    char pathName[256], fileName[64];
+    char fssep;
+    long long start;
+    DIError dierr;
+
+    if (pSpec->numDirs == 0 || pSpec->numBlocks < 65535)
+        return 0;
+
+    WorkPath(pOpts, "onedir.tmp", pathName, sizeof(pathName));
+    (void) remove(pathName);
+
+    dierr = CreateEmptyImage(pSpec, pathName, &diskImg);
+    if (dierr == kDIErrNone) {
+        pDiskFS = diskImg.OpenAppropriateDiskFS(false);
+        if (pDiskFS == nil)
+            dierr = kDIErrUnsupportedFSFmt;
+    }
+    if (dierr == kDIErrNone)
+        dierr = pDiskFS->Initialize(&diskImg, DiskFS::kInitFull);
+    if (dierr != kDIErrNone)
+        goto bail;
+
+    fssep = (pSpec->fsFormat == DiskImg::kFormatMacHFS) ? ':' : '/';
+
+    start = GetUsec();
+    for (int i = 0; i < kNumFiles; i++) {
+        DiskFS::CreateParms parms;
+        A2File* pNewFile;
+
+        snprintf(fileName, sizeof(fileName), "ONEDIR%cFILE%04d", fssep, i);
+        parms.pathName = fileName;
+        parms.fssep = fssep;
+        parms.storageType = DiskFS::kStorageSeedling;
+        parms.fileType = 0x06;      // BIN
+        parms.auxType = 0x2000;
+        parms.access = DiskFS::kFileAccessUnlocked;
+        parms.createWhen = parms.modWhen = 0x40000000;
+
+        dierr = pDiskFS->CreateFile(&parms, &pNewFile);
+        if (dierr != kDIErrNone)
+            goto bail;
+    }
+    Report("create_one_dir", pSpec->name, kNumFiles, 0, GetUsec() - start);
+
+bail:
+    delete pDiskFS;
+    (void) diskImg.CloseImage();
+    (void) remove(pathName);
+    if (dierr != kDIErrNone) {
+        fprintf(stderr, "ERROR: one-dir create on '%s' failed: %s\n",
+            pSpec->name, DIStrError(dierr));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * A GFDFile that takes a while to answer every positional read, the way
+ * a floppy drive or a CF card would.
+ */
+class GFDSlowFile : public GFDFile {
+public:
+    enum { kReadDelayUsec = 100 };
+
+    virtual DIError ReadAt(void* buf, size_t length, di_off_t offset) {
+        usleep(kReadDelayUsec);
+        return GFDFile::ReadAt(buf, length, offset);
+    }
+};
+
+typedef struct SlowCacheState {
+    GFDBlockCache*  pCache;
+    const uint8_t*  expected;       // the whole image, read up front
+    long            numBlocks;
+    int             numThreads;
+    DIMutex         lock;
+    bool            failed;
+} SlowCacheState;
+
+/*
+ * Thread body for BenchSlowCache: read every "numThreads"th block,
+ * starting at "threadIdx", and check it.
+ */
+static void
+SlowCacheThread(void* arg, int threadIdx)
+{
+    SlowCacheState* pState = (SlowCacheState*) arg;
+    unsigned char buf[512];
+
+    for (long block = threadIdx; block < pState->numBlocks;
+        block += pState->numThreads)
+    {
+        DIError dierr = pState->pCache->ReadAt(buf, sizeof(buf),
+                            (di_off_t) block * sizeof(buf));
+        if (dierr != kDIErrNone ||
+            memcmp(buf, pState->expected + block * sizeof(buf),
+                sizeof(buf)) != 0)
+        {
+            DIAutoLock lock(&pState->lock);
+            pState->failed = true;
+            return;
+        }
+    }
+}
+
+/*
+ * Read every block of the image through the sector cache, on one thread
+ * and then on several, with the file behind the cache made slow.  Each
+ * block is a miss, so this shows whether threads can wait on the media
+ * at the same time.  Only done for the 800K ProDOS image.
+ */
+int
+BenchSlowCache(const BenchOpts* pOpts, const CorpusSpec* pSpec,
+    const char* pathName)
+{
+    const long length = pSpec->numBlocks * 512L;
+    SlowCacheState state;
+    unsigned char* expected = nil;
+    char opName[32];
+    int result = -1;
+    FILE* fp;
+
+    if (pSpec->outer != DiskImg::kOuterFormatNone ||
+        pSpec->fileFormat != DiskImg::kFileFormatUnadorned ||
+        pSpec->fsFormat != DiskImg::kFormatProDOS ||
+        pSpec->numBlocks != 1600)
+    {
+        return 0;
+    }
+
+    expected = new unsigned char[length];
+    fp = fopen(pathName, "rb");
+    if (fp == nil || fread(expected, length, 1, fp) != 1) {
+        fprintf(stderr, "ERROR: unable to read '%s'\n", pathName);
+        if (fp != nil)
+            fclose(fp);
+        goto bail;
+    }
+    fclose(fp);
+
+    for (int pass = 0; pass < 2; pass++) {
+        int numThreads = (pass == 0) ? 1 : pOpts->numThreads;
+        GFDSlowFile* pSlowFile = new GFDSlowFile;
+        GFDBlockCache cache;
+        long long start;
+        DIError dierr;
+
+        if (pass != 0 && numThreads == 1)
+            break;
+
+        dierr = pSlowFile->Open(pathName, true);
+        if (dierr == kDIErrNone)
+            dierr = cache.Open(pSlowFile, length, length, false);
+        else
+            delete pSlowFile;
+        if (dierr != kDIErrNone) {
+            fprintf(stderr, "ERROR: unable to open '%s' for caching: %s\n",
+                pathName, DIStrError(dierr));
+            goto bail;
+        }
+
+        state.pCache = &cache;
+        state.expected = expected;
+        state.numBlocks = pSpec->numBlocks;
+        state.numThreads = numThreads;
+        state.failed = false;
+
+        start = GetUsec();
+        RunThreads(numThreads, SlowCacheThread, &state);
+        snprintf(opName, sizeof(opName), "cache_slow_read_t%d", numThreads);
+        Report(opName, pSpec->name, 1, length, GetUsec() - start);
+
+        if (state.failed) {
+            fprintf(stderr, "ERROR: bad data from cache on '%s'\n",
+                pathName);
+            goto bail;
+        }
+    }
+    result = 0;
+
+bail:
+    delete[] expected;
+    return result;
+}
+
+/*
+ * Store a big-endian value of "len" bytes.
+ */
+void
+PutBE(unsigned char* ptr, unsigned long val, int len)
+{
+    while (len--)
+        *ptr++ = (unsigned char) (val >> (len * 8));
+}
+
+/*
+ * Build a 5.25" FDI image from the tracks of a nibble image.  The library
+ * can read FDI but not write it, so we fake up what a flux reader would
+ * have captured: each nibble becomes 8 bit cells (10 for self-sync 0xff
+ * bytes), and each 1 bit becomes one pulse.  Only the "average" and
+ * "index" streams are stored, uncompressed.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int
+BuildFDIImage(const char* nibPathName, const char* fdiPathName)
+{
+    const int kCellTime = 1000;     // arbitrary units per bit cell
+    const int kHeaderLen = 512;
+    const int kMaxPulses = kTrackAllocSize * 10;
+    DiskImg diskImg;
+    unsigned char header[kHeaderLen];
+    unsigned char* trackData = nil;
+    unsigned char nibBuf[kTrackAllocSize];
+    FILE* fp = nil;
+    int result = -1;
+    DIError dierr;
+
+    dierr = diskImg.OpenImage(nibPathName, '/', true);
+    if (dierr == kDIErrNone)
+        dierr = diskImg.AnalyzeImage();
+    if (dierr != kDIErrNone || !diskImg.GetHasNibbles()) {
+        fprintf(stderr, "ERROR: unable to open '%s' as nibbles\n",
+            nibPathName);
+        return -1;
+    }
+
+    fp = fopen(fdiPathName, "wb");
+    if (fp == nil) {
+        fprintf(stderr, "ERROR: unable to create '%s': %s\n", fdiPathName,
+            strerror(errno));
+        return -1;
+    }
+
+    memset(header, 0, sizeof(header));
+    memcpy(header, "Formatted Disk Image file\r\n", 27);
+    memcpy(header + 27, "CiderPress bench", 16);
+    PutBE(header + 140, 0x0200, 2);                         // version
+    PutBE(header + 142, diskImg.GetNumTracks() - 1, 2);     // last track
+    header[144] = 0;                                        // last head
+    header[145] = 1;                                        // 5.25"
+    if (fwrite(header, sizeof(header), 1, fp) != 1)
+        goto bail;
+
+    /* 16-byte header, 4 bytes of avg and 2 of index per pulse, rounded */
+    trackData = new unsigned char[16 + kMaxPulses * 6 + 256];
+
+    for (long track = 0; track < diskImg.GetNumTracks(); track++) {
+        unsigned char* avgPtr;
+        unsigned char* idxPtr;
+        long trackLen, numPulses, dataLen;
+        int gap;
+
+        dierr = diskImg.ReadNibbleTrack(track, nibBuf, &trackLen);
+        if (dierr != kDIErrNone) {
+            fprintf(stderr, "ERROR: unable to read track %ld of '%s': %s\n",
+                track, nibPathName, DIStrError(dierr));
+            goto bail;
+        }
+
+        /* count the pulses so we know where the index stream starts */
+        numPulses = 0;
+        for (long i = 0; i < trackLen; i++) {
+            for (int bit = 0x80; bit != 0; bit >>= 1) {
+                if (nibBuf[i] & bit)
+                    numPulses++;
+            }
+        }
+        avgPtr = trackData + 16;
+        idxPtr = avgPtr + numPulses * 4;
+
+        gap = 0;
+        for (long i = 0; i < trackLen; i++) {
+            unsigned char val = nibBuf[i];
+            for (int bit = 0x80; bit != 0; bit >>= 1) {
+                gap++;
+                if (val & bit) {
+                    PutBE(avgPtr, gap * kCellTime, 4);
+                    avgPtr += 4;
+                    gap = 0;
+                }
+            }
+            if (val == 0xff && (nibBuf[(i + 1) % trackLen] == 0xff ||
+                                nibBuf[(i + trackLen - 1) % trackLen] == 0xff))
+            {
+                gap += 2;       // self-sync byte
+            }
+        }
+        if (gap != 0) {
+            /* fold trailing zeroes into the first pulse */
+            unsigned char* firstPtr = trackData + 16;
+            unsigned long first = (unsigned long) firstPtr[0] << 24 |
+                firstPtr[1] << 16 | firstPtr[2] << 8 | firstPtr[3];
+            PutBE(firstPtr, first + gap * kCellTime, 4);
+        }
+
+        /* every pulse is stable; the first few see the index hole */
+        for (long i = 0; i < numPulses; i++) {
+            PutBE(idxPtr, (i < 4) ? 0x0080 : 0x8000, 2);
+            idxPtr += 2;
+        }
+
+        dataLen = idxPtr - trackData;
+        dataLen = (dataLen + 255) & ~255;
+        memset(idxPtr, 0, dataLen - (idxPtr - trackData));
+
+        memset(trackData, 0, 16);
+        PutBE(trackData + 0x00, numPulses, 4);
+        PutBE(trackData + 0x04, numPulses * 4, 3);      // avg, uncompressed
+        PutBE(trackData + 0x0d, numPulses * 2, 3);      // idx, uncompressed
+
+        PutBE(header + 152 + track * 2, 0x8000 | (dataLen / 256), 2);
+        if (fwrite(trackData, dataLen, 1, fp) != 1)
+            goto bail;
+    }
+
+    /* rewrite the header with the track descriptors */
+    if (fseek(fp, 0, SEEK_SET) != 0 ||
+        fwrite(header, sizeof(header), 1, fp) != 1)
+    {
+        goto bail;
+    }
+    result = 0;
+
+bail:
+    if (result != 0)
+        fprintf(stderr, "ERROR: failed writing '%s'\n", fdiPathName);
+    delete[] trackData;
+    if (fp != nil && fclose(fp) != 0)
+        result = -1;
+    return result;
+}
+
+/*
+ * Build an FDI image from the nibble image in the corpus, and time opening
+ * it.  Converting the pulses to bits, and the bits to nibbles, takes most
+ * of the time.
+ */
+int
+BenchFDI(const BenchOpts* pOpts)
+{
+    const CorpusSpec* pNibSpec = nil;
+    CorpusSpec fdiSpec;
+    char nibPath[256], fdiPath[256];
+    unsigned int i;
+
+    for (i = 0; i < NELEM(kCorpus); i++) {
+        if (kCorpus[i].physical == DiskImg::kPhysicalFormatNib525_6656) {
+            pNibSpec = &kCorpus[i];
+            break;
+        }
+    }
+    if (pNibSpec == nil)
+        return 0;
+    WorkPath(pOpts, pNibSpec->name, nibPath, sizeof(nibPath));
+    if (access(nibPath, F_OK) != 0)
+        return 0;       // generation failed, already counted
+
+    fdiSpec = *pNibSpec;
+    fdiSpec.name = "prodos-140k.fdi";
+    WorkPath(pOpts, fdiSpec.name, fdiPath, sizeof(fdiPath));
+
+    fprintf(stderr, "Benchmarking %s\n", fdiSpec.name);
+    if (BuildFDIImage(nibPath, fdiPath) != 0)
+        return -1;
+    if (BenchOpenAnalyze(pOpts, &fdiSpec, fdiPath) != 0)
+        return -1;
+    return 0;
+}
+
+/*
+ * Time BitOutputBuffer::WriteBits and BitInputBuffer::GetBits, which the
+ * FDI and DDD code spend most of their time in.  A fixed list of fields,
+ * 1 to 16 bits wide, is written out and then read back and checked.
+ */
+int
+BenchBitBuffers(const BenchOpts* pOpts)
+{
+    const int kNumFields = 1024 * 1024;
+    const int kBufLen = kNumFields * 2 + 8;
+    BenchRandom rand(0xb175);
+    uint32_t* values = new uint32_t[kNumFields];
+    uint8_t* widths = new uint8_t[kNumFields];
+    uint8_t* buf = new uint8_t[kBufLen];
+    long long start, writeUsec = 0, readUsec = 0;
+    long long totalBits = 0;
+    int bitCount = 0;
+    int result = 0;
+    int i;
+
+    for (i = 0; i < kNumFields; i++) {
+        widths[i] = (uint8_t) (1 + rand.Next() % 16);
+        values[i] = (uint32_t) (rand.Next() & ((1U << widths[i]) - 1));
+    }
+
+    fprintf(stderr, "Benchmarking bit buffers\n");
+    for (int iter = 0; iter < pOpts->iterations && result == 0; iter++) {
+        uint32_t mismatch = 0;
+
+        start = GetUsec();
+        BitOutputBuffer output(buf, kBufLen);
+        for (i = 0; i < kNumFields; i++)
+            output.WriteBits(values[i], widths[i]);
+        bitCount = output.Finish();
+        writeUsec += GetUsec() - start;
+
+        start = GetUsec();
+        BitInputBuffer input(buf, bitCount, false);
+        for (i = 0; i < kNumFields; i++)
+            mismatch |= input.GetBits(widths[i], nil) ^ values[i];
+        readUsec += GetUsec() - start;
+
+        if (mismatch != 0 || input.GetOverrun() ||
+            input.GetBitsConsumed() != bitCount)
+        {
+            fprintf(stderr, "ERROR: bit buffer read back didn't match\n");
+            result = -1;
+        }
+        totalBits += bitCount;
+    }
+
+    if (result == 0) {
+        Report("bits_write", "(memory)", pOpts->iterations, totalBits / 8,
+            writeUsec);
+        Report("bits_read", "(memory)", pOpts->iterations, totalBits / 8,
+            readUsec);
+    }
+
+    delete[] values;
+    delete[] widths;
+    delete[] buf;
+    return result;
+}
+
+/*
+ * Gzip "srcPathName" into "dstPathName".  If "padLen" is larger than the
+ * source file, zeroes are added to the end to make it that long.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int
+GzipFile(const char* srcPathName, const char* dstPathName, long long padLen)
+{
+    unsigned char buf[65536];
+    FILE* fp;
+    gzFile gzfp;
+    size_t actual;
+    long long total = 0;
+    int result = 0;
+
+    fp = fopen(srcPathName, "rb");
+    if (fp == nil)
+        return -1;
+    gzfp = gzopen(dstPathName, "wb");
+    if (gzfp == nil) {
+        fclose(fp);
+        return -1;
+    }
+    while ((actual = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        if (gzwrite(gzfp, buf, (unsigned) actual) != (int) actual) {
+            result = -1;
+            break;
+        }
+        total += actual;
+    }
+    if (ferror(fp))
+        result = -1;
+    memset(buf, 0, sizeof(buf));
+    while (result == 0 && total < padLen) {
+        actual = sizeof(buf);
+        if (padLen - total < (long long) actual)
+            actual = (size_t) (padLen - total);
+        if (gzwrite(gzfp, buf, (unsigned) actual) != (int) actual)
+            result = -1;
+        total += actual;
+    }
+    fclose(fp);
+    if (gzclose(gzfp) != Z_OK)
+        result = -1;
+    return result;
+}
+
+/*
+ * Read every block of "pDiskImg" and compare it to the uncompressed image,
+ * which must be unadorned and in ProDOS order.  Blocks past the end of
+ * the original must be zeroed, as GzipFile pads them.
+ *
+ * Returns 0 if they match, -1 if not.
+ */
+int
+VerifyBlocks(DiskImg* pDiskImg, const char* origPathName)
+{
+    unsigned char origBuf[512], buf[512];
+    FILE* fp;
+    int result = 0;
+
+    fp = fopen(origPathName, "rb");
+    if (fp == nil)
+        return -1;
+    for (long block = 0; block < pDiskImg->GetNumBlocks(); block++) {
+        if (fread(origBuf, sizeof(origBuf), 1, fp) != 1) {
+            if (ferror(fp)) {
+                result = -1;
+                break;
+            }
+            memset(origBuf, 0, sizeof(origBuf));
+        }
+        if (pDiskImg->ReadBlock(block, buf) != kDIErrNone ||
+            memcmp(origBuf, buf, sizeof(buf)) != 0)
+        {
+            fprintf(stderr, "ERROR: block %ld doesn't match '%s'\n",
+                block, origPathName);
+            result = -1;
+            break;
+        }
+    }
+    fclose(fp);
+    return result;
+}
+
+/*
+ * Time opening "gzPath" and loading the catalog with each of the
+ * GzipIndexModes.  If "memoryLimit" is zero, the default limit is used.
+ * The persisted index is timed twice, once when it has to be built and
+ * saved, and again when it's loaded.
+ *
+ * After the timed runs, every block is checked against "srcPath".
+ */
+int
+BenchGzipModes(const BenchOpts* pOpts, const CorpusSpec* pSpec,
+    const char* gzPath, const char* srcPath, long memoryLimit)
+{
+    static const struct {
+        const char*             opName;
+        DiskImg::GzipIndexMode  mode;
+        bool                    removeIndex;    // before each iteration
+    } kModes[] = {
+        { "gz_temp_file",       DiskImg::kGzipIndexNone,    false },
+        { "gz_index",           DiskImg::kGzipIndexMemory,  false },
+        { "gz_index_save",      DiskImg::kGzipIndexPersist, true },
+        { "gz_index_load",      DiskImg::kGzipIndexPersist, false },
+    };
+    char indexPath[256 + 8];
+    unsigned int i;
+
+    snprintf(indexPath, sizeof(indexPath), "%s.gzidx", gzPath);
+    (void) remove(indexPath);
+
+    for (i = 0; i < NELEM(kModes); i++) {
+        long long start, elapsed = 0;
+
+        for (int iter = 0; iter < pOpts->iterations; iter++) {
+            DiskImg diskImg;
+            DiskFS* pDiskFS;
+            DIError dierr;
+            long count = 0;
+
+            if (kModes[i].removeIndex)
+                (void) remove(indexPath);
+
+            start = GetUsec();
+            if (memoryLimit != 0)
+                diskImg.SetGzipMemoryLimit(memoryLimit);
+            diskImg.SetGzipIndexMode(kModes[i].mode);
+            dierr = OpenDiskFS(gzPath, &diskImg, &pDiskFS);
+            if (dierr != kDIErrNone) {
+                fprintf(stderr, "ERROR: %s of '%s' failed: %s\n",
+                    kModes[i].opName, gzPath, DIStrError(dierr));
+                return -1;
+            }
+            A2File* pFile = pDiskFS->GetNextFile(nil);
+            while (pFile != nil) {
+                if (!pFile->IsDirectory() && !pFile->IsVolumeDirectory())
+                    count++;
+                pFile = pDiskFS->GetNextFile(pFile);
+            }
+            elapsed += GetUsec() - start;
+
+            if (count != pSpec->numFiles) {
+                fprintf(stderr, "ERROR: '%s' has %ld files, expected %d\n",
+                    gzPath, count, pSpec->numFiles);
+                delete pDiskFS;
+                return -1;
+            }
+            if (iter == 0 && VerifyBlocks(&diskImg, srcPath) != 0) {
+                delete pDiskFS;
+                return -1;
+            }
+            delete pDiskFS;
+        }
+
+        Report(kModes[i].opName, pSpec->name, pOpts->iterations, 0, elapsed);
+    }
+
+    if (access(indexPath, F_OK) != 0) {
+        fprintf(stderr, "ERROR: index '%s' was not saved\n", indexPath);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Gzip the biggest ProDOS image in the corpus, and run BenchGzipModes on
+ * it twice.  The first time, the memory limit is set below the size of
+ * the image, so it's either unpacked into a temp file or read through an
+ * index.  The second time, the image is padded out to a hard drive
+ * larger than the default memory limit, which is what the index is for:
+ * the catalog only needs the part of the drive that holds the volume,
+ * while the temp file gets all of it.
+ */
+int
+BenchGzipIndex(const BenchOpts* pOpts)
+{
+    const long kMemoryLimit = 8 * 1024 * 1024;
+    const long long kDriveLen = 128 * 1024 * 1024;
+    const CorpusSpec* pSrcSpec = nil;
+    CorpusSpec gzSpec;
+    char srcPath[256], gzPath[256];
+    unsigned int i;
+
+    for (i = 0; i < NELEM(kCorpus); i++) {
+        if (kCorpus[i].outer == DiskImg::kOuterFormatNone &&
+            kCorpus[i].fileFormat == DiskImg::kFileFormatUnadorned &&
+            kCorpus[i].order == DiskImg::kSectorOrderProDOS &&
+            kCorpus[i].numBlocks * 512L > kMemoryLimit &&
+            (pSrcSpec == nil || kCorpus[i].numBlocks > pSrcSpec->numBlocks))
+        {
+            pSrcSpec = &kCorpus[i];
+        }
+    }
+    if (pSrcSpec == nil)
+        return 0;
+    WorkPath(pOpts, pSrcSpec->name, srcPath, sizeof(srcPath));
+    if (access(srcPath, F_OK) != 0)
+        return 0;       // generation failed, already counted
+
+    gzSpec = *pSrcSpec;
+    gzSpec.name = "prodos-big.po.gz";
+    gzSpec.outer = DiskImg::kOuterFormatGzip;
+    WorkPath(pOpts, gzSpec.name, gzPath, sizeof(gzPath));
+
+    fprintf(stderr, "Benchmarking %s\n", gzSpec.name);
+    if (GzipFile(srcPath, gzPath, 0) != 0) {
+        fprintf(stderr, "ERROR: unable to create '%s'\n", gzPath);
+        return -1;
+    }
+    if (BenchGzipModes(pOpts, &gzSpec, gzPath, srcPath, kMemoryLimit) != 0)
+        return -1;
+
+    assert(kDriveLen > kGzipMax);
+    gzSpec.name = "prodos-hd.po.gz";
+    WorkPath(pOpts, gzSpec.name, gzPath, sizeof(gzPath));
+
+    fprintf(stderr, "Benchmarking %s\n", gzSpec.name);
+    if (GzipFile(srcPath, gzPath, kDriveLen) != 0) {
+        fprintf(stderr, "ERROR: unable to create '%s'\n", gzPath);
+        return -1;
+    }
+    if (BenchGzipModes(pOpts, &gzSpec, gzPath, srcPath, 0) != 0)
+        return -1;
+    return 0;
+}
+
+/*
+ * Build the corpus and run every benchmark against it.
+ *
+ * Returns the number of failures.
+ */
+int
+RunBenchmarks(const BenchOpts* pOpts)
+{
+    char pathName[256];
+    int failures = 0;
+    unsigned int i;
+
+    if (mkdir(pOpts->workDir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "ERROR: unable to create '%s': %s\n",
+            pOpts->workDir, strerror(errno));
+        return 1;
+    }
+
+    printf("op,image,iterations,bytes,usec,usec_per_iter,mb_per_sec\n");
+
+    for (i = 0; i < NELEM(kCorpus); i++) {
+        fprintf(stderr, "Generating %s\n", kCorpus[i].name);
+        WorkPath(pOpts, kCorpus[i].name, pathName, sizeof(pathName));
+        if (GenerateImage(&kCorpus[i], pathName, DiskImg::kCacheModeOff,
+                "write_files") != 0)
+        {
+            failures++;
+        }
+    }
+
+    for (i = 0; i < NELEM(kCorpus); i++) {
+        const CorpusSpec* pSpec = &kCorpus[i];
+
+        WorkPath(pOpts, pSpec->name, pathName, sizeof(pathName));
+        if (access(pathName, F_OK) != 0)
+            continue;       // generation failed, already counted
+
+        fprintf(stderr, "Benchmarking %s\n", pSpec->name);
+        if (BenchOpenAnalyze(pOpts, pSpec, pathName) != 0)
+            failures++;
+        if (BenchCatalog(pOpts, pSpec, pathName) != 0)
+            failures++;
+        if (BenchFirstFile(pOpts, pSpec, pathName, DiskFS::kInitFull) != 0)
+            failures++;
+        if (BenchFirstFile(pOpts, pSpec, pathName, DiskFS::kInitLazy) != 0)
+            failures++;
+        if (BenchExtractAll(pOpts, pSpec, pathName, 1) != 0)
+            failures++;
+        if (pOpts->numThreads > 1 &&
+            BenchExtractAll(pOpts, pSpec, pathName, pOpts->numThreads) != 0)
+        {
+            failures++;
+        }
+        if (BenchConvert(pOpts, pSpec, pathName) != 0)
+            failures++;
+        if (BenchWriteBack(pOpts, pSpec) != 0)
+            failures++;
+        if (BenchSlowCache(pOpts, pSpec, pathName) != 0)
+            failures++;
+        if (BenchOneDir(pOpts, pSpec) != 0)
+            failures++;
+    }
+
+    if (BenchFDI(pOpts) != 0)
+        failures++;
+    if (BenchBitBuffers(pOpts) != 0)
+        failures++;
+    if (BenchGzipIndex(pOpts) != 0)
+        failures++;
+
+    if (!pOpts->keepCorpus)
+        RemoveTree(pOpts->workDir);
+
+    return failures;
+}
+
+/*
+ * Show usage info.
+ */
+void
+Usage(const char* argv0)
+{
+    fprintf(stderr,
+        "Usage: %s [-i iterations] [-t threads] [-k] [work-dir]\n", argv0);
+    fprintf(stderr, "  -i: repeat count for open and catalog (default 20)\n");
+    fprintf(stderr, "  -t: thread count for the parallel extract (default 4)\n");
+    fprintf(stderr, "  -k: keep the generated corpus\n");
+    fprintf(stderr, "  work-dir defaults to 'bench-work'\n");
+}
+
+/*
+ * Parse args and go.
+ */
+int
+main(int argc, char** argv)
+{
+    BenchOpts opts;
+    int cc, failures;
+
+    opts.workDir = "bench-work";
+    opts.iterations = 20;
+    opts.numThreads = 4;
+    opts.keepCorpus = false;
+
+    while ((cc = getopt(argc, argv, "i:t:k")) != -1) {
+        switch (cc) {
+        case 'i':
+            opts.iterations = atoi(optarg);
+            break;
+        case 't':
+            opts.numThreads = atoi(optarg);
+            break;
+        case 'k':
+            opts.keepCorpus = true;
+            break;
+        default:
+            Usage(argv[0]);
+            exit(2);
+        }
+    }
+    if (optind < argc)
+        opts.workDir = argv[optind++];
+    if (optind != argc || opts.iterations < 1 || opts.numThreads < 1) {
+        Usage(argv[0]);
+        exit(2);
+    }
+
+#ifdef _DEBUG
+    const char* kLogFile = "bench-log.txt";
+    gLog = fopen(kLogFile, "w");
+    if (gLog == nil) {
+        fprintf(stderr, "ERROR: unable to open log file\n");
+        exit(1);
+    }
+#endif
+
+    Global::SetDebugMsgHandler(MsgHandler);
+#ifndef _DEBUG
+    Global::SetLogLevel(Global::kLogNone);      // logging skews the numbers
+#endif
+    Global::AppInit();
+
+    NuSetGlobalErrorMessageHandler(NufxErrorMsgHandler);
+
+    failures = RunBenchmarks(&opts);
+    if (failures != 0)
+        fprintf(stderr, "%d benchmark(s) failed\n", failures);
+
+    Global::AppCleanup();
+#ifdef _DEBUG
+    fclose(gLog);
+#endif
+
+    exit(failures == 0 ? 0 : 1);
+}
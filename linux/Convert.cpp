@@ -28,7 +28,8 @@ pid_t gPid = getpid();
  * Handle a debug message from the DiskImg library.
  */
 /*static*/ void
-MsgHandler(const char* file, int line, const char* msg)
+MsgHandler(Global::LogSeverity severity, const char* file, int line,
+    const char* msg)
 {
     ASSERT(file != nil);
     ASSERT(msg != nil);
@@ -45,11 +46,11 @@ NufxErrorMsgHandler(NuArchive* /*pArchive*/, void* vErrorMessage)
     const NuErrorMessage* pErrorMessage = (const NuErrorMessage*) vErrorMessage;
 
     if (pErrorMessage->isDebug) {
-        Global::PrintDebugMsg(pErrorMessage->file, pErrorMessage->line,
-            "<nufxlib> [D] %s\n", pErrorMessage->message);
+        Global::PrintDebugMsg(Global::kLogDebug, pErrorMessage->file,
+            pErrorMessage->line, "<nufxlib> [D] %s\n", pErrorMessage->message);
     } else {
-        Global::PrintDebugMsg(pErrorMessage->file, pErrorMessage->line,
-            "<nufxlib> %s\n", pErrorMessage->message);
+        Global::PrintDebugMsg(Global::kLogWarn, pErrorMessage->file,
+            pErrorMessage->line, "<nufxlib> %s\n", pErrorMessage->message);
     }
 
     return kNuOK;
@@ -387,7 +388,31 @@ Convert(const char* infile, const char* outfile)
         printf("Copying %d blocks\n", numBlocks);
 
         unsigned char blkBuf[512];
-        for (int block = 0; block < numBlocks; block++) {
+        int block = 0;
+        if (srcImg.GetHasNibbles() && srcImg.GetNumSectPerTrack() == 16) {
+            /* decode a whole track at a time; blocks are 8 per track */
+            unsigned char trkBuf[16 * 256];
+            uint32_t badMask;
+            for ( ; block + 8 <= numBlocks; block += 8) {
+                dierr = srcImg.ReadTrack(block / 8, trkBuf, &badMask);
+                if (dierr == kDIErrNone && badMask != 0)
+                    dierr = kDIErrSectorUnreadable;
+                if (dierr != kDIErrNone) {
+                    fprintf(stderr, "ERROR: ReadTrack failed (err=%d)\n",
+                        dierr);
+                    goto bail;
+                }
+                for (int i = 0; i < 8; i++) {
+                    dierr = dstImg.WriteBlock(block + i, trkBuf + i * 512);
+                    if (dierr != kDIErrNone) {
+                        fprintf(stderr, "ERROR: WriteBlock failed (err=%d)\n",
+                            dierr);
+                        goto bail;
+                    }
+                }
+            }
+        }
+        for ( ; block < numBlocks; block++) {
             dierr = srcImg.ReadBlock(block, blkBuf);
             if (dierr != kDIErrNone) {
                 fprintf(stderr, "ERROR: ReadBlock failed (err=%d)\n", dierr);
@@ -409,18 +434,23 @@ Convert(const char* infile, const char* outfile)
             numSectPerTrack = dstImg.GetNumSectPerTrack();
         printf("Copying %d tracks of %d sectors\n", numTracks, numSectPerTrack);
 
-        unsigned char sctBuf[256];
+        unsigned char trkBuf[32 * 256];
+        uint32_t badMask;
         for (int track = 0; track < numTracks; track++) {
+            /* unreadable sectors come back zeroed */
+            dierr = srcImg.ReadTrack(track, trkBuf, &badMask);
+            if (dierr != kDIErrNone) {
+                memset(trkBuf, 0, sizeof(trkBuf));
+                badMask = 0xffffffff;
+            }
             for (int sector = 0; sector < numSectPerTrack; sector++) {
-                dierr = srcImg.ReadTrackSector(track, sector, sctBuf);
-                if (dierr != kDIErrNone) {
+                if ((badMask & (1UL << sector)) != 0) {
                     fprintf(stderr,
-                        "WARNING: ReadTrackSector failed on T=%d S=%d (err=%d)\n",
-                        track, sector, dierr);
-                    dierr = kDIErrNone;     // allow bad blocks
-                    memset(sctBuf, 0, sizeof(sctBuf));
+                        "WARNING: ReadTrackSector failed on T=%d S=%d\n",
+                        track, sector);     // allow bad blocks
                 }
-                dierr = dstImg.WriteTrackSector(track, sector, sctBuf);
+                dierr = dstImg.WriteTrackSector(track, sector,
+                            trkBuf + sector * 256);
                 if (dierr != kDIErrNone) {
                     fprintf(stderr,
                         "ERROR: WriteBlock failed on T=%d S=%d (err=%d)\n",
@@ -160,7 +160,8 @@ bail:
  * Handle a debug message from the DiskImg library.
  */
 /*static*/ void
-MsgHandler(const char* file, int line, const char* msg)
+MsgHandler(Global::LogSeverity severity, const char* file, int line,
+    const char* msg)
 {
     assert(file != nil);
     assert(msg != nil);
@@ -190,6 +191,9 @@ main(int argc, char** argv)
 #endif
 
     Global::SetDebugMsgHandler(MsgHandler);
+#ifndef _DEBUG
+    Global::SetLogLevel(Global::kLogNone);      // MsgHandler discards it all
+#endif
     Global::AppInit();
 
     if (argc != 3) {
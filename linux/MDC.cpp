@@ -64,6 +64,8 @@ struct Stats {
 
 typedef struct ScanOpts {
     FILE*   outfp;
+    bool    showStats;      // print I/O statistics for each image
+    FormatCache* pFormatCache;  // remembers formats between runs, or nil
 } ScanOpts;
 
 typedef enum RecordKind {
@@ -527,6 +529,32 @@ LoadDiskFSContents(DiskFS* pDiskFS, const char* volName,
     return 0;
 }
 
+/*
+ * Print the I/O statistics gathered while processing an image.
+ */
+void
+PrintIOStats(const DiskImg* pDiskImg, FILE* outfp)
+{
+    DiskImg::IOStats stats;
+
+    pDiskImg->GetIOStats(&stats);
+    fprintf(outfp, "I/O: reads=%ld (%lld bytes) writes=%ld (%lld bytes)"
+        " seeks=%ld\n",
+        stats.readCalls, (long long) stats.bytesRead,
+        stats.writeCalls, (long long) stats.bytesWritten, stats.seeks);
+    fprintf(outfp, "     cache hits=%ld misses=%ld  probe hits=%ld"
+        "  nibble tracks=%ld (scans=%ld)  sub-volume probes=%ld"
+        "  format cached=%ld\n",
+        stats.cacheHits, stats.cacheMisses, stats.probeHits,
+        stats.nibbleTrackLoads, stats.nibbleTrackScans, stats.subVolumeProbes,
+        stats.formatCacheHits);
+    fprintf(outfp, "Time (msec): open=%.3f analyze=%.3f (fs=%.3f)"
+        " initialize=%.3f\n\n",
+        stats.openUsec / 1000.0, stats.analyzeUsec / 1000.0,
+        stats.analyzeFSUsec / 1000.0, stats.initializeUsec / 1000.0);
+}
+
+
 /*
  * Open a disk image and dump the contents.
  *
@@ -543,13 +571,16 @@ ScanDiskImage(const char* pathName, ScanOpts* pScanOpts)
     char errMsg[256] = "";
     DiskImg diskImg;
     DiskFS* pDiskFS = nil;
+    bool opened = false;
 
+    diskImg.SetFormatCache(pScanOpts->pFormatCache);
     dierr = diskImg.OpenImage(pathName, '/', true);
     if (dierr != kDIErrNone) {
         snprintf(errMsg, sizeof(errMsg), "Unable to open '%s': %s",
             pathName, DIStrError(dierr));
         goto bail;
     }
+    opened = true;
 
     dierr = diskImg.AnalyzeImage();
     if (dierr != kDIErrNone) {
@@ -622,10 +653,11 @@ bail:
     if (errMsg[0] != '\0') {
         fprintf(pScanOpts->outfp, "Unable to process '%s'\n", pathName);
         fprintf(pScanOpts->outfp, "  %s\n\n", (LPCTSTR) errMsg);
-        return -1;
-    } else {
-        return 0;
     }
+    if (opened && pScanOpts->showStats)
+        PrintIOStats(&diskImg, pScanOpts->outfp);
+
+    return errMsg[0] != '\0' ? -1 : 0;
 }
 
 
@@ -796,7 +828,8 @@ bail:
  * Handle a debug message from the DiskImg library.
  */
 /*static*/ void
-MsgHandler(const char* file, int line, const char* msg)
+MsgHandler(Global::LogSeverity severity, const char* file, int line,
+    const char* msg)
 {
     ASSERT(file != nil);
     ASSERT(msg != nil);
@@ -815,11 +848,11 @@ NufxErrorMsgHandler(NuArchive* /*pArchive*/, void* vErrorMessage)
     const NuErrorMessage* pErrorMessage = (const NuErrorMessage*) vErrorMessage;
 
     if (pErrorMessage->isDebug) {
-        Global::PrintDebugMsg(pErrorMessage->file, pErrorMessage->line,
-            "<nufxlib> [D] %s\n", pErrorMessage->message);
+        Global::PrintDebugMsg(Global::kLogDebug, pErrorMessage->file,
+            pErrorMessage->line, "<nufxlib> [D] %s\n", pErrorMessage->message);
     } else {
-        Global::PrintDebugMsg(pErrorMessage->file, pErrorMessage->line,
-            "<nufxlib> %s\n", pErrorMessage->message);
+        Global::PrintDebugMsg(Global::kLogWarn, pErrorMessage->file,
+            pErrorMessage->line, "<nufxlib> %s\n", pErrorMessage->message);
     }
 
     return kNuOK;
@@ -833,6 +866,10 @@ main(int argc, char** argv)
 {
     ScanOpts scanOpts;
     scanOpts.outfp = stdout;
+    scanOpts.showStats = false;
+    scanOpts.pFormatCache = nil;
+    const char* cachePath = nil;
+    int argi;
 
 #ifdef _DEBUG
     const char* kLogFile = "mdc-log.txt";
@@ -854,8 +891,25 @@ main(int argc, char** argv)
     printf("Linked against NufxLib v%d.%d.%d and zlib version %s.\n",
         major, minor, bug, zlibVersion());
 
-    if (argc == 1) {
-        fprintf(stderr, "\nUsage: mdc file ...\n");
+    for (argi = 1; argi < argc && argv[argi][0] == '-'; argi++) {
+        if (strcmp(argv[argi], "--stats") == 0) {
+            scanOpts.showStats = true;
+        } else if (strncmp(argv[argi], "--cache=", 8) == 0 &&
+            argv[argi][8] != '\0')
+        {
+            cachePath = argv[argi] + 8;
+        } else {
+            fprintf(stderr, "\nUnknown option '%s'\n", argv[argi]);
+            argi = argc;    // show usage
+            break;
+        }
+    }
+    if (argi >= argc) {
+        fprintf(stderr, "\nUsage: mdc [--stats] [--cache=file] file ...\n");
+        fprintf(stderr, "  --stats: show I/O statistics for each disk image\n");
+        fprintf(stderr, "  --cache: remember image formats in 'file', so that"
+                        " later scans\n"
+                        "           of the same images can skip detection\n");
         goto done;
     }
 
@@ -865,16 +919,29 @@ main(int argc, char** argv)
     printf("\n");
 
     Global::SetDebugMsgHandler(MsgHandler);
+#ifndef _DEBUG
+    Global::SetLogLevel(Global::kLogNone);      // MsgHandler discards it all
+#endif
     Global::AppInit();
 
     NuSetGlobalErrorMessageHandler(NufxErrorMsgHandler);
 
+    if (cachePath != nil) {
+        scanOpts.pFormatCache = new FormatCache;
+        if (scanOpts.pFormatCache->Open(cachePath) != kDIErrNone) {
+            fprintf(stderr, "WARNING: unable to read format cache '%s'\n",
+                cachePath);
+            delete scanOpts.pFormatCache;
+            scanOpts.pFormatCache = nil;
+        }
+    }
+
     time_t start;
     start = time(NULL);
     printf("Run started at %.24s\n\n", ctime(&start));
 
-    while (--argc) {
-        ProcessFile(*++argv, &scanOpts);
+    for ( ; argi < argc; argi++) {
+        ProcessFile(argv[argi], &scanOpts);
     }
 
     printf("Scan completed in %ld seconds:\n", time(NULL) - start);
@@ -882,6 +949,17 @@ main(int argc, char** argv)
     printf("  Files       : %ld (%ld good disk images)\n", gStats.numFiles,
         gStats.goodDiskImages);
 
+    if (scanOpts.pFormatCache != nil) {
+        printf("  Format cache: %ld hits, %ld misses\n",
+            scanOpts.pFormatCache->GetNumHits(),
+            scanOpts.pFormatCache->GetNumMisses());
+        if (scanOpts.pFormatCache->Close() != kDIErrNone) {
+            fprintf(stderr, "WARNING: unable to save format cache '%s'\n",
+                cachePath);
+        }
+        delete scanOpts.pFormatCache;
+    }
+
     Global::AppCleanup();
 
 done:
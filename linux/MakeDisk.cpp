@@ -55,6 +55,13 @@ CreateDisk(const char* fileName, long blockCount)
     DiskImg* pDiskImg = nil;
 
     pDiskImg = new DiskImg;
+
+    /*
+     * Adding files rewrites the same directory, bitmap, and index blocks
+     * over and over.  Hold them in memory and write them out at the end.
+     */
+    pDiskImg->SetCacheMode(DiskImg::kCacheModeWriteBack);
+
     dierr = pDiskImg->CreateImage(
         fileName,
         nil,                            // storageName
@@ -342,7 +349,8 @@ Process(const char* formatName, const char* sizeStr,
  * Handle a debug message from the DiskImg library.
  */
 /*static*/ void
-MsgHandler(const char* file, int line, const char* msg)
+MsgHandler(Global::LogSeverity severity, const char* file, int line,
+    const char* msg)
 {
     assert(file != nil);
     assert(msg != nil);
@@ -372,6 +380,9 @@ main(int argc, char** argv)
 #endif
 
     Global::SetDebugMsgHandler(MsgHandler);
+#ifndef _DEBUG
+    Global::SetLogLevel(Global::kLogNone);      // MsgHandler discards it all
+#endif
     Global::AppInit();
 
     if (argc < 5) {
@@ -374,7 +374,8 @@ CompressTrack(const unsigned char* trackBuf, BitBuffer* pBitBuf)
  * Handle a debug message from the DiskImg library.
  */
 /*static*/ void
-MsgHandler(const char* file, int line, const char* msg)
+MsgHandler(Global::LogSeverity severity, const char* file, int line,
+    const char* msg)
 {
     assert(file != nil);
     assert(msg != nil);
@@ -391,11 +392,11 @@ NufxErrorMsgHandler(NuArchive* /*pArchive*/, void* vErrorMessage)
     const NuErrorMessage* pErrorMessage = (const NuErrorMessage*) vErrorMessage;
 
     if (pErrorMessage->isDebug) {
-        Global::PrintDebugMsg(pErrorMessage->file, pErrorMessage->line,
-            "<nufxlib> [D] %s\n", pErrorMessage->message);
+        Global::PrintDebugMsg(Global::kLogDebug, pErrorMessage->file,
+            pErrorMessage->line, "<nufxlib> [D] %s\n", pErrorMessage->message);
     } else {
-        Global::PrintDebugMsg(pErrorMessage->file, pErrorMessage->line,
-            "<nufxlib> %s\n", pErrorMessage->message);
+        Global::PrintDebugMsg(Global::kLogWarn, pErrorMessage->file,
+            pErrorMessage->line, "<nufxlib> %s\n", pErrorMessage->message);
     }
 
     return kNuOK;
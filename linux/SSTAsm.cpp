@@ -294,7 +294,8 @@ ReassembleSST(const char* file1, const char* file2, FILE* outfp)
  * Handle a debug message from the DiskImg library.
  */
 /*static*/ void
-MsgHandler(const char* file, int line, const char* msg)
+MsgHandler(Global::LogSeverity severity, const char* file, int line,
+    const char* msg)
 {
     assert(file != nil);
     assert(msg != nil);
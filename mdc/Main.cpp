@@ -126,13 +126,16 @@ BOOL MainWindow::PeekAndPump(void)
  * ==========================================================================
  */
 
-/*static*/ void MainWindow::DebugMsgHandler(const char* file, int line,
-    const char* msg)
+/*static*/ void MainWindow::DebugMsgHandler(
+    DiskImgLib::Global::LogSeverity severity, const char* file,
+    int line, const char* msg)
 {
     ASSERT(file != NULL);
     ASSERT(msg != NULL);
 
-    LOG_BASE(DebugLog::LOG_INFO, file, line, "<diskimg> %hs", msg);
+    /* DiskImgLib severities have the same values as ours */
+    LOG_BASE((DebugLog::LogSeverity) severity, file, line, "<diskimg> %hs",
+        msg);
 }
 
 /*static*/ NuResult MainWindow::NufxErrorMsgHandler(NuArchive* /*pArchive*/,
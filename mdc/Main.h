@@ -66,8 +66,8 @@ private:
     /*
      * Handle a debug message from the DiskImg library.
      */
-    static void DebugMsgHandler(const char* file, int line,
-        const char* msg);
+    static void DebugMsgHandler(DiskImgLib::Global::LogSeverity severity,
+        const char* file, int line, const char* msg);
     static NuResult NufxErrorMsgHandler(NuArchive* /*pArchive*/,
         void* vErrorMessage);
 